@@ -25,10 +25,20 @@
 #define MAX_MSG_SIZE 140 // The size of the largest messages that can sent
 #define MAX_UNAME_SIZE 12 // The maximum size a username is allowed to be
 #define EXIT_CMD "~quit\n" // The command that initiates disconnect and quits
+#define SEARCH_CMD "~search " // The command that searches the message history
+#define MAX_SEARCH_RESULTS 10 // The most search results printed at once
+#define PING_CMD "~ping\n" // The command that measures round trip time
+#define LATENCY_CMD "~latency\n" // The command that prints latency statistics
+#define SEND_CMD "~send " // The command that sends a file
+#define WHO_CMD "~who\n" // The command that lists who is online
+#define MEMORY_CMD "~memory\n" // The command that reports memory per connection
+#define MAX_WHO_RESULTS 20 // The most users listed at once
+#define DRAIN_MS 2000 // The longest spent sending queued frames when exiting
+#define EXECUTOR_NAME "relay" // The name executors present to others
 #define HOST 0
 #define CLIENT 1
 #define PORT_MIN 1024
 #define PORT_MAX 65535
-#define IPV4_REGEX "((([01]?[0-9]?[0-9])|(2([0-4][0-9]|5[0-5])))\.){3}(([01]?[0-9]?[0-9])|(2([0-4][0-9]|5[0-5])))"
+#define IPV4_REGEX "((([01]?[0-9]?[0-9])|(2([0-4][0-9]|5[0-5])))\\.){3}(([01]?[0-9]?[0-9])|(2([0-4][0-9]|5[0-5])))"
 
 #endif
\ No newline at end of file
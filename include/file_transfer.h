@@ -0,0 +1,107 @@
+// file_transfer.h - Definitions for streaming files over chat connections
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Files travel over the same connection as chat messages, as a FILE_START
+// frame, a run of FILE_CHUNK frames and a FILE_END frame, all carrying the
+// same transfer id. Each transfer is streamed by its own thread one chunk at
+// a time, and the connection is free for other frames between chunks.
+//
+// The receiver answers every chunk with a FILE_ACK once it is on disk, and a
+// sender never has more than FILE_WINDOW chunks unacknowledged. That keeps
+// the amount of file data queued in front of a chat message small, however
+// large the file and however slow the receiver.
+//
+// Neither end copies file data through user space: chunks are sent with
+// sendfile, and received by splicing them from the socket through a pipe
+// into the file.
+//
+// FILE_START payloads are the sender's username (uname_len bytes), the size
+// of the file as a u64 in network byte order, then the file's name.
+
+#ifndef FILE_TRANSFER_H
+#define FILE_TRANSFER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <frame.h>
+
+#define FILE_CHUNK_SIZE 16384 // Bytes of file data per FILE_CHUNK frame
+#define FILE_WINDOW 4 // The most unacknowledged chunks per transfer
+#define FILE_ACK_TIMEOUT_MS 10000 // A transfer without acks this long fails
+#define FILE_MAX_RECEIVING 4 // Incoming transfers per connection at once
+#define FILE_MAX_NAME 255 // The longest file name that can be sent
+
+// Sends a frame of a transfer. If file_fd is -1 the payload is in payload,
+// otherwise it is header->length bytes of file_fd starting at offset (see
+// outbox_push_file). Returns 0 on success or -1 if the frame could not be sent
+typedef int8_t (*file_send_fn)(void *ctx, const frame_header *header, const void *payload, int file_fd, off_t offset);
+
+// Called with a human-readable notice as transfers start and end. ctx is the
+// one given when the transfer or receiver was set up
+typedef void (*file_notice_fn)(void *ctx, const char *notice);
+
+typedef struct file_receiver file_receiver;
+
+// Starts streaming the file at path to recipient, as sent by username. Every
+// frame goes out through send, and every notice through notice, both of
+// which are passed ctx; ctx is freed once the transfer is over. Returns 0 if
+// the transfer was started or -1 if the file could not be opened, in which
+// case ctx is left to the caller
+int8_t file_transfer_send(const char *path, const char *username, const char *recipient, file_send_fn send, void *ctx, file_notice_fn notice);
+
+// Records that a FILE_ACK arrived for transfer id, as long as match returns
+// true given the transfer's ctx and arg; acks for transfers to anyone else
+// are ignored
+void file_transfer_ack(uint64_t id, bool (*match)(void *ctx, void *arg), void *arg);
+
+// Aborts every transfer still being sent and waits for their threads to end
+void file_transfer_stop_all();
+
+// Aborts the transfers still being sent for which match returns true, given
+// their ctx and arg, and waits for their threads to end
+void file_transfer_stop_matching(bool (*match)(void *ctx, void *arg), void *arg);
+
+// Creates a receiver for the transfers arriving over one connection. Files
+// are saved in directory, and notices go to notice along with ctx. Returns a
+// pointer to the receiver or NULL on error
+file_receiver *file_receiver_create(const char *directory, file_notice_fn notice, void *ctx);
+
+// Closes any files still being received (leaving them incomplete) and frees
+// the receiver
+void file_receiver_destroy(file_receiver *receiver);
+
+// Returns true if no files are being received, so the receiver can be
+// destroyed without cutting anything off
+bool file_receiver_idle(file_receiver *receiver);
+
+// Returns how many bytes of the chunk being received have yet to arrive, or 0
+// if no chunk is partway in
+uint32_t file_receiver_chunk_left(file_receiver *receiver);
+
+// Returns the bytes of memory the receiver takes up
+size_t file_receiver_memory(file_receiver *receiver);
+
+// Handles a FILE_START, FILE_CHUNK or FILE_END frame received over fd. The
+// payload of a FILE_START or FILE_END is given in payload; that of a
+// FILE_CHUNK is read from fd here, without blocking, as it arrives. If the
+// sender needs an acknowledgement, it is set up in ack for the caller to send.
+// Returns 1 if ack should be sent, 0 if not, FRAME_PENDING if the rest of a
+// chunk has yet to arrive (call again with the same header once fd is
+// readable) or -1 if the chunk could not be read from fd
+int8_t file_receiver_handle(file_receiver *receiver, int fd, const frame_header *header, const void *payload, frame_header *ack);
+
+#endif
@@ -0,0 +1,166 @@
+// frame.h - Definitions for the sockets_chat wire format
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Everything sent over a connection is a frame: a fixed size header followed
+// by a payload. On the wire the header is laid out as follows, with every
+// integer in network byte order:
+//      u8  type        One of the FRAME_* types below
+//      u8  flags       Type specific flags
+//      u8  uname_len   Length of the username at the start of the payload
+//      u8  nhops       Number of relay timestamps following the header
+//      u32 length      Length of the payload
+//      u32 origin      Node id of the relay the frame originated from
+//      u64 id          Per-origin message id (0 if not yet assigned)
+//      u64 sent_at     When the frame was first sent (see frame_now)
+//      u64 hops[nhops] When each relay along the way received the frame
+//
+// Message payloads are the sender's username (uname_len bytes) followed by
+// the message text. Neither is NUL terminated on the wire.
+//
+// Between a client and its host, id is instead a sequence number: the host
+// numbers the messages it sends each client, the client numbers the messages
+// it sends the host, and each side acknowledges what it has received with ACK
+// frames. A client's HELLO may carry a session token and the last sequence
+// number it received after its username, to resume a session whose
+// connection dropped; the host's reply carries the session's token and the
+// last sequence number it received from the client (see relay.h).
+//
+// Timestamps are wall-clock nanoseconds rather than monotonic ones, since the
+// hops of a frame are stamped by different machines and monotonic clocks are
+// only comparable within one. Round trips, which are timed by one machine,
+// use the monotonic clock instead (see FRAME_PING).
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <chat.h>
+
+#define FRAME_HEADER_SIZE 28 // Size of the header, not counting hops
+#define FRAME_MAX_PAYLOAD 4096 // The largest payload a frame may carry
+#define FRAME_MAX_CHUNK 65536 // The largest payload of a FILE_CHUNK frame
+#define FRAME_MAX_HOPS 8 // Relays past this many are not timestamped
+#define FRAME_RESUME_SIZE 16 // u64 token and u64 sequence number after a HELLO's username
+#define FRAME_PENDING 2 // Returned while the rest of a frame has yet to arrive
+
+#define FRAME_HELLO 1 // Handshake; payload is the sender's username
+#define FRAME_MESSAGE 2 // A chat message
+#define FRAME_QUIT 3 // The sender is closing the connection
+#define FRAME_SYNC 4 // Relay link resync request (see relay.h)
+#define FRAME_PING 5 // Asks for a PONG; id is the sender's monotonic clock
+#define FRAME_PONG 6 // Answers a PING, echoing its id
+#define FRAME_FILE_START 7 // Starts file transfer id (see file_transfer.h)
+#define FRAME_FILE_CHUNK 8 // The next piece of the file in transfer id
+#define FRAME_FILE_END 9 // Transfer id is complete
+#define FRAME_FILE_ACK 10 // A chunk of transfer id has been written to disk
+#define FRAME_PRESENCE 11 // Changes in who is online (see presence.h)
+#define FRAME_ACK 12 // Every message up to sequence number id was received
+
+#define FRAME_HELLO_CLIENT 0 // HELLO flag: the sender is a chat client
+#define FRAME_HELLO_PEER 1 // HELLO flag: the sender is a relay node
+#define FRAME_HELLO_RESUMED 2 // HELLO flag: the host picked up the session asked for
+#define FRAME_MESSAGE_REPLAYED 1 // MESSAGE flag: resent during a resync
+#define FRAME_MESSAGE_NOTICE 2 // MESSAGE flag: from the host itself, to be shown as a notice
+#define FRAME_PRESENCE_SNAPSHOT 1 // PRESENCE flag: catching up a new connection
+
+typedef struct frame_header {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t uname_len;
+    uint32_t length;
+    uint32_t origin;
+    uint64_t id;
+    uint64_t sent_at;
+    uint8_t nhops;
+    uint64_t hops[FRAME_MAX_HOPS];
+} frame_header;
+
+// Reassembles frames arriving over a socket that is read without blocking,
+// however their bytes are split up on the way. Only the frame being received
+// is kept, so a reader is only needed while a frame is partway in
+typedef struct frame_reader {
+    size_t received; // Bytes of the frame received so far
+    frame_header header; // Valid once the whole header has been received
+    uint8_t encoded[FRAME_HEADER_SIZE + 8 * FRAME_MAX_HOPS];
+    uint8_t payload[FRAME_MAX_PAYLOAD];
+} frame_reader;
+
+// Sends the frame described by header with the given payload (header->length
+// bytes long) over fd. Returns 0 on success or -1 on error
+int8_t frame_send(int fd, const frame_header *header, const void *payload);
+
+// Encodes header and its hops into out, which must be able to hold
+// FRAME_HEADER_SIZE + 8 * FRAME_MAX_HOPS bytes. Returns the encoded size
+size_t frame_encode_header(uint8_t *out, const frame_header *header);
+
+// Reads as much of the next frame as fd has ready into reader, without
+// blocking. Returns 1 once the frame is complete, with its header and payload
+// in reader (the payload of a FILE_CHUNK frame is left unread for the caller
+// to deal with), FRAME_PENDING if the rest of it has yet to arrive, 0 if the
+// remote closed the connection or -1 on error (including frames whose payload
+// is too large). A complete frame stays in reader, and is returned again,
+// until frame_reader_next is called
+int8_t frame_reader_recv(frame_reader *reader, int fd);
+
+// Lets go of the frame in reader so that the next one can be received
+void frame_reader_next(frame_reader *reader);
+
+// Returns true if reader holds some or all of a frame
+bool frame_reader_busy(const frame_reader *reader);
+
+// Copies what reader holds of a frame to out, which must be able to hold
+// sizeof(frame_reader) bytes, for frame_reader_restore to pick up in another
+// reader (or process). A FILE_CHUNK frame is saved as if its payload were
+// just the chunk_left bytes of it still to arrive. Returns the number of
+// bytes copied
+size_t frame_reader_save(const frame_reader *reader, uint32_t chunk_left, uint8_t *out);
+
+// Sets reader up with length bytes saved by frame_reader_save. Returns 0 on
+// success or -1 if they are not the start of a valid frame
+int8_t frame_reader_restore(frame_reader *reader, const uint8_t *saved, size_t length);
+
+// Returns the current time as used for frame timestamps
+uint64_t frame_now();
+
+// Returns the current time on the monotonic clock, as used for PING ids
+uint64_t frame_monotonic_now();
+
+// Records that a relay received the frame now. Does nothing once the frame
+// has FRAME_MAX_HOPS timestamps
+void frame_stamp_hop(frame_header *header);
+
+// Sets up header and payload as a message from username, sent now. origin and
+// id are left as 0 for the relay to assign
+void frame_init_message(frame_header *header, void *payload, const char *username, const char *msg);
+
+// Sets up header and payload as a HELLO from username with the given flags.
+// Unless token is 0, the session token and the sequence number seq follow the
+// username. payload must be able to hold MAX_UNAME_SIZE + FRAME_RESUME_SIZE
+// bytes
+void frame_init_hello(frame_header *header, void *payload, uint8_t flags, const char *username, uint64_t token, uint64_t seq);
+
+// Copies the session token and sequence number that follow the username in a
+// HELLO into token and seq. Returns false, leaving both 0, if it carries none
+bool frame_split_resume(const frame_header *header, const void *payload, uint64_t *token, uint64_t *seq);
+
+// Copies the username and text of a message (or HELLO) frame out of payload
+// as NUL terminated strings. username must hold MAX_UNAME_SIZE bytes and msg
+// (which may be NULL) MAX_MSG_SIZE bytes; longer values are truncated
+void frame_split_message(const frame_header *header, const void *payload, char *username, char *msg);
+
+#endif
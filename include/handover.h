@@ -0,0 +1,97 @@
+// handover.h - Definitions for handing state to another process
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// A handover is a stream of records sent over a Unix socket from a running
+// process to the one replacing it. Each record is a u8 type and a u32 length
+// (in network byte order) followed by that many bytes of data, and may carry
+// one file descriptor with it (passed with SCM_RIGHTS). What the records mean
+// is up to the two ends; handover_buffer and handover_reader help build and
+// pick apart their data.
+
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HANDOVER_RECORD_HEADER_SIZE 5
+#define HANDOVER_MAX_RECORD 8388608 // The largest record that will be received
+
+// Data being built up for a record. Grows as needed; if it fails to, failed
+// is set and everything after is ignored
+typedef struct handover_buffer {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+} handover_buffer;
+
+// Data being read from a record. Reading past the end sets failed and yields
+// zeroes
+typedef struct handover_reader {
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+    bool failed;
+} handover_reader;
+
+// Binds and listens on a Unix socket at path, replacing whatever was there.
+// Returns the listening socket or -1 on error
+int handover_listen(const char *path);
+
+// Connects to the Unix socket at path. Returns the connected socket, or -1 if
+// nothing is listening there
+int handover_connect(const char *path);
+
+// Sends a record over fd, passing pass_fd along with it unless it is -1.
+// Returns 0 on success or -1 on error
+int8_t handover_send(int fd, uint8_t type, const void *data, uint32_t length, int pass_fd);
+
+// Receives a record from fd. Its data is returned in *data, which must be
+// freed, and any file descriptor passed with it in *passed_fd (or -1).
+// Returns 1 if a record was received, 0 if fd was closed or -1 on error
+int8_t handover_recv(int fd, uint8_t *type, uint8_t **data, uint32_t *length, int *passed_fd);
+
+// Appends length bytes to buffer
+void handover_put(handover_buffer *buffer, const void *data, size_t length);
+
+// Appends value to buffer in network byte order
+void handover_put_u32(handover_buffer *buffer, uint32_t value);
+
+// Appends value to buffer in network byte order
+void handover_put_u64(handover_buffer *buffer, uint64_t value);
+
+// Appends a string to buffer, preceded by its length as a u32
+void handover_put_string(handover_buffer *buffer, const char *string);
+
+// Frees the buffer's data and empties it
+void handover_buffer_free(handover_buffer *buffer);
+
+// Copies the next length bytes of the record to out
+void handover_get(handover_reader *reader, void *out, size_t length);
+
+// Returns the next u32 of the record
+uint32_t handover_get_u32(handover_reader *reader);
+
+// Returns the next u64 of the record
+uint64_t handover_get_u64(handover_reader *reader);
+
+// Copies the next string of the record to out, which holds size bytes.
+// Strings too long for out are truncated
+void handover_get_string(handover_reader *reader, char *out, size_t size);
+
+#endif
@@ -0,0 +1,71 @@
+// latency.h - Definitions for message latency histograms
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Latencies are recorded into log-linear histograms: every power of two is
+// split into LATENCY_SUB_BUCKETS buckets, which keeps the error of any
+// reported percentile under 1 / LATENCY_SUB_BUCKETS of its value whatever
+// its magnitude. Recording is a handful of relaxed atomic adds, so it is
+// cheap enough to do for every message and safe to read from another thread.
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <frame.h>
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct latency_histogram {
+    atomic_uint_fast64_t buckets[LATENCY_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t max;
+} latency_histogram;
+
+// Everything recorded about the latency of the frames one process receives.
+// hops[i] holds the latency of the i-th leg a message travelled: from its
+// sender to the first relay, between relays, and from the last relay to us
+typedef struct latency_trace {
+    latency_histogram end_to_end;
+    latency_histogram hops[FRAME_MAX_HOPS + 1];
+    latency_histogram round_trip;
+} latency_trace;
+
+// Creates a trace with every histogram empty. Returns NULL on error
+latency_trace *latency_trace_create();
+
+// Frees the trace
+void latency_trace_destroy(latency_trace *trace);
+
+// Records the end-to-end and per-hop latency of a frame received at now
+// (as returned by frame_now). Replayed frames are ignored, since their
+// timestamps say nothing about the current state of the network
+void latency_trace_record(latency_trace *trace, const frame_header *header, uint64_t now);
+
+// Records a latency of ns nanoseconds
+void latency_record(latency_histogram *histogram, uint64_t ns);
+
+// Returns an upper bound on the given percentile (between 0 and 100) of the
+// recorded latencies, in nanoseconds, or 0 if nothing has been recorded
+uint64_t latency_percentile(latency_histogram *histogram, double percentile);
+
+// Prints a summary of every non-empty histogram in the trace to out
+void latency_trace_print(latency_trace *trace, FILE *out);
+
+#endif
@@ -0,0 +1,112 @@
+// outbox.h - Definitions for per-connection frame scheduling
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// An outbox holds the frames waiting to go out over one connection. Rather
+// than being written in the order they were queued, frames are sorted into
+// lanes by how urgent they are:
+//      control      HELLO, PING, PONG, SYNC, FILE_ACK, ACK and PRESENCE frames
+//      interactive  Chat messages, and QUIT
+//      bulk         File transfers, messages replayed during a resync and
+//                   presence snapshots
+//
+// Lanes are served by deficit round robin: each round, a lane may send up
+// to its weight times OUTBOX_QUANTUM bytes, and the control lane always goes
+// first. Frames within a lane keep their order, and a frame is never
+// interleaved with another once it has started, so a control frame waits for
+// at most the one frame already on its way.
+//
+// QUIT travels in the interactive lane so that it never overtakes chat sent
+// before it. Queuing a QUIT throws away any bulk frames still waiting, since
+// the other end will never read them.
+//
+// An outbox's contents can be saved as the exact bytes it still has to send,
+// and restored into another outbox (in another process, say) so that the
+// connection carries on where it left off.
+//
+// Outboxes do no locking of their own; their owner must serialise access.
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <frame.h>
+
+#define OUTBOX_CONTROL 0
+#define OUTBOX_INTERACTIVE 1
+#define OUTBOX_BULK 2
+#define OUTBOX_LANES 3
+
+#define OUTBOX_QUANTUM 1024 // Bytes a lane may send per round per weight
+#define OUTBOX_CONTROL_WEIGHT 16
+#define OUTBOX_INTERACTIVE_WEIGHT 4
+#define OUTBOX_BULK_WEIGHT 1
+#define OUTBOX_MAX_BYTES 4194304 // The most bytes an outbox holds by default
+
+typedef struct outbox outbox;
+
+// Creates an empty outbox that holds at most budget bytes of queued frames.
+// Returns NULL on error
+outbox *outbox_create(size_t budget);
+
+// Frees the outbox and any frames still in it
+void outbox_destroy(outbox *box);
+
+// Throws away every frame in the outbox, including one partly sent, so that
+// it can be used for a new connection
+void outbox_clear(outbox *box);
+
+// Returns the lane a frame belongs in
+uint8_t outbox_lane(const frame_header *header);
+
+// Queues the frame described by header with the given payload (header->length
+// bytes long). Returns 0 on success or -1 if the outbox is over its budget
+int8_t outbox_push(outbox *box, const frame_header *header, const void *payload);
+
+// Queues a frame whose payload is the header->length bytes of file_fd starting
+// at offset. The data is read when the frame is sent, with sendfile; the
+// outbox keeps its own descriptor for the file. Returns 0 on success or -1 if
+// the outbox is full or file_fd could not be duplicated
+int8_t outbox_push_file(outbox *box, const frame_header *header, int file_fd, off_t offset);
+
+// Returns true if the outbox has anything left to send
+bool outbox_pending(outbox *box);
+
+// Returns the bytes of memory the outbox and the frames in it take up. File
+// data is not counted, since it stays in the file until it is sent
+size_t outbox_memory(outbox *box);
+
+// Sends as much as fd will take without blocking. Returns 1 if the outbox has
+// been emptied, 0 if fd is full or -1 if the connection failed
+int8_t outbox_flush(outbox *box, int fd);
+
+// Sends everything in the outbox, waiting up to timeout_ms for fd to take it.
+// Returns 1 if the outbox has been emptied, 0 on timeout or -1 if the
+// connection failed
+int8_t outbox_drain(outbox *box, int fd, int timeout_ms);
+
+// Copies every byte the outbox still has to send, in lane order after the rest
+// of any frame already on its way, into a new buffer that must be freed.
+// File data is read into the buffer. The outbox itself is left as it was.
+// Returns the buffer, with its length in *length, or NULL on error
+uint8_t *outbox_save(outbox *box, size_t *length);
+
+// Queues bytes saved by outbox_save, to be sent before anything queued after
+// them. The outbox must be empty. Returns 0 on success or -1 on error
+int8_t outbox_restore(outbox *box, const uint8_t *data, size_t length);
+
+#endif
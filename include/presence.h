@@ -0,0 +1,141 @@
+// presence.h - Definitions for user presence tracking
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Presence is whether each user is online, away, typing or gone. It is
+// carried by PRESENCE frames, whose payload is a list of entries:
+//      u8  state       One of the PRESENCE_* states below
+//      u8  uname_len   Length of the username that follows
+//      u64 version     When the state was set, as a frame_now timestamp
+//      username bytes (not terminated)
+//
+// Nothing is sent per keystroke or per change. A user's own client reports
+// a state only when it differs from the last one reported, and typing is
+// reported once per burst (see presence_tracker). Hosts collect changes in a
+// presence_table, where later changes to a user overwrite earlier ones that
+// have not been sent yet, and a user who ends up back where they started is
+// not sent at all. The host then sends what has changed every
+// PRESENCE_INTERVAL_MS, at most PRESENCE_MAX_BATCH bytes at a time, so however
+// many users there are, presence never takes more than that from any
+// connection. A new connection is caught up with a snapshot of everyone
+// online, sent a piece at a time in whatever room the changes leave in each
+// interval.
+//
+// A table keeps track of up to the number of users it was created for, and no
+// more: once it is full, new users are only taken in place of ones who went
+// offline. PRESENCE_MAX_USERS is twice RELAY_MAX_CONNECTIONS, so a full relay
+// has room for all of its clients and then some for those of its peers.
+//
+// Versions make the last change win everywhere, whatever order changes
+// travel between linked hosts in.
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <chat.h>
+
+#define PRESENCE_OFFLINE 0
+#define PRESENCE_ONLINE 1
+#define PRESENCE_AWAY 2
+#define PRESENCE_TYPING 3
+
+#define PRESENCE_ENTRY_SIZE 10 // Size of an entry, not counting the username
+#define PRESENCE_MIN_USERS 64 // The users a table has room for before it grows
+#define PRESENCE_MAX_USERS 524288 // The most users the tables of hosts and clients keep track of
+#define PRESENCE_SNAPSHOT_DONE UINT32_MAX // The cursor of a finished snapshot
+#define PRESENCE_INTERVAL_MS 250 // Time between fan outs of changes
+#define PRESENCE_MAX_BATCH 2048 // The most bytes of changes sent per interval
+#define PRESENCE_AWAY_MS 300000 // Time without input before a user is away
+#define PRESENCE_TYPING_MS 3000 // Time after the last keystroke typing ends
+
+// The presence of the user at this end. Not thread safe
+typedef struct presence_tracker {
+    uint8_t reported; // The state last reported
+    uint64_t last_input; // When the user last did anything
+    uint64_t last_keystroke; // When the user last typed, or 0 if they stopped
+} presence_tracker;
+
+// One user, as listed by presence_table_list
+typedef struct presence_user {
+    char username[MAX_UNAME_SIZE];
+    uint8_t state;
+} presence_user;
+
+typedef struct presence_table presence_table;
+
+// Starts tracking a user who has just come online
+void presence_tracker_init(presence_tracker *tracker);
+
+// Records a keystroke in whatever the user is typing
+void presence_tracker_keystroke(presence_tracker *tracker);
+
+// Records that the user sent a line, which also ends any typing
+void presence_tracker_input(presence_tracker *tracker);
+
+// Returns the user's state if it needs reporting, i.e. if it has changed
+// since the last time it was returned, or -1 if there is nothing to report
+int8_t presence_tracker_poll(presence_tracker *tracker);
+
+// Returns how many milliseconds are left until the user's state changes
+// without any more input (typing ends or the user goes away), for use as a
+// poll timeout, or -1 if only input can change it
+int presence_tracker_timeout(presence_tracker *tracker);
+
+// Creates an empty table that keeps track of up to max_users users, which
+// should be a power of two. Returns NULL on error
+presence_table *presence_table_create(size_t max_users);
+
+// Frees the table
+void presence_table_destroy(presence_table *table);
+
+// Sets the state of username as of version (or now, if version is 0), unless
+// the table already knows of a later change. Returns true if the state was
+// taken, or false if it was stale or the table is full
+bool presence_table_update(presence_table *table, const char *username, uint8_t state, uint64_t version);
+
+// Applies every entry of a PRESENCE payload with presence_table_update. If
+// only is not NULL, entries about anyone but only are ignored and the rest
+// are stamped with the current time, whatever version they carry
+void presence_table_apply(presence_table *table, const uint8_t *payload, size_t length, const char *only);
+
+// Encodes the changes that have not been sent yet into payload, up to max
+// bytes, and marks them sent. Changes that do not fit are kept for the next
+// call. Returns the number of bytes written
+size_t presence_table_collect(presence_table *table, uint8_t *payload, size_t max);
+
+// Encodes the state of every user that is not offline into payload, up to max
+// bytes, starting with the user at *cursor. *cursor should start at 0 and is
+// advanced past the users written; it is PRESENCE_SNAPSHOT_DONE once every
+// user has been. The table may be updated between calls: users already in the
+// table are still covered, but users new to it, or to a slot the snapshot has
+// passed, may not be, so changes must be collected and sent alongside.
+// Returns the number of bytes written
+size_t presence_table_snapshot(presence_table *table, uint8_t *payload, size_t max, size_t *cursor);
+
+// Copies up to max users that are not offline into users. Returns how many
+// users are not offline in total
+size_t presence_table_list(presence_table *table, presence_user *users, size_t max);
+
+// Encodes a single entry into payload, which must be able to hold
+// PRESENCE_ENTRY_SIZE + MAX_UNAME_SIZE bytes. Returns the encoded size
+size_t presence_encode(uint8_t *payload, const char *username, uint8_t state, uint64_t version);
+
+// Returns a human-readable name for state
+const char *presence_name(uint8_t state);
+
+#endif
@@ -0,0 +1,195 @@
+// relay.h - Definitions for the sockets_chat relay
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// A relay is what a host runs. It accepts connections from chat clients and
+// from other relay nodes (peers) on the same port, and can also dial out to
+// peers itself. Every message is stamped with the node id of the relay it
+// entered through (its origin) and a per-origin id.
+//
+// When a relay accepts a message it delivers it to its local user and
+// clients, and forwards it once over every peer link other than the one it
+// arrived on. Peers drop (origin, id) pairs they have already seen, so loops
+// in the peer graph are harmless.
+//
+// Relays stamp every message they accept with the time they received it, so
+// that whoever receives it can tell how long each leg of its trip took.
+//
+// Connections are read without blocking and take turns, each reading up to
+// RELAY_READ_QUANTUM bytes per round, so a busy or stalled one cannot hold up
+// the rest. Each client is also rate limited with two token buckets: one for
+// its messages and one for every frame it sends, whatever the type, since
+// PINGs, presence updates and file frames each cost the relay work too. A
+// client sending faster than either limit is simply not read from until it is
+// back within it; nothing it sent is lost, unless it hangs up before then.
+// Peers are not rate limited, since each relay limits its own clients. Each
+// connection must send its HELLO within RELAY_HANDSHAKE_MS of connecting, or
+// it is dropped.
+//
+// The connection table grows RELAY_SLOT_BLOCK slots at a time as connections
+// arrive, up to RELAY_MAX_CONNECTIONS (the open file limit usually runs out
+// first). An idle connection takes up only its slot; buffers for reading,
+// sending and receiving files are attached while they are in use.
+//
+// Relays keep track of the presence of every client, their own user and the
+// users of linked relays, and send changes to everyone at a capped rate (see
+// presence.h). New connections are sent a snapshot of everyone's presence,
+// within the same cap. A client who comes online once the table is full is
+// reported with a notice and left out.
+//
+// Clients can stream files to the relay and the relay's user can stream files
+// to every client (see file_transfer.h). Files are not forwarded between
+// relays.
+//
+// A running relay can be replaced by a new process (a newer build, say)
+// without any client or peer noticing. Relays with upgrades enabled listen on
+// a Unix socket; a relay started with the same socket connects to it, and the
+// running relay hands over its listening socket and every connection, with
+// SCM_RIGHTS, along with everything it knows: its node id, the ids it has
+// seen, its history, everyone's presence, and the bytes still queued for
+// each connection and those that have arrived of its next frame. The
+// sockets themselves are never closed, so nothing on the wire changes. Files
+// being transferred at the time are cut off.
+//
+// Each relay also keeps the last RELAY_HISTORY_SIZE messages. Whenever a link
+// comes up, both ends send a SYNC frame listing, per origin, the id up to
+// which they have seen every message; each side then replays whatever the
+// other is missing from its history.
+//
+// Clients' sessions outlive their connections. The relay numbers the messages
+// it sends each client by their place in its history, gives each client a
+// session token in its HELLO, and acknowledges the client's own numbered
+// messages with ACK frames every RELAY_ACK_MS. If a client's connection drops
+// without a QUIT, its session is held (and its user stays in the chat) for
+// RELAY_RESUME_MS. A client that reconnects with the token and the last
+// sequence number it received is sent every message it missed, and resends
+// those of its own the relay had not acknowledged. Messages that have already
+// left the history cannot be sent; the client is told how many it lost.
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <frame.h>
+#include <latency.h>
+#include <file_transfer.h>
+#include <presence.h>
+
+#define RELAY_MAX_CONNECTIONS 262144 // The most clients and peers at once
+#define RELAY_SLOT_BLOCK 256 // Connection slots allocated at a time
+#define RELAY_MAX_LINKS 16 // The most peers a relay can be told to dial
+#define RELAY_MAX_ORIGINS 64 // The most relay nodes tracked for dedup
+#define RELAY_HISTORY_SIZE 4096 // Messages kept for resyncing links
+#define RELAY_DEDUP_WINDOW 1024 // Ids tracked per origin; a multiple of 64
+#define RELAY_RETRY_MS 1000 // Time between attempts to re-establish links
+#define RELAY_POLL_MS 100 // The longest the relay waits between checks
+#define RELAY_HANDSHAKE_MS 2000 // The longest a handshake may take
+#define RELAY_RESUME_MS 60000 // How long a dropped client's session is held
+#define RELAY_ACK_MS 250 // The longest a client's messages go unacknowledged
+#define RELAY_MIN_BUDGET 131072 // The smallest per-connection budget; room for file chunks
+#define RELAY_READ_QUANTUM 8192 // Bytes each connection may read per round
+#define RELAY_MESSAGE_RATE 20 // Messages per second a client may send by default
+#define RELAY_MESSAGE_BURST 40 // Messages a client may send at once
+#define RELAY_FRAME_RATE 2000 // Frames per second a client may send by default
+#define RELAY_FRAME_BURST 4000 // Frames a client may send at once
+
+// The callbacks below are passed the ctx given to relay_create, and may be
+// called from any of the relay's threads
+
+// Called for every message the relay accepts from a client or peer
+typedef void (*relay_deliver_fn)(void *ctx, const char *username, const char *msg);
+
+// Called with a human-readable notice when connections come and go
+typedef void (*relay_notice_fn)(void *ctx, const char *notice);
+
+// Called once the relay has handed everything over to a new process. The relay
+// is then idle, and only needs relay_stop
+typedef void (*relay_handover_fn)(void *ctx);
+
+typedef struct relay relay;
+
+// Creates a relay that will listen on port and present itself as username.
+// The latency of every message the relay accepts, and of every PING it sends,
+// is recorded into trace (which may be NULL). deliver and notice are passed
+// ctx. Returns a pointer to the relay or NULL on error
+relay *relay_create(int port, const char *username, relay_deliver_fn deliver, relay_notice_fn notice, latency_trace *trace, void *ctx);
+
+// Adds a peer for the relay to link with. The relay dials it once started and
+// keeps re-dialing it whenever the link drops. Must be called before
+// relay_start. Returns 0 on success or -1 if there are too many links
+int8_t relay_add_link(relay *relay, const char *address, const char *service);
+
+// Sets the directory files sent by clients are saved in (the current
+// directory by default). Must be called before relay_start. Returns 0 on
+// success or -1 on error
+int8_t relay_set_download_dir(relay *relay, const char *directory);
+
+// Sets the most memory, in bytes, that frames waiting to be sent to any one
+// connection may take up (OUTBOX_MAX_BYTES by default). A connection that
+// falls so far behind is dropped. Must be called before relay_start. Returns
+// 0 on success or -1 if bytes is less than RELAY_MIN_BUDGET
+int8_t relay_set_budget(relay *relay, size_t bytes);
+
+// Sets how many messages per second each client may send, on average; up to
+// RELAY_MESSAGE_BURST may be sent at once (RELAY_MESSAGE_RATE by default, or
+// 0 for no limit). Must be called before relay_start
+void relay_set_message_rate(relay *relay, uint32_t rate);
+
+// Sets how many frames of any type per second each client may send, on
+// average; up to RELAY_FRAME_BURST may be sent at once (RELAY_FRAME_RATE by
+// default, or 0 for no limit). Must be called before relay_start
+void relay_set_frame_rate(relay *relay, uint32_t rate);
+
+// Lets the relay be replaced through the Unix socket at path. When started, the
+// relay takes over from whichever relay is listening there, if any, then
+// listens there itself. handed_over is called if the relay is in turn
+// replaced. Must be called before relay_start. Returns 0 on success or -1 on
+// error
+int8_t relay_enable_upgrades(relay *relay, const char *path, relay_handover_fn handed_over);
+
+// Binds the listening socket, or takes over that of the relay being replaced,
+// and starts the relay's threads. Returns 0 on success or -1 on error
+int8_t relay_start(relay *relay);
+
+// Sends a message from the local user to every client and peer. While the
+// relay is being handed over the message is refused with a notice
+void relay_broadcast(relay *relay, const char *msg);
+
+// Pings every client and peer. Each round trip time is reported as a notice
+// once the PONG comes back
+void relay_ping(relay *relay);
+
+// Starts streaming the file at path to every client. Returns the number of
+// clients the file is being sent to, or -1 if it could not be opened
+int relay_send_file(relay *relay, const char *path);
+
+// Sets the presence of the relay's own user
+void relay_set_presence(relay *relay, uint8_t state);
+
+// Returns the table of everyone's presence as known to the relay
+presence_table *relay_presence(relay *relay);
+
+// Prints how much memory the connections take up: the slots allocated in the
+// connection table, and for each connection whatever has arrived of its next
+// frame, the frames waiting to be sent to it and its file receiver. Idle
+// connections have none of those, and are only counted, not listed
+void relay_print_memory(relay *relay, FILE *out);
+
+// Tells every connection that the relay is going away (unless it has handed
+// them over), stops its threads and frees it
+void relay_stop(relay *relay);
+
+#endif
@@ -0,0 +1,72 @@
+// search_index.h - Definitions for the chat history search index
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// The search index retains the messages handed to it and maintains an
+// inverted index (term -> posting list of message sequence numbers) alongside
+// it. Posting lists are stored delta and varint encoded, with a skip entry
+// every SEARCH_SKIP_INTERVAL postings so intersections can jump over blocks
+// that cannot contain a match.
+//
+// Messages are kept in two generations, each with an index of its own. Once
+// the newer one is full the older one is dropped, so the index holds at most
+// the newest max_messages messages, and once it has been handed that many
+// never less than half as many.
+//
+// The index is safe to use from multiple threads. Queries only hold the lock
+// long enough to copy out the posting lists they need, so the thread adding
+// messages is never held up for the duration of a search.
+
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SEARCH_MAX_TERM_SIZE 32 // Longer terms are truncated to this length
+#define SEARCH_MAX_TERMS 32 // The most terms a single query may contain
+#define SEARCH_SKIP_INTERVAL 128 // Number of postings between skip entries
+#define SEARCH_MAX_MESSAGES 1048576 // The most messages retained by default
+
+typedef struct search_index search_index;
+
+// Creates a new, empty search index retaining up to max_messages messages.
+// Returns a pointer to the index or NULL if memory could not be allocated
+search_index *search_index_create(uint64_t max_messages);
+
+// Frees the index along with every message retained in it
+void search_index_destroy(search_index *index);
+
+// Retains a copy of msg (sent by username) and indexes its terms. Returns the
+// sequence number assigned to the message (starting at 1) or 0 on error
+uint64_t search_index_add(search_index *index, const char *username, const char *msg);
+
+// Finds the messages that contain every term in terms. The sequence numbers of
+// up to max_results of the most recent matches are written to results, newest
+// first. Returns the total number of matching messages, or -1 if terms
+// contains no searchable terms
+int64_t search_index_query(search_index *index, const char *terms, uint64_t *results, size_t max_results);
+
+// Copies the username and text of message seq into username (which must hold
+// at least MAX_UNAME_SIZE bytes) and msg (which must hold at least
+// MAX_MSG_SIZE bytes). Returns 0 on success or -1 if seq is not retained,
+// having never been added or since aged out
+int8_t search_index_get(search_index *index, uint64_t seq, char *username, char *msg);
+
+// Returns the number of messages retained in the index, which leaves out
+// those that have aged out
+uint64_t search_index_count(search_index *index);
+
+#endif
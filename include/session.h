@@ -0,0 +1,122 @@
+// session.h - Definitions for a client's session with a host
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// A session is everything about one client's connection to one host: the
+// socket, the frames waiting to go out over it, the files coming in over it
+// and who the host says is online. Sessions have no threads of their own.
+// Whoever owns one polls the descriptors it asks for alongside anything else
+// it is waiting on, and hands the results back with session_handle; many
+// sessions can share one event loop that way.
+//
+// Connecting never blocks: the connection is made, and the handshake
+// completed, by session_handle, backing off between attempts for as long as
+// the host is out of reach. If the connection drops later on, the session
+// reconnects the same way and asks the host to resume it (see relay.h):
+// messages missed in the meantime are delivered, and ours the host had not
+// acknowledged are sent again. It gives up after SESSION_RESUME_MS.
+//
+// Frames may be queued from any thread (file transfers queue theirs from
+// their own), but session_handle and session_close must only be called from
+// the thread that owns the session.
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <latency.h>
+#include <presence.h>
+
+#define SESSION_NFDS 2 // Descriptors each session needs polled
+#define SESSION_RESUME_MS 60000 // How long a dropped connection is retried
+
+typedef struct session session;
+
+// Called for every message the host sends, with the ctx given to
+// session_create
+typedef void (*session_message_fn)(void *ctx, const char *username, const char *msg);
+
+// Called with a human-readable notice, such as a round trip time or the
+// progress of a file transfer, with the ctx given to session_create. May be
+// called from a file transfer's thread
+typedef void (*session_notice_fn)(void *ctx, const char *notice);
+
+// Creates a session for username that is not yet connected. Files the host
+// sends are saved in download_dir, and the latency of messages and pings is
+// recorded into trace. Returns a pointer to the session or NULL on error
+session *session_create(const char *username, const char *download_dir, latency_trace *trace, session_message_fn message, session_notice_fn notice, void *ctx);
+
+// Frees the session, which must have been closed if it was ever connected
+void session_destroy(session *session);
+
+// Starts connecting to the host at address and service. session_handle
+// retries until the host accepts us, reporting the connection as a notice
+// once it is made; messages sent until then are held for it. Returns 0, or -1
+// if the address could not be resolved
+int8_t session_connect(session *session, const char *address, const char *service);
+
+// Returns true once the host has accepted us
+bool session_established(session *session);
+
+// Returns the host's username, or the address it was given by until it has
+// accepted us
+const char *session_remote_name(session *session);
+
+// Returns the host's IPv4 address
+const char *session_remote_ip(session *session);
+
+// Returns who the host says is online
+presence_table *session_presence(session *session);
+
+// Fills in the SESSION_NFDS descriptors the session needs polled, and what
+// for
+void session_poll_fds(session *session, struct pollfd *pfds);
+
+// Handles whatever poll found on the descriptors filled in by
+// session_poll_fds: sends what the connection will take and receives what
+// the host has sent, or moves connecting along. Nothing waits on the host;
+// frames are put together as their bytes arrive. Returns 0 if the session
+// carries on or -1 if the host has gone away
+int8_t session_handle(session *session, const struct pollfd *pfds);
+
+// Returns the longest, in milliseconds, poll may wait before session_handle
+// has to be called again, or -1 if it may wait indefinitely
+int session_timeout(session *session);
+
+// Queues a chat message from our user. While connecting, it is held until
+// the host accepts us. Returns 0 on success or -1 if it could not be
+// queued, as when too many of our messages are still waiting for the host to
+// acknowledge them
+int8_t session_send_message(session *session, const char *msg);
+
+// Pings the host. The round trip time is reported as a notice once the PONG
+// comes back
+void session_ping(session *session);
+
+// Tells the host our user's presence
+void session_set_presence(session *session, uint8_t state);
+
+// Starts streaming the file at path to the host. Returns 0 if the transfer was
+// started or -1 if the file could not be opened or the session is reconnecting
+int8_t session_send_file(session *session, const char *path);
+
+// Closes the connection, first telling the host we are leaving if say_quit
+// is set. Files still being sent to the host are stopped, and whatever is
+// still queued is sent first, waiting up to DRAIN_MS for the host to take it
+void session_close(session *session, bool say_quit);
+
+#endif
@@ -0,0 +1,75 @@
+// tabs.h - Definitions for the tabbed terminal interface
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// tabs lays the terminal out as a bar of tab labels on the top line, the
+// messages of the active tab below it and a line to type into at the bottom.
+// Every tab has a msg_window of its own, all in the same place on the screen;
+// only the active one is drawn, and the others are written to in memory until
+// they are shown. Tab switches between tabs and shift-tab goes back.
+//
+// Nothing is drawn as it happens. Whoever drives the tabs calls tabs_flush
+// once everything waiting has been handled, and all of it goes out to the
+// terminal in a single refresh; an idle terminal costs nothing.
+//
+// tabs takes over the terminal from stdio and is not thread safe.
+
+#ifndef TABS_H
+#define TABS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TABS_MAX 16 // The most tabs open at once
+#define TABS_MAX_LABEL 32 // The longest tab label, including the terminator
+
+typedef struct tabs tabs;
+
+// Takes over the terminal and draws an empty tab bar. Returns a pointer to the
+// tabs or NULL on error
+tabs *tabs_create();
+
+// Frees the tabs and hands the terminal back
+void tabs_destroy(tabs *tabs);
+
+// Opens a tab labelled label. The first tab opened becomes the active one.
+// Returns the tab's number, which it keeps until it is closed, or -1 if
+// TABS_MAX tabs are already open
+int tabs_open(tabs *tabs, const char *label);
+
+// Relabels tab as label
+void tabs_set_label(tabs *tabs, int tab, const char *label);
+
+// Closes tab. If it was the active tab, the next open one becomes active
+void tabs_close(tabs *tabs, int tab);
+
+// Returns the number of the active tab, or -1 if no tabs are open
+int tabs_active(tabs *tabs);
+
+// Prints text in tab, starting on a line of its own. text may run over
+// several lines. Tabs other than the active one are marked as having unread
+// output. Text printed to a tab that is not open is dropped
+void tabs_print(tabs *tabs, int tab, const char *text);
+
+// Handles the keys typed since the last call. Once return is pressed, the
+// line typed is copied into line, which holds size bytes, ending in a newline
+// as fgets would leave it. Returns 1 if a line was copied or 0 once there are
+// no more keys waiting
+int8_t tabs_read_line(tabs *tabs, char *line, size_t size);
+
+// Draws everything that has changed, in whichever tab, since the last flush
+void tabs_flush();
+
+#endif
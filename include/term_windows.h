@@ -25,6 +25,7 @@
 #define CURSES_TEST_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <curses.h>
 
 // Define the character codes for some common keypresses that ncurses does not
@@ -70,6 +71,8 @@ typedef struct ext_window {
 // A msg_window currently encompasses a ncurses WINDOW
 // pointer, window size information, and seperate cursors for reading
 // (read_curs) and editing (print_curs)
+// A hidden msg_window is still written to, but is not drawn until it is
+// shown again; several can share the same place on the screen that way
 typedef struct msg_window {
     WINDOW *window;
 
@@ -78,6 +81,8 @@ typedef struct msg_window {
 
     cursor *read_curs;
     cursor *print_curs;
+
+    bool hidden;
 } msg_window;
 
 // An edit_window is a window for live text editing
@@ -96,6 +101,34 @@ typedef struct edit_window {
 void term_windows_init();
 void term_windows_end();
 
+// Initializes term_windows on the terminal of the given type (or $TERM if
+// type is NULL) that is written to through out and read from through in,
+// rather than on the controlling terminal. Returns 0 on success or -1 if the
+// terminal could not be set up
+int8_t term_windows_init_term(const char *type, FILE *out, FILE *in);
+
+// Sets a function to be called, with ctx, whenever a character is typed into
+// or deleted from an edit_window, e.g. to report that the user is typing (see
+// presence_tracker_keystroke). hook may be NULL
+void term_windows_set_edit_hook(void (*hook)(void *ctx), void *ctx);
+
+// Sets whether refreshes are deferred. While they are, windows are only
+// brought up to date in memory, and nothing is drawn until
+// term_windows_flush is called; any number of changes between flushes then
+// cost a single refresh
+void term_windows_set_deferred(bool deferred);
+
+// Draws whatever has changed since the last flush, if refreshes are deferred
+void term_windows_flush();
+
+// Sets the edit_window the terminal's cursor is left in by term_windows_flush,
+// so that it stays where the user is typing. win may be NULL
+void term_windows_set_focus(edit_window *win);
+
+// Returns the number of times a window has been refreshed, i.e. the number of
+// times output has been pushed to the terminal
+uint64_t term_windows_refresh_count();
+
 // Creates a new ext_window with the given size parameters. Returns a pointer
 // to the newly created window
 ext_window *ext_window_create(uint16_t nlines, uint16_t ncols, uint16_t start_row, uint16_t start_col);
@@ -105,10 +138,24 @@ ext_window *ext_window_create(uint16_t nlines, uint16_t ncols, uint16_t start_ro
 // Used primarily to create a wrapper for ncurses stdscr
 ext_window *ext_window_create_from_existing(WINDOW *win);
 
+// Frees the ext_window
+void ext_window_destroy(ext_window *win);
+
+// Clears the ext_window
+int8_t ext_window_clear(ext_window *win);
+
+// Writes str to the ext_window starting at column col of its first line,
+// highlighted if highlight is set. Returns 0 on success or -1 if col is out
+// of the ext_window bounds
+int8_t ext_window_puts(ext_window *win, uint16_t col, const char *str, bool highlight);
+
 // Creates a new edit_window with the given size parameters. Returns a pointer
 // to the newly edit_created window
 edit_window *edit_window_create(uint16_t nlines, uint16_t ncols, uint16_t start_row, uint16_t start_col);
 
+// Frees the edit_window
+void edit_window_destroy(edit_window *win);
+
 // Moves the edit_window's print cursor down nlines lines. Returns the number
 // of lines the cursor was moved; this may differ from nlines if the distance
 // between the current line and the last line is greated tham nlines. If nlines
@@ -139,10 +186,17 @@ int8_t edit_window_backspace(edit_window *win);
 // Clears the current line of the edit_window
 int8_t edit_window_clrln(edit_window *win);
 
+// Returns the next key typed into the edit_window, or ERR if none is waiting.
+// Never blocks
+int edit_window_read_key(edit_window *win);
+
 // Creates a new msg_window with the given size parameters. Returns a pointer
 // to the newly msg_created window
 msg_window *msg_window_create(uint16_t nlines, uint16_t ncols, uint16_t start_row, uint16_t start_col);
 
+// Frees the msg_window
+void msg_window_destroy(msg_window *win);
+
 int64_t msg_window_move_v(msg_window *win, int64_t nlines);
 
 // Moves the msg_window's print cursor right ncols columns. Returns the number
@@ -170,4 +224,13 @@ int8_t msg_window_scroll(msg_window *win, uint64_t nlines);
 // print cursor
 int8_t msg_window_puts(msg_window *win, char *str);
 
+// Prints str to msg_window on a line of its own, wrapping it onto as many
+// lines as it needs and scrolling the window as the bottom is reached. The
+// print cursor is left at the start of the next line
+int8_t msg_window_add_line(msg_window *win, const char *str);
+
+// Hides or shows the msg_window. Showing it draws everything written to it
+// while it was hidden
+void msg_window_set_hidden(msg_window *win, bool hidden);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+// transcript.h - Definitions for the asynchronous transcript logger
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// The transcript logger keeps file I/O off the message path. Threads hand
+// records to transcript_logger_log, which only copies them into a lock-free
+// ring; a dedicated writer thread, woken through an eventfd when it has gone
+// idle, drains the ring into large sequential writes and calls fdatasync once
+// per group of records, either when the sync interval elapses or when enough
+// bytes have accumulated. Records that do not fit in the ring are dropped, and
+// the writer notes how many in the transcript where they would have been.
+//
+// Transcript file format (all integers little-endian):
+//      file header: "SCTR" magic, u16 version, u16 reserved
+//      record:      u16 record length (including this header)
+//                   u8  direction (one of the TRANSCRIPT_* directions below)
+//                   u8  username length
+//                   u64 timestamp (nanoseconds since the Unix epoch)
+//                   username bytes, then message bytes (neither terminated)
+//
+// A TRANSCRIPT_DROPPED record has no username; its message gives the number
+// of records dropped since the last such record.
+
+#ifndef TRANSCRIPT_H
+#define TRANSCRIPT_H
+
+#include <stdint.h>
+#include <chat.h>
+
+#define TRANSCRIPT_MAGIC "SCTR"
+#define TRANSCRIPT_VERSION 1
+#define TRANSCRIPT_FILE_HEADER_SIZE 8
+#define TRANSCRIPT_RECORD_HEADER_SIZE 12
+#define TRANSCRIPT_MAX_RECORD_SIZE (TRANSCRIPT_RECORD_HEADER_SIZE + MAX_UNAME_SIZE + MAX_MSG_SIZE)
+#define TRANSCRIPT_QUEUE_SIZE 4096 // Records the ring holds; a power of two
+#define TRANSCRIPT_DEFAULT_SYNC_MS 1000 // Default group commit interval
+#define TRANSCRIPT_DEFAULT_SYNC_BYTES 1048576 // Default group commit size
+
+#define TRANSCRIPT_SENT 0
+#define TRANSCRIPT_RECEIVED 1
+#define TRANSCRIPT_DROPPED 2 // Written by the logger itself; see above
+
+typedef struct transcript_logger transcript_logger;
+
+// Opens (or appends to) the transcript at path and starts its writer thread.
+// Written records are synced to disk every sync_ms milliseconds or whenever
+// sync_bytes bytes have been written since the last sync, whichever comes
+// first. Returns a pointer to the logger or NULL on error
+transcript_logger *transcript_logger_create(const char *path, uint32_t sync_ms, uint64_t sync_bytes);
+
+// Queues a record of msg being sent or received by username. Never blocks
+// and never touches the file. Returns 0 on success or -1 if the ring was full
+// and the record had to be dropped
+int8_t transcript_logger_log(transcript_logger *logger, uint8_t direction, const char *username, const char *msg);
+
+// Writes out and syncs every queued record, stops the writer thread and
+// closes the transcript. Returns the number of records that were dropped
+// over the lifetime of the logger
+uint64_t transcript_logger_destroy(transcript_logger *logger);
+
+#endif
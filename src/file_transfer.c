@@ -0,0 +1,593 @@
+// file_transfer.c - Streams files over chat connections
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <file_transfer.h>
+
+#define MAX_NOTICE_SIZE 512
+#define MAX_PATH_NOTICE_SIZE (PATH_MAX + MAX_NOTICE_SIZE) // Notices naming a saved file
+#define MAX_RENAMES 100 // Attempts at finding an unused name for a file
+#define DISCARD_BUFFER_SIZE 4096
+
+// A file being sent. Everything but the id is guarded by transfers_lock
+typedef struct outgoing {
+    uint64_t id;
+    int file_fd;
+    off_t size;
+    char name[FILE_MAX_NAME + 1];
+    char username[MAX_UNAME_SIZE];
+    char recipient[MAX_UNAME_SIZE];
+
+    file_send_fn send;
+    void *ctx;
+    file_notice_fn notice;
+
+    uint32_t in_flight; // Chunks sent but not yet acknowledged
+    bool cancelled;
+    pthread_cond_t acked;
+
+    struct outgoing *next;
+} outgoing;
+
+// A file being received
+typedef struct incoming {
+    uint64_t id; // 0 if the slot is free
+    int fd; // -1 if the file could not be written
+    off_t size;
+    off_t received;
+    char path[PATH_MAX];
+    char username[MAX_UNAME_SIZE];
+} incoming;
+
+struct file_receiver {
+    char *directory;
+    file_notice_fn notice;
+    void *ctx; // Passed to notice
+    int pipe[2]; // Chunks are spliced from the socket into the file through this
+    uint32_t chunk_left; // Bytes of the chunk being received yet to arrive
+    bool in_chunk; // A chunk is partway in
+    incoming files[FILE_MAX_RECEIVING];
+};
+
+static pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t transfer_ended = PTHREAD_COND_INITIALIZER;
+static outgoing *transfers; // Every transfer being sent
+static uint64_t next_transfer_id;
+
+static void put_u64(uint8_t *out, uint64_t value) {
+    uint32_t high = htonl((uint32_t) (value >> 32));
+    uint32_t low = htonl((uint32_t) value);
+
+    memcpy(out, &high, 4);
+    memcpy(out + 4, &low, 4);
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+    uint32_t high, low;
+
+    memcpy(&high, in, 4);
+    memcpy(&low, in + 4, 4);
+
+    return (uint64_t) ntohl(high) << 32 | ntohl(low);
+}
+
+// Returns the time timeout_ms from now, as pthread_cond_timedwait expects
+static struct timespec deadline_after(uint32_t timeout_ms) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    return deadline;
+}
+
+// Waits until transfer has fewer than limit chunks unacknowledged. Must be
+// called with transfers_lock held. Returns false if the transfer was
+// cancelled or the receiver stopped acknowledging
+static bool wait_for_window(outgoing *transfer, uint32_t limit) {
+    struct timespec deadline = deadline_after(FILE_ACK_TIMEOUT_MS);
+
+    while (transfer->in_flight >= limit && !transfer->cancelled) {
+        if (pthread_cond_timedwait(&transfer->acked, &transfers_lock, &deadline) == ETIMEDOUT) {
+            return false;
+        }
+    }
+
+    return !transfer->cancelled;
+}
+
+// Sends a frame of transfer that carries no file data
+static int8_t send_control(outgoing *transfer, uint8_t type, const void *payload, uint32_t length, uint8_t uname_len) {
+    frame_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.id = transfer->id;
+    header.length = length;
+    header.uname_len = uname_len;
+
+    return transfer->send(transfer->ctx, &header, payload, -1, 0);
+}
+
+static void *stream_file(void *arg) {
+    outgoing *transfer = arg;
+    char notice[MAX_NOTICE_SIZE];
+    uint8_t start[MAX_UNAME_SIZE + 8 + FILE_MAX_NAME];
+    size_t u_len = strlen(transfer->username);
+    size_t n_len = strlen(transfer->name);
+    off_t offset = 0;
+    bool sent = false;
+
+    memcpy(start, transfer->username, u_len);
+    put_u64(start + u_len, transfer->size);
+    memcpy(start + u_len + 8, transfer->name, n_len);
+
+    if (send_control(transfer, FRAME_FILE_START, start, u_len + 8 + n_len, u_len) == 0) {
+        frame_header chunk;
+
+        memset(&chunk, 0, sizeof(chunk));
+        chunk.type = FRAME_FILE_CHUNK;
+        chunk.id = transfer->id;
+
+        while (offset < transfer->size) {
+            pthread_mutex_lock(&transfers_lock);
+            bool open = wait_for_window(transfer, FILE_WINDOW);
+            if (open) {
+                transfer->in_flight++;
+            }
+            pthread_mutex_unlock(&transfers_lock);
+
+            chunk.length = transfer->size - offset < FILE_CHUNK_SIZE ? transfer->size - offset : FILE_CHUNK_SIZE;
+
+            if (!open || transfer->send(transfer->ctx, &chunk, NULL, transfer->file_fd, offset) < 0) {
+                break;
+            }
+
+            offset += chunk.length;
+        }
+
+        // Only report success once the whole file is on the other end's disk
+        if (offset == transfer->size) {
+            pthread_mutex_lock(&transfers_lock);
+            sent = wait_for_window(transfer, 1);
+            pthread_mutex_unlock(&transfers_lock);
+        }
+
+        if (sent) {
+            sent = send_control(transfer, FRAME_FILE_END, NULL, 0, 0) == 0;
+        }
+    }
+
+    if (sent) {
+        snprintf(notice, MAX_NOTICE_SIZE, "Sent %s (%ld bytes) to %s", transfer->name, transfer->size, transfer->recipient);
+    } else {
+        snprintf(notice, MAX_NOTICE_SIZE, "Failed to send %s to %s", transfer->name, transfer->recipient);
+    }
+    transfer->notice(transfer->ctx, notice);
+
+    pthread_mutex_lock(&transfers_lock);
+    for (outgoing **link = &transfers; *link != NULL; link = &(*link)->next) {
+        if (*link == transfer) {
+            *link = transfer->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&transfer_ended);
+    pthread_mutex_unlock(&transfers_lock);
+
+    close(transfer->file_fd);
+    pthread_cond_destroy(&transfer->acked);
+    free(transfer->ctx);
+    free(transfer);
+
+    pthread_exit(NULL);
+}
+
+int8_t file_transfer_send(const char *path, const char *username, const char *recipient, file_send_fn send, void *ctx, file_notice_fn notice) {
+    struct stat info;
+    const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    int file_fd = open(path, O_RDONLY);
+
+    if (file_fd < 0) {
+        return -1;
+    }
+
+    if (fstat(file_fd, &info) < 0 || !S_ISREG(info.st_mode) || strlen(name) > FILE_MAX_NAME) {
+        close(file_fd);
+        return -1;
+    }
+
+    outgoing *transfer = calloc(1, sizeof(outgoing));
+
+    if (transfer == NULL) {
+        close(file_fd);
+        return -1;
+    }
+
+    transfer->file_fd = file_fd;
+    transfer->size = info.st_size;
+    strcpy(transfer->name, name);
+    strncpy(transfer->username, username, MAX_UNAME_SIZE - 1);
+    strncpy(transfer->recipient, recipient, MAX_UNAME_SIZE - 1);
+    transfer->send = send;
+    transfer->ctx = ctx;
+    transfer->notice = notice;
+    pthread_cond_init(&transfer->acked, NULL);
+
+    pthread_mutex_lock(&transfers_lock);
+    transfer->id = ++next_transfer_id;
+    transfer->next = transfers;
+    transfers = transfer;
+    pthread_mutex_unlock(&transfers_lock);
+
+    // The transfer's thread inherits our signal mask. Block everything while
+    // spawning it so signals are left to the main thread's signalfd
+    pthread_t streamer;
+    pthread_attr_t attr;
+    sigset_t all, old_mask;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+    pthread_create(&streamer, &attr, stream_file, transfer);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_attr_destroy(&attr);
+
+    return 0;
+}
+
+void file_transfer_ack(uint64_t id, bool (*match)(void *ctx, void *arg), void *arg) {
+    pthread_mutex_lock(&transfers_lock);
+    for (outgoing *transfer = transfers; transfer != NULL; transfer = transfer->next) {
+        if (transfer->id == id && match(transfer->ctx, arg)) {
+            if (transfer->in_flight > 0) {
+                transfer->in_flight--;
+            }
+            pthread_cond_signal(&transfer->acked);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&transfers_lock);
+}
+
+// Returns true if any transfer still being sent is picked out by match, or
+// any at all if match is NULL
+static bool any_matching(bool (*match)(void *ctx, void *arg), void *arg) {
+    for (outgoing *transfer = transfers; transfer != NULL; transfer = transfer->next) {
+        if (match == NULL || match(transfer->ctx, arg)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void file_transfer_stop_matching(bool (*match)(void *ctx, void *arg), void *arg) {
+    pthread_mutex_lock(&transfers_lock);
+    for (outgoing *transfer = transfers; transfer != NULL; transfer = transfer->next) {
+        if (match == NULL || match(transfer->ctx, arg)) {
+            transfer->cancelled = true;
+            pthread_cond_signal(&transfer->acked);
+        }
+    }
+
+    while (any_matching(match, arg)) {
+        pthread_cond_wait(&transfer_ended, &transfers_lock);
+    }
+    pthread_mutex_unlock(&transfers_lock);
+}
+
+void file_transfer_stop_all() {
+    file_transfer_stop_matching(NULL, NULL);
+}
+
+file_receiver *file_receiver_create(const char *directory, file_notice_fn notice, void *ctx) {
+    file_receiver *receiver = calloc(1, sizeof(file_receiver));
+
+    if (receiver == NULL) {
+        return NULL;
+    }
+
+    receiver->directory = strdup(directory);
+    receiver->notice = notice;
+    receiver->ctx = ctx;
+
+    if (receiver->directory == NULL || pipe(receiver->pipe) < 0) {
+        free(receiver->directory);
+        free(receiver);
+        return NULL;
+    }
+
+    return receiver;
+}
+
+void file_receiver_destroy(file_receiver *receiver) {
+    for (int i = 0; i < FILE_MAX_RECEIVING; i++) {
+        if (receiver->files[i].id != 0 && receiver->files[i].fd >= 0) {
+            close(receiver->files[i].fd);
+        }
+    }
+
+    close(receiver->pipe[0]);
+    close(receiver->pipe[1]);
+    free(receiver->directory);
+    free(receiver);
+}
+
+bool file_receiver_idle(file_receiver *receiver) {
+    if (receiver->in_chunk) {
+        return false;
+    }
+
+    for (int i = 0; i < FILE_MAX_RECEIVING; i++) {
+        if (receiver->files[i].id != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint32_t file_receiver_chunk_left(file_receiver *receiver) {
+    return receiver->in_chunk ? receiver->chunk_left : 0;
+}
+
+size_t file_receiver_memory(file_receiver *receiver) {
+    return sizeof(file_receiver) + strlen(receiver->directory) + 1;
+}
+
+static incoming *find_file(file_receiver *receiver, uint64_t id) {
+    for (int i = 0; i < FILE_MAX_RECEIVING; i++) {
+        if (receiver->files[i].id == id && id != 0) {
+            return &receiver->files[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Creates the file to save name in, adding a suffix if a file by that name
+// already exists. Returns the open file, or -1 on error
+static int create_file(file_receiver *receiver, const char *name, char *path) {
+    // The name comes from the other end, so it must not lead anywhere but
+    // into our directory
+    if (name[0] == '\0' || name[0] == '.' || strchr(name, '/') != NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_RENAMES; i++) {
+        int length;
+
+        if (i == 0) {
+            length = snprintf(path, PATH_MAX, "%s/%s", receiver->directory, name);
+        } else {
+            length = snprintf(path, PATH_MAX, "%s/%s.%d", receiver->directory, name, i);
+        }
+
+        // A truncated path would save the file somewhere else
+        if (length < 0 || length >= PATH_MAX) {
+            return -1;
+        }
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+        if (fd >= 0 || errno != EEXIST) {
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+static int8_t start_file(file_receiver *receiver, const frame_header *header, const uint8_t *payload) {
+    char notice[MAX_NOTICE_SIZE];
+    char name[FILE_MAX_NAME + 1];
+    incoming *file = NULL;
+
+    for (int i = 0; file == NULL && i < FILE_MAX_RECEIVING; i++) {
+        if (receiver->files[i].id == 0) {
+            file = &receiver->files[i];
+        }
+    }
+
+    if (header->id == 0 || find_file(receiver, header->id) != NULL || header->length < header->uname_len + 8u
+        || header->length - header->uname_len - 8 > FILE_MAX_NAME) {
+        return 0;
+    }
+
+    size_t n_len = header->length - header->uname_len - 8;
+    memcpy(name, payload + header->uname_len + 8, n_len);
+    name[n_len] = '\0';
+
+    if (file == NULL) {
+        snprintf(notice, MAX_NOTICE_SIZE, "Refused %s: too many files being received", name);
+        receiver->notice(receiver->ctx, notice);
+        return 0;
+    }
+
+    file->id = header->id;
+    file->size = get_u64(payload + header->uname_len);
+    file->received = 0;
+    frame_split_message(header, payload, file->username, NULL);
+    file->fd = create_file(receiver, name, file->path);
+
+    if (file->fd < 0) {
+        snprintf(notice, MAX_NOTICE_SIZE, "Could not save %s from %s", name, file->username);
+    } else {
+        snprintf(notice, MAX_NOTICE_SIZE, "Receiving %s (%ld bytes) from %s", name, file->size, file->username);
+    }
+    receiver->notice(receiver->ctx, notice);
+
+    return 0;
+}
+
+static void end_file(file_receiver *receiver, incoming *file) {
+    char notice[MAX_PATH_NOTICE_SIZE];
+
+    if (file->fd >= 0) {
+        close(file->fd);
+
+        if (file->received == file->size) {
+            snprintf(notice, MAX_PATH_NOTICE_SIZE, "Received %s from %s", file->path, file->username);
+        } else {
+            snprintf(notice, MAX_PATH_NOTICE_SIZE, "Received %s from %s incomplete", file->path, file->username);
+        }
+        receiver->notice(receiver->ctx, notice);
+    }
+
+    file->id = 0;
+}
+
+// Returns 0 if a read from fd came up short only because nothing more has
+// arrived yet, or -1 if fd failed
+static int8_t read_failed(ssize_t received) {
+    return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+// Reads and throws away what has arrived of the *left bytes of a chunk on fd,
+// counting them off. Returns 0 on success or -1 on error
+static int8_t discard(int fd, uint32_t *left) {
+    uint8_t buffer[DISCARD_BUFFER_SIZE];
+
+    while (*left > 0) {
+        ssize_t received = recv(fd, buffer, *left < DISCARD_BUFFER_SIZE ? *left : DISCARD_BUFFER_SIZE, MSG_DONTWAIT);
+
+        if (received <= 0) {
+            return read_failed(received);
+        }
+
+        *left -= received;
+    }
+
+    return 0;
+}
+
+// Moves what has arrived of the *left bytes of a chunk on fd into file,
+// without them passing through user space, and counts them off. Returns 0 on
+// success or -1 if fd failed. If only the file failed, it is closed and the
+// rest of the chunk discarded
+static int8_t splice_chunk(file_receiver *receiver, int fd, incoming *file, uint32_t *left) {
+    while (*left > 0) {
+        uint8_t byte;
+
+        // SPLICE_F_NONBLOCK only covers the pipe; on a blocking socket splice
+        // waits for data, so it is only called once some has arrived
+        ssize_t waiting = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+        if (waiting <= 0) {
+            return read_failed(waiting);
+        }
+
+        ssize_t in_pipe = splice(fd, NULL, receiver->pipe[1], NULL, *left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (in_pipe <= 0) {
+            return read_failed(in_pipe);
+        }
+        *left -= in_pipe;
+
+        while (in_pipe > 0) {
+            ssize_t written = splice(receiver->pipe[0], NULL, file->fd, NULL, in_pipe, SPLICE_F_MOVE);
+
+            if (written <= 0) {
+                char notice[MAX_PATH_NOTICE_SIZE];
+
+                snprintf(notice, MAX_PATH_NOTICE_SIZE, "Failed to write %s", file->path);
+                receiver->notice(receiver->ctx, notice);
+                close(file->fd);
+                file->fd = -1;
+
+                // Empty the pipe, since the next chunk will go through it
+                uint8_t buffer[DISCARD_BUFFER_SIZE];
+                while (in_pipe > 0) {
+                    ssize_t drained = read(receiver->pipe[0], buffer, in_pipe < DISCARD_BUFFER_SIZE ? in_pipe : DISCARD_BUFFER_SIZE);
+                    if (drained <= 0) {
+                        return -1;
+                    }
+                    in_pipe -= drained;
+                }
+
+                return discard(fd, left);
+            }
+
+            in_pipe -= written;
+            file->received += written;
+        }
+    }
+
+    return 0;
+}
+
+int8_t file_receiver_handle(file_receiver *receiver, int fd, const frame_header *header, const void *payload, frame_header *ack) {
+    incoming *file = find_file(receiver, header->id);
+
+    if (header->type == FRAME_FILE_CHUNK) {
+        if (!receiver->in_chunk) {
+            receiver->in_chunk = true;
+            receiver->chunk_left = header->length;
+        }
+
+        if (file != NULL && file->fd >= 0) {
+            if (splice_chunk(receiver, fd, file, &receiver->chunk_left) < 0) {
+                return -1;
+            }
+        } else if (discard(fd, &receiver->chunk_left) < 0) {
+            return -1;
+        }
+
+        if (receiver->chunk_left > 0) {
+            return FRAME_PENDING;
+        }
+        receiver->in_chunk = false;
+
+        // Acknowledge even chunks we could not save, so the sender is not
+        // left waiting for the window to open
+        memset(ack, 0, sizeof(frame_header));
+        ack->type = FRAME_FILE_ACK;
+        ack->id = header->id;
+
+        return 1;
+    }
+
+    if (header->type == FRAME_FILE_START) {
+        return start_file(receiver, header, payload);
+    }
+
+    if (header->type == FRAME_FILE_END && file != NULL) {
+        end_file(receiver, file);
+    }
+
+    return 0;
+}
@@ -0,0 +1,327 @@
+// frame.c - Sending and receiving sockets_chat frames
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <frame.h>
+
+static void put_u32(uint8_t *out, uint32_t value) {
+    value = htonl(value);
+    memcpy(out, &value, 4);
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+    put_u32(out, (uint32_t) (value >> 32));
+    put_u32(out + 4, (uint32_t) value);
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+    uint32_t value;
+    memcpy(&value, in, 4);
+
+    return ntohl(value);
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+    return (uint64_t) get_u32(in) << 32 | get_u32(in + 4);
+}
+
+size_t frame_encode_header(uint8_t *out, const frame_header *header) {
+    out[0] = header->type;
+    out[1] = header->flags;
+    out[2] = header->uname_len;
+    out[3] = header->nhops;
+    put_u32(out + 4, header->length);
+    put_u32(out + 8, header->origin);
+    put_u64(out + 12, header->id);
+    put_u64(out + 20, header->sent_at);
+
+    for (uint8_t i = 0; i < header->nhops; i++) {
+        put_u64(out + FRAME_HEADER_SIZE + 8 * i, header->hops[i]);
+    }
+
+    return FRAME_HEADER_SIZE + 8 * header->nhops;
+}
+
+// Decodes the fixed part of the header; the hops are read separately
+static void decode_header(const uint8_t *in, frame_header *header) {
+    header->type = in[0];
+    header->flags = in[1];
+    header->uname_len = in[2];
+    header->nhops = in[3];
+    header->length = get_u32(in + 4);
+    header->origin = get_u32(in + 8);
+    header->id = get_u64(in + 12);
+    header->sent_at = get_u64(in + 20);
+}
+
+uint64_t frame_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t frame_monotonic_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void frame_stamp_hop(frame_header *header) {
+    if (header->nhops < FRAME_MAX_HOPS) {
+        header->hops[header->nhops++] = frame_now();
+    }
+}
+
+int8_t frame_send(int fd, const frame_header *header, const void *payload) {
+    uint8_t encoded[FRAME_HEADER_SIZE + 8 * FRAME_MAX_HOPS];
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    iov[0].iov_base = encoded;
+    iov[0].iov_len = frame_encode_header(encoded, header);
+    iov[1].iov_base = (void*) payload;
+    iov[1].iov_len = header->length;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = header->length > 0 ? 2 : 1;
+
+    // Keep going until both the header and the payload are out, so that a
+    // short write never leaves half a frame on the connection
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            return -1;
+        }
+
+        while (msg.msg_iovlen > 0 && (size_t) sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t*) msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+// Returns how much of the frame in reader comes before its payload: the
+// header and its hops. Only valid once the fixed part of the header is in
+static size_t header_end(const frame_reader *reader) {
+    return FRAME_HEADER_SIZE + 8 * reader->header.nhops;
+}
+
+// Returns the size of the frame in reader, not counting the payload of a
+// FILE_CHUNK frame. Only valid once the fixed part of the header is in
+static size_t frame_end(const frame_reader *reader) {
+    return header_end(reader) + (reader->header.type == FRAME_FILE_CHUNK ? 0 : reader->header.length);
+}
+
+// Points out at where the next bytes of the frame in reader go, and returns
+// how many more it needs: the fixed part of the header, then the hops, then
+// the payload. Returns 0 once the frame is complete
+static size_t next_part(frame_reader *reader, uint8_t **out) {
+    if (reader->received < FRAME_HEADER_SIZE) {
+        *out = reader->encoded + reader->received;
+        return FRAME_HEADER_SIZE - reader->received;
+    }
+    if (reader->received < header_end(reader)) {
+        *out = reader->encoded + reader->received;
+        return header_end(reader) - reader->received;
+    }
+
+    *out = reader->payload + (reader->received - header_end(reader));
+
+    return frame_end(reader) - reader->received;
+}
+
+// Counts received more bytes as having arrived in the part next_part pointed
+// out, decoding the header once it is in. Returns 0, or -1 if the header is
+// not valid
+static int8_t part_received(frame_reader *reader, size_t received) {
+    bool had_header = reader->received >= FRAME_HEADER_SIZE;
+    frame_header *header = &reader->header;
+
+    reader->received += received;
+
+    if (!had_header && reader->received == FRAME_HEADER_SIZE) {
+        decode_header(reader->encoded, header);
+
+        uint32_t max_length = header->type == FRAME_FILE_CHUNK ? FRAME_MAX_CHUNK : FRAME_MAX_PAYLOAD;
+
+        if (header->length > max_length || header->uname_len > header->length
+            || header->nhops > FRAME_MAX_HOPS) {
+            return -1;
+        }
+    }
+
+    // The hops are decoded once the last of them is in
+    if (had_header && reader->received == header_end(reader)) {
+        for (uint8_t i = 0; i < header->nhops; i++) {
+            header->hops[i] = get_u64(reader->encoded + FRAME_HEADER_SIZE + 8 * i);
+        }
+    }
+
+    return 0;
+}
+
+int8_t frame_reader_recv(frame_reader *reader, int fd) {
+    uint8_t *out;
+    size_t wanted;
+
+    while ((wanted = next_part(reader, &out)) > 0) {
+        ssize_t received = recv(fd, out, wanted, MSG_DONTWAIT);
+
+        if (received == 0) {
+            return 0;
+        }
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? FRAME_PENDING : -1;
+        }
+        if (part_received(reader, received) < 0) {
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+size_t frame_reader_save(const frame_reader *reader, uint32_t chunk_left, uint8_t *out) {
+    size_t header_size = reader->received;
+
+    // The header and its hops are kept apart from the payload
+    if (header_size >= FRAME_HEADER_SIZE && header_size > header_end(reader)) {
+        header_size = header_end(reader);
+    }
+
+    memcpy(out, reader->encoded, header_size);
+    memcpy(out + header_size, reader->payload, reader->received - header_size);
+
+    // The new reader is left to skip what is still to come of the chunk
+    if (reader->received >= FRAME_HEADER_SIZE && reader->header.type == FRAME_FILE_CHUNK) {
+        put_u32(out + 4, chunk_left);
+    }
+
+    return reader->received;
+}
+
+int8_t frame_reader_restore(frame_reader *reader, const uint8_t *saved, size_t length) {
+    uint8_t *out;
+    size_t wanted;
+
+    frame_reader_next(reader);
+
+    while (length > 0 && (wanted = next_part(reader, &out)) > 0) {
+        size_t taken = wanted < length ? wanted : length;
+
+        memcpy(out, saved, taken);
+        if (part_received(reader, taken) < 0) {
+            return -1;
+        }
+
+        saved += taken;
+        length -= taken;
+    }
+
+    return length == 0 ? 0 : -1;
+}
+
+void frame_reader_next(frame_reader *reader) {
+    reader->received = 0;
+}
+
+bool frame_reader_busy(const frame_reader *reader) {
+    return reader->received > 0;
+}
+
+void frame_init_message(frame_header *header, void *payload, const char *username, const char *msg) {
+    size_t u_len = strnlen(username, MAX_UNAME_SIZE - 1);
+    size_t m_len = strnlen(msg, MAX_MSG_SIZE - 1);
+
+    memcpy(payload, username, u_len);
+    memcpy((uint8_t*) payload + u_len, msg, m_len);
+
+    memset(header, 0, sizeof(frame_header));
+    header->type = FRAME_MESSAGE;
+    header->uname_len = u_len;
+    header->length = u_len + m_len;
+    header->sent_at = frame_now();
+}
+
+void frame_init_hello(frame_header *header, void *payload, uint8_t flags, const char *username, uint64_t token, uint64_t seq) {
+    size_t u_len = strnlen(username, MAX_UNAME_SIZE - 1);
+
+    memset(header, 0, sizeof(frame_header));
+    header->type = FRAME_HELLO;
+    header->flags = flags;
+    header->uname_len = u_len;
+    header->length = u_len;
+    memcpy(payload, username, u_len);
+
+    if (token != 0) {
+        put_u64((uint8_t*) payload + u_len, token);
+        put_u64((uint8_t*) payload + u_len + 8, seq);
+        header->length += FRAME_RESUME_SIZE;
+    }
+}
+
+bool frame_split_resume(const frame_header *header, const void *payload, uint64_t *token, uint64_t *seq) {
+    *token = 0;
+    *seq = 0;
+
+    if (header->length < (uint32_t) header->uname_len + FRAME_RESUME_SIZE) {
+        return false;
+    }
+
+    *token = get_u64((const uint8_t*) payload + header->uname_len);
+    *seq = get_u64((const uint8_t*) payload + header->uname_len + 8);
+
+    return true;
+}
+
+void frame_split_message(const frame_header *header, const void *payload, char *username, char *msg) {
+    size_t u_len = header->uname_len;
+    size_t m_len = header->length - header->uname_len;
+
+    if (u_len > MAX_UNAME_SIZE - 1) {
+        u_len = MAX_UNAME_SIZE - 1;
+    }
+    memcpy(username, payload, u_len);
+    username[u_len] = '\0';
+
+    if (msg != NULL) {
+        if (m_len > MAX_MSG_SIZE - 1) {
+            m_len = MAX_MSG_SIZE - 1;
+        }
+        memcpy(msg, (uint8_t*) payload + header->uname_len, m_len);
+        msg[m_len] = '\0';
+    }
+}
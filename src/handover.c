@@ -0,0 +1,277 @@
+// handover.c - Hands state and sockets to another process
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <handover.h>
+
+// Fills in the address of the Unix socket at path. Returns -1 if path is too
+// long to be one
+static int8_t unix_address(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+int handover_listen(const char *path) {
+    struct sockaddr_un addr;
+
+    if (unix_address(path, &addr) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int handover_connect(const char *path) {
+    struct sockaddr_un addr;
+
+    if (unix_address(path, &addr) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+int8_t handover_send(int fd, uint8_t type, const void *data, uint32_t length, int pass_fd) {
+    uint8_t header[HANDOVER_RECORD_HEADER_SIZE];
+    uint32_t net_length = htonl(length);
+    union {
+        struct cmsghdr align;
+        uint8_t buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+
+    header[0] = type;
+    memcpy(header + 1, &net_length, 4);
+
+    iov.iov_base = header;
+    iov.iov_len = HANDOVER_RECORD_HEADER_SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    // The descriptor rides along with the record header, so the receiver
+    // picks it up with the same recvmsg
+    if (pass_fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != HANDOVER_RECORD_HEADER_SIZE) {
+        return -1;
+    }
+
+    const uint8_t *next = data;
+
+    while (length > 0) {
+        ssize_t sent = send(fd, next, length, MSG_NOSIGNAL);
+
+        if (sent <= 0) {
+            return -1;
+        }
+
+        next += sent;
+        length -= sent;
+    }
+
+    return 0;
+}
+
+int8_t handover_recv(int fd, uint8_t *type, uint8_t **data, uint32_t *length, int *passed_fd) {
+    uint8_t header[HANDOVER_RECORD_HEADER_SIZE];
+    union {
+        struct cmsghdr align;
+        uint8_t buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+
+    iov.iov_base = header;
+    iov.iov_len = HANDOVER_RECORD_HEADER_SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    *data = NULL;
+    *passed_fd = -1;
+
+    ssize_t received = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+    if (received == 0) {
+        return 0;
+    }
+    if (received != HANDOVER_RECORD_HEADER_SIZE) {
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    *type = header[0];
+    memcpy(length, header + 1, 4);
+    *length = ntohl(*length);
+
+    if (*length > HANDOVER_MAX_RECORD) {
+        return -1;
+    }
+
+    *data = malloc(*length > 0 ? *length : 1);
+
+    if (*data == NULL
+        || (*length > 0 && recv(fd, *data, *length, MSG_WAITALL) != (ssize_t) *length)) {
+        free(*data);
+        *data = NULL;
+        if (*passed_fd >= 0) {
+            close(*passed_fd);
+            *passed_fd = -1;
+        }
+        return -1;
+    }
+
+    return 1;
+}
+
+void handover_put(handover_buffer *buffer, const void *data, size_t length) {
+    if (buffer->failed) {
+        return;
+    }
+
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity : 256;
+
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+
+        uint8_t *grown = realloc(buffer->data, capacity);
+
+        if (grown == NULL) {
+            buffer->failed = true;
+            return;
+        }
+
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void handover_put_u32(handover_buffer *buffer, uint32_t value) {
+    value = htonl(value);
+    handover_put(buffer, &value, 4);
+}
+
+void handover_put_u64(handover_buffer *buffer, uint64_t value) {
+    handover_put_u32(buffer, (uint32_t) (value >> 32));
+    handover_put_u32(buffer, (uint32_t) value);
+}
+
+void handover_put_string(handover_buffer *buffer, const char *string) {
+    handover_put_u32(buffer, strlen(string));
+    handover_put(buffer, string, strlen(string));
+}
+
+void handover_buffer_free(handover_buffer *buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(handover_buffer));
+}
+
+void handover_get(handover_reader *reader, void *out, size_t length) {
+    if (reader->failed || reader->length - reader->offset < length) {
+        reader->failed = true;
+        memset(out, 0, length);
+        return;
+    }
+
+    memcpy(out, reader->data + reader->offset, length);
+    reader->offset += length;
+}
+
+uint32_t handover_get_u32(handover_reader *reader) {
+    uint32_t value;
+
+    handover_get(reader, &value, 4);
+
+    return ntohl(value);
+}
+
+uint64_t handover_get_u64(handover_reader *reader) {
+    uint64_t high = handover_get_u32(reader);
+
+    return high << 32 | handover_get_u32(reader);
+}
+
+void handover_get_string(handover_reader *reader, char *out, size_t size) {
+    uint32_t length = handover_get_u32(reader);
+
+    if (reader->failed || reader->length - reader->offset < length) {
+        reader->failed = true;
+        out[0] = '\0';
+        return;
+    }
+
+    size_t copied = length < size - 1 ? length : size - 1;
+
+    memcpy(out, reader->data + reader->offset, copied);
+    out[copied] = '\0';
+    reader->offset += length;
+}
@@ -0,0 +1,144 @@
+// latency.c - Message latency histograms
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <latency.h>
+
+static size_t bucket_index(uint64_t ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return ns;
+    }
+
+    // Keep the top LATENCY_SUB_BITS + 1 bits of the value; the position of
+    // the highest one picks the power of two, the rest the sub-bucket
+    int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+
+    return (size_t) (shift + 1) * LATENCY_SUB_BUCKETS + ((ns >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+// Returns the largest value that lands in bucket i
+static uint64_t bucket_limit(size_t i) {
+    if (i < LATENCY_SUB_BUCKETS) {
+        return i;
+    }
+
+    int shift = i / LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub = i % LATENCY_SUB_BUCKETS;
+
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+latency_trace *latency_trace_create() {
+    latency_trace *trace = calloc(1, sizeof(latency_trace));
+
+    return trace;
+}
+
+void latency_trace_destroy(latency_trace *trace) {
+    free(trace);
+}
+
+void latency_record(latency_histogram *histogram, uint64_t ns) {
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_index(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, ns,
+        memory_order_relaxed, memory_order_relaxed));
+}
+
+// Clocks on different machines never agree exactly, so a leg can appear to
+// have taken negative time; count it as instant
+static uint64_t elapsed(uint64_t from, uint64_t to) {
+    return to > from ? to - from : 0;
+}
+
+void latency_trace_record(latency_trace *trace, const frame_header *header, uint64_t now) {
+    if (header->sent_at == 0 || header->flags & FRAME_MESSAGE_REPLAYED) {
+        return;
+    }
+
+    uint64_t previous = header->sent_at;
+    for (uint8_t i = 0; i < header->nhops; i++) {
+        latency_record(&trace->hops[i], elapsed(previous, header->hops[i]));
+        previous = header->hops[i];
+    }
+
+    latency_record(&trace->hops[header->nhops], elapsed(previous, now));
+    latency_record(&trace->end_to_end, elapsed(header->sent_at, now));
+}
+
+uint64_t latency_percentile(latency_histogram *histogram, double percentile) {
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (count * percentile / 100.0);
+    uint64_t seen = 0;
+
+    if (rank >= count) {
+        rank = count - 1;
+    }
+
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+
+        if (seen > rank) {
+            uint64_t limit = bucket_limit(i);
+            uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+            return limit < max ? limit : max;
+        }
+    }
+
+    return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+static void print_histogram(FILE *out, const char *name, latency_histogram *histogram) {
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+
+    if (count == 0) {
+        return;
+    }
+
+    fprintf(
+        out,
+        "  %-12s %8lu %10.3f %10.3f %10.3f %10.3f\n",
+        name,
+        count,
+        latency_percentile(histogram, 50) / 1e6,
+        latency_percentile(histogram, 90) / 1e6,
+        latency_percentile(histogram, 99) / 1e6,
+        atomic_load_explicit(&histogram->max, memory_order_relaxed) / 1e6
+    );
+}
+
+void latency_trace_print(latency_trace *trace, FILE *out) {
+    char name[16];
+
+    fprintf(out, "  %-12s %8s %10s %10s %10s %10s\n", "latency (ms)", "count", "p50", "p90", "p99", "max");
+    print_histogram(out, "end-to-end", &trace->end_to_end);
+
+    for (int i = 0; i <= FRAME_MAX_HOPS; i++) {
+        snprintf(name, sizeof(name), "hop %d", i + 1);
+        print_histogram(out, name, &trace->hops[i]);
+    }
+
+    print_histogram(out, "round trip", &trace->round_trip);
+}
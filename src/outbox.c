@@ -0,0 +1,437 @@
+// outbox.c - Schedules the frames sent over a connection
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <outbox.h>
+
+typedef struct outbox_entry {
+    struct outbox_entry *next;
+    size_t length; // Bytes in data: the encoded header and any payload
+    size_t sent; // Bytes of data and file data sent so far
+    int file_fd; // -1 unless the payload comes from a file
+    off_t file_offset;
+    size_t file_length;
+    uint8_t data[];
+} outbox_entry;
+
+typedef struct outbox_queue {
+    outbox_entry *head;
+    outbox_entry *tail;
+    int64_t deficit; // Bytes the lane may still send this round
+} outbox_queue;
+
+struct outbox {
+    outbox_queue lanes[OUTBOX_LANES];
+    outbox_entry *current; // Partly sent; finished before anything else
+    uint8_t turn; // The lane being served
+    size_t queued; // Bytes held, including current
+    size_t budget; // The most bytes that may be queued
+};
+
+static const int64_t weights[OUTBOX_LANES] = {
+    OUTBOX_CONTROL_WEIGHT,
+    OUTBOX_INTERACTIVE_WEIGHT,
+    OUTBOX_BULK_WEIGHT
+};
+
+static size_t entry_size(const outbox_entry *entry) {
+    return entry->length + entry->file_length;
+}
+
+static void free_entry(outbox_entry *entry) {
+    if (entry->file_fd >= 0) {
+        close(entry->file_fd);
+    }
+    free(entry);
+}
+
+outbox *outbox_create(size_t budget) {
+    outbox *box = calloc(1, sizeof(outbox));
+
+    if (box == NULL) {
+        return NULL;
+    }
+
+    box->budget = budget;
+
+    // The first round starts with the control lane
+    box->turn = OUTBOX_LANES - 1;
+
+    return box;
+}
+
+void outbox_destroy(outbox *box) {
+    outbox_clear(box);
+    free(box);
+}
+
+void outbox_clear(outbox *box) {
+    if (box->current != NULL) {
+        free_entry(box->current);
+        box->current = NULL;
+    }
+
+    for (int i = 0; i < OUTBOX_LANES; i++) {
+        outbox_entry *entry = box->lanes[i].head;
+
+        while (entry != NULL) {
+            outbox_entry *next = entry->next;
+            free_entry(entry);
+            entry = next;
+        }
+
+        memset(&box->lanes[i], 0, sizeof(outbox_queue));
+    }
+
+    box->turn = OUTBOX_LANES - 1;
+    box->queued = 0;
+}
+
+uint8_t outbox_lane(const frame_header *header) {
+    switch (header->type) {
+        case FRAME_MESSAGE:
+            return header->flags & FRAME_MESSAGE_REPLAYED ? OUTBOX_BULK : OUTBOX_INTERACTIVE;
+        case FRAME_QUIT:
+            return OUTBOX_INTERACTIVE;
+        case FRAME_PRESENCE:
+            return header->flags & FRAME_PRESENCE_SNAPSHOT ? OUTBOX_BULK : OUTBOX_CONTROL;
+        case FRAME_FILE_START:
+        case FRAME_FILE_CHUNK:
+        case FRAME_FILE_END:
+            return OUTBOX_BULK;
+        default:
+            return OUTBOX_CONTROL;
+    }
+}
+
+// Throws away every bulk frame that has not started going out
+static void discard_bulk(outbox *box) {
+    outbox_queue *lane = &box->lanes[OUTBOX_BULK];
+
+    while (lane->head != NULL) {
+        outbox_entry *next = lane->head->next;
+
+        box->queued -= entry_size(lane->head);
+        free_entry(lane->head);
+        lane->head = next;
+    }
+
+    lane->tail = NULL;
+    lane->deficit = 0;
+}
+
+// Encodes header into a new entry with room for extra bytes of payload, and
+// queues it. Returns the entry, or NULL if the outbox is full
+static outbox_entry *enqueue(outbox *box, const frame_header *header, size_t extra, size_t file_length) {
+    uint8_t encoded[FRAME_HEADER_SIZE + 8 * FRAME_MAX_HOPS];
+    size_t header_size = frame_encode_header(encoded, header);
+
+    if (header->type == FRAME_QUIT) {
+        discard_bulk(box);
+    }
+
+    if (box->queued + header_size + extra + file_length > box->budget) {
+        return NULL;
+    }
+
+    outbox_entry *entry = malloc(sizeof(outbox_entry) + header_size + extra);
+
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    memcpy(entry->data, encoded, header_size);
+    entry->next = NULL;
+    entry->length = header_size + extra;
+    entry->sent = 0;
+    entry->file_fd = -1;
+    entry->file_offset = 0;
+    entry->file_length = file_length;
+
+    outbox_queue *lane = &box->lanes[outbox_lane(header)];
+
+    if (lane->tail == NULL) {
+        lane->head = entry;
+    } else {
+        lane->tail->next = entry;
+    }
+    lane->tail = entry;
+    box->queued += entry_size(entry);
+
+    return entry;
+}
+
+int8_t outbox_push(outbox *box, const frame_header *header, const void *payload) {
+    outbox_entry *entry = enqueue(box, header, header->length, 0);
+
+    if (entry == NULL) {
+        return -1;
+    }
+
+    memcpy(entry->data + entry->length - header->length, payload, header->length);
+
+    return 0;
+}
+
+int8_t outbox_push_file(outbox *box, const frame_header *header, int file_fd, off_t offset) {
+    // The file may be closed by whoever queued the frame before it is sent
+    int own_fd = dup(file_fd);
+
+    if (own_fd < 0) {
+        return -1;
+    }
+
+    outbox_entry *entry = enqueue(box, header, 0, header->length);
+
+    if (entry == NULL) {
+        close(own_fd);
+        return -1;
+    }
+
+    entry->file_fd = own_fd;
+    entry->file_offset = offset;
+
+    return 0;
+}
+
+bool outbox_pending(outbox *box) {
+    return box->queued > 0;
+}
+
+size_t outbox_memory(outbox *box) {
+    size_t memory = sizeof(outbox);
+
+    if (box->current != NULL) {
+        memory += sizeof(outbox_entry) + box->current->length;
+    }
+
+    for (int i = 0; i < OUTBOX_LANES; i++) {
+        for (outbox_entry *entry = box->lanes[i].head; entry != NULL; entry = entry->next) {
+            memory += sizeof(outbox_entry) + entry->length;
+        }
+    }
+
+    return memory;
+}
+
+// Takes the next entry to send off its lane. Returns NULL if there is none
+static outbox_entry *next_entry(outbox *box) {
+    if (box->queued == 0) {
+        box->turn = OUTBOX_LANES - 1;
+        return NULL;
+    }
+
+    while (true) {
+        outbox_queue *lane = &box->lanes[box->turn];
+
+        if (lane->head != NULL && lane->deficit >= (int64_t) entry_size(lane->head)) {
+            outbox_entry *entry = lane->head;
+
+            lane->head = entry->next;
+            if (lane->head == NULL) {
+                lane->tail = NULL;
+                lane->deficit = 0;
+            } else {
+                lane->deficit -= entry_size(entry);
+            }
+
+            return entry;
+        }
+
+        // The lane has had its share of this round; give the next one its
+        // quantum
+        box->turn = (box->turn + 1) % OUTBOX_LANES;
+        if (box->lanes[box->turn].head != NULL) {
+            box->lanes[box->turn].deficit += weights[box->turn] * OUTBOX_QUANTUM;
+        }
+    }
+}
+
+// Sends as much of entry as fd will take. Returns 1 once all of it has been
+// sent, 0 if fd is full or -1 on error
+static int8_t send_entry(outbox_entry *entry, int fd) {
+    while (entry->sent < entry->length) {
+        int flags = MSG_DONTWAIT | MSG_NOSIGNAL | (entry->file_length > 0 ? MSG_MORE : 0);
+        ssize_t sent = send(fd, entry->data + entry->sent, entry->length - entry->sent, flags);
+
+        if (sent < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        entry->sent += sent;
+    }
+
+    if (entry->sent == entry_size(entry)) {
+        return 1;
+    }
+
+    // sendfile has no way to be told not to block, so the socket has to be
+    // switched to non-blocking mode for it
+    int fd_flags = fcntl(fd, F_GETFL);
+    int8_t result = 1;
+
+    fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK);
+
+    while (entry->sent < entry_size(entry)) {
+        off_t offset = entry->file_offset + (entry->sent - entry->length);
+        ssize_t sent = sendfile(fd, entry->file_fd, &offset, entry_size(entry) - entry->sent);
+
+        if (sent <= 0) {
+            result = sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            break;
+        }
+
+        entry->sent += sent;
+    }
+
+    fcntl(fd, F_SETFL, fd_flags);
+
+    return result;
+}
+
+int8_t outbox_flush(outbox *box, int fd) {
+    while (true) {
+        if (box->current == NULL) {
+            box->current = next_entry(box);
+
+            if (box->current == NULL) {
+                return 1;
+            }
+        }
+
+        int8_t result = send_entry(box->current, fd);
+
+        if (result <= 0) {
+            return result;
+        }
+
+        box->queued -= entry_size(box->current);
+        free_entry(box->current);
+        box->current = NULL;
+    }
+}
+
+int8_t outbox_drain(outbox *box, int fd, int timeout_ms) {
+    struct pollfd pfd;
+    int8_t result;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    while ((result = outbox_flush(box, fd)) == 0) {
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            return 0;
+        }
+    }
+
+    return result;
+}
+
+// Copies what is left of entry to out. Returns the number of bytes copied, or
+// -1 if its file could not be read
+static ssize_t save_entry(const outbox_entry *entry, uint8_t *out) {
+    size_t copied = 0;
+
+    if (entry->sent < entry->length) {
+        copied = entry->length - entry->sent;
+        memcpy(out, entry->data + entry->sent, copied);
+    }
+
+    while (entry->sent + copied < entry_size(entry)) {
+        size_t done = entry->sent + copied - entry->length;
+        ssize_t read = pread(entry->file_fd, out + copied, entry->file_length - done, entry->file_offset + done);
+
+        if (read <= 0) {
+            return -1;
+        }
+
+        copied += read;
+    }
+
+    return copied;
+}
+
+uint8_t *outbox_save(outbox *box, size_t *length) {
+    size_t size = box->queued - (box->current != NULL ? box->current->sent : 0);
+    uint8_t *saved = malloc(size > 0 ? size : 1);
+
+    if (saved == NULL) {
+        return NULL;
+    }
+
+    *length = 0;
+
+    if (box->current != NULL) {
+        ssize_t copied = save_entry(box->current, saved);
+
+        if (copied < 0) {
+            free(saved);
+            return NULL;
+        }
+        *length += copied;
+    }
+
+    for (int i = 0; i < OUTBOX_LANES; i++) {
+        for (outbox_entry *entry = box->lanes[i].head; entry != NULL; entry = entry->next) {
+            ssize_t copied = save_entry(entry, saved + *length);
+
+            if (copied < 0) {
+                free(saved);
+                return NULL;
+            }
+            *length += copied;
+        }
+    }
+
+    return saved;
+}
+
+int8_t outbox_restore(outbox *box, const uint8_t *data, size_t length) {
+    if (box->queued > 0) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    outbox_entry *entry = malloc(sizeof(outbox_entry) + length);
+
+    if (entry == NULL) {
+        return -1;
+    }
+
+    // Sending it as if it were a frame already on its way keeps anything
+    // queued later from getting in ahead of it
+    memcpy(entry->data, data, length);
+    entry->next = NULL;
+    entry->length = length;
+    entry->sent = 0;
+    entry->file_fd = -1;
+    entry->file_offset = 0;
+    entry->file_length = 0;
+
+    box->current = entry;
+    box->queued = length;
+
+    return 0;
+}
@@ -0,0 +1,440 @@
+// presence.c - Tracks and coalesces user presence
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <frame.h>
+#include <presence.h>
+
+// The sent_state of a slot whose state went out in a snapshot before its
+// change was collected. Such a change is sent even if it comes to nothing
+#define STATE_UNKNOWN 0xff
+
+// A slot in the table. Slots are found by open addressing on the username;
+// once taken, a slot always holds some user, so probe chains never break.
+// Slots of users who are offline and fully sent may be given to new users
+typedef struct presence_slot {
+    char username[MAX_UNAME_SIZE]; // Empty if the slot has never been used
+    uint8_t state;
+    uint8_t sent_state; // The state last collected, or STATE_UNKNOWN
+    bool queued; // The slot is in the changed ring
+    uint64_t version;
+} presence_slot;
+
+struct presence_table {
+    pthread_mutex_t lock;
+    presence_slot *slots;
+    size_t capacity; // Slots in the table; grows up to max_users
+    size_t max_users;
+    size_t used; // Slots that have ever held a user
+    uint32_t *order; // The used slots in the order they were first used
+
+    // Slots with changes waiting to be collected, in the order they changed.
+    // A slot is never in the ring twice, so it cannot overflow
+    uint32_t *changed;
+    size_t changed_head;
+    size_t nchanged;
+};
+
+static void put_u64(uint8_t *out, uint64_t value) {
+    uint32_t high = htonl((uint32_t) (value >> 32));
+    uint32_t low = htonl((uint32_t) value);
+
+    memcpy(out, &high, 4);
+    memcpy(out + 4, &low, 4);
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+    uint32_t high, low;
+
+    memcpy(&high, in, 4);
+    memcpy(&low, in + 4, 4);
+
+    return (uint64_t) ntohl(high) << 32 | ntohl(low);
+}
+
+void presence_tracker_init(presence_tracker *tracker) {
+    // Whoever we are connected to marks us online when we connect
+    tracker->reported = PRESENCE_ONLINE;
+    tracker->last_input = frame_monotonic_now();
+    tracker->last_keystroke = 0;
+}
+
+void presence_tracker_keystroke(presence_tracker *tracker) {
+    tracker->last_keystroke = tracker->last_input = frame_monotonic_now();
+}
+
+void presence_tracker_input(presence_tracker *tracker) {
+    tracker->last_input = frame_monotonic_now();
+    tracker->last_keystroke = 0;
+}
+
+int8_t presence_tracker_poll(presence_tracker *tracker) {
+    uint64_t now = frame_monotonic_now();
+    uint8_t state = PRESENCE_ONLINE;
+
+    if (tracker->last_keystroke != 0 && now - tracker->last_keystroke < PRESENCE_TYPING_MS * 1000000ULL) {
+        state = PRESENCE_TYPING;
+    } else if (now - tracker->last_input >= PRESENCE_AWAY_MS * 1000000ULL) {
+        state = PRESENCE_AWAY;
+    }
+
+    if (state == tracker->reported) {
+        return -1;
+    }
+
+    tracker->reported = state;
+
+    return state;
+}
+
+int presence_tracker_timeout(presence_tracker *tracker) {
+    uint64_t now = frame_monotonic_now();
+    uint64_t due;
+
+    // Typing ends on its own, and so does being around
+    if (tracker->reported == PRESENCE_TYPING) {
+        due = tracker->last_keystroke + PRESENCE_TYPING_MS * 1000000ULL;
+    } else if (tracker->reported != PRESENCE_AWAY) {
+        due = tracker->last_input + PRESENCE_AWAY_MS * 1000000ULL;
+    } else {
+        return -1;
+    }
+
+    // Round up, so that the state has changed by the time the wait is over
+    return due > now ? (due - now + 999999) / 1000000 : 0;
+}
+
+presence_table *presence_table_create(size_t max_users) {
+    presence_table *table = calloc(1, sizeof(presence_table));
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    // Most tables only ever see a handful of users, so they start small
+    table->capacity = PRESENCE_MIN_USERS;
+    table->max_users = max_users;
+    table->slots = calloc(table->capacity, sizeof(presence_slot));
+    table->changed = calloc(table->capacity, sizeof(uint32_t));
+    table->order = calloc(table->capacity, sizeof(uint32_t));
+
+    if (table->slots == NULL || table->changed == NULL || table->order == NULL) {
+        free(table->slots);
+        free(table->changed);
+        free(table->order);
+        free(table);
+        return NULL;
+    }
+
+    pthread_mutex_init(&table->lock, NULL);
+
+    return table;
+}
+
+void presence_table_destroy(presence_table *table) {
+    pthread_mutex_destroy(&table->lock);
+    free(table->slots);
+    free(table->changed);
+    free(table->order);
+    free(table);
+}
+
+// FNV-1a
+static uint32_t hash_username(const char *username) {
+    uint32_t hash = 2166136261u;
+
+    for (const char *c = username; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Finds the slot of username, or a slot for it if it has none. Returns NULL
+// if the table is full
+static presence_slot *find_slot(presence_table *table, const char *username) {
+    presence_slot *reusable = NULL;
+    uint32_t start = hash_username(username) % table->capacity;
+
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        presence_slot *slot = &table->slots[(start + i) % table->capacity];
+
+        if (slot->username[0] == '\0') {
+            return reusable != NULL ? reusable : slot;
+        }
+        if (strcmp(slot->username, username) == 0) {
+            return slot;
+        }
+        if (reusable == NULL && slot->state == PRESENCE_OFFLINE && !slot->queued) {
+            reusable = slot;
+        }
+    }
+
+    return reusable;
+}
+
+// Doubles the number of slots, rehashing every user into them and carrying
+// the changed ring and the order of first use over. Returns -1 if the table
+// is already as large as it gets or memory runs out, in which case it is left
+// as it was
+static int8_t grow(presence_table *table) {
+    if (table->capacity >= table->max_users) {
+        return -1;
+    }
+
+    presence_table old = *table;
+    table->capacity *= 2;
+    table->slots = calloc(table->capacity, sizeof(presence_slot));
+    table->changed = calloc(table->capacity, sizeof(uint32_t));
+    table->order = calloc(table->capacity, sizeof(uint32_t));
+
+    if (table->slots == NULL || table->changed == NULL || table->order == NULL) {
+        free(table->slots);
+        free(table->changed);
+        free(table->order);
+        *table = old;
+        return -1;
+    }
+
+    // Every slot that was ever used keeps its place in the probe chains, so
+    // stale versions are still recognised after the move
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.slots[i].username[0] == '\0') {
+            continue;
+        }
+
+        uint32_t j = hash_username(old.slots[i].username) % table->capacity;
+
+        while (table->slots[j].username[0] != '\0') {
+            j = (j + 1) % table->capacity;
+        }
+        table->slots[j] = old.slots[i];
+    }
+
+    table->changed_head = 0;
+    for (size_t i = 0; i < old.nchanged; i++) {
+        presence_slot *moved = &old.slots[old.changed[(old.changed_head + i) % old.capacity]];
+        table->changed[i] = find_slot(table, moved->username) - table->slots;
+    }
+
+    for (size_t i = 0; i < old.used; i++) {
+        table->order[i] = find_slot(table, old.slots[old.order[i]].username) - table->slots;
+    }
+
+    free(old.slots);
+    free(old.changed);
+    free(old.order);
+
+    return 0;
+}
+
+// Sets the state of username as of version. A version of 0 means now, or just
+// after the last change if the clock has not moved on since
+static bool update(presence_table *table, const char *username, uint8_t state, uint64_t version) {
+    if (state > PRESENCE_TYPING) {
+        return false;
+    }
+
+    // Keep a quarter of the slots free so that probe chains stay short
+    presence_slot *slot = find_slot(table, username);
+
+    if ((slot == NULL || slot->username[0] == '\0') && (table->used + 1) * 4 > table->capacity * 3
+        && grow(table) == 0) {
+        slot = find_slot(table, username);
+    }
+
+    if (slot == NULL) {
+        return false;
+    }
+
+    if (slot->username[0] == '\0') {
+        table->order[table->used++] = slot - table->slots;
+    }
+
+    if (strcmp(slot->username, username) != 0) {
+        strncpy(slot->username, username, MAX_UNAME_SIZE - 1);
+        slot->username[MAX_UNAME_SIZE - 1] = '\0';
+        slot->state = slot->sent_state = PRESENCE_OFFLINE;
+        slot->version = 0;
+    }
+
+    if (version == 0) {
+        version = frame_now();
+        if (version <= slot->version) {
+            version = slot->version + 1;
+        }
+    }
+
+    if (version <= slot->version) {
+        return false;
+    }
+
+    slot->state = state;
+    slot->version = version;
+
+    if (!slot->queued) {
+        slot->queued = true;
+        table->changed[(table->changed_head + table->nchanged++) % table->capacity] = slot - table->slots;
+    }
+
+    return true;
+}
+
+bool presence_table_update(presence_table *table, const char *username, uint8_t state, uint64_t version) {
+    pthread_mutex_lock(&table->lock);
+    bool updated = update(table, username, state, version);
+    pthread_mutex_unlock(&table->lock);
+
+    return updated;
+}
+
+void presence_table_apply(presence_table *table, const uint8_t *payload, size_t length, const char *only) {
+    char username[MAX_UNAME_SIZE];
+    size_t offset = 0;
+
+    pthread_mutex_lock(&table->lock);
+    while (offset + PRESENCE_ENTRY_SIZE <= length) {
+        uint8_t state = payload[offset];
+        uint8_t u_len = payload[offset + 1];
+        uint64_t version = get_u64(payload + offset + 2);
+
+        if (offset + PRESENCE_ENTRY_SIZE + u_len > length) {
+            break;
+        }
+
+        if (u_len > 0 && u_len < MAX_UNAME_SIZE) {
+            memcpy(username, payload + offset + PRESENCE_ENTRY_SIZE, u_len);
+            username[u_len] = '\0';
+
+            if (only == NULL) {
+                update(table, username, state, version);
+            } else if (strcmp(username, only) == 0) {
+                update(table, username, state, 0);
+            }
+        }
+
+        offset += PRESENCE_ENTRY_SIZE + u_len;
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+size_t presence_encode(uint8_t *payload, const char *username, uint8_t state, uint64_t version) {
+    size_t u_len = strnlen(username, MAX_UNAME_SIZE - 1);
+
+    payload[0] = state;
+    payload[1] = u_len;
+    put_u64(payload + 2, version);
+    memcpy(payload + PRESENCE_ENTRY_SIZE, username, u_len);
+
+    return PRESENCE_ENTRY_SIZE + u_len;
+}
+
+size_t presence_table_collect(presence_table *table, uint8_t *payload, size_t max) {
+    size_t length = 0;
+
+    pthread_mutex_lock(&table->lock);
+    while (table->nchanged > 0) {
+        presence_slot *slot = &table->slots[table->changed[table->changed_head]];
+
+        // Users who changed and changed back since the last collection have
+        // nothing to report
+        if (slot->state != slot->sent_state) {
+            if (length + PRESENCE_ENTRY_SIZE + strlen(slot->username) > max) {
+                break;
+            }
+
+            length += presence_encode(payload + length, slot->username, slot->state, slot->version);
+            slot->sent_state = slot->state;
+        }
+
+        slot->queued = false;
+        table->changed_head = (table->changed_head + 1) % table->capacity;
+        table->nchanged--;
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return length;
+}
+
+size_t presence_table_snapshot(presence_table *table, uint8_t *payload, size_t max, size_t *cursor) {
+    size_t length = 0;
+
+    // Going by order of first use rather than by slot keeps the cursor good
+    // through updates and growth, since a used slot is never given up. Users
+    // who arrive meanwhile are left to the changes
+    pthread_mutex_lock(&table->lock);
+    for (; *cursor < table->used; (*cursor)++) {
+        presence_slot *slot = &table->slots[table->order[*cursor]];
+
+        if (slot->state != PRESENCE_OFFLINE) {
+            if (length + PRESENCE_ENTRY_SIZE + strlen(slot->username) > max) {
+                break;
+            }
+
+            length += presence_encode(payload + length, slot->username, slot->state, slot->version);
+        }
+
+        // The snapshot is ahead of a change still to be collected, so whoever
+        // it goes to must be sent the change whatever it comes to
+        if (slot->queued) {
+            slot->sent_state = STATE_UNKNOWN;
+        }
+    }
+    if (*cursor >= table->used) {
+        *cursor = PRESENCE_SNAPSHOT_DONE;
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return length;
+}
+
+size_t presence_table_list(presence_table *table, presence_user *users, size_t max) {
+    size_t count = 0;
+
+    pthread_mutex_lock(&table->lock);
+    for (size_t i = 0; i < table->capacity; i++) {
+        presence_slot *slot = &table->slots[i];
+
+        if (slot->username[0] == '\0' || slot->state == PRESENCE_OFFLINE) {
+            continue;
+        }
+
+        if (count < max) {
+            strcpy(users[count].username, slot->username);
+            users[count].state = slot->state;
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return count;
+}
+
+const char *presence_name(uint8_t state) {
+    switch (state) {
+        case PRESENCE_ONLINE:
+            return "online";
+        case PRESENCE_AWAY:
+            return "away";
+        case PRESENCE_TYPING:
+            return "typing";
+        default:
+            return "offline";
+    }
+}
@@ -0,0 +1,2273 @@
+// relay.c - Relays messages between clients and other relay nodes
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <chat.h>
+#include <relay.h>
+#include <outbox.h>
+#include <handover.h>
+
+#define NOT_LINKED -1 // The connection was not dialed by the relay
+#define MAX_NOTICE_SIZE 128
+#define SYNC_ENTRY_SIZE 12 // u32 origin followed by u64 contiguous id
+#define MAX_MESSAGE_PAYLOAD (MAX_UNAME_SIZE + MAX_MSG_SIZE)
+
+// Records of a handover, in the order they are sent. The new relay answers
+// the HANDOVER_END with one of its own once it has taken everything over
+#define HANDOVER_STATE 1 // Node id, next message id and messages retained
+#define HANDOVER_ORIGIN 2 // The ids seen from one origin
+#define HANDOVER_MESSAGE 3 // A retained message
+#define HANDOVER_PRESENCE 4 // A snapshot of presence
+#define HANDOVER_LISTENER 5 // Carries the listening socket
+#define HANDOVER_CONNECTION 6 // Carries a connection, and what it has queued
+#define HANDOVER_HELD 7 // A client session waiting to be resumed
+#define HANDOVER_END 8
+
+// A slot in the connection table. An idle connection is just its slot: the
+// frame reader, outbox and file receiver are only attached while something is
+// partway in, waiting to go out or being received. What the poller looks at
+// on every pass comes first
+typedef struct connection {
+    int fd; // -1 if the slot is free
+    bool is_peer;
+    bool greeting; // Its HELLO has yet to arrive; see add_connection
+    bool overflowed; // The outbox went over budget; the connection is dropped
+    int link; // The link that dialed this connection, or NOT_LINKED
+    uint32_t node; // The peer's node id (peers only)
+    uint64_t generation; // Tells apart connections that reuse the slot
+    int32_t deficit; // Bytes that may still be read this round
+    uint32_t presence_cursor; // Where the presence snapshot being sent is up to
+    uint64_t bucket; // When the client's message bucket is full again
+    uint64_t frames; // When the client's frame bucket is full again
+    uint64_t expires; // When the handshake runs out of time (while greeting)
+    frame_reader *in; // The frame partway in, or NULL between frames
+    outbox *out; // Frames waiting to be sent over the connection, or NULL
+    file_receiver *files; // Files being received over the connection, or NULL
+    char username[MAX_UNAME_SIZE];
+    char ip[INET_ADDRSTRLEN];
+
+    // The client's session (clients only)
+    uint64_t token; // Lets the client resume the session if the connection drops
+    uint64_t acked; // Our last sequence number the client acknowledged
+    uint64_t received; // The client's last sequence number we accepted
+    uint64_t received_acked; // received as of the last ACK we sent
+} connection;
+
+// What every connection slot costs, used or not: the slot and its place in
+// the poller's arrays
+#define SLOT_SIZE (sizeof(connection) + sizeof(struct pollfd) + sizeof(int) + sizeof(uint64_t))
+
+// The session of a client whose connection dropped, kept until it reconnects
+// or RELAY_RESUME_MS pass
+typedef struct held_session {
+    uint64_t token; // 0 if the slot is free
+    char username[MAX_UNAME_SIZE];
+    char ip[INET_ADDRSTRLEN];
+    uint64_t acked;
+    uint64_t received;
+    uint64_t expires; // On the monotonic clock
+} held_session;
+
+typedef struct peer_link {
+    char *address;
+    char *service;
+    bool connected;
+    bool is_self; // The link leads back to this relay; never dial it again
+} peer_link;
+
+// Which ids from one origin have been seen. window has a bit for each of the
+// RELAY_DEDUP_WINDOW ids up to and including highest; anything older than
+// that is assumed to have been seen
+typedef struct origin_state {
+    uint32_t origin;
+    uint64_t highest;
+    uint64_t contiguous; // Every id up to and including this has been seen
+    uint64_t window[RELAY_DEDUP_WINDOW / 64];
+} origin_state;
+
+// Where the frames of a file being sent to a client go
+typedef struct file_target {
+    relay *relay;
+    int slot;
+    uint64_t generation;
+} file_target;
+
+typedef struct retained_frame {
+    frame_header header;
+    uint64_t token; // The session of the client that sent it, or 0
+    uint8_t payload[MAX_MESSAGE_PAYLOAD];
+} retained_frame;
+
+struct relay {
+    uint32_t node; // This relay's node id
+    int port;
+    int listener;
+    int wakeup; // Written to when frames are queued from other threads
+    int upgrades; // Where the relay's replacement connects, or -1
+    char username[MAX_UNAME_SIZE];
+    char *download_dir;
+    char *upgrade_path;
+    size_t budget; // The most bytes queued for any one connection
+    uint32_t message_rate; // Messages per second each client may send, or 0
+    uint32_t frame_rate; // Frames per second each client may send, or 0
+
+    relay_deliver_fn deliver;
+    relay_notice_fn notice;
+    relay_handover_fn handed_over;
+    void *ctx; // Passed to deliver, notice and handed_over
+    latency_trace *trace;
+
+    pthread_t poller;
+    pthread_t linker;
+    atomic_bool running;
+
+    // Guards everything below
+    pthread_mutex_t lock;
+
+    uint64_t next_id;
+    uint64_t next_generation;
+
+    // Connection slots are allocated RELAY_SLOT_BLOCK at a time as
+    // connections arrive, and never move once they have been, so the poller
+    // can hold on to one while it reads without the lock
+    connection *conns[RELAY_MAX_CONNECTIONS / RELAY_SLOT_BLOCK];
+    int nslots; // Slots allocated so far
+    int first_free; // No slot below this one is free
+    peer_link links[RELAY_MAX_LINKS];
+    size_t nlinks;
+
+    origin_state origins[RELAY_MAX_ORIGINS];
+    size_t norigins;
+
+    // A ring of the last RELAY_HISTORY_SIZE messages. A message's place in it
+    // (counting from 1) is the sequence number clients know it by
+    retained_frame *history;
+    uint64_t nretained; // Total messages ever retained
+
+    held_session *held[RELAY_MAX_CONNECTIONS / RELAY_SLOT_BLOCK]; // Allocated like conns
+    int nheld; // Held session slots allocated so far
+    uint64_t acks_due; // When clients are next sent ACKs
+
+    presence_table *presence;
+    uint64_t presence_due; // When changes in presence are next sent out
+
+    bool handing_over; // A snapshot is on its way to a new relay
+    bool replaced; // Everything has been handed over to a new relay
+};
+
+// Returns connection slot i, which must have been allocated
+static connection *conn_at(relay *relay, int i) {
+    return &relay->conns[i / RELAY_SLOT_BLOCK][i % RELAY_SLOT_BLOCK];
+}
+
+// Returns held session slot i, which must have been allocated
+static held_session *held_at(relay *relay, int i) {
+    return &relay->held[i / RELAY_SLOT_BLOCK][i % RELAY_SLOT_BLOCK];
+}
+
+static void notify(relay *relay, const char *format, const char *username, const char *ip) {
+    char notice[MAX_NOTICE_SIZE];
+
+    snprintf(notice, MAX_NOTICE_SIZE, format, username, ip);
+    relay->notice(relay->ctx, notice);
+}
+
+// Passes on the notices of files clients send us
+static void file_received_notice(void *ctx, const char *notice) {
+    relay *relay = ctx;
+
+    relay->notice(relay->ctx, notice);
+}
+
+// Passes on the notices of files we send to a client
+static void file_sent_notice(void *ctx, const char *notice) {
+    relay *relay = ((file_target*) ctx)->relay;
+
+    relay->notice(relay->ctx, notice);
+}
+
+// Picks out the transfers of files to conn
+static bool sent_to(void *ctx, void *conn) {
+    file_target *target = ctx;
+
+    return conn_at(target->relay, target->slot) == conn && ((connection*) conn)->generation == target->generation;
+}
+
+// Returns conn's outbox, attaching one if the connection was idle. Returns
+// NULL if none could be allocated
+static outbox *attach_outbox(relay *relay, connection *conn) {
+    if (conn->out == NULL) {
+        conn->out = outbox_create(relay->budget);
+    }
+
+    return conn->out;
+}
+
+// Frees conn's outbox, if it has one
+static void detach_outbox(connection *conn) {
+    if (conn->out != NULL) {
+        outbox_destroy(conn->out);
+        conn->out = NULL;
+    }
+}
+
+// Returns conn's frame reader, attaching one if the connection was between
+// frames. Returns NULL if none could be allocated. Attached under the lock so
+// that relay_print_memory can look at it
+static frame_reader *attach_reader(relay *relay, connection *conn) {
+    if (conn->in == NULL) {
+        frame_reader *in = malloc(sizeof(frame_reader));
+
+        if (in == NULL) {
+            return NULL;
+        }
+        frame_reader_next(in);
+
+        pthread_mutex_lock(&relay->lock);
+        conn->in = in;
+        pthread_mutex_unlock(&relay->lock);
+    }
+
+    return conn->in;
+}
+
+// Frees conn's frame reader, if it has one. Must be called with the lock held
+static void detach_reader(connection *conn) {
+    free(conn->in);
+    conn->in = NULL;
+}
+
+// Queues a frame to go out over conn. The poller sends it once the socket can
+// take it
+static void queue_frame(relay *relay, connection *conn, const frame_header *header, const void *payload) {
+    outbox *out = attach_outbox(relay, conn);
+
+    if (out == NULL || outbox_push(out, header, payload) < 0) {
+        conn->overflowed = true;
+    }
+}
+
+// Clients have two token buckets. Their message bucket holds
+// RELAY_MESSAGE_BURST tokens and refills at relay->message_rate tokens per
+// second; each message takes one. Their frame bucket holds RELAY_FRAME_BURST
+// tokens and refills at relay->frame_rate tokens per second; every frame,
+// whatever its type, takes one. Rather than a count of tokens, a connection
+// keeps the time each bucket will be full again, which is all that is needed
+// to tell how many tokens are left
+
+// Takes a token from a bucket that refills at rate tokens per second
+static void take_token(uint64_t *bucket, uint32_t rate, uint64_t now) {
+    if (rate == 0) {
+        return;
+    }
+
+    if (*bucket < now) {
+        *bucket = now;
+    }
+    *bucket += 1000000000ULL / rate;
+}
+
+// Returns when a bucket holding burst tokens that refills at rate tokens per
+// second will next have a token, or 0 if it has one now
+static uint64_t next_token(uint64_t bucket, uint32_t rate, uint32_t burst, uint64_t now) {
+    if (rate == 0) {
+        return 0;
+    }
+
+    // The bucket has a token as long as it is no more than this from full
+    uint64_t allowance = (burst - 1) * (1000000000ULL / rate);
+
+    return bucket > now + allowance ? bucket - allowance : 0;
+}
+
+// Returns when both of conn's buckets will next have a token, or 0 if they
+// have one now. Nothing more is read from a client until then, so a flood
+// backs up into the client's socket rather than into everyone else's
+static uint64_t throttled_until(relay *relay, connection *conn, uint64_t now) {
+    if (conn->is_peer) {
+        return 0;
+    }
+
+    uint64_t messages = next_token(conn->bucket, relay->message_rate, RELAY_MESSAGE_BURST, now);
+    uint64_t frames = next_token(conn->frames, relay->frame_rate, RELAY_FRAME_BURST, now);
+
+    return messages > frames ? messages : frames;
+}
+
+// Makes the poller look at the outboxes again. Needed whenever frames are
+// queued by a thread other than the poller
+static void wake_poller(relay *relay) {
+    uint64_t one = 1;
+
+    write(relay->wakeup, &one, sizeof(one));
+}
+
+static origin_state *find_origin(relay *relay, uint32_t origin) {
+    for (size_t i = 0; i < relay->norigins; i++) {
+        if (relay->origins[i].origin == origin) {
+            return &relay->origins[i];
+        }
+    }
+
+    if (relay->norigins == RELAY_MAX_ORIGINS) {
+        return NULL;
+    }
+
+    origin_state *state = &relay->origins[relay->norigins++];
+    memset(state, 0, sizeof(origin_state));
+    state->origin = origin;
+
+    return state;
+}
+
+static bool window_test(origin_state *state, uint64_t id) {
+    uint64_t bit = id % RELAY_DEDUP_WINDOW;
+
+    return state->window[bit / 64] & ((uint64_t) 1 << (bit % 64));
+}
+
+static void window_set(origin_state *state, uint64_t id, bool seen) {
+    uint64_t bit = id % RELAY_DEDUP_WINDOW;
+
+    if (seen) {
+        state->window[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    } else {
+        state->window[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+    }
+}
+
+// Records that message id from origin has been seen. Returns true if it had
+// not been seen before
+static bool mark_seen(relay *relay, uint32_t origin, uint64_t id) {
+    origin_state *state = find_origin(relay, origin);
+
+    // Too many nodes to track; better to risk a duplicate than to lose it
+    if (state == NULL) {
+        return true;
+    }
+
+    if (id > state->highest) {
+        // Slide the window forward, forgetting the ids that fall out of it
+        if (id - state->highest >= RELAY_DEDUP_WINDOW) {
+            memset(state->window, 0, sizeof(state->window));
+        } else {
+            for (uint64_t i = state->highest + 1; i < id; i++) {
+                window_set(state, i, false);
+            }
+        }
+        state->highest = id;
+    } else if (state->highest - id >= RELAY_DEDUP_WINDOW || window_test(state, id)) {
+        return false;
+    }
+
+    window_set(state, id, true);
+
+    if (state->highest - state->contiguous > RELAY_DEDUP_WINDOW) {
+        state->contiguous = state->highest - RELAY_DEDUP_WINDOW;
+    }
+    while (state->contiguous < state->highest && window_test(state, state->contiguous + 1)) {
+        state->contiguous++;
+    }
+
+    return true;
+}
+
+// Sends a SYNC frame describing which messages we have over conn
+static void send_sync(relay *relay, connection *conn) {
+    uint8_t payload[RELAY_MAX_ORIGINS * SYNC_ENTRY_SIZE];
+    frame_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_SYNC;
+    header.origin = relay->node;
+    header.length = relay->norigins * SYNC_ENTRY_SIZE;
+
+    for (size_t i = 0; i < relay->norigins; i++) {
+        uint8_t *entry = payload + i * SYNC_ENTRY_SIZE;
+        uint32_t origin = htonl(relay->origins[i].origin);
+        uint32_t high = htonl((uint32_t) (relay->origins[i].contiguous >> 32));
+        uint32_t low = htonl((uint32_t) relay->origins[i].contiguous);
+
+        memcpy(entry, &origin, 4);
+        memcpy(entry + 4, &high, 4);
+        memcpy(entry + 8, &low, 4);
+    }
+
+    queue_frame(relay, conn, &header, payload);
+}
+
+// Replays every retained message the peer on conn has not seen according to
+// its SYNC frame
+static void resync(relay *relay, connection *conn, const frame_header *header, const uint8_t *payload) {
+    size_t nentries = header->length / SYNC_ENTRY_SIZE;
+    uint64_t start = relay->nretained > RELAY_HISTORY_SIZE ? relay->nretained - RELAY_HISTORY_SIZE : 0;
+    uint64_t replayed = 0;
+
+    for (uint64_t i = start; i < relay->nretained; i++) {
+        retained_frame *retained = &relay->history[i % RELAY_HISTORY_SIZE];
+        uint64_t contiguous = 0;
+
+        for (size_t j = 0; j < nentries; j++) {
+            const uint8_t *entry = payload + j * SYNC_ENTRY_SIZE;
+            uint32_t origin, high, low;
+
+            memcpy(&origin, entry, 4);
+            if (ntohl(origin) == retained->header.origin) {
+                memcpy(&high, entry + 4, 4);
+                memcpy(&low, entry + 8, 4);
+                contiguous = (uint64_t) ntohl(high) << 32 | ntohl(low);
+                break;
+            }
+        }
+
+        if (retained->header.id > contiguous) {
+            frame_header replay = retained->header;
+
+            replay.flags |= FRAME_MESSAGE_REPLAYED;
+            queue_frame(relay, conn, &replay, retained->payload);
+            replayed++;
+        }
+    }
+
+    if (replayed > 0) {
+        char count[24];
+        snprintf(count, sizeof(count), "%lu", replayed);
+        notify(relay, "Resynced %s with %s missed messages", conn->username, count);
+    }
+}
+
+// Accepts a message that has been assigned an origin and id: keeps it for
+// resyncing, hands it to the local user (unless it came from them) and
+// forwards it to every connection but the one it came from
+static void accept_message(relay *relay, const frame_header *header, const uint8_t *payload, int source) {
+    retained_frame *retained = &relay->history[relay->nretained++ % RELAY_HISTORY_SIZE];
+    retained->header = *header;
+    retained->token = source >= 0 ? conn_at(relay, source)->token : 0;
+    memcpy(retained->payload, payload, header->length);
+
+    // Clients are sent the message's sequence number in place of its id
+    frame_header numbered = *header;
+    numbered.id = relay->nretained;
+
+    if (source >= 0) {
+        char username[MAX_UNAME_SIZE];
+        char msg[MAX_MSG_SIZE];
+
+        frame_split_message(header, payload, username, msg);
+        relay->deliver(relay->ctx, username, msg);
+    }
+
+    for (int i = 0; i < relay->nslots; i++) {
+        connection *conn = conn_at(relay, i);
+
+        if (i != source && conn->fd >= 0 && !conn->greeting) {
+            queue_frame(relay, conn, conn->is_peer ? header : &numbered, payload);
+        }
+    }
+}
+
+// Tells the client on conn that up to missed messages it has not received are
+// gone from the history and cannot be resent
+static void report_gap(relay *relay, connection *conn, uint64_t missed) {
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + MAX_MSG_SIZE];
+    char count[24];
+    char notice[MAX_MSG_SIZE];
+
+    snprintf(count, sizeof(count), "%lu", missed);
+    notify(relay, "Could not resend up to %s messages to %s; they are no longer kept", count, conn->username);
+
+    snprintf(notice, sizeof(notice), "Up to %s messages sent while you were away are no longer kept and were lost", count);
+    frame_init_message(&header, payload, relay->username, notice);
+    header.flags = FRAME_MESSAGE_NOTICE;
+    header.origin = relay->node;
+    queue_frame(relay, conn, &header, payload);
+}
+
+// Sends the client on conn every retained message after its last acknowledged
+// one, other than those it sent itself. Replays go out in order with
+// everything else, so the client's sequence numbers never go backwards
+static void replay_missed(relay *relay, connection *conn) {
+    uint64_t start = relay->nretained > RELAY_HISTORY_SIZE ? relay->nretained - RELAY_HISTORY_SIZE : 0;
+    uint64_t replayed = 0;
+
+    if (conn->acked > start) {
+        start = conn->acked;
+    } else if (conn->acked < start) {
+        report_gap(relay, conn, start - conn->acked);
+    }
+
+    for (uint64_t seq = start + 1; seq <= relay->nretained; seq++) {
+        retained_frame *retained = &relay->history[(seq - 1) % RELAY_HISTORY_SIZE];
+
+        if (retained->token != conn->token) {
+            frame_header numbered = retained->header;
+
+            numbered.id = seq;
+            queue_frame(relay, conn, &numbered, retained->payload);
+            replayed++;
+        }
+    }
+
+    if (replayed > 0) {
+        char count[24];
+        snprintf(count, sizeof(count), "%lu", replayed);
+        notify(relay, "Resent %s missed messages to %s", count, conn->username);
+    }
+}
+
+// Sends each client an ACK for the messages it has sent since the last one,
+// if it is time to
+static void fan_out_acks(relay *relay) {
+    frame_header ack;
+    uint64_t now = frame_monotonic_now();
+
+    if (now < relay->acks_due) {
+        return;
+    }
+    relay->acks_due = now + RELAY_ACK_MS * 1000000ULL;
+
+    memset(&ack, 0, sizeof(ack));
+    ack.type = FRAME_ACK;
+    ack.origin = relay->node;
+
+    for (int i = 0; i < relay->nslots; i++) {
+        connection *conn = conn_at(relay, i);
+
+        if (conn->fd >= 0 && !conn->is_peer && conn->received > conn->received_acked) {
+            ack.id = conn->received_acked = conn->received;
+            queue_frame(relay, conn, &ack, NULL);
+        }
+    }
+}
+
+// Returns the held session token names, or NULL if there is none
+static held_session *find_held(relay *relay, uint64_t token) {
+    for (int i = 0; token != 0 && i < relay->nheld; i++) {
+        if (held_at(relay, i)->token == token) {
+            return held_at(relay, i);
+        }
+    }
+
+    return NULL;
+}
+
+// Returns a free slot to hold a session in, allocating another block of them
+// if every one is taken. Returns NULL if none could be allocated
+static held_session *free_held(relay *relay) {
+    for (int i = 0; i < relay->nheld; i++) {
+        if (held_at(relay, i)->token == 0) {
+            return held_at(relay, i);
+        }
+    }
+
+    held_session *block = relay->nheld < RELAY_MAX_CONNECTIONS ? calloc(RELAY_SLOT_BLOCK, sizeof(held_session)) : NULL;
+
+    if (block == NULL) {
+        return NULL;
+    }
+    relay->held[relay->nheld / RELAY_SLOT_BLOCK] = block;
+    relay->nheld += RELAY_SLOT_BLOCK;
+
+    return block;
+}
+
+// Lets go of the sessions that were not resumed in time; their users are gone
+static void expire_held(relay *relay) {
+    uint64_t now = frame_monotonic_now();
+
+    for (int i = 0; i < relay->nheld; i++) {
+        held_session *held = held_at(relay, i);
+
+        if (held->token != 0 && now >= held->expires) {
+            notify(relay, "Terminated connection by %s (%s)", held->username, held->ip);
+            presence_table_update(relay->presence, held->username, PRESENCE_OFFLINE, 0);
+            held->token = 0;
+        }
+    }
+}
+
+// Returns a new, random session token
+static uint64_t new_token() {
+    uint64_t token = 0;
+
+    while (token == 0) {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            token = frame_monotonic_now() ^ (uint64_t) getpid() << 32;
+        }
+    }
+
+    return token;
+}
+
+// Sends out whatever presence changes have built up, if it is time to, along
+// with the next piece of each snapshot being sent. A connection is sent no
+// more than PRESENCE_MAX_BATCH bytes of the two together, so while snapshots
+// are being sent, changes only get half of that
+static void fan_out_presence(relay *relay) {
+    uint8_t payload[PRESENCE_MAX_BATCH], snapshot[PRESENCE_MAX_BATCH];
+    frame_header header, snapshot_header;
+    uint64_t now = frame_monotonic_now();
+    bool snapshots = false;
+
+    if (now < relay->presence_due) {
+        return;
+    }
+    relay->presence_due = now + PRESENCE_INTERVAL_MS * 1000000ULL;
+
+    for (int i = 0; i < relay->nslots && !snapshots; i++) {
+        connection *conn = conn_at(relay, i);
+
+        snapshots = conn->fd >= 0 && !conn->greeting && conn->presence_cursor != PRESENCE_SNAPSHOT_DONE;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_PRESENCE;
+    header.origin = relay->node;
+    header.length = presence_table_collect(relay->presence, payload, snapshots ? PRESENCE_MAX_BATCH / 2 : PRESENCE_MAX_BATCH);
+
+    snapshot_header = header;
+    snapshot_header.flags = FRAME_PRESENCE_SNAPSHOT;
+
+    for (int i = 0; i < relay->nslots && (header.length > 0 || snapshots); i++) {
+        connection *conn = conn_at(relay, i);
+
+        if (conn->fd < 0 || conn->greeting) {
+            continue;
+        }
+
+        if (header.length > 0) {
+            queue_frame(relay, conn, &header, payload);
+        }
+
+        if (conn->presence_cursor != PRESENCE_SNAPSHOT_DONE) {
+            size_t cursor = conn->presence_cursor;
+
+            snapshot_header.length = presence_table_snapshot(relay->presence, snapshot, PRESENCE_MAX_BATCH - header.length, &cursor);
+            conn->presence_cursor = cursor;
+            if (snapshot_header.length > 0) {
+                queue_frame(relay, conn, &snapshot_header, snapshot);
+            }
+        }
+    }
+}
+
+// Closes connection i. A client that did not say it was leaving keeps its
+// session, and its presence, for RELAY_RESUME_MS in case it comes back. One
+// that never finished its handshake is closed without a word
+static void drop_connection(relay *relay, int i, bool quit) {
+    connection *conn = conn_at(relay, i);
+    held_session *held = !quit && !conn->is_peer && !conn->greeting ? free_held(relay) : NULL;
+
+    if (held != NULL) {
+        held->token = conn->token;
+        strcpy(held->username, conn->username);
+        strcpy(held->ip, conn->ip);
+        held->acked = conn->acked;
+        held->received = conn->received;
+        held->expires = frame_monotonic_now() + RELAY_RESUME_MS * 1000000ULL;
+
+        notify(relay, "Lost connection with %s (%s); holding the session", conn->username, conn->ip);
+    } else if (!conn->greeting) {
+        notify(relay, "Terminated connection by %s (%s)", conn->username, conn->ip);
+
+        if (!conn->is_peer) {
+            presence_table_update(relay->presence, conn->username, PRESENCE_OFFLINE, 0);
+        }
+    }
+
+    if (conn->link != NOT_LINKED) {
+        relay->links[conn->link].connected = false;
+    }
+
+    if (conn->files != NULL) {
+        file_receiver_destroy(conn->files);
+        conn->files = NULL;
+    }
+
+    detach_reader(conn);
+    detach_outbox(conn);
+    conn->overflowed = false;
+    conn->greeting = false;
+
+    close(conn->fd);
+    conn->fd = -1;
+    if (i < relay->first_free) {
+        relay->first_free = i;
+    }
+}
+
+// Returns a free connection slot, allocating another block of them if every
+// one is taken. Must be called with the lock held. Returns its index, or -1 if
+// RELAY_MAX_CONNECTIONS are in use or no more could be allocated
+static int free_slot(relay *relay) {
+    for (; relay->first_free < relay->nslots; relay->first_free++) {
+        if (conn_at(relay, relay->first_free)->fd < 0) {
+            return relay->first_free;
+        }
+    }
+
+    connection *block = relay->nslots < RELAY_MAX_CONNECTIONS ? calloc(RELAY_SLOT_BLOCK, sizeof(connection)) : NULL;
+
+    if (block == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < RELAY_SLOT_BLOCK; i++) {
+        block[i].fd = -1;
+    }
+    relay->conns[relay->nslots / RELAY_SLOT_BLOCK] = block;
+    relay->nslots += RELAY_SLOT_BLOCK;
+
+    return relay->first_free;
+}
+
+// Puts a new connection over fd into the connection table. Its socket sends
+// small frames without waiting to coalesce them: an outbox already sends
+// everything it holds at once, and otherwise a PONG can sit behind an
+// unacknowledged fan out for a delayed ACK's 40 ms. It is greeting until its
+// HELLO arrives, which the poller handles with complete_handshake; it is
+// dropped if that takes longer than RELAY_HANDSHAKE_MS. Connections dialed for
+// a link have already sent our HELLO. Must be called with the lock held.
+// Returns its index, or -1 if the table is full
+static int add_connection(relay *relay, int fd, const char *ip, int link) {
+    int i = free_slot(relay);
+
+    if (i < 0) {
+        return -1;
+    }
+
+    connection *conn = conn_at(relay, i);
+
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn->fd = fd;
+    conn->greeting = true;
+    conn->expires = frame_monotonic_now() + RELAY_HANDSHAKE_MS * 1000000ULL;
+    conn->deficit = 0;
+    conn->presence_cursor = PRESENCE_SNAPSHOT_DONE;
+    conn->bucket = 0;
+    conn->frames = 0;
+    conn->is_peer = false;
+    conn->link = link;
+    conn->generation = ++relay->next_generation;
+    conn->username[0] = '\0';
+    strncpy(conn->ip, ip, INET_ADDRSTRLEN);
+    conn->token = 0;
+    conn->received = 0;
+    conn->received_acked = 0;
+
+    if (link != NOT_LINKED) {
+        relay->links[link].connected = true;
+    }
+
+    return i;
+}
+
+// Sets up our HELLO in header and payload. Clients are also sent their
+// session token and the last sequence number received from them
+static void init_hello(relay *relay, frame_header *header, uint8_t *payload, uint8_t flags, uint64_t token, uint64_t seq) {
+    frame_init_hello(header, payload, flags, relay->username, token, seq);
+    header->origin = relay->node;
+}
+
+// Puts connection i to use now that the HELLO in hello and payload has
+// arrived, answering it unless we dialed the connection (and so spoke first).
+// A client that asks for a session being held is resumed from the sequence
+// number it last received. Must be called with the lock held. Returns false if
+// the connection was dropped instead
+static bool complete_handshake(relay *relay, int i, const frame_header *hello, const uint8_t *payload) {
+    connection *conn = conn_at(relay, i);
+
+    // A peer that turns out to be ourselves is dropped without a word, and
+    // never dialed again
+    if (hello->type != FRAME_HELLO || (hello->flags == FRAME_HELLO_PEER && hello->origin == relay->node)) {
+        if (hello->type == FRAME_HELLO && conn->link != NOT_LINKED) {
+            relay->links[conn->link].is_self = true;
+        }
+        drop_connection(relay, i, false);
+        return false;
+    }
+
+    conn->greeting = false;
+    conn->is_peer = hello->flags == FRAME_HELLO_PEER;
+    conn->node = hello->origin;
+    frame_split_message(hello, payload, conn->username, NULL);
+
+    uint64_t seq = 0;
+    held_session *held = NULL;
+
+    if (!conn->is_peer) {
+        frame_split_resume(hello, payload, &conn->token, &seq);
+        held = find_held(relay, conn->token);
+
+        if (held == NULL) {
+            conn->token = new_token();
+        }
+    }
+
+    if (conn->link == NOT_LINKED) {
+        frame_header reply;
+        uint8_t reply_payload[MAX_UNAME_SIZE + FRAME_RESUME_SIZE];
+        uint8_t flags = hello->flags | (held != NULL ? FRAME_HELLO_RESUMED : 0);
+
+        init_hello(relay, &reply, reply_payload, flags, conn->token, held != NULL ? held->received : 0);
+        queue_frame(relay, conn, &reply, reply_payload);
+    }
+
+    if (held != NULL) {
+        strcpy(conn->username, held->username);
+        conn->acked = held->acked > seq ? held->acked : seq;
+        conn->received = held->received;
+        held->token = 0;
+
+        notify(relay, "Resumed session with %s (%s)", conn->username, conn->ip);
+        replay_missed(relay, conn);
+        conn->presence_cursor = 0;
+
+        return true;
+    }
+
+    // Nothing said before a client arrived is owed to it
+    conn->acked = relay->nretained;
+    conn->received = 0;
+
+    notify(
+        relay,
+        conn->is_peer ? "Linked with %s (%s)" : "Connection established with %s (%s)",
+        conn->username,
+        conn->ip
+    );
+
+    // Catch the peer up on anything it missed while the link was down
+    if (conn->is_peer) {
+        send_sync(relay, conn);
+    } else if (!presence_table_update(relay->presence, conn->username, PRESENCE_ONLINE, 0)) {
+        notify(relay, "Not tracking the presence of %s (%s): too many users", conn->username, conn->ip);
+    }
+    conn->presence_cursor = 0;
+
+    return true;
+}
+
+static void accept_connection(relay *relay) {
+    struct sockaddr_in remote_addr;
+    socklen_t remote_addr_size = sizeof(remote_addr);
+    char ip[INET_ADDRSTRLEN];
+
+    int fd = accept(relay->listener, (struct sockaddr*) &remote_addr, &remote_addr_size);
+    if (fd < 0) {
+        return;
+    }
+
+    inet_ntop(AF_INET, &remote_addr.sin_addr, ip, INET_ADDRSTRLEN);
+
+    pthread_mutex_lock(&relay->lock);
+    if (add_connection(relay, fd, ip, NOT_LINKED) < 0) {
+        close(fd);
+    }
+    pthread_mutex_unlock(&relay->lock);
+}
+
+// Answers a PING on conn, or reports the round trip time of a PONG
+static void handle_ping(relay *relay, connection *conn, frame_header *header) {
+    if (header->type == FRAME_PING) {
+        header->type = FRAME_PONG;
+        header->length = 0;
+        header->uname_len = 0;
+        queue_frame(relay, conn, header, NULL);
+        return;
+    }
+
+    uint64_t round_trip = frame_monotonic_now() - header->id;
+    char rtt[24];
+
+    if (relay->trace != NULL) {
+        latency_record(&relay->trace->round_trip, round_trip);
+    }
+
+    snprintf(rtt, sizeof(rtt), "%.3f", round_trip / 1e6);
+    notify(relay, "Round trip to %s: %s ms", conn->username, rtt);
+}
+
+// Handles a frame of a file a client is sending us, whose header (and payload,
+// but for a chunk's) is in in. A chunk is written out as it arrives. Only
+// this thread touches conn->files, so the file data can be written out
+// without holding the lock. Returns 1 once the frame has been handled, 0 if
+// the rest of a chunk has yet to arrive or -1 if the connection was dropped
+static int8_t handle_file(relay *relay, int i, const frame_reader *in) {
+    connection *conn = conn_at(relay, i);
+    frame_header ack;
+    int8_t result = -1;
+
+    // The receiver is only kept while files are coming in. It is attached and
+    // detached under the lock so that relay_print_memory can look at it
+    if (conn->files == NULL && !conn->is_peer) {
+        file_receiver *files = file_receiver_create(relay->download_dir, file_received_notice, relay);
+
+        pthread_mutex_lock(&relay->lock);
+        conn->files = files;
+        pthread_mutex_unlock(&relay->lock);
+    }
+
+    if (conn->files != NULL) {
+        result = file_receiver_handle(conn->files, conn->fd, &in->header, in->payload, &ack);
+    }
+
+    if (result == FRAME_PENDING) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&relay->lock);
+    if (result < 0) {
+        drop_connection(relay, i, false);
+    } else {
+        if (result > 0) {
+            queue_frame(relay, conn, &ack, NULL);
+        }
+        if (conn->files != NULL && file_receiver_idle(conn->files)) {
+            file_receiver_destroy(conn->files);
+            conn->files = NULL;
+        }
+    }
+    pthread_mutex_unlock(&relay->lock);
+
+    return result < 0 ? -1 : 1;
+}
+
+// Reads what connection i has sent of its next frame, and handles the frame
+// once all of it has arrived. Returns the size of the frame handled, 0 if the
+// rest of it has yet to arrive or -1 if the connection was dropped
+static ssize_t handle_frame(relay *relay, int i) {
+    connection *conn = conn_at(relay, i);
+    frame_reader *in = attach_reader(relay, conn);
+    int8_t result = in != NULL ? frame_reader_recv(in, conn->fd) : -1;
+    uint64_t received_at = frame_now();
+
+    if (result == FRAME_PENDING) {
+        return 0;
+    }
+
+    frame_header header;
+    ssize_t size = -1;
+
+    if (result > 0) {
+        header = in->header;
+        size = FRAME_HEADER_SIZE + 8 * header.nhops + header.length;
+    }
+
+    if (result > 0 && !conn->greeting && header.type >= FRAME_FILE_START && header.type <= FRAME_FILE_END) {
+        int8_t handled = handle_file(relay, i, in);
+
+        if (handled <= 0) {
+            return handled;
+        }
+
+        frame_reader_next(in);
+        return size;
+    }
+
+    pthread_mutex_lock(&relay->lock);
+
+    if (result <= 0 || header.type == FRAME_QUIT) {
+        drop_connection(relay, i, result > 0);
+        size = -1;
+    } else if (conn->greeting) {
+        if (!complete_handshake(relay, i, &header, in->payload)) {
+            size = -1;
+        }
+    } else if (header.type == FRAME_MESSAGE && header.length <= MAX_MESSAGE_PAYLOAD) {
+        bool is_new = true;
+
+        if (!conn->is_peer) {
+            take_token(&conn->bucket, relay->message_rate, frame_monotonic_now());
+        }
+
+        if (!conn->is_peer) {
+            // Clients resend what we had not acknowledged when they resume,
+            // some of which may have got through before the connection
+            // dropped
+            is_new = header.id == 0 || header.id > conn->received;
+            if (header.id > conn->received) {
+                conn->received = header.id;
+            }
+
+            // Messages from our own clients enter the federation here
+            if (is_new) {
+                header.origin = relay->node;
+                header.id = ++relay->next_id;
+                mark_seen(relay, header.origin, header.id);
+            }
+        } else {
+            is_new = mark_seen(relay, header.origin, header.id);
+        }
+
+        if (is_new) {
+            if (relay->trace != NULL) {
+                latency_trace_record(relay->trace, &header, received_at);
+            }
+
+            frame_stamp_hop(&header);
+            accept_message(relay, &header, in->payload, i);
+        }
+    } else if (header.type == FRAME_SYNC && conn->is_peer) {
+        resync(relay, conn, &header, in->payload);
+    } else if (header.type == FRAME_PING || header.type == FRAME_PONG) {
+        handle_ping(relay, conn, &header);
+    } else if (header.type == FRAME_FILE_ACK) {
+        // Only the client a file is going to can make its transfer go on
+        file_transfer_ack(header.id, sent_to, conn);
+    } else if (header.type == FRAME_ACK && !conn->is_peer) {
+        if (header.id > conn->acked) {
+            conn->acked = header.id;
+        }
+    } else if (header.type == FRAME_PRESENCE) {
+        // Clients may only speak for themselves
+        presence_table_apply(relay->presence, in->payload, header.length, conn->is_peer ? NULL : conn->username);
+    }
+
+    // A dropped connection's reader went with it
+    if (size >= 0) {
+        frame_reader_next(in);
+    }
+
+    pthread_mutex_unlock(&relay->lock);
+
+    return size;
+}
+
+// Sends whatever conn's socket will take from its outbox, and lets go of the
+// outbox once it is empty
+static void flush_connection(relay *relay, int i) {
+    connection *conn = conn_at(relay, i);
+
+    pthread_mutex_lock(&relay->lock);
+    if (conn->out != NULL) {
+        int8_t result = outbox_flush(conn->out, conn->fd);
+
+        if (result < 0) {
+            drop_connection(relay, i, false);
+        } else if (result > 0) {
+            detach_outbox(conn);
+        }
+    }
+    pthread_mutex_unlock(&relay->lock);
+}
+
+// Returns true if slot i still holds the connection it held in generation
+static bool is_current(relay *relay, int i, uint64_t generation) {
+    pthread_mutex_lock(&relay->lock);
+    bool current = conn_at(relay, i)->fd >= 0 && conn_at(relay, i)->generation == generation;
+    pthread_mutex_unlock(&relay->lock);
+
+    return current;
+}
+
+// Reads what connection i has sent, in turn with every other connection that
+// poll found readable. Each round, a connection may read RELAY_READ_QUANTUM
+// more bytes (deficit round robin); one that reads a frame larger than that
+// owes the difference, and sits out rounds until it has paid it back. Reads
+// never block: whatever has not arrived of a frame is picked up in a later
+// round, so a connection that sends part of one holds up no one else. A client
+// is only read from while both of its buckets have a token, and keeps no
+// credit for the rounds it sits out
+static void read_connection(relay *relay, int i) {
+    connection *conn = conn_at(relay, i);
+
+    conn->deficit += RELAY_READ_QUANTUM;
+
+    while (conn->deficit > 0) {
+        pthread_mutex_lock(&relay->lock);
+        bool throttled = throttled_until(relay, conn, frame_monotonic_now()) != 0;
+        pthread_mutex_unlock(&relay->lock);
+
+        if (throttled) {
+            conn->deficit = 0;
+            break;
+        }
+
+        ssize_t size = handle_frame(relay, i);
+
+        if (size < 0) {
+            return;
+        }
+
+        // A connection with nothing more to read keeps no credit for later
+        if (size == 0) {
+            conn->deficit = 0;
+            break;
+        }
+
+        conn->deficit -= size;
+
+        if (!conn->is_peer) {
+            pthread_mutex_lock(&relay->lock);
+            take_token(&conn->frames, relay->frame_rate, frame_monotonic_now());
+            pthread_mutex_unlock(&relay->lock);
+        }
+    }
+
+    // Between frames, the connection is back to just its slot
+    pthread_mutex_lock(&relay->lock);
+    if (conn->in != NULL && !frame_reader_busy(conn->in)) {
+        detach_reader(conn);
+    }
+    pthread_mutex_unlock(&relay->lock);
+}
+
+// A record waiting to be sent to the relay taking over
+typedef struct handover_record {
+    uint8_t type;
+    handover_buffer buffer;
+    int pass_fd; // Passed along with the record unless -1
+} handover_record;
+
+// Everything the relay knows, as the records the relay taking over is sent
+typedef struct relay_snapshot {
+    handover_record *records;
+    size_t length;
+    size_t capacity;
+    bool failed;
+} relay_snapshot;
+
+// Adds a record holding buffer to the snapshot, which takes over its data
+static void add_record(relay_snapshot *snapshot, uint8_t type, handover_buffer *buffer, int pass_fd) {
+    if (!snapshot->failed && snapshot->length == snapshot->capacity) {
+        size_t capacity = snapshot->capacity > 0 ? snapshot->capacity * 2 : 64;
+        handover_record *records = realloc(snapshot->records, capacity * sizeof(handover_record));
+
+        if (records == NULL) {
+            snapshot->failed = true;
+        } else {
+            snapshot->records = records;
+            snapshot->capacity = capacity;
+        }
+    }
+
+    if (snapshot->failed || buffer->failed) {
+        snapshot->failed = true;
+        handover_buffer_free(buffer);
+        return;
+    }
+
+    handover_record *record = &snapshot->records[snapshot->length++];
+
+    record->type = type;
+    record->buffer = *buffer;
+    record->pass_fd = pass_fd;
+    memset(buffer, 0, sizeof(handover_buffer));
+}
+
+static void free_snapshot(relay_snapshot *snapshot) {
+    for (size_t i = 0; i < snapshot->length; i++) {
+        handover_buffer_free(&snapshot->records[i].buffer);
+    }
+    free(snapshot->records);
+    memset(snapshot, 0, sizeof(relay_snapshot));
+}
+
+// Takes down everything the relay knows, for the relay replacing it. The
+// sockets are passed as they are, so must not be closed until the snapshot
+// has been sent. Must hold the lock
+static void take_snapshot(relay *relay, relay_snapshot *snapshot) {
+    handover_buffer buffer;
+    uint64_t start = relay->nretained > RELAY_HISTORY_SIZE ? relay->nretained - RELAY_HISTORY_SIZE : 0;
+
+    memset(&buffer, 0, sizeof(buffer));
+    handover_put_u32(&buffer, relay->node);
+    handover_put_u64(&buffer, relay->next_id);
+    handover_put_u64(&buffer, relay->nretained);
+    handover_put_string(&buffer, relay->username);
+    add_record(snapshot, HANDOVER_STATE, &buffer, -1);
+
+    for (size_t i = 0; i < relay->norigins; i++) {
+        origin_state *state = &relay->origins[i];
+
+        handover_put_u32(&buffer, state->origin);
+        handover_put_u64(&buffer, state->highest);
+        handover_put_u64(&buffer, state->contiguous);
+        for (size_t j = 0; j < RELAY_DEDUP_WINDOW / 64; j++) {
+            handover_put_u64(&buffer, state->window[j]);
+        }
+        add_record(snapshot, HANDOVER_ORIGIN, &buffer, -1);
+    }
+
+    for (uint64_t i = start; i < relay->nretained; i++) {
+        retained_frame *retained = &relay->history[i % RELAY_HISTORY_SIZE];
+        frame_header *header = &retained->header;
+
+        handover_put_u64(&buffer, i);
+        handover_put(&buffer, &header->type, 1);
+        handover_put(&buffer, &header->flags, 1);
+        handover_put(&buffer, &header->uname_len, 1);
+        handover_put(&buffer, &header->nhops, 1);
+        handover_put_u32(&buffer, header->origin);
+        handover_put_u64(&buffer, header->id);
+        handover_put_u64(&buffer, header->sent_at);
+        for (uint8_t j = 0; j < header->nhops; j++) {
+            handover_put_u64(&buffer, header->hops[j]);
+        }
+        handover_put_u32(&buffer, header->length);
+        handover_put(&buffer, retained->payload, header->length);
+        handover_put_u64(&buffer, retained->token);
+        add_record(snapshot, HANDOVER_MESSAGE, &buffer, -1);
+    }
+
+    uint8_t payload[PRESENCE_MAX_BATCH];
+    size_t cursor = 0;
+
+    while (cursor != PRESENCE_SNAPSHOT_DONE) {
+        size_t length = presence_table_snapshot(relay->presence, payload, PRESENCE_MAX_BATCH, &cursor);
+
+        if (length > 0) {
+            handover_put(&buffer, payload, length);
+            add_record(snapshot, HANDOVER_PRESENCE, &buffer, -1);
+        }
+    }
+
+    add_record(snapshot, HANDOVER_LISTENER, &buffer, relay->listener);
+
+    for (int i = 0; i < relay->nslots; i++) {
+        connection *conn = conn_at(relay, i);
+        size_t length = 0;
+        uint8_t *queued = NULL;
+
+        // Connections still greeting are let go of; their clients dial again
+        if (conn->fd < 0 || conn->greeting) {
+            continue;
+        }
+
+        if (conn->out != NULL && (queued = outbox_save(conn->out, &length)) == NULL) {
+            snapshot->failed = true;
+            return;
+        }
+
+        // Links are matched up by address, since the new relay may have been
+        // given different ones
+        peer_link *link = conn->link != NOT_LINKED ? &relay->links[conn->link] : NULL;
+
+        handover_put_u32(&buffer, conn->is_peer);
+        handover_put_u32(&buffer, conn->node);
+        handover_put_string(&buffer, conn->username);
+        handover_put_string(&buffer, conn->ip);
+        handover_put_string(&buffer, link != NULL ? link->address : "");
+        handover_put_string(&buffer, link != NULL ? link->service : "");
+        handover_put_u64(&buffer, conn->token);
+        handover_put_u64(&buffer, conn->acked);
+        handover_put_u64(&buffer, conn->received);
+        handover_put_u32(&buffer, conn->presence_cursor != PRESENCE_SNAPSHOT_DONE);
+
+        // Whatever has arrived of the next frame goes along too, or the new
+        // relay would take the rest of it for the start of a frame
+        uint8_t partial[sizeof(frame_reader)];
+        size_t partial_length = 0;
+
+        if (conn->in != NULL) {
+            uint32_t chunk_left = conn->files != NULL ? file_receiver_chunk_left(conn->files) : 0;
+            partial_length = frame_reader_save(conn->in, chunk_left, partial);
+        }
+        handover_put_u32(&buffer, partial_length);
+        handover_put(&buffer, partial, partial_length);
+
+        if (length > 0) {
+            handover_put(&buffer, queued, length);
+        }
+        free(queued);
+
+        add_record(snapshot, HANDOVER_CONNECTION, &buffer, conn->fd);
+    }
+
+    // Expiry times are on the monotonic clock, which the new relay shares
+    for (int i = 0; i < relay->nheld; i++) {
+        held_session *held = held_at(relay, i);
+
+        if (held->token == 0) {
+            continue;
+        }
+
+        handover_put_u64(&buffer, held->token);
+        handover_put_string(&buffer, held->username);
+        handover_put_string(&buffer, held->ip);
+        handover_put_u64(&buffer, held->acked);
+        handover_put_u64(&buffer, held->received);
+        handover_put_u64(&buffer, held->expires);
+        add_record(snapshot, HANDOVER_HELD, &buffer, -1);
+    }
+
+    add_record(snapshot, HANDOVER_END, &buffer, -1);
+}
+
+// Sends the snapshot's records over fd. Returns 0 on success or -1 on error
+static int8_t send_snapshot(int fd, relay_snapshot *snapshot) {
+    if (snapshot->failed) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < snapshot->length; i++) {
+        handover_record *record = &snapshot->records[i];
+
+        if (handover_send(fd, record->type, record->buffer.data, record->buffer.length, record->pass_fd) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Hands the relay over to the new relay connecting to the upgrade socket. The
+// connections are only let go of once the new relay has confirmed it has
+// them; until then this relay carries on as if nothing happened
+static void hand_over(relay *relay) {
+    struct timeval timeout = { RELAY_HANDSHAKE_MS / 1000, (RELAY_HANDSHAKE_MS % 1000) * 1000 };
+    relay_snapshot snapshot;
+    uint8_t type, *data;
+    uint32_t length;
+    int passed_fd;
+
+    int fd = accept(relay->upgrades, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // The snapshot is sent without the lock, so the other threads are not
+    // held up on the new relay. Nothing is read or written meanwhile, since
+    // that is this thread's job, and only this thread closes connections;
+    // messages sent in the meantime are refused rather than left behind
+    memset(&snapshot, 0, sizeof(snapshot));
+    pthread_mutex_lock(&relay->lock);
+    take_snapshot(relay, &snapshot);
+    relay->handing_over = true;
+    pthread_mutex_unlock(&relay->lock);
+
+    bool done = send_snapshot(fd, &snapshot) == 0
+        && handover_recv(fd, &type, &data, &length, &passed_fd) > 0
+        && type == HANDOVER_END;
+
+    if (passed_fd >= 0) {
+        close(passed_fd);
+    }
+    free(data);
+    free_snapshot(&snapshot);
+
+    pthread_mutex_lock(&relay->lock);
+    relay->handing_over = false;
+
+    // Our copies of the sockets are closed without a word; the new relay's
+    // keep them open
+    if (done) {
+        for (int i = 0; i < relay->nslots; i++) {
+            connection *conn = conn_at(relay, i);
+
+            if (conn->fd < 0) {
+                continue;
+            }
+
+            if (conn->files != NULL) {
+                file_receiver_destroy(conn->files);
+                conn->files = NULL;
+            }
+            detach_reader(conn);
+            detach_outbox(conn);
+            close(conn->fd);
+            conn->fd = -1;
+        }
+
+        close(relay->listener);
+        relay->listener = -1;
+        close(relay->upgrades);
+        relay->upgrades = -1;
+        relay->replaced = true;
+    }
+
+    pthread_mutex_unlock(&relay->lock);
+    close(fd);
+
+    if (done) {
+        relay->notice(relay->ctx, "Handed over to a new process");
+        relay->handed_over(relay->ctx);
+    } else {
+        relay->notice(relay->ctx, "Failed to hand over to a new process");
+    }
+}
+
+// Takes over a connection handed over by the relay being replaced
+static int8_t adopt_connection(relay *relay, int fd, handover_reader *reader) {
+    char address[NI_MAXHOST];
+    char service[NI_MAXSERV];
+    int i = fd >= 0 ? free_slot(relay) : -1;
+
+    if (i < 0) {
+        return -1;
+    }
+
+    connection *conn = conn_at(relay, i);
+
+    conn->is_peer = handover_get_u32(reader);
+    conn->node = handover_get_u32(reader);
+    handover_get_string(reader, conn->username, MAX_UNAME_SIZE);
+    handover_get_string(reader, conn->ip, INET_ADDRSTRLEN);
+    handover_get_string(reader, address, sizeof(address));
+    handover_get_string(reader, service, sizeof(service));
+    conn->token = handover_get_u64(reader);
+    conn->acked = handover_get_u64(reader);
+    conn->received = handover_get_u64(reader);
+    conn->received_acked = 0;
+
+    // Our table lists users in a different order, so an unfinished snapshot
+    // starts over
+    conn->presence_cursor = handover_get_u32(reader) ? 0 : PRESENCE_SNAPSHOT_DONE;
+
+    uint8_t partial[sizeof(frame_reader)];
+    size_t partial_length = handover_get_u32(reader);
+
+    if (partial_length > sizeof(partial)) {
+        return -1;
+    }
+    handover_get(reader, partial, partial_length);
+
+    // Whatever is left of the record is what the connection had queued
+    size_t queued = reader->length - reader->offset;
+
+    if (reader->failed
+        || (partial_length > 0 && (attach_reader(relay, conn) == NULL
+            || frame_reader_restore(conn->in, partial, partial_length) < 0))
+        || (queued > 0 && (attach_outbox(relay, conn) == NULL
+            || outbox_restore(conn->out, reader->data + reader->offset, queued) < 0))) {
+        detach_reader(conn);
+        detach_outbox(conn);
+        return -1;
+    }
+
+    conn->fd = fd;
+    conn->greeting = false;
+    conn->generation = ++relay->next_generation;
+    conn->deficit = 0;
+    conn->bucket = 0;
+    conn->frames = 0;
+    conn->link = NOT_LINKED;
+
+    for (size_t j = 0; j < relay->nlinks; j++) {
+        peer_link *link = &relay->links[j];
+
+        if (strcmp(link->address, address) == 0 && strcmp(link->service, service) == 0) {
+            conn->link = j;
+            link->connected = true;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// Applies one record of a handover. Returns 1 once the handover is complete,
+// 0 if more records are to come or -1 if the record is bad
+static int8_t apply_record(relay *relay, uint8_t type, handover_reader *reader, int fd) {
+    if (type == HANDOVER_STATE) {
+        char old_username[MAX_UNAME_SIZE];
+
+        relay->node = handover_get_u32(reader);
+        relay->next_id = handover_get_u64(reader);
+        relay->nretained = handover_get_u64(reader);
+        handover_get_string(reader, old_username, MAX_UNAME_SIZE);
+
+        // The old relay's user leaves with it, unless they are back as ours
+        if (!reader->failed && old_username[0] != '\0' && strcmp(old_username, relay->username) != 0) {
+            presence_table_update(relay->presence, old_username, PRESENCE_OFFLINE, 0);
+        }
+    } else if (type == HANDOVER_ORIGIN) {
+        origin_state *state = find_origin(relay, handover_get_u32(reader));
+
+        if (state == NULL) {
+            return -1;
+        }
+
+        state->highest = handover_get_u64(reader);
+        state->contiguous = handover_get_u64(reader);
+        for (size_t j = 0; j < RELAY_DEDUP_WINDOW / 64; j++) {
+            state->window[j] = handover_get_u64(reader);
+        }
+    } else if (type == HANDOVER_MESSAGE) {
+        retained_frame *retained = &relay->history[handover_get_u64(reader) % RELAY_HISTORY_SIZE];
+        frame_header *header = &retained->header;
+
+        memset(header, 0, sizeof(frame_header));
+        handover_get(reader, &header->type, 1);
+        handover_get(reader, &header->flags, 1);
+        handover_get(reader, &header->uname_len, 1);
+        handover_get(reader, &header->nhops, 1);
+        header->origin = handover_get_u32(reader);
+        header->id = handover_get_u64(reader);
+        header->sent_at = handover_get_u64(reader);
+
+        if (header->nhops > FRAME_MAX_HOPS) {
+            return -1;
+        }
+        for (uint8_t j = 0; j < header->nhops; j++) {
+            header->hops[j] = handover_get_u64(reader);
+        }
+
+        header->length = handover_get_u32(reader);
+        if (header->length > MAX_MESSAGE_PAYLOAD) {
+            return -1;
+        }
+        handover_get(reader, retained->payload, header->length);
+        retained->token = handover_get_u64(reader);
+    } else if (type == HANDOVER_PRESENCE) {
+        presence_table_apply(relay->presence, reader->data, reader->length, NULL);
+    } else if (type == HANDOVER_LISTENER) {
+        if (fd < 0 || relay->listener >= 0) {
+            return -1;
+        }
+        relay->listener = fd;
+    } else if (type == HANDOVER_CONNECTION) {
+        if (adopt_connection(relay, fd, reader) < 0) {
+            return -1;
+        }
+    } else if (type == HANDOVER_HELD) {
+        held_session *held = free_held(relay);
+
+        if (held == NULL) {
+            return -1;
+        }
+
+        held->token = handover_get_u64(reader);
+        handover_get_string(reader, held->username, MAX_UNAME_SIZE);
+        handover_get_string(reader, held->ip, INET_ADDRSTRLEN);
+        held->acked = handover_get_u64(reader);
+        held->received = handover_get_u64(reader);
+        held->expires = handover_get_u64(reader);
+    } else if (type == HANDOVER_END) {
+        return relay->listener >= 0 ? 1 : -1;
+    }
+
+    return reader->failed ? -1 : 0;
+}
+
+// Takes over from the relay listening on the upgrade socket, if there is one.
+// Returns 1 if it was taken over, 0 if there was nothing to take over or -1 if
+// the handover failed, in which case the old relay keeps running
+static int8_t take_over(relay *relay) {
+    uint8_t type, *data;
+    uint32_t length;
+    int passed_fd;
+    int8_t result = 0;
+
+    int fd = handover_connect(relay->upgrade_path);
+    if (fd < 0) {
+        return 0;
+    }
+
+    while (result == 0) {
+        if (handover_recv(fd, &type, &data, &length, &passed_fd) <= 0) {
+            result = -1;
+            break;
+        }
+
+        handover_reader reader = { data, length, 0, false };
+
+        result = apply_record(relay, type, &reader, passed_fd);
+        free(data);
+
+        // Descriptors the relay did not keep hold of are not needed
+        if (result < 0 && passed_fd >= 0 && passed_fd != relay->listener) {
+            close(passed_fd);
+        }
+    }
+
+    if (result > 0 && handover_send(fd, HANDOVER_END, NULL, 0, -1) < 0) {
+        result = -1;
+    }
+    close(fd);
+
+    if (result < 0) {
+        for (int i = 0; i < relay->nslots; i++) {
+            connection *conn = conn_at(relay, i);
+
+            if (conn->fd >= 0) {
+                detach_reader(conn);
+                detach_outbox(conn);
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+        if (relay->listener >= 0) {
+            close(relay->listener);
+            relay->listener = -1;
+        }
+    }
+
+    return result;
+}
+
+// Waits for activity on the listener and every connection, and handles it.
+// This is the only thread that writes to connections once they are set up
+static void *poll_connections(void *arg) {
+    relay *relay = arg;
+    struct pollfd *pfds = NULL;
+    int *slots = NULL;
+    uint64_t *generations = NULL;
+    size_t capacity = 0; // Entries in each of the arrays
+
+    while (atomic_load(&relay->running)) {
+        nfds_t nfds = 3;
+        int timeout = RELAY_POLL_MS;
+        uint64_t now = frame_monotonic_now();
+
+        // The arrays grow along with the connection table. Connections that
+        // do not fit, if they cannot, wait until they do
+        pthread_mutex_lock(&relay->lock);
+        if (capacity < (size_t) relay->nslots + 3) {
+            size_t wanted = relay->nslots + 3;
+            struct pollfd *grown_pfds = realloc(pfds, wanted * sizeof(struct pollfd));
+            int *grown_slots = grown_pfds != NULL ? realloc(slots, wanted * sizeof(int)) : NULL;
+            uint64_t *grown_generations = grown_slots != NULL ? realloc(generations, wanted * sizeof(uint64_t)) : NULL;
+
+            pfds = grown_pfds != NULL ? grown_pfds : pfds;
+            slots = grown_slots != NULL ? grown_slots : slots;
+            generations = grown_generations != NULL ? grown_generations : generations;
+            if (grown_generations != NULL) {
+                capacity = wanted;
+            }
+        }
+        pthread_mutex_unlock(&relay->lock);
+
+        if (capacity == 0) {
+            poll(NULL, 0, RELAY_POLL_MS);
+            continue;
+        }
+
+        // Once the relay has been replaced, the listener and the upgrade
+        // socket are -1, which poll ignores
+        pfds[0].fd = relay->listener;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = relay->wakeup;
+        pfds[1].events = POLLIN;
+        pfds[2].fd = relay->upgrades;
+        pfds[2].events = POLLIN;
+
+        // Connections are only ever removed by this thread, so the snapshot
+        // stays valid while we are using it. Only wait for a socket to be
+        // writable if there is something to write to it, and only for it to
+        // be readable if it may be read from. Connections whose outboxes
+        // overflowed have stopped reading, and those whose HELLO did not
+        // arrive in time never started, so both are dropped rather than
+        // waited for
+        pthread_mutex_lock(&relay->lock);
+        fan_out_presence(relay);
+        fan_out_acks(relay);
+        expire_held(relay);
+
+        for (int i = 0; i < relay->nslots; i++) {
+            connection *conn = conn_at(relay, i);
+
+            if (conn->fd >= 0 && (conn->overflowed || (conn->greeting && now >= conn->expires))) {
+                drop_connection(relay, i, false);
+            }
+
+            if (conn->fd >= 0 && nfds < capacity) {
+                uint64_t until = throttled_until(relay, conn, now);
+
+                if (until != 0 && (until - now) / 1000000 + 1 < (uint64_t) timeout) {
+                    timeout = (until - now) / 1000000 + 1;
+                }
+
+                // A throttled client is still watched for hanging up
+                pfds[nfds].fd = conn->fd;
+                pfds[nfds].events = (until == 0 ? POLLIN : POLLRDHUP) | (conn->out != NULL && outbox_pending(conn->out) ? POLLOUT : 0);
+                slots[nfds] = i;
+                generations[nfds] = conn->generation;
+                nfds++;
+            }
+        }
+        pthread_mutex_unlock(&relay->lock);
+
+        if (poll(pfds, nfds, timeout) <= 0) {
+            continue;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            accept_connection(relay);
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            uint64_t count;
+            read(relay->wakeup, &count, sizeof(count));
+        }
+
+        // Nothing else polled may be touched once it has been handed over
+        if (pfds[2].revents & POLLIN) {
+            hand_over(relay);
+            continue;
+        }
+
+        // The linker may have put a new connection in a slot we dropped, so
+        // make sure each one is still the connection that was polled
+        for (nfds_t i = 3; i < nfds; i++) {
+            if (pfds[i].revents & POLLOUT && is_current(relay, slots[i], generations[i])) {
+                flush_connection(relay, slots[i]);
+            }
+            if (!(pfds[i].revents & (POLLIN | POLLRDHUP | POLLHUP | POLLERR)) || !is_current(relay, slots[i], generations[i])) {
+                continue;
+            }
+
+            // What a throttled client sent before hanging up is not read, as
+            // it would not have been had it stayed
+            if (pfds[i].events & POLLIN) {
+                read_connection(relay, slots[i]);
+            } else {
+                pthread_mutex_lock(&relay->lock);
+                drop_connection(relay, slots[i], false);
+                pthread_mutex_unlock(&relay->lock);
+            }
+        }
+    }
+
+    free(pfds);
+    free(slots);
+    free(generations);
+    pthread_exit(NULL);
+}
+
+// Opens a connection to a link and sends our HELLO over it; the peer's is
+// waited for by the poller. Returns the connected socket, or -1 on failure
+static int dial(relay *relay, peer_link *link, char *ip) {
+    struct addrinfo *remote_addr, hint;
+
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_INET;
+    hint.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(link->address, link->service, &hint, &remote_addr) != 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
+
+    if (fd >= 0 && connect(fd, remote_addr->ai_addr, remote_addr->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd >= 0) {
+        inet_ntop(AF_INET, &((struct sockaddr_in*) remote_addr->ai_addr)->sin_addr, ip, INET_ADDRSTRLEN);
+    }
+    freeaddrinfo(remote_addr);
+
+    if (fd >= 0) {
+        frame_header hello;
+        uint8_t payload[MAX_UNAME_SIZE + FRAME_RESUME_SIZE];
+
+        init_hello(relay, &hello, payload, FRAME_HELLO_PEER, 0, 0);
+
+        if (frame_send(fd, &hello, payload) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    return fd;
+}
+
+// Keeps every configured link up, re-dialing those that are down
+static void *maintain_links(void *arg) {
+    relay *relay = arg;
+    struct timespec interval = { 0, RELAY_POLL_MS * 1000000 };
+    uint64_t elapsed = RELAY_RETRY_MS;
+
+    while (atomic_load(&relay->running)) {
+        if (elapsed < RELAY_RETRY_MS) {
+            nanosleep(&interval, NULL);
+            elapsed += RELAY_POLL_MS;
+            continue;
+        }
+        elapsed = 0;
+
+        for (size_t i = 0; i < relay->nlinks; i++) {
+            peer_link *link = &relay->links[i];
+            char ip[INET_ADDRSTRLEN];
+
+            pthread_mutex_lock(&relay->lock);
+            bool wanted = !link->connected && !link->is_self && !relay->replaced && !relay->handing_over;
+            pthread_mutex_unlock(&relay->lock);
+
+            if (!wanted) {
+                continue;
+            }
+
+            int fd = dial(relay, link, ip);
+            if (fd < 0) {
+                continue;
+            }
+
+            pthread_mutex_lock(&relay->lock);
+            if (relay->replaced || relay->handing_over || add_connection(relay, fd, ip, i) < 0) {
+                close(fd);
+            }
+            pthread_mutex_unlock(&relay->lock);
+
+            wake_poller(relay);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+relay *relay_create(int port, const char *username, relay_deliver_fn deliver, relay_notice_fn notice, latency_trace *trace, void *ctx) {
+    relay *relay = calloc(1, sizeof(struct relay));
+
+    if (relay == NULL) {
+        return NULL;
+    }
+
+    relay->history = malloc(RELAY_HISTORY_SIZE * sizeof(retained_frame));
+
+    if (relay->history == NULL) {
+        free(relay);
+        return NULL;
+    }
+
+    // Node ids only need to be unique among the relays that are linked
+    // together, so a random one is good enough
+    if (getrandom(&relay->node, sizeof(relay->node), 0) != sizeof(relay->node)) {
+        relay->node = (uint32_t) time(NULL) ^ (uint32_t) getpid();
+    }
+
+    relay->wakeup = eventfd(0, EFD_NONBLOCK);
+    relay->presence = presence_table_create(PRESENCE_MAX_USERS);
+
+    if (relay->wakeup < 0 || relay->presence == NULL) {
+        if (relay->wakeup >= 0) {
+            close(relay->wakeup);
+        }
+        if (relay->presence != NULL) {
+            presence_table_destroy(relay->presence);
+        }
+        free(relay->history);
+        free(relay);
+        return NULL;
+    }
+
+    relay->port = port;
+    relay->listener = -1;
+    relay->upgrades = -1;
+    relay->download_dir = strdup(".");
+    relay->budget = OUTBOX_MAX_BYTES;
+    relay->message_rate = RELAY_MESSAGE_RATE;
+    relay->frame_rate = RELAY_FRAME_RATE;
+    strncpy(relay->username, username, MAX_UNAME_SIZE - 1);
+    relay->deliver = deliver;
+    relay->notice = notice;
+    relay->ctx = ctx;
+    relay->trace = trace;
+    pthread_mutex_init(&relay->lock, NULL);
+
+    return relay;
+}
+
+int8_t relay_add_link(relay *relay, const char *address, const char *service) {
+    if (relay->nlinks == RELAY_MAX_LINKS) {
+        return -1;
+    }
+
+    peer_link *link = &relay->links[relay->nlinks++];
+    link->address = strdup(address);
+    link->service = strdup(service);
+    link->connected = false;
+    link->is_self = false;
+
+    return 0;
+}
+
+int8_t relay_set_download_dir(relay *relay, const char *directory) {
+    char *copy = strdup(directory);
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    free(relay->download_dir);
+    relay->download_dir = copy;
+
+    return 0;
+}
+
+int8_t relay_set_budget(relay *relay, size_t bytes) {
+    if (bytes < RELAY_MIN_BUDGET) {
+        return -1;
+    }
+
+    relay->budget = bytes;
+
+    return 0;
+}
+
+void relay_set_message_rate(relay *relay, uint32_t rate) {
+    relay->message_rate = rate;
+}
+
+void relay_set_frame_rate(relay *relay, uint32_t rate) {
+    relay->frame_rate = rate;
+}
+
+int8_t relay_enable_upgrades(relay *relay, const char *path, relay_handover_fn handed_over) {
+    char *copy = strdup(path);
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    free(relay->upgrade_path);
+    relay->upgrade_path = copy;
+    relay->handed_over = handed_over;
+
+    return 0;
+}
+
+// Binds the listening socket. Returns 0 on success or -1 on error
+static int8_t bind_listener(relay *relay) {
+    // Open a socket to listen to incoming connections
+    relay->listener = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
+    if (relay->listener < 0) {
+        perror("In relay_start - failed to open socket");
+        return -1;
+    }
+
+    // Allows use to reuse this address. This addresses addresses an occurence
+    // where if the user runs the program, exits, then runs it again before the
+    // address is freed, they get a complaint stating the address is in use
+    int reuse_addr = 1;
+
+    if (setsockopt(relay->listener, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(int)) < 0) {
+        perror("In relay_start - failed to set socket options");
+        return -1;
+    }
+
+    struct sockaddr_in local_addr;
+
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_port = htons(relay->port);
+    local_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(relay->listener, (struct sockaddr*) &local_addr, sizeof(local_addr)) < 0) {
+        perror("In relay_start - failed to bind address");
+        return -1;
+    }
+
+    listen(relay->listener, SOMAXCONN);
+
+    return 0;
+}
+
+int8_t relay_start(relay *relay) {
+    int8_t taken_over = 0;
+
+    if (relay->upgrade_path != NULL) {
+        taken_over = take_over(relay);
+
+        if (taken_over < 0) {
+            fputs("In relay_start - failed to take over from the running relay\n", stderr);
+            return -1;
+        }
+    }
+
+    if (taken_over == 0 && bind_listener(relay) < 0) {
+        return -1;
+    }
+
+    // The relay we replaced has let go of the socket by now, so it is ours
+    // to listen on for our own replacement
+    if (relay->upgrade_path != NULL) {
+        relay->upgrades = handover_listen(relay->upgrade_path);
+
+        if (relay->upgrades < 0) {
+            perror("In relay_start - failed to listen for upgrades");
+            return -1;
+        }
+    }
+
+    if (taken_over > 0) {
+        relay->notice(relay->ctx, "Took over from the running process");
+    }
+
+    atomic_store(&relay->running, true);
+
+    // The relay's threads inherit our signal mask. Block everything while
+    // spawning them so signals are left to the main thread's signalfd
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+    pthread_create(&relay->poller, NULL, poll_connections, relay);
+    pthread_create(&relay->linker, NULL, maintain_links, relay);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    return 0;
+}
+
+void relay_broadcast(relay *relay, const char *msg) {
+    frame_header header;
+    uint8_t payload[MAX_MESSAGE_PAYLOAD];
+
+    frame_init_message(&header, payload, relay->username, msg);
+
+    pthread_mutex_lock(&relay->lock);
+
+    // A message sent now would be left behind with the old connections
+    if (relay->handing_over || relay->replaced) {
+        pthread_mutex_unlock(&relay->lock);
+        relay->notice(relay->ctx, "Not sent: the host is being handed over to a new process");
+        return;
+    }
+
+    header.origin = relay->node;
+    header.id = ++relay->next_id;
+    mark_seen(relay, header.origin, header.id);
+    accept_message(relay, &header, payload, -1);
+    pthread_mutex_unlock(&relay->lock);
+
+    wake_poller(relay);
+}
+
+void relay_ping(relay *relay) {
+    frame_header ping;
+
+    memset(&ping, 0, sizeof(ping));
+    ping.type = FRAME_PING;
+    ping.origin = relay->node;
+
+    pthread_mutex_lock(&relay->lock);
+    for (int i = 0; i < relay->nslots; i++) {
+        connection *conn = conn_at(relay, i);
+
+        if (conn->fd >= 0 && !conn->greeting) {
+            ping.id = frame_monotonic_now();
+            queue_frame(relay, conn, &ping, NULL);
+        }
+    }
+    pthread_mutex_unlock(&relay->lock);
+
+    wake_poller(relay);
+}
+
+// Sends a frame of a file to the client in target->slot, as long as it is
+// still the client the transfer was started for
+static int8_t send_file_frame(void *ctx, const frame_header *header, const void *payload, int file_fd, off_t offset) {
+    file_target *target = ctx;
+    relay *relay = target->relay;
+    connection *conn = conn_at(relay, target->slot);
+    int8_t result = -1;
+
+    pthread_mutex_lock(&relay->lock);
+    if (conn->fd >= 0 && conn->generation == target->generation) {
+        outbox *out = attach_outbox(relay, conn);
+
+        if (out == NULL) {
+            result = -1;
+        } else if (file_fd < 0) {
+            result = outbox_push(out, header, payload);
+        } else {
+            result = outbox_push_file(out, header, file_fd, offset);
+        }
+    }
+    pthread_mutex_unlock(&relay->lock);
+
+    wake_poller(relay);
+
+    return result;
+}
+
+int relay_send_file(relay *relay, const char *path) {
+    int started = 0;
+
+    pthread_mutex_lock(&relay->lock);
+    for (int i = 0; i < relay->nslots; i++) {
+        connection *conn = conn_at(relay, i);
+
+        if (conn->fd < 0 || conn->is_peer || conn->greeting) {
+            continue;
+        }
+
+        file_target *target = malloc(sizeof(file_target));
+        if (target == NULL) {
+            break;
+        }
+        target->relay = relay;
+        target->slot = i;
+        target->generation = conn->generation;
+
+        if (file_transfer_send(path, relay->username, conn->username, send_file_frame, target, file_sent_notice) < 0) {
+            free(target);
+            pthread_mutex_unlock(&relay->lock);
+            return -1;
+        }
+        started++;
+    }
+    pthread_mutex_unlock(&relay->lock);
+
+    return started;
+}
+
+void relay_set_presence(relay *relay, uint8_t state) {
+    presence_table_update(relay->presence, relay->username, state, 0);
+}
+
+presence_table *relay_presence(relay *relay) {
+    return relay->presence;
+}
+
+void relay_print_memory(relay *relay, FILE *out) {
+    size_t count = 0, idle = 0;
+
+    pthread_mutex_lock(&relay->lock);
+
+    // Slots are counted whether they are in use or not
+    size_t total = relay->nslots * SLOT_SIZE + relay->nheld * sizeof(held_session);
+
+    for (int i = 0; i < relay->nslots; i++) {
+        connection *conn = conn_at(relay, i);
+
+        if (conn->fd >= 0) {
+            size_t attached = (conn->in != NULL ? sizeof(frame_reader) : 0)
+                + (conn->out != NULL ? outbox_memory(conn->out) : 0)
+                + (conn->files != NULL ? file_receiver_memory(conn->files) : 0);
+
+            count++;
+            idle += attached == 0;
+            total += attached;
+        }
+    }
+
+    fprintf(out, "%lu connections using %lu bytes", count, total);
+    if (count > 0) {
+        fprintf(out, " (%lu per connection)", total / count);
+    }
+    fprintf(out, "; budget %lu bytes each\n", relay->budget);
+
+    // However many connections there are, only the busy ones are listed
+    if (count > idle) {
+        fprintf(out, "  %-*s %-*s %8s %8s %8s %8s\n", MAX_UNAME_SIZE, "name", INET_ADDRSTRLEN, "address", "slot", "reading", "queued", "files");
+    }
+
+    for (int i = 0; i < relay->nslots; i++) {
+        connection *conn = conn_at(relay, i);
+
+        if (conn->fd >= 0 && (conn->in != NULL || conn->out != NULL || conn->files != NULL)) {
+            fprintf(
+                out,
+                "  %-*s %-*s %8lu %8lu %8lu %8lu\n",
+                MAX_UNAME_SIZE, conn->username,
+                INET_ADDRSTRLEN, conn->ip,
+                SLOT_SIZE,
+                conn->in != NULL ? sizeof(frame_reader) : 0,
+                conn->out != NULL ? outbox_memory(conn->out) : 0,
+                conn->files != NULL ? file_receiver_memory(conn->files) : 0
+            );
+        }
+    }
+
+    if (idle > 0) {
+        fprintf(out, "  %lu idle connections take up only their slot of %lu bytes\n", idle, SLOT_SIZE);
+    }
+
+    pthread_mutex_unlock(&relay->lock);
+}
+
+void relay_stop(relay *relay) {
+    frame_header quit;
+
+    if (atomic_exchange(&relay->running, false)) {
+        pthread_join(relay->poller, NULL);
+        pthread_join(relay->linker, NULL);
+    }
+
+    // Transfers send through the connection table, so they have to be gone
+    // before it is
+    file_transfer_stop_all();
+
+    memset(&quit, 0, sizeof(quit));
+    quit.type = FRAME_QUIT;
+    quit.origin = relay->node;
+
+    // QUIT goes out after any chat still queued, but ahead of bulk data
+    for (int i = 0; i < relay->nslots; i++) {
+        connection *conn = conn_at(relay, i);
+
+        if (conn->fd >= 0) {
+            outbox *out = conn->greeting ? NULL : attach_outbox(relay, conn);
+
+            if (out != NULL) {
+                outbox_push(out, &quit, NULL);
+                outbox_drain(out, conn->fd, RELAY_HANDSHAKE_MS);
+            }
+            detach_reader(conn);
+            detach_outbox(conn);
+            close(conn->fd);
+        }
+        if (conn->files != NULL) {
+            file_receiver_destroy(conn->files);
+        }
+    }
+
+    // The slots go once nothing is left in them
+    for (int i = 0; i < relay->nslots; i += RELAY_SLOT_BLOCK) {
+        free(relay->conns[i / RELAY_SLOT_BLOCK]);
+    }
+    for (int i = 0; i < relay->nheld; i += RELAY_SLOT_BLOCK) {
+        free(relay->held[i / RELAY_SLOT_BLOCK]);
+    }
+
+    if (relay->listener >= 0) {
+        close(relay->listener);
+    }
+    if (relay->upgrades >= 0) {
+        close(relay->upgrades);
+        unlink(relay->upgrade_path);
+    }
+    close(relay->wakeup);
+
+    for (size_t i = 0; i < relay->nlinks; i++) {
+        free(relay->links[i].address);
+        free(relay->links[i].service);
+    }
+
+    pthread_mutex_destroy(&relay->lock);
+    free(relay->download_dir);
+    free(relay->upgrade_path);
+    presence_table_destroy(relay->presence);
+    free(relay->history);
+    free(relay);
+}
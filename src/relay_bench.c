@@ -0,0 +1,498 @@
+// relay_bench - Measures what a relay's connections cost
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// relay_bench runs a relay in this process, listening on a loopback port, and
+// connects clients to it over real sockets, introducing each with a HELLO as
+// sockets_chat would. It measures one of two things.
+//
+// By default, the clients are idle: they read and discard whatever the relay
+// sends them. Once every client has been accepted and the relay has gone
+// quiet, the relay's own account of its memory (as ~memory prints it) is
+// reported, along with how much the process grew per connection.
+//
+// With -f, some of the clients flood the relay with PINGs and presence
+// updates as fast as it will read them, while a probe client PINGs it at
+// a steady pace and times each round trip. This is done three times, on a
+// fresh relay each time: with nobody flooding, with the relay's rate limits
+// turned off and with its default limits, to show how much a flood slows
+// everyone else down and how much of it the limits keep out. Messages are
+// left out of the flood, since the relay limits them on their own; each PING
+// still costs it a PONG and each presence update a fan out.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <chat.h>
+#include <frame.h>
+#include <latency.h>
+#include <presence.h>
+#include <relay.h>
+
+#define DEFAULT_IDLE 5000 // Idle clients connected
+#define DEFAULT_PORT 47800
+#define SPARE_FILES 64 // Files kept free for everything but the connections
+#define DRAIN_BUFFER_SIZE 65536
+#define SETTLE_MS 200 // The relay is quiet once nothing arrives for this long
+#define BENCH_USERNAME "bench"
+#define FLOOD_MS 3000 // How long each round of the flood benchmark lasts
+#define FLOOD_BATCH_SIZE 65536 // Bytes of frames a flooder encodes at a time
+#define PROBE_INTERVAL_MS 10 // Time between the probe's PINGs
+#define PROBE_TIMEOUT_MS 1000 // A PING unanswered this long is counted as lost
+
+static atomic_size_t accepted; // Clients the relay has finished greeting
+static atomic_bool flooding; // Flooders keep going while this is set
+
+// A client sending the relay frames as fast as it will read them
+typedef struct flooder {
+    pthread_t thread;
+    int fd;
+    char username[MAX_UNAME_SIZE];
+    uint8_t batch[FLOOD_BATCH_SIZE]; // Frames sent over and over
+    size_t length; // Bytes of frames in batch
+    size_t offset; // Bytes of batch sent this time through
+    frame_reader in; // What the relay is sending back
+    size_t answered; // PINGs the relay has answered
+} flooder;
+
+// Messages delivered to the relay's user are not wanted
+static void deliver_nothing(void *ctx, const char *username, const char *msg) {
+    (void) ctx;
+    (void) username;
+    (void) msg;
+}
+
+// Counts the clients the relay has accepted; every other notice is dropped
+static void count_accepted(void *ctx, const char *notice) {
+    (void) ctx;
+
+    if (strncmp(notice, "Connection established", strlen("Connection established")) == 0) {
+        atomic_fetch_add(&accepted, 1);
+    }
+}
+
+// Returns how much of the process is resident, in bytes
+static size_t resident_bytes() {
+    unsigned long size, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm != NULL) {
+        if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Opens a client connection to the relay on port and sends its HELLO. The
+// socket is left nonblocking. Returns it, or -1 on error
+static int connect_client(int port, const char *username) {
+    struct sockaddr_in address;
+    frame_header hello;
+    uint8_t payload[MAX_UNAME_SIZE + FRAME_RESUME_SIZE];
+    int fd = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    frame_init_hello(&hello, payload, FRAME_HELLO_CLIENT, username, 0, 0);
+
+    if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0
+        || frame_send(fd, &hello, payload) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+// Reads and discards whatever the relay has sent to the nfds clients in pfds,
+// waiting up to timeout_ms for it. Returns the number of bytes read
+static size_t drain_clients(struct pollfd *pfds, size_t nfds, int timeout_ms) {
+    static uint8_t buffer[DRAIN_BUFFER_SIZE];
+    size_t total = 0;
+
+    if (poll(pfds, nfds, timeout_ms) <= 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < nfds; i++) {
+        if (pfds[i].revents & POLLIN) {
+            ssize_t n;
+
+            while ((n = recv(pfds[i].fd, buffer, DRAIN_BUFFER_SIZE, 0)) > 0) {
+                total += n;
+            }
+        }
+    }
+
+    return total;
+}
+
+// Connects nclients idle clients and reports what they cost the relay
+static int bench_idle(relay *relay, int port, size_t nclients) {
+    struct pollfd *pfds = calloc(nclients, sizeof(struct pollfd));
+    char username[MAX_UNAME_SIZE];
+    size_t before = resident_bytes();
+    uint64_t start = frame_monotonic_now();
+
+    if (pfds == NULL) {
+        perror("In bench_idle - failed to allocate the clients");
+        return 2;
+    }
+
+    for (size_t i = 0; i < nclients; i++) {
+        snprintf(username, MAX_UNAME_SIZE, "idle%06u", (unsigned) (i % 1000000));
+        pfds[i].fd = connect_client(port, username);
+        pfds[i].events = POLLIN;
+
+        if (pfds[i].fd < 0) {
+            fprintf(stderr, "Error: Client %lu could not connect\n", i);
+            return 3;
+        }
+
+        // Every client is sent everyone's presence when it arrives. Clients
+        // connect a block at a time, and each block waits for the relay to
+        // settle, so that not all of it is in flight at once; loopback drops
+        // packets once the kernel runs short of memory for sockets
+        if (i % RELAY_SLOT_BLOCK == RELAY_SLOT_BLOCK - 1 || i == nclients - 1) {
+            while (atomic_load(&accepted) < i + 1 || drain_clients(pfds, i + 1, SETTLE_MS) > 0);
+        }
+    }
+
+    // Buffers the relay let go of while everyone was arriving are handed
+    // back, so that only what it still holds is counted
+    malloc_trim(0);
+
+    printf(
+        "%lu idle clients connected and settled in %.2f s\n",
+        nclients,
+        (frame_monotonic_now() - start) / 1e9
+    );
+    relay_print_memory(relay, stdout);
+    printf(
+        "Process grew by %lu bytes per connection, counting both ends of each\n",
+        (resident_bytes() - before) / nclients
+    );
+
+    for (size_t i = 0; i < nclients; i++) {
+        close(pfds[i].fd);
+    }
+    free(pfds);
+
+    return 0;
+}
+
+// Adds a frame to the end of flooder's batch
+static void add_frame(flooder *flooder, const frame_header *header, const void *payload) {
+    flooder->length += frame_encode_header(flooder->batch + flooder->length, header);
+    memcpy(flooder->batch + flooder->length, payload, header->length);
+    flooder->length += header->length;
+}
+
+// Fills flooder's batch with PINGs and presence updates, taking turns, until
+// it has no room for more
+static void fill_batch(flooder *flooder) {
+    frame_header ping, presence;
+    uint8_t presence_payload[PRESENCE_ENTRY_SIZE + MAX_UNAME_SIZE];
+    size_t most = 2 * FRAME_HEADER_SIZE + sizeof(presence_payload);
+
+    memset(&ping, 0, sizeof(ping));
+    ping.type = FRAME_PING;
+    ping.id = frame_monotonic_now();
+
+    memset(&presence, 0, sizeof(presence));
+    presence.type = FRAME_PRESENCE;
+    presence.length = presence_encode(presence_payload, flooder->username, PRESENCE_TYPING, 0);
+
+    flooder->length = 0;
+    while (flooder->length + most <= FLOOD_BATCH_SIZE) {
+        add_frame(flooder, &ping, NULL);
+        add_frame(flooder, &presence, presence_payload);
+    }
+}
+
+// Reads the frames that have arrived over fd into in, counting PONGs into
+// pongs (which may be NULL) and discarding everything else. Returns the id of
+// the last PONG read, 0 if there was none or -1 if the connection was closed
+static int64_t read_frames(int fd, frame_reader *in, size_t *pongs) {
+    int64_t last = 0;
+    int8_t result;
+
+    while ((result = frame_reader_recv(in, fd)) == 1) {
+        if (in->header.type == FRAME_PONG) {
+            last = (int64_t) in->header.id;
+            if (pongs != NULL) {
+                (*pongs)++;
+            }
+        }
+        frame_reader_next(in);
+    }
+
+    return result == FRAME_PENDING ? last : -1;
+}
+
+// Sends flooder's batch to the relay over and over until flooding is cleared
+// or the relay drops it, reading whatever comes back as it goes
+static void *flood(void *arg) {
+    flooder *flooder = arg;
+    struct pollfd pfd = { .fd = flooder->fd, .events = POLLIN | POLLOUT };
+
+    while (atomic_load(&flooding) && poll(&pfd, 1, PROBE_INTERVAL_MS) >= 0) {
+        if ((pfd.revents & POLLIN) && read_frames(flooder->fd, &flooder->in, &flooder->answered) < 0) {
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t sent = send(
+                flooder->fd,
+                flooder->batch + flooder->offset,
+                flooder->length - flooder->offset,
+                MSG_NOSIGNAL | MSG_DONTWAIT
+            );
+
+            if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                break;
+            }
+
+            flooder->offset = sent > 0 ? (flooder->offset + sent) % flooder->length : flooder->offset;
+        }
+
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// PINGs the relay over probe every PROBE_INTERVAL_MS for FLOOD_MS, recording
+// each round trip into round_trip. Returns the number of PINGs that went
+// unanswered, or -1 if the relay dropped the probe
+static long probe_relay(int probe, latency_histogram *round_trip) {
+    frame_reader in;
+    frame_header ping;
+    uint64_t end = frame_monotonic_now() + FLOOD_MS * 1000000ULL;
+    long lost = 0;
+
+    memset(&in, 0, sizeof(in));
+    memset(&ping, 0, sizeof(ping));
+    ping.type = FRAME_PING;
+
+    while (frame_monotonic_now() < end) {
+        struct pollfd pfd = { .fd = probe, .events = POLLIN };
+        uint64_t sent_at = frame_monotonic_now();
+        int64_t answer = 0;
+
+        ping.id = sent_at;
+        if (frame_send(probe, &ping, NULL) < 0) {
+            return -1;
+        }
+
+        // Frames fanned out from the flood are read past until the PONG
+        while (answer != (int64_t) sent_at && frame_monotonic_now() - sent_at < PROBE_TIMEOUT_MS * 1000000ULL) {
+            if (poll(&pfd, 1, PROBE_INTERVAL_MS) > 0 && (answer = read_frames(probe, &in, NULL)) < 0) {
+                return -1;
+            }
+        }
+
+        if (answer == (int64_t) sent_at) {
+            latency_record(round_trip, frame_monotonic_now() - sent_at);
+            usleep(PROBE_INTERVAL_MS * 1000);
+        } else {
+            lost++;
+        }
+    }
+
+    return lost;
+}
+
+// Runs one round of the flood benchmark on a fresh relay on port, with
+// nflooders clients flooding it, and reports how the probe fared
+static int bench_flood_round(int port, size_t nflooders, bool limited, const char *name) {
+    flooder *flooders = calloc(nflooders, sizeof(flooder));
+    latency_histogram *round_trip = calloc(1, sizeof(latency_histogram));
+    relay *relay = relay_create(port, BENCH_USERNAME, deliver_nothing, count_accepted, NULL, NULL);
+    size_t answered = 0;
+    int probe;
+
+    if (flooders == NULL || round_trip == NULL || relay == NULL) {
+        perror("In bench_flood_round - failed to set up the round");
+        return 2;
+    }
+
+    if (!limited) {
+        relay_set_message_rate(relay, 0);
+        relay_set_frame_rate(relay, 0);
+    }
+
+    atomic_store(&accepted, 0);
+    if (relay_start(relay) < 0 || (probe = connect_client(port, "probe")) < 0) {
+        fputs("Error: Failed to start the relay\n", stderr);
+        return 2;
+    }
+
+    for (size_t i = 0; i < nflooders; i++) {
+        snprintf(flooders[i].username, MAX_UNAME_SIZE, "flood%04u", (unsigned) (i % 10000));
+        flooders[i].fd = connect_client(port, flooders[i].username);
+
+        if (flooders[i].fd < 0) {
+            fprintf(stderr, "Error: Flooder %lu could not connect\n", i);
+            return 3;
+        }
+    }
+
+    while (atomic_load(&accepted) < nflooders + 1) {
+        usleep(PROBE_INTERVAL_MS * 1000);
+    }
+
+    atomic_store(&flooding, true);
+    for (size_t i = 0; i < nflooders; i++) {
+        fill_batch(&flooders[i]);
+        pthread_create(&flooders[i].thread, NULL, flood, &flooders[i]);
+    }
+
+    long lost = probe_relay(probe, round_trip);
+
+    atomic_store(&flooding, false);
+    for (size_t i = 0; i < nflooders; i++) {
+        pthread_join(flooders[i].thread, NULL);
+        close(flooders[i].fd);
+        answered += flooders[i].answered;
+    }
+    close(probe);
+    relay_stop(relay);
+
+    printf("%s:\n", name);
+    if (lost < 0) {
+        puts("  The relay dropped the probe");
+    } else {
+        printf(
+            "  Probe round trip: median %.3f ms, 99th percentile %.3f ms, max %.3f ms; %ld of %lu PINGs lost\n",
+            latency_percentile(round_trip, 50) / 1e6,
+            latency_percentile(round_trip, 99) / 1e6,
+            atomic_load(&round_trip->max) / 1e6,
+            lost,
+            (size_t) (lost + atomic_load(&round_trip->count))
+        );
+    }
+    if (nflooders > 0) {
+        printf("  The relay answered %.0f of each flooder's PINGs per second\n", (double) answered / nflooders / (FLOOD_MS / 1000.0));
+    }
+
+    free(round_trip);
+    free(flooders);
+
+    return 0;
+}
+
+// Measures the probe's round trips to a relay that nobody floods, then to
+// relays that nflooders clients flood, without and with rate limits
+static int bench_flood(int port, size_t nflooders) {
+    int result = bench_flood_round(port, 0, true, "Nobody flooding");
+
+    if (result == 0) {
+        result = bench_flood_round(port + 1, nflooders, false, "Flooding, rate limits off");
+    }
+    if (result == 0) {
+        result = bench_flood_round(port + 2, nflooders, true, "Flooding, default rate limits");
+    }
+
+    return result;
+}
+
+int main(int argc, char **argv) {
+    size_t idle = DEFAULT_IDLE;
+    size_t flooders = 0;
+    int port = DEFAULT_PORT;
+    struct rlimit files;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:f:p:")) > 0) {
+        switch (opt) {
+            case 'i':
+                idle = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                flooders = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                port = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i CLIENTS | -f FLOODERS] [-p PORT]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (idle == 0 || idle > RELAY_MAX_CONNECTIONS || flooders > RELAY_MAX_CONNECTIONS || port < PORT_MIN || port > PORT_MAX - 2) {
+        fputs("Error: Invalid client count or port\n", stderr);
+        return 1;
+    }
+
+    if (flooders > 0) {
+        return bench_flood(port, flooders);
+    }
+
+    // Both ends of every connection are open in this process
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+
+    if (2 * idle + SPARE_FILES > files.rlim_cur) {
+        fprintf(
+            stderr,
+            "Error: %lu clients need %lu open files, but only %lu are allowed (see ulimit -n)\n",
+            idle, 2 * idle + SPARE_FILES, (size_t) files.rlim_cur
+        );
+        return 1;
+    }
+
+    latency_trace *trace = latency_trace_create();
+    relay *relay = trace != NULL ? relay_create(port, BENCH_USERNAME, deliver_nothing, count_accepted, trace, NULL) : NULL;
+
+    if (relay == NULL || relay_start(relay) < 0) {
+        fputs("Error: Failed to start the relay\n", stderr);
+        return 2;
+    }
+
+    int result = bench_idle(relay, port, idle);
+
+    relay_stop(relay);
+    latency_trace_destroy(trace);
+
+    return result;
+}
@@ -0,0 +1,419 @@
+// render_bench - Measures the cost of rendering chat traffic with term_windows
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// render_bench runs term_windows headless: ncurses is pointed at the slave
+// end of a pseudo-terminal, and a drain thread reads (and counts) everything
+// written to the master end. Synthetic message streams are replayed into a
+// msg_window (printed line by line, scrolled ahead of each message, and added
+// whole both as they arrive and with refreshes deferred the way the chat
+// draws them), and keystrokes into an edit_window. For each stream the time
+// spent in term_windows, the bytes written to the terminal and the number of
+// refreshes are reported per message (or keystroke).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <pty.h>
+#include <chat.h>
+#include <term_windows.h>
+
+#define DEFAULT_MESSAGES 2000 // Messages replayed per stream
+#define DEFAULT_LINES 24
+#define DEFAULT_COLS 80
+#define EDIT_LINES 1 // The edit window sits on the last line of the screen
+#define DRAIN_BUFFER_SIZE 65536
+#define SETTLE_MS 20 // Output is complete once the pty is quiet this long
+#define FLUSH_MS 10 // Time between flushes of deferred refreshes
+#define BENCH_USERNAME "bench"
+
+typedef struct stream {
+    uint16_t length; // Length of each message
+    uint32_t rate; // Messages per second, or 0 to send them back-to-back
+} stream;
+
+static const uint16_t default_lengths[] = { 16, 70, MAX_MSG_SIZE - 1 };
+static const uint32_t default_rates[] = { 0, 1000 };
+
+static int master; // Our end of the pseudo-terminal
+static atomic_uint_fast64_t bytes_written; // Bytes ncurses has written to it
+static atomic_bool draining;
+static unsigned int nstreams; // Streams replayed so far, which seeds each one's text
+
+// Reads and discards everything written to the terminal, counting the bytes
+static void *drain_terminal(void *empty) {
+    char *buffer = malloc(DRAIN_BUFFER_SIZE);
+    struct pollfd pfd;
+
+    (void) empty; // Nothing is passed to the thread
+    pfd.fd = master;
+    pfd.events = POLLIN;
+
+    while (atomic_load(&draining)) {
+        if (poll(&pfd, 1, SETTLE_MS) > 0) {
+            ssize_t n = read(master, buffer, DRAIN_BUFFER_SIZE);
+
+            if (n > 0) {
+                atomic_fetch_add(&bytes_written, n);
+            }
+        }
+    }
+
+    free(buffer);
+    pthread_exit(NULL);
+}
+
+// Waits until everything written to the terminal so far has been counted and
+// returns the total
+static uint64_t settled_bytes() {
+    struct timespec settle = { 0, SETTLE_MS * 1000000 };
+    uint64_t before;
+
+    do {
+        before = atomic_load(&bytes_written);
+        nanosleep(&settle, NULL);
+    } while (atomic_load(&bytes_written) != before);
+
+    return before;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Sleeps until the given time
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = now_ns();
+
+    if (deadline > now) {
+        struct timespec ts = { (deadline - now) / 1000000000, (deadline - now) % 1000000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Fills text with length printable characters, broken into words
+static void make_text(char *text, uint16_t length, unsigned int *seed) {
+    for (uint16_t i = 0; i < length; i++) {
+        text[i] = rand_r(seed) % 6 == 0 ? ' ' : 'a' + rand_r(seed) % 26;
+    }
+    text[length] = '\0';
+}
+
+static void report(const char *kind, const stream *stream, uint64_t count, uint64_t elapsed_ns, uint64_t bytes, uint64_t refreshes) {
+    char rate[16];
+
+    if (stream->rate == 0) {
+        strcpy(rate, "flood");
+    } else {
+        snprintf(rate, sizeof(rate), "%u/s", stream->rate);
+    }
+
+    printf(
+        "%-9s %6u %8s %8lu %12.2f %12.1f %12.2f\n",
+        kind,
+        stream->length,
+        rate,
+        count,
+        elapsed_ns / 1000.0 / count,
+        (double) bytes / count,
+        (double) refreshes / count
+    );
+}
+
+// Replays count messages of the stream into win the way the chat displays
+// incoming messages: the message is printed on its own line, scrolling the
+// window once the bottom is reached
+static void replay_messages(msg_window *win, const stream *stream, uint64_t count) {
+    char text[MAX_MSG_SIZE];
+    char line[MAX_UNAME_SIZE + MAX_MSG_SIZE + 4];
+    unsigned int seed = ++nstreams;
+    uint64_t elapsed = 0;
+    uint64_t start_bytes = settled_bytes();
+    uint64_t start_refreshes = term_windows_refresh_count();
+    uint64_t next = now_ns();
+
+    for (uint64_t i = 0; i < count; i++) {
+        make_text(text, stream->length, &seed);
+        snprintf(line, sizeof(line), "<%s>: %s", BENCH_USERNAME, text);
+
+        if (stream->rate > 0) {
+            sleep_until(next);
+            next += 1000000000 / stream->rate;
+        }
+
+        uint64_t begin = now_ns();
+        msg_window_puts(win, line);
+        msg_window_move_v(win, 1);
+        msg_window_set_col(win, 0);
+        elapsed += now_ns() - begin;
+    }
+
+    report(
+        "message",
+        stream,
+        count,
+        elapsed,
+        settled_bytes() - start_bytes,
+        term_windows_refresh_count() - start_refreshes
+    );
+}
+
+// Replays count messages of the stream into win, scrolling up as many lines as
+// each message takes before printing it at the bottom of the window
+static void replay_scrolling(msg_window *win, const stream *stream, uint64_t count) {
+    char text[MAX_MSG_SIZE];
+    char line[MAX_UNAME_SIZE + MAX_MSG_SIZE + 4];
+    unsigned int seed = ++nstreams;
+    uint64_t elapsed = 0;
+    uint64_t start_bytes = settled_bytes();
+    uint64_t start_refreshes = term_windows_refresh_count();
+    uint64_t next = now_ns();
+
+    for (uint64_t i = 0; i < count; i++) {
+        make_text(text, stream->length, &seed);
+        snprintf(line, sizeof(line), "<%s>: %s", BENCH_USERNAME, text);
+
+        uint16_t nlines = (strlen(line) + win->ncols - 1) / win->ncols;
+
+        if (nlines > win->nlines) {
+            nlines = win->nlines;
+        }
+
+        if (stream->rate > 0) {
+            sleep_until(next);
+            next += 1000000000 / stream->rate;
+        }
+
+        uint64_t begin = now_ns();
+        msg_window_scroll(win, nlines);
+        msg_window_set_row(win, win->nlines - nlines);
+        msg_window_set_col(win, 0);
+        msg_window_puts(win, line);
+        elapsed += now_ns() - begin;
+    }
+
+    report(
+        "scroll",
+        stream,
+        count,
+        elapsed,
+        settled_bytes() - start_bytes,
+        term_windows_refresh_count() - start_refreshes
+    );
+}
+
+// Replays count messages of the stream into win with msg_window_add_line. If
+// deferred is true, refreshes are deferred and flushed every FLUSH_MS, as the
+// chat does between waits for input, so that messages arriving together are
+// drawn together
+static void replay_lines(msg_window *win, const stream *stream, uint64_t count, bool deferred) {
+    char text[MAX_MSG_SIZE];
+    char line[MAX_UNAME_SIZE + MAX_MSG_SIZE + 4];
+    unsigned int seed = ++nstreams;
+    uint64_t elapsed = 0;
+    uint64_t start_bytes = settled_bytes();
+    uint64_t start_refreshes = term_windows_refresh_count();
+    uint64_t next = now_ns();
+    uint64_t next_flush = next + FLUSH_MS * 1000000ULL;
+
+    term_windows_set_deferred(deferred);
+
+    for (uint64_t i = 0; i < count; i++) {
+        make_text(text, stream->length, &seed);
+        snprintf(line, sizeof(line), "<%s>: %s", BENCH_USERNAME, text);
+
+        if (stream->rate > 0) {
+            sleep_until(next);
+            next += 1000000000 / stream->rate;
+        }
+
+        uint64_t begin = now_ns();
+        msg_window_add_line(win, line);
+        if (deferred && begin >= next_flush) {
+            term_windows_flush();
+            next_flush = begin + FLUSH_MS * 1000000ULL;
+        }
+        elapsed += now_ns() - begin;
+    }
+
+    if (deferred) {
+        uint64_t begin = now_ns();
+        term_windows_flush();
+        elapsed += now_ns() - begin;
+        term_windows_set_deferred(false);
+    }
+
+    report(
+        deferred ? "deferred" : "line",
+        stream,
+        count,
+        elapsed,
+        settled_bytes() - start_bytes,
+        term_windows_refresh_count() - start_refreshes
+    );
+}
+
+// Types count messages of the stream into win a key at a time, clearing the
+// line after each one as if it had been sent
+static void replay_typing(edit_window *win, const stream *stream, uint64_t count) {
+    char text[MAX_MSG_SIZE];
+    unsigned int seed = ++nstreams;
+    uint64_t elapsed = 0;
+    uint64_t keystrokes = 0;
+    uint64_t start_bytes = settled_bytes();
+    uint64_t start_refreshes = term_windows_refresh_count();
+    uint64_t next = now_ns();
+
+    for (uint64_t i = 0; i < count; i++) {
+        make_text(text, stream->length, &seed);
+
+        for (uint16_t j = 0; j < stream->length; j++) {
+            if (stream->rate > 0) {
+                sleep_until(next);
+                next += 1000000000 / stream->rate;
+            }
+
+            uint64_t begin = now_ns();
+            edit_window_putc(win, text[j]);
+            elapsed += now_ns() - begin;
+            keystrokes++;
+        }
+
+        uint64_t begin = now_ns();
+        edit_window_set_col(win, 0);
+        edit_window_clrln(win);
+        elapsed += now_ns() - begin;
+    }
+
+    report(
+        "keystroke",
+        stream,
+        keystrokes,
+        elapsed,
+        settled_bytes() - start_bytes,
+        term_windows_refresh_count() - start_refreshes
+    );
+}
+
+int main(int argc, char **argv) {
+    uint64_t count = DEFAULT_MESSAGES;
+    uint16_t lines = DEFAULT_LINES, cols = DEFAULT_COLS;
+    const char *type = NULL;
+    long length = -1, rate = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:r:L:C:t:")) > 0) {
+        switch (opt) {
+            case 'n':
+                count = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                length = strtol(optarg, NULL, 10);
+                if (length <= 0 || length >= MAX_MSG_SIZE) {
+                    fprintf(stderr, "Message length must be between 1 and %d\n", MAX_MSG_SIZE - 1);
+                    return 1;
+                }
+                break;
+            case 'r':
+                rate = strtol(optarg, NULL, 10);
+                break;
+            case 'L':
+                lines = strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                cols = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                type = optarg;
+                break;
+            default:
+                fprintf(
+                    stderr,
+                    "Usage: %s [-n MESSAGES] [-l LENGTH] [-r RATE] [-L LINES] [-C COLS] [-t TERM]\n",
+                    argv[0]
+                );
+                return 1;
+        }
+    }
+
+    if (count == 0 || lines <= EDIT_LINES || cols == 0) {
+        fputs("Error: Invalid message count or terminal size\n", stderr);
+        return 1;
+    }
+
+    // Open a pseudo-terminal of the requested size for ncurses to draw on
+    int slave;
+    struct winsize size = { lines, cols, 0, 0 };
+    if (openpty(&master, &slave, NULL, NULL, &size) < 0) {
+        perror("In main - failed to open a pseudo-terminal");
+        return 2;
+    }
+
+    FILE *term_out = fdopen(slave, "w");
+    FILE *term_in = fdopen(dup(slave), "r");
+
+    pthread_t drainer;
+    atomic_store(&draining, true);
+    pthread_create(&drainer, NULL, drain_terminal, NULL);
+
+    if (term_windows_init_term(type, term_out, term_in) < 0) {
+        fprintf(stderr, "Error: Failed to set up terminal type %s\n", type != NULL ? type : getenv("TERM"));
+        return 3;
+    }
+
+    msg_window *msgs = msg_window_create(lines - EDIT_LINES, cols, 0, 0);
+    edit_window *edit = edit_window_create(EDIT_LINES, cols, lines - EDIT_LINES, 0);
+
+    size_t nlengths = length > 0 ? 1 : sizeof(default_lengths) / sizeof(default_lengths[0]);
+    size_t nrates = rate >= 0 ? 1 : sizeof(default_rates) / sizeof(default_rates[0]);
+
+    printf("Terminal %ux%u, %lu messages per stream\n", cols, lines, count);
+    printf(
+        "%-9s %6s %8s %8s %12s %12s %12s\n",
+        "kind", "length", "rate", "count", "us/each", "bytes/each", "refresh/each"
+    );
+
+    for (size_t i = 0; i < nlengths; i++) {
+        for (size_t j = 0; j < nrates; j++) {
+            stream stream = {
+                length > 0 ? length : default_lengths[i],
+                rate >= 0 ? rate : default_rates[j]
+            };
+
+            replay_messages(msgs, &stream, count);
+            replay_scrolling(msgs, &stream, count);
+            replay_lines(msgs, &stream, count, false);
+            replay_lines(msgs, &stream, count, true);
+            replay_typing(edit, &stream, count / stream.length + 1);
+        }
+    }
+
+    term_windows_end();
+
+    atomic_store(&draining, false);
+    pthread_join(drainer, NULL);
+
+    return 0;
+}
@@ -0,0 +1,662 @@
+// search_index.c - An inverted index over the chat history
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <chat.h>
+#include <search_index.h>
+
+#define INITIAL_TABLE_SIZE 1024 // Must be a power of two
+#define HISTORY_BLOCK_SIZE 65536 // Size of each block of retained messages
+#define MAX_VARINT_SIZE 10 // The most bytes a 64-bit varint can occupy
+
+// Marks the position of every SEARCH_SKIP_INTERVAL-th posting. base is the
+// sequence number of the posting just before the block (0 for the first
+// block), which is what the first delta in the block is relative to
+typedef struct skip_entry {
+    uint64_t base;
+    size_t offset;
+} skip_entry;
+
+typedef struct posting_list {
+    uint8_t *data; // Delta encoded sequence numbers, stored as varints
+    size_t size;
+    size_t capacity;
+
+    skip_entry *skips;
+    size_t nskips;
+    size_t skip_capacity;
+
+    uint64_t count; // Number of postings in the list
+    uint64_t last_seq; // The largest sequence number in the list
+} posting_list;
+
+typedef struct term_entry {
+    char *term; // NULL if the slot is empty
+    uint32_t hash;
+    posting_list postings;
+} term_entry;
+
+// Retained messages are packed back-to-back into large blocks as
+// "username\0msg\0" so that retaining a message does not cost a malloc
+typedef struct history_block {
+    struct history_block *next;
+    size_t used;
+    char data[HISTORY_BLOCK_SIZE];
+} history_block;
+
+// A run of consecutive messages along with the index of their terms. Only the
+// newest generation has messages added to it
+typedef struct generation {
+    term_entry *table; // NULL if the generation is unused
+    size_t table_size;
+    size_t nterms;
+
+    history_block *blocks; // The block currently being filled
+    char **messages; // messages[seq - first] points to the record for seq
+    uint64_t first; // The sequence number of the generation's first message
+    uint64_t nmessages;
+    uint64_t messages_capacity;
+} generation;
+
+struct search_index {
+    pthread_rwlock_t lock;
+
+    // Once the current generation is full, the previous one is dropped and
+    // the current one takes its place, so the oldest messages age out
+    // without anything being reindexed
+    generation current;
+    generation previous;
+    uint64_t generation_size; // The most messages in a generation
+};
+
+// A private copy of a posting list taken while the index was locked, along
+// with the state needed to walk it
+typedef struct posting_cursor {
+    uint8_t *data;
+    size_t size;
+    skip_entry *skips;
+    size_t nskips;
+    uint64_t count;
+
+    size_t offset;
+    size_t block; // The skip block offset currently lies in
+    uint64_t cur; // The posting the cursor is on
+    bool done;
+} posting_cursor;
+
+// FNV-1a
+static uint32_t hash_term(const char *term) {
+    uint32_t hash = 2166136261u;
+
+    while (*term != '\0') {
+        hash ^= (uint8_t) *term++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Splits text into lowercase alphanumeric terms. Calls add_term for every term
+// found. Stops early and returns false if add_term does
+static bool tokenize(const char *text, bool (*add_term)(const char *term, void *arg), void *arg) {
+    char term[SEARCH_MAX_TERM_SIZE + 1];
+    size_t len = 0;
+
+    for (;; text++) {
+        if (*text != '\0' && isalnum((unsigned char) *text)) {
+            if (len < SEARCH_MAX_TERM_SIZE) {
+                term[len++] = tolower((unsigned char) *text);
+            }
+            continue;
+        }
+
+        if (len > 0) {
+            term[len] = '\0';
+            len = 0;
+
+            if (!add_term(term, arg)) {
+                return false;
+            }
+        }
+
+        if (*text == '\0') {
+            return true;
+        }
+    }
+}
+
+static size_t varint_encode(uint8_t *out, uint64_t value) {
+    size_t n = 0;
+
+    while (value >= 0x80) {
+        out[n++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t) value;
+
+    return n;
+}
+
+static uint64_t varint_decode(const uint8_t *in, size_t *offset) {
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = in[(*offset)++];
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return value;
+}
+
+static term_entry *find_slot(term_entry *table, size_t table_size, const char *term, uint32_t hash) {
+    size_t i = hash & (table_size - 1);
+
+    while (table[i].term != NULL) {
+        if (table[i].hash == hash && strcmp(table[i].term, term) == 0) {
+            break;
+        }
+        i = (i + 1) & (table_size - 1);
+    }
+
+    return &table[i];
+}
+
+static bool grow_table(generation *gen) {
+    size_t new_size = gen->table_size * 2;
+    term_entry *new_table = calloc(new_size, sizeof(term_entry));
+
+    if (new_table == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < gen->table_size; i++) {
+        term_entry *old = &gen->table[i];
+
+        if (old->term != NULL) {
+            *find_slot(new_table, new_size, old->term, old->hash) = *old;
+        }
+    }
+
+    free(gen->table);
+    gen->table = new_table;
+    gen->table_size = new_size;
+
+    return true;
+}
+
+static bool posting_list_append(posting_list *list, uint64_t seq) {
+    if (list->size + MAX_VARINT_SIZE > list->capacity) {
+        size_t new_capacity = list->capacity > 0 ? list->capacity * 2 : 16;
+        uint8_t *new_data = realloc(list->data, new_capacity);
+
+        if (new_data == NULL) {
+            return false;
+        }
+
+        list->data = new_data;
+        list->capacity = new_capacity;
+    }
+
+    if (list->count % SEARCH_SKIP_INTERVAL == 0) {
+        if (list->nskips == list->skip_capacity) {
+            size_t new_capacity = list->skip_capacity > 0 ? list->skip_capacity * 2 : 4;
+            skip_entry *new_skips = realloc(list->skips, new_capacity * sizeof(skip_entry));
+
+            if (new_skips == NULL) {
+                return false;
+            }
+
+            list->skips = new_skips;
+            list->skip_capacity = new_capacity;
+        }
+
+        list->skips[list->nskips].base = list->last_seq;
+        list->skips[list->nskips].offset = list->size;
+        list->nskips++;
+    }
+
+    list->size += varint_encode(list->data + list->size, seq - list->last_seq);
+    list->last_seq = seq;
+    list->count++;
+
+    return true;
+}
+
+// Context for index_term, which is called by tokenize while adding a message
+typedef struct add_context {
+    generation *gen;
+    uint64_t seq;
+} add_context;
+
+static bool index_term(const char *term, void *arg) {
+    add_context *ctx = arg;
+    generation *gen = ctx->gen;
+
+    // Keep the table at most 70% full so probe sequences stay short
+    if ((gen->nterms + 1) * 10 > gen->table_size * 7 && !grow_table(gen)) {
+        return false;
+    }
+
+    uint32_t hash = hash_term(term);
+    term_entry *entry = find_slot(gen->table, gen->table_size, term, hash);
+
+    if (entry->term == NULL) {
+        entry->term = strdup(term);
+
+        if (entry->term == NULL) {
+            return false;
+        }
+
+        entry->hash = hash;
+        gen->nterms++;
+    }
+
+    // The term occurred earlier in the same message
+    if (entry->postings.count > 0 && entry->postings.last_seq == ctx->seq) {
+        return true;
+    }
+
+    return posting_list_append(&entry->postings, ctx->seq);
+}
+
+static char *retain_message(generation *gen, const char *username, const char *msg) {
+    size_t u_len = strnlen(username, MAX_UNAME_SIZE - 1);
+    size_t m_len = strnlen(msg, MAX_MSG_SIZE - 1);
+
+    // Messages read with fgets carry their newline; there is no need to keep it
+    if (m_len > 0 && msg[m_len - 1] == '\n') {
+        m_len--;
+    }
+
+    size_t needed = u_len + m_len + 2;
+
+    if (gen->blocks == NULL || gen->blocks->used + needed > HISTORY_BLOCK_SIZE) {
+        history_block *block = malloc(sizeof(history_block));
+
+        if (block == NULL) {
+            return NULL;
+        }
+
+        block->next = gen->blocks;
+        block->used = 0;
+        gen->blocks = block;
+    }
+
+    char *record = gen->blocks->data + gen->blocks->used;
+    memcpy(record, username, u_len);
+    record[u_len] = '\0';
+    memcpy(record + u_len + 1, msg, m_len);
+    record[u_len + m_len + 1] = '\0';
+    gen->blocks->used += needed;
+
+    return record;
+}
+
+// Sets up an empty generation whose first message will be first. Returns
+// false if memory could not be allocated
+static bool init_generation(generation *gen, uint64_t first) {
+    memset(gen, 0, sizeof(generation));
+    gen->table = calloc(INITIAL_TABLE_SIZE, sizeof(term_entry));
+
+    if (gen->table == NULL) {
+        return false;
+    }
+
+    gen->table_size = INITIAL_TABLE_SIZE;
+    gen->first = first;
+
+    return true;
+}
+
+// Frees everything in the generation and leaves it unused
+static void free_generation(generation *gen) {
+    for (size_t i = 0; i < gen->table_size; i++) {
+        if (gen->table[i].term != NULL) {
+            free(gen->table[i].term);
+            free(gen->table[i].postings.data);
+            free(gen->table[i].postings.skips);
+        }
+    }
+    free(gen->table);
+
+    while (gen->blocks != NULL) {
+        history_block *next = gen->blocks->next;
+        free(gen->blocks);
+        gen->blocks = next;
+    }
+    free(gen->messages);
+
+    memset(gen, 0, sizeof(generation));
+}
+
+// Returns the record for message seq, or NULL if it is not retained
+static const char *find_message(search_index *index, uint64_t seq) {
+    generation *gens[] = { &index->previous, &index->current };
+
+    for (size_t i = 0; i < 2; i++) {
+        if (seq >= gens[i]->first && seq - gens[i]->first < gens[i]->nmessages) {
+            return gens[i]->messages[seq - gens[i]->first];
+        }
+    }
+
+    return NULL;
+}
+
+search_index *search_index_create(uint64_t max_messages) {
+    search_index *index = calloc(1, sizeof(search_index));
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    if (!init_generation(&index->current, 1)) {
+        free(index);
+        return NULL;
+    }
+
+    index->generation_size = max_messages > 1 ? max_messages / 2 : 1;
+    pthread_rwlock_init(&index->lock, NULL);
+
+    return index;
+}
+
+void search_index_destroy(search_index *index) {
+    free_generation(&index->current);
+    free_generation(&index->previous);
+
+    pthread_rwlock_destroy(&index->lock);
+    free(index);
+}
+
+uint64_t search_index_add(search_index *index, const char *username, const char *msg) {
+    generation *gen = &index->current;
+    uint64_t seq = 0;
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    if (gen->nmessages == index->generation_size) {
+        generation next;
+
+        if (!init_generation(&next, gen->first + gen->nmessages)) {
+            goto unlock;
+        }
+
+        free_generation(&index->previous);
+        index->previous = *gen;
+        *gen = next;
+    }
+
+    if (gen->nmessages == gen->messages_capacity) {
+        uint64_t new_capacity = gen->messages_capacity > 0 ? gen->messages_capacity * 2 : 1024;
+
+        if (new_capacity > index->generation_size) {
+            new_capacity = index->generation_size;
+        }
+
+        char **new_messages = realloc(gen->messages, new_capacity * sizeof(char*));
+
+        if (new_messages == NULL) {
+            goto unlock;
+        }
+
+        gen->messages = new_messages;
+        gen->messages_capacity = new_capacity;
+    }
+
+    char *record = retain_message(gen, username, msg);
+
+    if (record == NULL) {
+        goto unlock;
+    }
+
+    gen->messages[gen->nmessages] = record;
+    seq = gen->first + gen->nmessages++;
+
+    // Only the message text is indexed; the username is skipped over
+    add_context ctx = { gen, seq };
+    tokenize(record + strlen(record) + 1, index_term, &ctx);
+
+unlock:
+    pthread_rwlock_unlock(&index->lock);
+
+    return seq;
+}
+
+// Context for collect_term, which is called by tokenize while parsing a query
+typedef struct query_context {
+    char terms[SEARCH_MAX_TERMS][SEARCH_MAX_TERM_SIZE + 1];
+    size_t nterms;
+} query_context;
+
+static bool collect_term(const char *term, void *arg) {
+    query_context *ctx = arg;
+
+    for (size_t i = 0; i < ctx->nterms; i++) {
+        if (strcmp(ctx->terms[i], term) == 0) {
+            return true;
+        }
+    }
+
+    if (ctx->nterms == SEARCH_MAX_TERMS) {
+        return false;
+    }
+
+    strcpy(ctx->terms[ctx->nterms++], term);
+
+    return true;
+}
+
+// Moves the cursor to the first posting that is >= target. Returns false if
+// there is no such posting
+static bool cursor_seek(posting_cursor *cursor, uint64_t target) {
+    if (cursor->done) {
+        return false;
+    }
+    if (cursor->cur >= target) {
+        return true;
+    }
+
+    // Every posting before the last block whose base is below target is
+    // itself below target, so those blocks can be skipped without decoding
+    size_t lo = cursor->block + 1, hi = cursor->nskips;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (cursor->skips[mid].base < target) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo - 1 > cursor->block) {
+        cursor->block = lo - 1;
+        cursor->offset = cursor->skips[cursor->block].offset;
+        cursor->cur = cursor->skips[cursor->block].base;
+    }
+
+    while (cursor->cur < target) {
+        if (cursor->offset >= cursor->size) {
+            cursor->done = true;
+            return false;
+        }
+
+        if (cursor->block + 1 < cursor->nskips && cursor->offset == cursor->skips[cursor->block + 1].offset) {
+            cursor->block++;
+        }
+        cursor->cur += varint_decode(cursor->data, &cursor->offset);
+    }
+
+    return true;
+}
+
+static int compare_cursors(const void *a, const void *b) {
+    const posting_cursor *x = a, *y = b;
+
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+// Takes private copies of gen's posting lists for the terms of query, so that
+// the intersection can run without holding the lock. Returns false if the
+// generation has no messages holding one of the terms
+static bool copy_postings(generation *gen, query_context *query, posting_cursor *cursors) {
+    if (gen->nmessages == 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < query->nterms; i++) {
+        const char *term = query->terms[i];
+        term_entry *entry = find_slot(gen->table, gen->table_size, term, hash_term(term));
+        posting_list *list = &entry->postings;
+
+        if (entry->term == NULL) {
+            return false;
+        }
+
+        cursors[i].data = malloc(list->size);
+        cursors[i].skips = malloc(list->nskips * sizeof(skip_entry));
+
+        if (cursors[i].data == NULL || cursors[i].skips == NULL) {
+            return false;
+        }
+
+        memcpy(cursors[i].data, list->data, list->size);
+        memcpy(cursors[i].skips, list->skips, list->nskips * sizeof(skip_entry));
+        cursors[i].size = list->size;
+        cursors[i].nskips = list->nskips;
+        cursors[i].count = list->count;
+    }
+
+    return true;
+}
+
+// Intersects the nterms posting lists behind cursors. Matches arrive oldest
+// first; the newest max_results of them are kept in results as a ring, with
+// *nmatches counting every match
+static void intersect(posting_cursor *cursors, size_t nterms, uint64_t *results, size_t max_results, int64_t *nmatches) {
+    // Drive the intersection from the rarest term; the others are only ever
+    // probed for the candidates it produces
+    qsort(cursors, nterms, sizeof(posting_cursor), compare_cursors);
+
+    uint64_t candidate = 1;
+    while (cursor_seek(&cursors[0], candidate)) {
+        candidate = cursors[0].cur;
+
+        size_t i;
+        for (i = 1; i < nterms; i++) {
+            if (!cursor_seek(&cursors[i], candidate)) {
+                return;
+            }
+            if (cursors[i].cur != candidate) {
+                break;
+            }
+        }
+
+        if (i == nterms) {
+            if (max_results > 0) {
+                results[*nmatches % max_results] = candidate;
+            }
+            (*nmatches)++;
+            candidate++;
+        } else {
+            candidate = cursors[i].cur;
+        }
+    }
+}
+
+int64_t search_index_query(search_index *index, const char *terms, uint64_t *results, size_t max_results) {
+    query_context query;
+    posting_cursor cursors[2][SEARCH_MAX_TERMS];
+    bool found[2];
+    int64_t nmatches = 0;
+
+    query.nterms = 0;
+    tokenize(terms, collect_term, &query);
+
+    if (query.nterms == 0) {
+        return -1;
+    }
+
+    memset(cursors, 0, sizeof(cursors));
+
+    // The previous generation holds the older messages, so goes first
+    pthread_rwlock_rdlock(&index->lock);
+    found[0] = copy_postings(&index->previous, &query, cursors[0]);
+    found[1] = copy_postings(&index->current, &query, cursors[1]);
+    pthread_rwlock_unlock(&index->lock);
+
+    for (size_t i = 0; i < 2; i++) {
+        if (found[i]) {
+            intersect(cursors[i], query.nterms, results, max_results, &nmatches);
+        }
+    }
+
+    // Put the ring of matches in order, newest first
+    if (max_results > 0 && nmatches > 0) {
+        size_t kept = nmatches < (int64_t) max_results ? (size_t) nmatches : max_results;
+        uint64_t ordered[kept];
+
+        for (size_t i = 0; i < kept; i++) {
+            ordered[i] = results[(nmatches - 1 - i) % max_results];
+        }
+        memcpy(results, ordered, kept * sizeof(uint64_t));
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        for (size_t j = 0; j < query.nterms; j++) {
+            free(cursors[i][j].data);
+            free(cursors[i][j].skips);
+        }
+    }
+
+    return nmatches;
+}
+
+int8_t search_index_get(search_index *index, uint64_t seq, char *username, char *msg) {
+    int8_t result = -1;
+
+    pthread_rwlock_rdlock(&index->lock);
+    const char *record = find_message(index, seq);
+
+    if (record != NULL) {
+        size_t u_len = strlen(record);
+
+        memcpy(username, record, u_len + 1);
+        strcpy(msg, record + u_len + 1);
+        result = 0;
+    }
+    pthread_rwlock_unlock(&index->lock);
+
+    return result;
+}
+
+uint64_t search_index_count(search_index *index) {
+    uint64_t count;
+
+    pthread_rwlock_rdlock(&index->lock);
+    count = index->previous.nmessages + index->current.nmessages;
+    pthread_rwlock_unlock(&index->lock);
+
+    return count;
+}
@@ -0,0 +1,724 @@
+// session.c - A client's session with a host
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <chat.h>
+#include <frame.h>
+#include <outbox.h>
+#include <file_transfer.h>
+#include <session.h>
+
+#define MAX_NOTICE_SIZE 128
+#define SESSION_MAX_UNACKED 64 // Our messages kept until the host acknowledges them
+#define SESSION_ACK_EVERY 32 // Messages received between our ACKs
+#define SESSION_ACK_MS 250 // The longest a received message goes unacknowledged
+#define SESSION_RETRY_MIN_MS 250 // The first wait before reconnecting
+#define SESSION_RETRY_MAX_MS 8000 // The longest wait between attempts to reconnect
+#define SESSION_HANDSHAKE_MS 2000 // The longest connecting and greeting may take
+#define SESSION_READ_QUANTUM 8192 // Bytes read from the host before others get a turn
+
+// Where the session is with its connection
+#define SESSION_CLOSED 0 // Not connected, and not trying to be
+#define SESSION_CONNECTED 1
+#define SESSION_WAITING 2 // Waiting to try (again)
+#define SESSION_CONNECTING 3 // A new connection is being made
+#define SESSION_GREETING 4 // Our HELLO went out over the new connection
+
+// A message we sent, in case it has to be sent again
+typedef struct unacked_message {
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + MAX_MSG_SIZE];
+} unacked_message;
+
+struct session {
+    int remote; // -1 until connected
+    int wakeup; // Written to when frames are queued from other threads
+    char username[MAX_UNAME_SIZE];
+    char r_username[MAX_UNAME_SIZE];
+    char remote_ip[INET_ADDRSTRLEN];
+
+    // Getting to the host, and back to it after the connection drops
+    struct sockaddr_in address; // Where the host is
+    uint8_t state;
+    bool established; // Whether the host has ever accepted us
+    uint64_t deadline; // When the current wait or attempt runs out
+    uint64_t lost_at; // When the connection dropped
+    int retry_ms; // The wait before the next attempt
+
+    // Sequence numbers (see frame.h). The session token is 0 if the host
+    // cannot resume sessions
+    uint64_t token;
+    uint64_t received; // The host's last message we received
+    uint64_t received_acked; // received as of the last ACK we sent
+    uint64_t ack_due; // When received has to be acknowledged, or 0 if it has been
+    uint64_t sent; // Our last message
+    uint64_t acked; // Our last message the host acknowledged
+    unacked_message unacked[SESSION_MAX_UNACKED]; // Message n is at n % SESSION_MAX_UNACKED
+    int presence_state; // Our user's last presence, or -1
+
+    session_message_fn message;
+    session_notice_fn notice;
+    void *ctx; // Passed to message and notice
+    latency_trace *trace;
+
+    char *download_dir; // Where files the host sends are saved
+    file_receiver *downloads; // Files the host is sending us; NULL until one arrives
+    presence_table *presence; // Who the host says is online
+
+    pthread_mutex_t send_lock; // Guards outgoing
+    outbox *outgoing; // Frames waiting to be sent to the host
+
+    frame_reader in; // What has arrived of the host's next frame
+};
+
+// Where the frames of a file being sent to the host go. Freed by the transfer
+typedef struct session_file {
+    session *session;
+} session_file;
+
+// Passes on the notices of files the host sends us
+static void file_received_notice(void *ctx, const char *notice) {
+    session *session = ctx;
+
+    session->notice(session->ctx, notice);
+}
+
+// Passes on the notices of files we send to the host
+static void file_sent_notice(void *ctx, const char *notice) {
+    session *session = ((session_file*) ctx)->session;
+
+    session->notice(session->ctx, notice);
+}
+
+session *session_create(const char *username, const char *download_dir, latency_trace *trace, session_message_fn message, session_notice_fn notice, void *ctx) {
+    session *session = calloc(1, sizeof(struct session));
+
+    if (session == NULL) {
+        return NULL;
+    }
+
+    session->remote = -1;
+    session->presence_state = -1;
+    strncpy(session->username, username, MAX_UNAME_SIZE - 1);
+    session->message = message;
+    session->notice = notice;
+    session->ctx = ctx;
+    session->trace = trace;
+    pthread_mutex_init(&session->send_lock, NULL);
+
+    session->wakeup = eventfd(0, EFD_NONBLOCK);
+    session->download_dir = strdup(download_dir);
+    session->presence = presence_table_create(PRESENCE_MAX_USERS);
+    session->outgoing = outbox_create(OUTBOX_MAX_BYTES);
+
+    if (session->wakeup < 0 || session->download_dir == NULL || session->presence == NULL
+        || session->outgoing == NULL) {
+        session_destroy(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+void session_destroy(session *session) {
+    if (session->wakeup >= 0) {
+        close(session->wakeup);
+    }
+    if (session->downloads != NULL) {
+        file_receiver_destroy(session->downloads);
+    }
+    free(session->download_dir);
+    if (session->presence != NULL) {
+        presence_table_destroy(session->presence);
+    }
+    if (session->outgoing != NULL) {
+        outbox_destroy(session->outgoing);
+    }
+
+    pthread_mutex_destroy(&session->send_lock);
+    free(session);
+}
+
+// Introduces ourselves to the host over the new connection, asking to resume
+// our session if we have one
+static int8_t send_hello(session *session) {
+    frame_header hello;
+    uint8_t payload[MAX_UNAME_SIZE + FRAME_RESUME_SIZE];
+
+    frame_init_hello(&hello, payload, FRAME_HELLO_CLIENT, session->username, session->token, session->received);
+
+    return frame_send(session->remote, &hello, payload);
+}
+
+// Receives what the host has sent of its HELLO. Returns 1 if the host resumed
+// our session, 0 if it started a new one, FRAME_PENDING if the rest of the
+// HELLO has yet to arrive or -1 if the host did not complete the handshake.
+// The last of our messages the host received is left in *seq
+static int8_t recv_hello(session *session, uint64_t *seq) {
+    frame_reader *in = &session->in;
+    int8_t result = frame_reader_recv(in, session->remote);
+
+    if (result == FRAME_PENDING) {
+        return FRAME_PENDING;
+    }
+    if (result <= 0 || in->header.type != FRAME_HELLO) {
+        return -1;
+    }
+
+    frame_split_message(&in->header, in->payload, session->r_username, NULL);
+    frame_split_resume(&in->header, in->payload, &session->token, seq);
+    frame_reader_next(in);
+
+    return (in->header.flags & FRAME_HELLO_RESUMED) != 0 ? 1 : 0;
+}
+
+// Closes the connection and waits before trying a new one, backing off
+// exponentially
+static void retry_later(session *session) {
+    if (session->remote >= 0) {
+        close(session->remote);
+        session->remote = -1;
+    }
+    frame_reader_next(&session->in);
+
+    // The first connection is tried for as long as it takes, but our user is
+    // told if it is not made straight away
+    if (!session->established && session->retry_ms == SESSION_RETRY_MIN_MS) {
+        char notice[MAX_NOTICE_SIZE];
+
+        snprintf(notice, MAX_NOTICE_SIZE, "Could not connect to %s (%s); retrying", session->r_username, session->remote_ip);
+        session->notice(session->ctx, notice);
+    }
+
+    session->state = SESSION_WAITING;
+    session->deadline = frame_monotonic_now() + session->retry_ms * 1000000ULL;
+    session->retry_ms = session->retry_ms * 2 < SESSION_RETRY_MAX_MS ? session->retry_ms * 2 : SESSION_RETRY_MAX_MS;
+}
+
+// Starts a new connection to the host without waiting for it to be made
+static void start_connecting(session *session) {
+    session->remote = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, DEFAULT_PROTOCOL);
+
+    if (session->remote < 0
+        || (connect(session->remote, (struct sockaddr*) &session->address, sizeof(session->address)) < 0
+            && errno != EINPROGRESS)) {
+        retry_later(session);
+        return;
+    }
+
+    session->state = SESSION_CONNECTING;
+    session->deadline = frame_monotonic_now() + SESSION_HANDSHAKE_MS * 1000000ULL;
+}
+
+int8_t session_connect(session *session, const char *address, const char *service) {
+    struct addrinfo *remote_addr, hint;
+
+    // Give the sockets API hints about the address we are attempting to obtain
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_INET;
+    hint.ai_socktype = SOCK_STREAM;
+
+    // Obtain the host address
+    int result = getaddrinfo(address, service, &hint, &remote_addr);
+
+    if (result != 0) {
+        fprintf(stderr, "Error obtaining address: %s\n", gai_strerror(result));
+        return -1;
+    }
+
+    // Kept for reconnecting
+    memcpy(&session->address, remote_addr->ai_addr, sizeof(struct sockaddr_in));
+    freeaddrinfo(remote_addr);
+
+    // The host goes by the address it was given until it tells us its name
+    inet_ntop(AF_INET, &session->address.sin_addr, session->remote_ip, INET_ADDRSTRLEN);
+    strncpy(session->r_username, address, MAX_UNAME_SIZE - 1);
+
+    // The connection is made, and the handshake completed, by session_handle
+    session->retry_ms = SESSION_RETRY_MIN_MS;
+    start_connecting(session);
+
+    return 0;
+}
+
+bool session_established(session *session) {
+    return session->established;
+}
+
+const char *session_remote_name(session *session) {
+    return session->r_username;
+}
+
+const char *session_remote_ip(session *session) {
+    return session->remote_ip;
+}
+
+presence_table *session_presence(session *session) {
+    return session->presence;
+}
+
+// Queues a frame for the host. Frames are sent, control frames first, as the
+// connection can take them
+static int8_t send_frame(session *session, const frame_header *header, const void *payload) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&session->send_lock);
+    int8_t result = outbox_push(session->outgoing, header, payload);
+    pthread_mutex_unlock(&session->send_lock);
+
+    write(session->wakeup, &one, sizeof(one));
+
+    return result;
+}
+
+// Queues a frame of a file transfer for the host
+static int8_t send_file_frame(void *ctx, const frame_header *header, const void *payload, int file_fd, off_t offset) {
+    session *session = ((session_file*) ctx)->session;
+    uint64_t one = 1;
+
+    if (file_fd < 0) {
+        return send_frame(session, header, payload);
+    }
+
+    pthread_mutex_lock(&session->send_lock);
+    int8_t result = outbox_push_file(session->outgoing, header, file_fd, offset);
+    pthread_mutex_unlock(&session->send_lock);
+
+    write(session->wakeup, &one, sizeof(one));
+
+    return result;
+}
+
+void session_poll_fds(session *session, struct pollfd *pfds) {
+    // Only wait for the socket to be writable if there is something to write
+    // to it
+    pthread_mutex_lock(&session->send_lock);
+    pfds[0].fd = session->remote;
+    pfds[0].events = POLLIN | (outbox_pending(session->outgoing) ? POLLOUT : 0);
+    pthread_mutex_unlock(&session->send_lock);
+
+    // While reconnecting, wait for the connection to be made and then for the
+    // host's HELLO
+    if (session->state == SESSION_CONNECTING) {
+        pfds[0].events = POLLOUT;
+    } else if (session->state == SESSION_GREETING) {
+        pfds[0].events = POLLIN;
+    }
+
+    pfds[1].fd = session->wakeup;
+    pfds[1].events = POLLIN;
+}
+
+// Acknowledges every message received from the host so far
+static void send_ack(session *session) {
+    frame_header ack;
+
+    memset(&ack, 0, sizeof(ack));
+    ack.type = FRAME_ACK;
+    ack.id = session->received_acked = session->received;
+    session->ack_due = 0;
+    send_frame(session, &ack, NULL);
+}
+
+// Handles a frame of a file the host is sending us, whose payload (other
+// than a chunk's) is in session->in. Returns as receive_frame does
+static ssize_t receive_file(session *session) {
+    frame_reader *in = &session->in;
+    frame_header ack;
+
+    // File data goes straight from the socket to disk. Most hosts never send
+    // files, so the receiver is only set up once one does, and only kept
+    // while files are coming in
+    if (session->downloads == NULL) {
+        session->downloads = file_receiver_create(session->download_dir, file_received_notice, session);
+    }
+    if (session->downloads == NULL) {
+        perror("In receive_file: ");
+        return -2;
+    }
+
+    // The rest of a chunk is picked up once poll says it has arrived
+    int8_t result = file_receiver_handle(session->downloads, session->remote, &in->header, in->payload, &ack);
+
+    if (result == FRAME_PENDING) {
+        return 0;
+    }
+    if (result < 0) {
+        return -2;
+    }
+
+    if (result > 0) {
+        send_frame(session, &ack, NULL);
+    }
+    if (file_receiver_idle(session->downloads)) {
+        file_receiver_destroy(session->downloads);
+        session->downloads = NULL;
+    }
+    frame_reader_next(in);
+
+    return FRAME_HEADER_SIZE + 8 * in->header.nhops + in->header.length;
+}
+
+// Picks out the transfers of files to session's host
+static bool sent_by(void *ctx, void *session) {
+    return ((session_file*) ctx)->session == session;
+}
+
+// Reads what the host has sent of its next frame, and handles the frame once
+// all of it has arrived. Returns the size of the frame handled, 0 if the rest
+// of it has yet to arrive, -1 if the host left or -2 if the connection dropped
+static ssize_t receive_frame(session *session) {
+    frame_reader *in = &session->in;
+    char sender_name[MAX_UNAME_SIZE];
+    char msg[MAX_MSG_SIZE];
+    int8_t result = frame_reader_recv(in, session->remote);
+    uint64_t received_at = frame_now();
+
+    if (result == FRAME_PENDING) {
+        return 0;
+    }
+
+    // The host went away, either by saying so or by dropping the connection
+    if (result <= 0) {
+        return -2;
+    }
+    if (in->header.type >= FRAME_FILE_START && in->header.type <= FRAME_FILE_END) {
+        return receive_file(session);
+    }
+
+    frame_header header = in->header;
+
+    frame_reader_next(in);
+    if (header.type == FRAME_QUIT) {
+        return -1;
+    }
+
+    // Answer the host's pings, and report the answers to ours
+    if (header.type == FRAME_PING) {
+        header.type = FRAME_PONG;
+        header.length = 0;
+        send_frame(session, &header, NULL);
+    } else if (header.type == FRAME_PONG) {
+        uint64_t round_trip = frame_monotonic_now() - header.id;
+        char notice[MAX_NOTICE_SIZE];
+
+        latency_record(&session->trace->round_trip, round_trip);
+        snprintf(notice, MAX_NOTICE_SIZE, "Round trip to %s: %.3f ms", session->r_username, round_trip / 1e6);
+        session->notice(session->ctx, notice);
+    } else if (header.type == FRAME_FILE_ACK) {
+        file_transfer_ack(header.id, sent_by, session);
+    } else if (header.type == FRAME_ACK) {
+        if (header.id > session->acked && header.id <= session->sent) {
+            session->acked = header.id;
+        }
+    } else if (header.type == FRAME_PRESENCE) {
+        presence_table_apply(session->presence, in->payload, header.length, NULL);
+    } else if (header.type == FRAME_MESSAGE && (header.flags & FRAME_MESSAGE_NOTICE)) {
+        frame_split_message(&header, in->payload, sender_name, msg);
+        session->notice(session->ctx, msg);
+    } else if (header.type == FRAME_MESSAGE && (header.id == 0 || header.id > session->received)) {
+        latency_trace_record(session->trace, &header, received_at);
+        frame_split_message(&header, in->payload, sender_name, msg);
+        session->message(session->ctx, sender_name, msg);
+
+        if (header.id > session->received) {
+            session->received = header.id;
+        }
+
+        // Acknowledged in batches, or after SESSION_ACK_MS if the chat goes
+        // quiet before a batch fills up
+        if (session->received - session->received_acked >= SESSION_ACK_EVERY) {
+            send_ack(session);
+        } else if (session->ack_due == 0 && session->received > session->received_acked) {
+            session->ack_due = frame_monotonic_now() + SESSION_ACK_MS * 1000000ULL;
+        }
+    }
+
+    return FRAME_HEADER_SIZE + 8 * header.nhops + header.length;
+}
+
+// Starts reconnecting after the connection dropped. Returns 0, or -1 if the
+// host cannot resume sessions and has to be treated as gone
+static int8_t connection_lost(session *session) {
+    char notice[MAX_NOTICE_SIZE];
+
+    if (session->token == 0) {
+        return -1;
+    }
+
+    // Transfers in either direction are cut off; the host discards the rest
+    // of them when our connection drops
+    file_transfer_stop_matching(sent_by, session);
+    if (session->downloads != NULL) {
+        file_receiver_destroy(session->downloads);
+        session->downloads = NULL;
+    }
+
+    snprintf(notice, MAX_NOTICE_SIZE, "Lost connection to %s (%s); reconnecting", session->r_username, session->remote_ip);
+    session->notice(session->ctx, notice);
+
+    session->lost_at = frame_monotonic_now();
+    session->retry_ms = SESSION_RETRY_MIN_MS;
+    retry_later(session);
+
+    return 0;
+}
+
+// Starts the session over the new connection, or picks it back up. Everything
+// queued for the old one is thrown away; our messages the host did not receive
+// (up to seq) are sent again, along with our presence
+static void resume(session *session, bool resumed, uint64_t seq) {
+    char notice[MAX_NOTICE_SIZE];
+
+    // A new session starts from scratch; the host has none of our messages
+    if (!resumed) {
+        session->received = 0;
+        seq = 0;
+    }
+    session->received_acked = session->received;
+    session->ack_due = 0;
+
+    if (seq > session->acked && seq <= session->sent) {
+        session->acked = seq;
+    }
+
+    pthread_mutex_lock(&session->send_lock);
+    outbox_clear(session->outgoing);
+    for (uint64_t i = session->acked + 1; i <= session->sent; i++) {
+        unacked_message *unacked = &session->unacked[i % SESSION_MAX_UNACKED];
+        outbox_push(session->outgoing, &unacked->header, unacked->payload);
+    }
+    pthread_mutex_unlock(&session->send_lock);
+
+    if (session->presence_state >= 0) {
+        session_set_presence(session, session->presence_state);
+    }
+
+    session->state = SESSION_CONNECTED;
+
+    if (!session->established) {
+        session->established = true;
+        snprintf(notice, MAX_NOTICE_SIZE, "Connection established with %s (%s)", session->r_username, session->remote_ip);
+    } else if (resumed) {
+        snprintf(notice, MAX_NOTICE_SIZE, "Resumed session with %s (%s)", session->r_username, session->remote_ip);
+    } else {
+        snprintf(notice, MAX_NOTICE_SIZE, "Reconnected to %s (%s) as a new session", session->r_username, session->remote_ip);
+    }
+    session->notice(session->ctx, notice);
+}
+
+// Moves connecting along with whatever poll found on the connection being
+// made (if any). Returns 0, or -1 once SESSION_RESUME_MS have passed without
+// getting back to the host
+static int8_t reconnect(session *session, short revents) {
+    uint64_t now = frame_monotonic_now();
+
+    if (session->state == SESSION_CONNECTING && revents != 0) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        // The HELLO is small enough to go out at once on a new connection
+        getsockopt(session->remote, SOL_SOCKET, SO_ERROR, &error, &length);
+
+        if (error != 0 || send_hello(session) < 0) {
+            retry_later(session);
+        } else {
+            session->state = SESSION_GREETING;
+        }
+    } else if (session->state == SESSION_GREETING && revents != 0) {
+        uint64_t seq;
+        int8_t resumed = recv_hello(session, &seq);
+
+        if (resumed < 0) {
+            retry_later(session);
+        } else if (resumed != FRAME_PENDING) {
+            resume(session, resumed, seq);
+        }
+    }
+
+    // A host that trickles its HELLO in gets no longer than one that is silent
+    if (session->state == SESSION_CONNECTING || session->state == SESSION_GREETING) {
+        if (now >= session->deadline) {
+            retry_later(session);
+        }
+    } else if (session->state == SESSION_WAITING && now >= session->deadline) {
+        if (session->established && now - session->lost_at >= SESSION_RESUME_MS * 1000000ULL) {
+            return -1;
+        }
+        start_connecting(session);
+    }
+
+    return 0;
+}
+
+int8_t session_handle(session *session, const struct pollfd *pfds) {
+    if (pfds[1].revents & POLLIN) {
+        uint64_t count;
+        read(session->wakeup, &count, sizeof(count));
+    }
+
+    if (session->state != SESSION_CONNECTED) {
+        return reconnect(session, pfds[0].revents);
+    }
+
+    if (pfds[0].revents & POLLOUT) {
+        pthread_mutex_lock(&session->send_lock);
+        int8_t flushed = outbox_flush(session->outgoing, session->remote);
+        pthread_mutex_unlock(&session->send_lock);
+
+        if (flushed < 0) {
+            return connection_lost(session);
+        }
+    }
+
+    // Frames are read until the host has sent no more or its turn is up, so
+    // one busy host cannot hold up the others sharing the event loop
+    if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        ssize_t quantum = SESSION_READ_QUANTUM;
+
+        while (quantum > 0) {
+            ssize_t size = receive_frame(session);
+
+            if (size < 0) {
+                return size == -2 ? connection_lost(session) : -1;
+            }
+            if (size == 0) {
+                break;
+            }
+            quantum -= size;
+        }
+    }
+
+    if (session->ack_due != 0 && frame_monotonic_now() >= session->ack_due) {
+        send_ack(session);
+    }
+
+    return 0;
+}
+
+int session_timeout(session *session) {
+    if (session->state == SESSION_CLOSED || (session->state == SESSION_CONNECTED && session->ack_due == 0)) {
+        return -1;
+    }
+
+    uint64_t now = frame_monotonic_now();
+    uint64_t deadline = session->state == SESSION_CONNECTED ? session->ack_due : session->deadline;
+
+    return now >= deadline ? 0 : (deadline - now + 999999) / 1000000;
+}
+
+int8_t session_send_message(session *session, const char *msg) {
+    // Kept until the host acknowledges it, so no more are taken while the
+    // ring is full of messages the host may not have. Hosts that cannot
+    // resume sessions never need them again, once connected
+    if ((session->token != 0 || !session->established) && session->sent - session->acked >= SESSION_MAX_UNACKED) {
+        return -1;
+    }
+
+    unacked_message *unacked = &session->unacked[++session->sent % SESSION_MAX_UNACKED];
+
+    frame_init_message(&unacked->header, unacked->payload, session->username, msg);
+    unacked->header.id = session->sent;
+
+    // Anything queued while connecting is replaced by resume
+    if (session->state != SESSION_CONNECTED) {
+        return 0;
+    }
+
+    return send_frame(session, &unacked->header, unacked->payload);
+}
+
+void session_ping(session *session) {
+    frame_header ping;
+
+    memset(&ping, 0, sizeof(ping));
+    ping.type = FRAME_PING;
+    ping.id = frame_monotonic_now();
+    send_frame(session, &ping, NULL);
+}
+
+void session_set_presence(session *session, uint8_t state) {
+    frame_header header;
+    uint8_t payload[PRESENCE_ENTRY_SIZE + MAX_UNAME_SIZE];
+
+    session->presence_state = state;
+
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_PRESENCE;
+    header.length = presence_encode(payload, session->username, state, 0);
+    send_frame(session, &header, payload);
+}
+
+int8_t session_send_file(session *session, const char *path) {
+    if (session->state != SESSION_CONNECTED) {
+        return -1;
+    }
+
+    session_file *target = malloc(sizeof(session_file));
+
+    if (target == NULL) {
+        return -1;
+    }
+    target->session = session;
+
+    if (file_transfer_send(path, session->username, session->r_username, send_file_frame, target, file_sent_notice) < 0) {
+        free(target);
+        return -1;
+    }
+
+    return 0;
+}
+
+void session_close(session *session, bool say_quit) {
+    // Files still being sent would otherwise be cut off mid-frame
+    file_transfer_stop_matching(sent_by, session);
+
+    if (session->state != SESSION_CONNECTED) {
+        if (session->remote >= 0) {
+            close(session->remote);
+            session->remote = -1;
+        }
+        session->state = SESSION_CLOSED;
+        return;
+    }
+
+    if (say_quit) {
+        frame_header quit_frame;
+
+        memset(&quit_frame, 0, sizeof(quit_frame));
+        quit_frame.type = FRAME_QUIT;
+        send_frame(session, &quit_frame, NULL);
+    }
+
+    // Send whatever is still queued, including our QUIT, before closing
+    pthread_mutex_lock(&session->send_lock);
+    outbox_drain(session->outgoing, session->remote, DRAIN_MS);
+    pthread_mutex_unlock(&session->send_lock);
+
+    close(session->remote);
+    session->remote = -1;
+    session->state = SESSION_CLOSED;
+}
@@ -26,82 +26,195 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <getopt.h>
 #include <regex.h>
 #include <chat.h>
 #include <term_windows.h>
+#include <search_index.h>
+#include <transcript.h>
+#include <frame.h>
+#include <relay.h>
+#include <latency.h>
+#include <file_transfer.h>
+#include <presence.h>
+#include <session.h>
+#include <tabs.h>
 #include <limits.h>
 
 // TODO Improve option handling (e.g. add a USAGE statement)
 // TODO Can we daemonize a server
-//      --executor; -e  : Server host is not a user, only a relay
 //      --daemonize; -d : Host server runs in the background as a daemon?
 // TODO Look into security considerations
 // TODO Add color and formatting options
 // TODO Verify license stuff
 // TODO Improve commments and documenation
 
-int listener; // The socket that handles incoming connections
-int remote; // The socket connection to the client
-char *username; // The username for this client
-char *r_username; // The username for the remote server
-char *remote_ip; // The IPv4 address of the remote device
-
-bool was_last_sender; // Was this server the last entity to send a message?
-bool connection_established; // Are we connected with a client?
-
-void* receive_buffer; // Buffer that stores received messages
-void* send_buffer; // Buffer that stores the messages to send
-
-pthread_t receiver; // Thread responsible for receiving messages from the client
-pthread_t sender; // Thread responsible for sending messages to the client
-pthread_t handler; // Thread responsible for handling signals
-
-struct sigaction sig_action, def_action;
-sigset_t mask;
-
-void quit();
+// A host the client is connected to. It is the ctx of its session
+typedef struct host {
+    struct chat *chat;
+    session *session; // NULL once the connection is closed
+    bool labelled; // Whether its tab is labelled with the host's name
+} host;
+
+// A notice waiting for the event loop to show it
+typedef struct pending_notice {
+    struct pending_notice *next;
+    int tab; // Where it is shown
+    char text[];
+} pending_notice;
+
+// A relayed message waiting for the event loop to index it
+typedef struct pending_message {
+    struct pending_message *next;
+    char record[]; // "username\0msg\0"
+} pending_message;
+
+// Everything this run of the program is doing. It is handed to every
+// function that needs any of it, rather than living in globals
+typedef struct chat {
+    char username[MAX_UNAME_SIZE]; // Our user's name
+    bool is_executor; // Is this host only a relay, without a user of its own?
+    relay *node; // The relay that serves clients and peers (host only)
+    host hosts[TABS_MAX]; // The hosts we are connected to (client only)
+    size_t nhosts;
+    tabs *tabs; // Host i is shown in tab i, when connected with -c
+    search_index *history; // Searchable history of relayed messages (host only)
+    int indexing; // Written to when a message is queued for the index (host only)
+    pthread_mutex_t unindexed_lock; // Guards unindexed
+    pending_message *unindexed; // Oldest first
+    transcript_logger *logger; // Records the transcript when -t is given
+    latency_trace *latencies; // The latency of the messages we receive
+    presence_tracker tracker; // Whether our user is around
+    int signals; // Delivers SIGINT and SIGTERM to the event loop
+    int stop; // Written to once the relay has been handed over (host only)
+    int notify; // Written to when a notice is queued (tabs only)
+    pthread_mutex_t notices_lock; // Guards notices
+    pending_notice *notices; // Oldest first
+    char *output; // What a command printed, on its way to a tab
+    size_t output_size;
+    bool reading_input; // stdin has not been closed
+    bool running;
+} chat;
+
+void free_chat(chat *chat);
 void sig_handler(const int signo);
 void install_sig_handler();
-void wait_for_client_connection(const int port, const char *address);
-void wait_for_closed_connection();
-void setup_ui();
-void connect_to_host(const char *service, const char *address);
-void *send_messages(void* empty);
-void *receive_messages(void *empty);
+int open_signals();
+void run_chat(chat *chat);
+void end_chat(chat *chat, bool by_remote);
+int8_t setup_ui(chat *chat);
+void label_tab(chat *chat, size_t index);
+void read_input(chat *chat);
+void handle_line(chat *chat, const char *line);
+void close_tab(chat *chat);
+void host_left(chat *chat, size_t index);
+host *active_host(chat *chat);
+FILE *open_output(chat *chat);
+void close_output(chat *chat, FILE *out);
+void show_notices(chat *chat);
+void queue_for_index(chat *chat, const char *sender_name, const char *msg);
+void index_messages(chat *chat);
+void record_keystroke(void *ctx);
+bool run_command(chat *chat, const char *line);
+void search_history(chat *chat, const char *terms);
+void send_ping(chat *chat);
+void send_file(chat *chat, const char *path);
+void list_presence(chat *chat);
+void report_presence(chat *chat);
+void print_prompt(chat *chat);
+void deliver_message(void *ctx, const char *sender_name, const char *msg);
+void print_notice(void *ctx, const char *notice);
+void handed_over(void *ctx);
+void receive_message(void *ctx, const char *sender_name, const char *msg);
+void print_session_notice(void *ctx, const char *notice);
 
 int main(int argc, char **argv) {
     int port;
     char mode;
     char *address, *service;
-
-    // Install the signal handler for the intialization process. Once we
-    // connect to the client and spawn the send and receive threads, we switch
-    // to another method of signal handling that works better with
-    // multi-threading
+    char *transcript_path = NULL;
+    uint32_t sync_ms = TRANSCRIPT_DEFAULT_SYNC_MS;
+    uint64_t sync_bytes = TRANSCRIPT_DEFAULT_SYNC_BYTES;
+    char *links[RELAY_MAX_LINKS];
+    size_t nlinks = 0;
+    char *download_dir = "."; // Where received files are saved
+    char *upgrade_path = NULL; // Where the relay can be replaced, if anywhere
+    size_t budget = 0; // The relay's memory budget per connection, if given
+    long message_rate = -1; // Messages per second each client may send, if given
+    char *targets[TABS_MAX]; // Hosts to connect to, each in a tab of its own
+    size_t ntargets = 0;
+    chat chat;
+
+    memset(&chat, 0, sizeof(chat));
+    chat.signals = -1;
+    chat.stop = -1;
+    chat.notify = -1;
+    chat.indexing = -1;
+    pthread_mutex_init(&chat.notices_lock, NULL);
+    pthread_mutex_init(&chat.unindexed_lock, NULL);
+
+    // Lines are read from stdin with fgets once poll says they are there, so
+    // stdio must not read ahead of the line it was asked for
+    setvbuf(stdin, NULL, _IONBF, 0);
+
+    // Install the signal handler for the intialization process. Once
+    // everything is set up, signals are taken through a signalfd by the event
+    // loop instead
     install_sig_handler();
 
-    atexit(&quit);
-
     // Obtain commandline options
     regmatch_t matches[2];
     regex_t regex;
     bool port_not_specified = true;
     bool address_not_specified = true;
-    char opt, *arg_str = "p:a:h", **end_ptr = malloc(sizeof(char**));
+    char opt, *arg_str = "p:a:hel:t:i:B:D:u:c:m:r:", **end_ptr = malloc(sizeof(char**));
+    long num_conv;
     opterr = 0;
     mode = CLIENT;
 
     // Extract the arguments and perform validation where appropriate
     while((opt = getopt(argc, argv, arg_str)) > 0) {
         switch(opt) {
+            case 'e':
+                chat.is_executor = true;
+                // Fall through - an executor is a host
             case 'h':
                 mode = HOST;
                 break;
+            case 'l':
+                // Peers are given as ADDRESS:PORT
+                if (strrchr(optarg, ':') == NULL || *(strrchr(optarg, ':') + 1) == '\0') {
+                    fprintf(stderr, "%s is not of the form ADDRESS:PORT\n", optarg);
+                    return 10;
+                }
+
+                if (nlinks == RELAY_MAX_LINKS) {
+                    fprintf(stderr, "Too many links (at most %d)\n", RELAY_MAX_LINKS);
+                    return 10;
+                }
+
+                links[nlinks++] = optarg;
+                break;
+            case 'c':
+                // Hosts are given as ADDRESS:PORT
+                if (strrchr(optarg, ':') == NULL || *(strrchr(optarg, ':') + 1) == '\0') {
+                    fprintf(stderr, "%s is not of the form ADDRESS:PORT\n", optarg);
+                    return 16;
+                }
+
+                if (ntargets == TABS_MAX) {
+                    fprintf(stderr, "Too many hosts (at most %d)\n", TABS_MAX);
+                    return 16;
+                }
+
+                targets[ntargets++] = optarg;
+                break;
             case 'p':
                 // TODO Perform validation on the received port
                 service = optarg;
-                long num_conv = strtol(service, end_ptr, 10);
+                num_conv = strtol(service, end_ptr, 10);
 
                 // The last valid character was something other than '\0', so
                 // the string contains non-number components. Throw an error
@@ -113,7 +226,7 @@ int main(int argc, char **argv) {
                 if (num_conv < PORT_MIN || num_conv > PORT_MAX) {
                     fprintf(
                         stderr, 
-                        "Port %d is out of range (must be between %d and %d)\n",
+                        "Port %ld is out of range (must be between %d and %d)\n",
                         num_conv, PORT_MIN, PORT_MAX
                     );
 
@@ -132,13 +245,58 @@ int main(int argc, char **argv) {
                 regcomp(&regex, IPV4_REGEX, REG_EXTENDED);
                 regexec(&regex, address, 1, matches, 0);
 
-                if (matches[0].rm_so != 0 || matches[0].rm_eo != strlen(address)) {
+                if (matches[0].rm_so != 0 || (size_t) matches[0].rm_eo != strlen(address)) {
                     fprintf(stderr, "%s is not a valid IPV4 address\n", address);
                     return 4;
                 }
                 regfree(&regex);
                 address_not_specified = false;
 
+                break;
+            case 't':
+                transcript_path = optarg;
+                break;
+            case 'D':
+                download_dir = optarg;
+                break;
+            case 'u':
+                upgrade_path = optarg;
+                break;
+            case 'i':
+            case 'B':
+                num_conv = strtol(optarg, end_ptr, 10);
+
+                if (**end_ptr != '\0' || num_conv <= 0) {
+                    fprintf(stderr, "%s is not a valid sync threshold\n", optarg);
+                    return 8;
+                }
+
+                if (opt == 'i') {
+                    sync_ms = (uint32_t) num_conv;
+                } else {
+                    sync_bytes = (uint64_t) num_conv;
+                }
+
+                break;
+            case 'm':
+                num_conv = strtol(optarg, end_ptr, 10);
+
+                if (**end_ptr != '\0' || num_conv < RELAY_MIN_BUDGET) {
+                    fprintf(stderr, "%s is not a valid budget (must be at least %d bytes)\n", optarg, RELAY_MIN_BUDGET);
+                    return 18;
+                }
+
+                budget = (size_t) num_conv;
+                break;
+            case 'r':
+                num_conv = strtol(optarg, end_ptr, 10);
+
+                if (**end_ptr != '\0' || num_conv < 0 || num_conv > UINT32_MAX) {
+                    fprintf(stderr, "%s is not a valid message rate\n", optarg);
+                    return 19;
+                }
+
+                message_rate = num_conv;
                 break;
             default:
                 fprintf(stderr, "Invalid option: \"-%c\"\n", opt);
@@ -146,349 +304,931 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (port_not_specified) {
+    if (ntargets > 0 && (mode == HOST || !port_not_specified || !address_not_specified)) {
+        fputs("Error: -c cannot be combined with -h, -e, -a or -p\n", stderr);
+        return 16;
+    }
+
+    if (port_not_specified && ntargets == 0) {
         fputs("Error: Missing port\n", stderr);
         return 5;
     }
 
-    if (address_not_specified && mode != HOST) {
+    if (address_not_specified && mode != HOST && ntargets == 0) {
         fputs("Error: Missing address\n", stderr);
         return 6;
     }
 
-    // Reference to main thread so other threads can send signals here
-    handler = pthread_self(); 
+    if (nlinks > 0 && mode != HOST) {
+        fputs("Error: Only hosts can link with other hosts\n", stderr);
+        return 10;
+    }
 
-    // Set our username
-    username = (char*) malloc(MAX_UNAME_SIZE);
-    printf("Please enter a username: ");
-    fgets(username, MAX_UNAME_SIZE, stdin);
-    *(username + strlen(username) - 1) = '\0';
+    if (upgrade_path != NULL && mode != HOST) {
+        fputs("Error: Only hosts can be upgraded\n", stderr);
+        return 14;
+    }
+
+    if (budget > 0 && mode != HOST) {
+        fputs("Error: Only hosts have a memory budget\n", stderr);
+        return 18;
+    }
 
-    // The convention is that when a client and host connect, the host waits
-    // for the client to prompt. Based on whether we are the client or the
-    // host, determine if we should prompt or wait
+    if (message_rate >= 0 && mode != HOST) {
+        fputs("Error: Only hosts limit message rates\n", stderr);
+        return 19;
+    }
+
+
+    // The host retains the messages it relays so the history can be searched.
+    // The relay hands them over with its lock held, so they are indexed by
+    // the event loop rather than there
     if (mode == HOST) {
-        wait_for_client_connection(port, address);
+        chat.history = search_index_create(SEARCH_MAX_MESSAGES);
+        chat.indexing = eventfd(0, EFD_NONBLOCK);
+        if (chat.history == NULL || chat.indexing < 0) {
+            fputs("Error: Failed to create the history index\n", stderr);
+            return 7;
+        }
+    }
+
+    chat.latencies = latency_trace_create();
+    if (chat.latencies == NULL) {
+        fputs("Error: Failed to create the latency trace\n", stderr);
+        free_chat(&chat);
+        return 12;
+    }
+
+    // Transcripts are opt-in
+    if (transcript_path != NULL) {
+        chat.logger = transcript_logger_create(transcript_path, sync_ms, sync_bytes);
+        if (chat.logger == NULL) {
+            fprintf(stderr, "Error: Failed to open transcript %s\n", transcript_path);
+            free_chat(&chat);
+            return 9;
+        }
+    }
+
+    // Set our username. Executors have no user to ask, so they go by the
+    // name they present to clients and peers
+    if (chat.is_executor) {
+        strcpy(chat.username, EXECUTOR_NAME);
     } else {
-        connect_to_host(service, address);
+        printf("Please enter a username: ");
+        fflush(stdout);
+        if (fgets(chat.username, MAX_UNAME_SIZE, stdin) == NULL) {
+            free_chat(&chat);
+            return 0;
+        }
+        chat.username[strcspn(chat.username, "\n")] = '\0';
+    }
+
+    // The host runs a relay that clients and peers connect to whenever they
+    // like; the client connects to the host and waits for it to reply
+    if (mode == HOST) {
+        chat.node = relay_create(port, chat.username, deliver_message, print_notice, chat.latencies, &chat);
+        chat.stop = eventfd(0, EFD_NONBLOCK);
+        if (chat.node == NULL || chat.stop < 0 || relay_set_download_dir(chat.node, download_dir) < 0) {
+            fputs("Error: Failed to create the relay\n", stderr);
+            free_chat(&chat);
+            return 11;
+        }
+
+        for (size_t i = 0; i < nlinks; i++) {
+            char *separator = strrchr(links[i], ':');
+            *separator = '\0';
+            relay_add_link(chat.node, links[i], separator + 1);
+        }
+
+        if (budget > 0) {
+            relay_set_budget(chat.node, budget);
+        }
+        if (message_rate >= 0) {
+            relay_set_message_rate(chat.node, (uint32_t) message_rate);
+        }
+
+        if (upgrade_path != NULL && relay_enable_upgrades(chat.node, upgrade_path, handed_over) < 0) {
+            fputs("Error: Failed to create the relay\n", stderr);
+            free_chat(&chat);
+            return 11;
+        }
+
+        if (relay_start(chat.node) < 0) {
+            free_chat(&chat);
+            return -4;
+        }
+        if (!chat.is_executor) {
+            relay_set_presence(chat.node, PRESENCE_ONLINE);
+        }
+    } else {
+        // Without -c there is just the one host, given with -a and -p
+        if (ntargets == 0) {
+            targets[ntargets++] = NULL;
+        }
+
+        for (size_t i = 0; i < ntargets; i++) {
+            host *host = &chat.hosts[chat.nhosts];
+
+            host->chat = &chat;
+            host->session = session_create(chat.username, download_dir, chat.latencies, receive_message, print_session_notice, host);
+            if (host->session == NULL) {
+                fputs("Error: Failed to set up file transfers\n", stderr);
+                free_chat(&chat);
+                return 13;
+            }
+            chat.nhosts++;
+
+            if (targets[i] != NULL) {
+                char *separator = strrchr(targets[i], ':');
+                *separator = '\0';
+                address = targets[i];
+                service = separator + 1;
+            }
+
+            // The connection is made by the event loop, which says so once
+            // the host accepts us
+            if (session_connect(host->session, address, service) < 0) {
+                session_destroy(host->session);
+                host->session = NULL;
+                end_chat(&chat, false);
+                free_chat(&chat);
+                return -1;
+            }
+        }
     }
 
-    // Block signals; we use this thread as a signal handler. Uninstall our
-    // old interrupt handler
-    sigaction(SIGINT, &def_action, NULL);
-    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+    // From here on signals are just another event. Uninstall our old
+    // interrupt handler
+    chat.signals = open_signals();
+    signal(SIGINT, SIG_DFL);
+    if (chat.signals < 0) {
+        perror("Failed to set up signal handling");
+        end_chat(&chat, false);
+        free_chat(&chat);
+        return 15;
+    }
 
-    // Initiate the threads that will take care of sending and receiving
-    // messages.
-    pthread_create(&receiver, NULL, receive_messages, NULL);
-    pthread_create(&sender, NULL, send_messages, NULL);
+    // Several hosts are shown in tabs; otherwise the terminal is used as is
+    if (mode != HOST && targets[0] != NULL && setup_ui(&chat) < 0) {
+        fputs("Error: Failed to set up the terminal\n", stderr);
+        end_chat(&chat, false);
+        free_chat(&chat);
+        return 17;
+    }
 
-    // The main thread waits for the connection to close, then performs
-    // the proper cleanup
-    wait_for_closed_connection();
+    run_chat(&chat);
+    free_chat(&chat);
 
     return 0;
 }
 
+// Frees whatever has been set up in chat. The relay or session must have
+// been stopped or closed already, if they were started
+void free_chat(chat *chat) {
+    if (chat->node != NULL) {
+        relay_stop(chat->node);
+    }
+    for (size_t i = 0; i < chat->nhosts; i++) {
+        if (chat->hosts[i].session != NULL) {
+            session_destroy(chat->hosts[i].session);
+        }
+    }
+    if (chat->tabs != NULL) {
+        tabs_destroy(chat->tabs);
+    }
+    if (chat->notify >= 0) {
+        close(chat->notify);
+    }
+    while (chat->notices != NULL) {
+        pending_notice *notice = chat->notices;
+        chat->notices = notice->next;
+        free(notice);
+    }
+    pthread_mutex_destroy(&chat->notices_lock);
+    if (chat->indexing >= 0) {
+        close(chat->indexing);
+    }
+    while (chat->unindexed != NULL) {
+        pending_message *message = chat->unindexed;
+        chat->unindexed = message->next;
+        free(message);
+    }
+    pthread_mutex_destroy(&chat->unindexed_lock);
+    if (chat->history != NULL) {
+        search_index_destroy(chat->history);
+    }
+    if (chat->latencies != NULL) {
+        latency_trace_destroy(chat->latencies);
+    }
+    if (chat->signals >= 0) {
+        close(chat->signals);
+    }
+    if (chat->stop >= 0) {
+        close(chat->stop);
+    }
+    if (chat->logger != NULL) {
+        uint64_t dropped = transcript_logger_destroy(chat->logger);
+        if (dropped > 0) {
+            fprintf(stderr, "Transcript dropped %lu records\n", dropped);
+        }
+    }
+}
+
 // Signal handler used to handle SIGINT (i.e. user early-exiting the program)
-// before the additional threads have been spawned
+// before the event loop has started
 void sig_handler(const int signo) {
+    (void) signo;
     exit(-1);
 }
 
-// Verifies which resources have been allocated and frees them
-void quit() {
-    // Depending on when the user quit, we may have allocate memory for the
-    // following variables. Verify before freeing
-    if (username != 0) {
-        free(username);
+// Installs the initial signal handler
+void install_sig_handler() {
+    struct sigaction sig_action;
+
+    sigemptyset(&sig_action.sa_mask);
+    sig_action.sa_handler = sig_handler;
+    sig_action.sa_flags = 0;
+    sigaction(SIGINT, &sig_action, NULL);
+}
+
+// Routes SIGINT and SIGTERM to a signalfd, so the event loop sees them
+// alongside everything else it waits on. Every other thread blocks all
+// signals, so they can only end up there. Returns the signalfd or -1 on error
+int open_signals() {
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        return -1;
+    }
+
+    return signalfd(-1, &signals, SFD_CLOEXEC);
+}
+
+// The event loop. Waits for our user, the hosts and signals, and handles
+// whatever turns up until the chat is over
+void run_chat(chat *chat) {
+    struct pollfd pfds[5 + TABS_MAX * SESSION_NFDS];
+    bool by_remote = false;
+
+    chat->running = true;
+    chat->reading_input = !chat->is_executor;
+    presence_tracker_init(&chat->tracker);
+
+    if (!chat->is_executor) {
+        print_prompt(chat);
+    }
+
+    while (chat->running) {
+        nfds_t nfds = 5;
+
+        // Only users go idle, and only when the tracker says so
+        int timeout = -1;
+
+        if (!chat->is_executor) {
+            report_presence(chat);
+            timeout = presence_tracker_timeout(&chat->tracker);
+        }
+
+        // Everything handled since the last wait is drawn at once
+        if (chat->tabs != NULL) {
+            tabs_flush();
+        }
+
+        // Descriptors that are -1 are ignored by poll
+        pfds[0].fd = chat->signals;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = chat->reading_input ? fileno(stdin) : -1;
+        pfds[1].events = POLLIN;
+        pfds[2].fd = chat->stop;
+        pfds[2].events = POLLIN;
+        pfds[3].fd = chat->notify;
+        pfds[3].events = POLLIN;
+        pfds[4].fd = chat->indexing;
+        pfds[4].events = POLLIN;
+
+        // Sessions wake up to acknowledge messages or to try reconnecting
+        for (size_t i = 0; i < chat->nhosts; i++, nfds += SESSION_NFDS) {
+            if (chat->hosts[i].session != NULL) {
+                int session_timeout_ms = session_timeout(chat->hosts[i].session);
+
+                if (session_timeout_ms >= 0 && (timeout < 0 || session_timeout_ms < timeout)) {
+                    timeout = session_timeout_ms;
+                }
+                session_poll_fds(chat->hosts[i].session, pfds + nfds);
+            } else {
+                for (int j = 0; j < SESSION_NFDS; j++) {
+                    pfds[nfds + j].fd = -1;
+                }
+            }
+        }
+
+        // A timeout still falls through, for the sessions' sake
+        if (poll(pfds, nfds, timeout) < 0) {
+            continue;
+        }
+
+        // Interrupts and the relay being handed over end the chat as if the
+        // user had quit
+        if (pfds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            read(chat->signals, &info, sizeof(info));
+            break;
+        }
+        if (pfds[2].revents & POLLIN) {
+            break;
+        }
+
+        if (pfds[3].revents & POLLIN) {
+            show_notices(chat);
+        }
+        if (pfds[4].revents & POLLIN) {
+            index_messages(chat);
+        }
+
+        if (pfds[1].revents & (POLLIN | POLLHUP)) {
+            read_input(chat);
+        }
+
+        // A host leaving ends the chat, unless there are others in tabs
+        for (size_t i = 0; i < chat->nhosts && chat->running; i++) {
+            host *host = &chat->hosts[i];
+
+            if (host->session == NULL || session_handle(host->session, pfds + 5 + i * SESSION_NFDS) == 0) {
+                if (chat->tabs != NULL && host->session != NULL && !host->labelled && session_established(host->session)) {
+                    label_tab(chat, i);
+                }
+                continue;
+            }
+
+            if (chat->tabs != NULL) {
+                host_left(chat, i);
+            } else {
+                by_remote = true;
+                chat->running = false;
+            }
+        }
+    }
+
+    end_chat(chat, by_remote);
+}
+
+// Lets whoever we are connected to know we are leaving, unless they are the
+// ones who left, and closes the connections
+void end_chat(chat *chat, bool by_remote) {
+    // Stopping the relay tells every client and peer that we are leaving
+    if (chat->node != NULL) {
+        relay_stop(chat->node);
+        chat->node = NULL;
+        printf("\nStopped relaying\n");
+
+        return;
     }
-    if (r_username != 0) {
-        free(r_username);
+
+    // The terminal is handed back first, so what follows stays on it
+    if (chat->tabs != NULL) {
+        tabs_destroy(chat->tabs);
+        chat->tabs = NULL;
     }
-    if (remote_ip != 0) {
-        free(remote_ip);
+
+    for (size_t i = 0; i < chat->nhosts; i++) {
+        session *session = chat->hosts[i].session;
+
+        if (session == NULL) {
+            continue;
+        }
+
+        session_close(session, !by_remote);
+        printf(
+            "\nTerminated connection %s %s (%s)\n",
+            by_remote ? "by" : "with",
+            session_remote_name(session),
+            session_remote_ip(session)
+        );
+
+        session_destroy(session);
+        chat->hosts[i].session = NULL;
     }
 }
 
-// Installs the initial signal handler
-void install_sig_handler() {
-    // Set up initial signal handling
-    sigemptyset(&mask);
+// Takes over the terminal and opens a tab for every host. Returns 0 on
+// success or -1 on error
+int8_t setup_ui(chat *chat) {
+    // File transfers report from their own threads, so their notices are
+    // queued for the event loop to show
+    chat->notify = eventfd(0, EFD_NONBLOCK);
+    chat->tabs = tabs_create();
+    if (chat->notify < 0 || chat->tabs == NULL) {
+        return -1;
+    }
 
-    // Set the signal mask. Used to establish this thread as the signal handler
-    // when the sender and receiver threads are started
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGUSR1);
-    sigaddset(&mask, SIGUSR2);
+    // Tabs go by the address they were given until their host accepts us
+    for (size_t i = 0; i < chat->nhosts; i++) {
+        tabs_open(chat->tabs, session_remote_ip(chat->hosts[i].session));
+    }
 
-    sig_action.sa_handler = sig_handler;
-    sig_action.sa_mask = mask;
-    sig_action.sa_flags = 0;
-    sigaction(SIGINT, &sig_action, &def_action);
+    // Every key typed counts towards our user's presence, not just whole
+    // lines
+    term_windows_set_edit_hook(record_keystroke, chat);
+
+    return 0;
 }
 
-// Listens for incoming connnections and establishes a connection with the
-// incoming guest
-void wait_for_client_connection(const int port, const char *address) {
-    // Open a socket to listen to incoming connections
-    listener = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
-    if (listener < 0) {
-        perror("In main - failed to open socket");
-        exit(-2);
+// Labels the tab of a host that has just accepted us with its name
+void label_tab(chat *chat, size_t index) {
+    session *session = chat->hosts[index].session;
+    char label[TABS_MAX_LABEL];
+
+    snprintf(label, TABS_MAX_LABEL, "%s@%s", session_remote_name(session), session_remote_ip(session));
+    tabs_set_label(chat->tabs, index, label);
+    chat->hosts[index].labelled = true;
+}
+
+// Reads what our user typed, and sends it or carries it out
+void read_input(chat *chat) {
+    char line[MAX_MSG_SIZE];
+
+    if (chat->tabs != NULL) {
+        while (chat->running && tabs_read_line(chat->tabs, line, MAX_MSG_SIZE) > 0) {
+            handle_line(chat, line);
+        }
+        return;
+    }
+
+    // Without a user there is nothing more to read, but the chat carries on
+    if (fgets(line, MAX_MSG_SIZE, stdin) == NULL) {
+        chat->reading_input = false;
+        return;
+    }
+
+    handle_line(chat, line);
+}
+
+// Sends a line our user typed, or carries it out if it is a command
+void handle_line(chat *chat, const char *line) {
+    // A line sent ends any typing. Outside of tabs, stdin only hands us whole
+    // lines, so this is all there is to tell when the user has gone away
+    presence_tracker_input(&chat->tracker);
+
+    // Commands are carried out locally and never sent as messages
+    if (run_command(chat, line)) {
+        print_prompt(chat);
+        return;
+    }
+
+    // Check to see if the user is requesting to quit. end_chat lets the other
+    // side know. In tabs, only the host in the active tab is left
+    if (strcmp(line, EXIT_CMD) == 0) {
+        if (chat->tabs != NULL) {
+            close_tab(chat);
+        } else {
+            chat->running = false;
+        }
+        return;
     }
 
-    // Allows use to reuse this address. This addresses addresses an occurence
-    // where if the user runs the program, exits, then runs it again before the
-    // address is freed, they get a complaint stating the address is in use
-    int reuse_addr = 1;
+    if (chat->node != NULL) {
+        relay_broadcast(chat->node, line);
+    } else {
+        host *host = active_host(chat);
 
-    int result = setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(int));
+        if (host->session == NULL) {
+            tabs_print(chat->tabs, tabs_active(chat->tabs), "Not connected; type ~quit to close this tab");
+            return;
+        }
+        if (session_send_message(host->session, line) < 0) {
+            print_session_notice(host, "Too many messages are waiting for the host; not sent");
+            return;
+        }
+
+        // Nothing echoes what was typed in tabs, so it is shown with the rest
+        if (chat->tabs != NULL) {
+            char echo[MAX_UNAME_SIZE + MAX_MSG_SIZE + 4];
+
+            snprintf(echo, sizeof(echo), "<%s>: %s", chat->username, line);
+            tabs_print(chat->tabs, tabs_active(chat->tabs), echo);
+        }
+    }
 
-    if (result < 0) {
-        perror("In main - failed to set socket options");
-        exit(-3);
+    // Messages relayed before this one are indexed first, to keep them in
+    // order
+    if (chat->history != NULL) {
+        index_messages(chat);
+        search_index_add(chat->history, chat->username, line);
+    }
+    if (chat->logger != NULL) {
+        transcript_logger_log(chat->logger, TRANSCRIPT_SENT, chat->username, line);
     }
 
-    struct sockaddr_in local_addr, remote_addr;
+    print_prompt(chat);
+}
 
-    /* Set-up socket address */
-    local_addr.sin_family = AF_INET;
-    local_addr.sin_port = htons(port);
-    local_addr.sin_addr.s_addr = INADDR_ANY;
-    
-    memset(&local_addr.sin_zero, 0, sizeof(local_addr.sin_addr));
+// Leaves the host in the active tab and closes the tab. Once the last tab is
+// closed the chat is over
+void close_tab(chat *chat) {
+    int tab = tabs_active(chat->tabs);
+    session *session = chat->hosts[tab].session;
 
-    /* Bind the server */
-    if (bind(listener, (struct sockaddr*) &local_addr, sizeof(local_addr)) < 0) {
-        perror("In main - failed to bind address");
-        exit(-4);
+    if (session != NULL) {
+        session_close(session, true);
+        session_destroy(session);
+        chat->hosts[tab].session = NULL;
     }
 
-    /* Obtain connections from clients */
-    listen(listener, SOMAXCONN);
+    tabs_close(chat->tabs, tab);
+    if (tabs_active(chat->tabs) < 0) {
+        chat->running = false;
+    }
+}
 
-    // We found a client, attempt to establish communication
-    socklen_t remote_addr_size = sizeof(remote_addr);
-    remote = accept(
-        listener, 
-        (struct sockaddr*) &remote_addr, 
-        (socklen_t* restrict) &remote_addr_size
-    );
+// Closes the connection to a host that has gone away. Its tab stays open, so
+// what was said there can still be read, until our user closes it
+void host_left(chat *chat, size_t index) {
+    session *session = chat->hosts[index].session;
+    char line[MAX_MSG_SIZE];
 
-    // The remote socket was not properly initialized, so there was an error in
-    // establishing the connection
-    if (remote < 0) {
-        fprintf(stderr, "Failed to accept incoming connection\n");
+    session_close(session, false);
+    snprintf(line, MAX_MSG_SIZE, "Terminated connection by %s (%s)", session_remote_name(session), session_remote_ip(session));
+    tabs_print(chat->tabs, index, line);
+
+    session_destroy(session);
+    chat->hosts[index].session = NULL;
+}
+
+// Returns the host our user is talking to: the one in the active tab, or the
+// only one there is
+host *active_host(chat *chat) {
+    return chat->tabs != NULL ? &chat->hosts[tabs_active(chat->tabs)] : &chat->hosts[0];
+}
+
+// Returns where a command prints to: stdout, or in tabs a buffer that
+// close_output shows in the active tab
+FILE *open_output(chat *chat) {
+    FILE *out = NULL;
+
+    if (chat->tabs != NULL) {
+        out = open_memstream(&chat->output, &chat->output_size);
     }
 
-    connection_established = true;
+    return out != NULL ? out : stdout;
+}
 
-    // TODO Allow multiple conenctions in the future 
-    close(listener);
+// Finishes off what a command printed to out
+void close_output(chat *chat, FILE *out) {
+    if (out == stdout) {
+        fflush(stdout);
+        return;
+    }
 
-    // Obtaint the ip of the remote for information purposes
-    remote_ip = malloc(INET_ADDRSTRLEN);
-    inet_ntop(
-        AF_INET, 
-        &remote_addr.sin_addr,
-        remote_ip,
-        INET_ADDRSTRLEN
-    );
+    fclose(out);
+    if (chat->output_size > 0) {
+        tabs_print(chat->tabs, tabs_active(chat->tabs), chat->output);
+    }
+    free(chat->output);
+    chat->output = NULL;
+}
+
+// Shows the notices queued since the last time, each in its host's tab
+void show_notices(chat *chat) {
+    uint64_t count;
+
+    read(chat->notify, &count, sizeof(count));
 
-    // Recieve the client's username
-    int u_length;
-    r_username = malloc(MAX_UNAME_SIZE);
-    u_length = recv(remote, r_username, MAX_UNAME_SIZE, NO_FLAGS);
-    *(r_username + u_length) = '\0';
-    printf("Connection established with %s (%s)\n", r_username, remote_ip);
+    pthread_mutex_lock(&chat->notices_lock);
+    pending_notice *notices = chat->notices;
+    chat->notices = NULL;
+    pthread_mutex_unlock(&chat->notices_lock);
 
-    // Send username to the client
-    send(remote, username, strlen(username), NO_FLAGS);
+    while (notices != NULL) {
+        pending_notice *notice = notices;
+
+        notices = notice->next;
+        tabs_print(chat->tabs, notice->tab, notice->text);
+        free(notice);
+    }
 }
 
-// Wait for either the host or the client to close the connection.
-void wait_for_closed_connection() {
-    int signo;
-    sigwait(&mask, &signo);
-    connection_established = false;
+// Called by the tabs for every key typed or deleted
+void record_keystroke(void *ctx) {
+    chat *chat = ctx;
 
-    switch(signo) {
-        case SIGINT:
-            send(remote, EXIT_CMD, strlen(EXIT_CMD), NO_FLAGS);
-        case SIGUSR1:
-            printf("\nTerminated connection with %s (%s)\n", r_username, remote_ip);
-            break;
-        case SIGUSR2:
-        default: 
-            printf("\nTerminated connection by %s (%s)\n", r_username, remote_ip);
+    presence_tracker_keystroke(&chat->tracker);
+}
+
+// Prints the prompt our user types after. Tabs have a line of their own to
+// type into instead
+void print_prompt(chat *chat) {
+    if (chat->tabs != NULL) {
+        return;
+    }
+
+    printf("<%s>: ", chat->username);
+    fflush(stdout);
+}
+
+// Queues a relayed message for the event loop to index
+void queue_for_index(chat *chat, const char *sender_name, const char *msg) {
+    size_t u_len = strlen(sender_name), m_len = strlen(msg);
+    pending_message *pending = malloc(sizeof(pending_message) + u_len + m_len + 2);
+    uint64_t one = 1;
+
+    if (pending == NULL) {
+        return;
     }
+    pending->next = NULL;
+    memcpy(pending->record, sender_name, u_len + 1);
+    memcpy(pending->record + u_len + 1, msg, m_len + 1);
+
+    pthread_mutex_lock(&chat->unindexed_lock);
+    pending_message **last = &chat->unindexed;
+    while (*last != NULL) {
+        last = &(*last)->next;
+    }
+    *last = pending;
+    pthread_mutex_unlock(&chat->unindexed_lock);
+
+    write(chat->indexing, &one, sizeof(one));
+}
+
+// Adds the messages queued since the last time to the history index
+void index_messages(chat *chat) {
+    uint64_t count;
+
+    read(chat->indexing, &count, sizeof(count));
+
+    pthread_mutex_lock(&chat->unindexed_lock);
+    pending_message *messages = chat->unindexed;
+    chat->unindexed = NULL;
+    pthread_mutex_unlock(&chat->unindexed_lock);
 
-    pthread_join(sender, NULL);
-    pthread_join(receiver, NULL);
+    while (messages != NULL) {
+        pending_message *message = messages;
 
-    close(remote);
+        messages = message->next;
+        search_index_add(chat->history, message->record, message->record + strlen(message->record) + 1);
+        free(message);
+    }
 }
 
-void setup_ui() {
-    // TODO Initialize non-canonical terminal windows here
+// Called by the relay for every message it accepts from a client or peer
+void deliver_message(void *ctx, const char *sender_name, const char *msg) {
+    chat *chat = ctx;
+
+    if (chat->history != NULL) {
+        queue_for_index(chat, sender_name, msg);
+    }
+    if (chat->logger != NULL) {
+        transcript_logger_log(chat->logger, TRANSCRIPT_RECEIVED, sender_name, msg);
+    }
+
+    // Executors have no prompt to keep in place
+    if (chat->is_executor) {
+        printf("<%s>: %s", sender_name, msg);
+        fflush(stdout);
+        return;
+    }
+
+    printf("\n<%s>: %s", sender_name, msg);
+    print_prompt(chat);
 }
 
-// Called when connecting to the host, making this program the guest. Initiates
-// network connections and establishes communication with the host
-void connect_to_host(const char* service, const char* address) {
-    struct addrinfo *remote_addr, *host, hint; 
-    struct sockaddr_in *server_info;
+// Called by a session for every message its host sends
+void receive_message(void *ctx, const char *sender_name, const char *msg) {
+    host *host = ctx;
+    chat *chat = host->chat;
 
-    // Give the sockets API hints about the address we are attempting to obtain
-    memset(&hint, 0, sizeof(hint));
-    hint.ai_family = AF_INET;
-    hint.ai_socktype = SOCK_STREAM;
+    if (chat->logger != NULL) {
+        transcript_logger_log(chat->logger, TRANSCRIPT_RECEIVED, sender_name, msg);
+    }
 
-    // Obtain the host address and open the connection socket
-    int result = getaddrinfo(address, service, &hint, &remote_addr);
+    if (chat->tabs != NULL) {
+        char line[MAX_UNAME_SIZE + MAX_MSG_SIZE + 4];
 
-    if (result != 0) {
-        fprintf(stderr, "Error obtaining address: %s\n", gai_strerror(result));
-        exit(-1);
+        snprintf(line, sizeof(line), "<%s>: %s", sender_name, msg);
+        tabs_print(chat->tabs, host - chat->hosts, line);
+        return;
     }
 
-    remote = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
+    printf("\n<%s>: %s", sender_name, msg);
+    print_prompt(chat);
+}
 
-    if (remote < 0) {
-        fprintf(stderr, "Failed to open socket\n");
-        exit(-2);
+// Called by the relay when clients and peers come and go, and by file
+// transfers as they start and end
+void print_notice(void *ctx, const char *notice) {
+    chat *chat = ctx;
+
+    if (chat->is_executor) {
+        printf("%s\n", notice);
+        fflush(stdout);
+    } else {
+        printf("\n%s\n", notice);
+        print_prompt(chat);
     }
+}
 
-    /*
-    * Make a connection to the chat server. Currently very inefficient as it 
-    * spams conenction requests until the connection succeeds instead of 
-    * waiting.
-    * 
-    * #TODO Implement exponential backoff connection retry
-    */
+// Called by a session with round trip times and file transfer notices. In
+// tabs, they are queued for the event loop, since file transfers call from
+// their own threads
+void print_session_notice(void *ctx, const char *notice) {
+    host *host = ctx;
+    chat *chat = host->chat;
 
-    int connection_status = CONNECTION_NOT_ESTABLISHED;
-    while (connection_status == CONNECTION_NOT_ESTABLISHED) {
-        connection_status = connect(
-            remote,
-            remote_addr->ai_addr,
-            remote_addr->ai_addrlen
-        );
+    if (chat->tabs == NULL) {
+        print_notice(chat, notice);
+        return;
+    }
+
+    pending_notice *pending = malloc(sizeof(pending_notice) + strlen(notice) + 1);
+    uint64_t one = 1;
+
+    if (pending == NULL) {
+        return;
+    }
+    pending->next = NULL;
+    pending->tab = host - chat->hosts;
+    strcpy(pending->text, notice);
+
+    pthread_mutex_lock(&chat->notices_lock);
+    pending_notice **last = &chat->notices;
+    while (*last != NULL) {
+        last = &(*last)->next;
+    }
+    *last = pending;
+    pthread_mutex_unlock(&chat->notices_lock);
 
-        /*
-        *If we can't make the connection, close and reopen the socket
-        * Some UNIX implementations have undefined behavior when attempting
-        * to recall connect on a socket involved in a failed connect call
-        */
-        if (connection_status == CONNECTION_NOT_ESTABLISHED) {
-            close(remote);
-            remote = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
+    write(chat->notify, &one, sizeof(one));
+}
+
+// Called by the relay once a new process has taken over its connections.
+// There is nothing left for us to do, so stop as if the user had quit
+void handed_over(void *ctx) {
+    chat *chat = ctx;
+    uint64_t one = 1;
+
+    write(chat->stop, &one, sizeof(one));
+}
+
+// Carries out line if it is a command. Returns true if it was one
+bool run_command(chat *chat, const char *line) {
+    if (strncmp(line, SEARCH_CMD, strlen(SEARCH_CMD)) == 0) {
+        search_history(chat, line + strlen(SEARCH_CMD));
+    } else if (strcmp(line, PING_CMD) == 0) {
+        send_ping(chat);
+    } else if (strcmp(line, LATENCY_CMD) == 0) {
+        FILE *out = open_output(chat);
+        latency_trace_print(chat->latencies, out);
+        close_output(chat, out);
+    } else if (strncmp(line, SEND_CMD, strlen(SEND_CMD)) == 0) {
+        send_file(chat, line + strlen(SEND_CMD));
+    } else if (strcmp(line, WHO_CMD) == 0) {
+        list_presence(chat);
+    } else if (strcmp(line, MEMORY_CMD) == 0) {
+        FILE *out = open_output(chat);
+
+        if (chat->node != NULL) {
+            relay_print_memory(chat->node, out);
+        } else {
+            fputs("Memory use is only reported on the host\n", out);
         }
+        close_output(chat, out);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Measures the round trip time to the host, or from the host to each of its
+// clients and peers. The results are printed once the replies arrive
+void send_ping(chat *chat) {
+    if (chat->node != NULL) {
+        relay_ping(chat->node);
+    } else if (active_host(chat)->session != NULL) {
+        session_ping(active_host(chat)->session);
     }
-    connection_established = true;
+}
 
-    /* Send the client username and obtain the remote username */
+// Prints everyone who is online, away or typing
+void list_presence(chat *chat) {
+    presence_table *table;
+    presence_user users[MAX_WHO_RESULTS];
 
-    // Obtain the address of the server
-    remote_ip = malloc(INET_ADDRSTRLEN);
-    server_info = (struct sockaddr_in*) remote_addr->ai_addr;
-    inet_ntop(AF_INET, &server_info->sin_addr, remote_ip, INET_ADDRSTRLEN);
+    if (chat->node != NULL) {
+        table = relay_presence(chat->node);
+    } else if (active_host(chat)->session != NULL) {
+        table = session_presence(active_host(chat)->session);
+    } else {
+        return;
+    }
 
-    // Send the client's username
-    send(remote, (void*)username, strlen(username), NO_FLAGS);
+    size_t count = presence_table_list(table, users, MAX_WHO_RESULTS);
+    FILE *out = open_output(chat);
+
+    fprintf(out, "%lu users online", count);
+    if (count > MAX_WHO_RESULTS) {
+        fprintf(out, " (showing %d)", MAX_WHO_RESULTS);
+    }
+    fputc('\n', out);
+
+    for (size_t i = 0; i < count && i < MAX_WHO_RESULTS; i++) {
+        fprintf(out, "  %-*s %s\n", MAX_UNAME_SIZE, users[i].username, presence_name(users[i].state));
+    }
 
-    // Receive the server's username
-    int u_length;
-    connection_established = true;
-    r_username = malloc(MAX_UNAME_SIZE);
-    u_length = recv(remote, (void*)r_username, MAX_UNAME_SIZE, NO_FLAGS);
-    *(r_username + u_length) = '\0';
-    printf("Connection established with %s (%s)\n", r_username, remote_ip);
+    close_output(chat, out);
 }
 
-void *send_messages(void* empty) {
-    send_buffer = malloc(MAX_MSG_SIZE);
-    struct pollfd pfd;
-    pfd.fd = fileno(stdin);
-    pfd.events = POLLIN;
+// Tells everyone when our user starts typing, goes away or comes back. The
+// tracker only has something to report when the state actually changes
+void report_presence(chat *chat) {
+    int8_t state = presence_tracker_poll(&chat->tracker);
 
-    // Print the initial prompt
-    printf("<%s>: ", username);
-    fflush(stdout);
-    while(connection_established) {
-        if (poll(&pfd, 1, 0) > 0) {
-            /*
-            * Because fgets blocks our printing calls, our receiver thread 
-            * prints the username after the message from the client so that all
-            * text the user enters here appear after their username. We should 
-            * only print the username if it hasn't already been printed, so we 
-            * check to if we were the last sender. If so, we have yet to print 
-            * the username
-            */
-            
-            fgets((char*) send_buffer, MAX_MSG_SIZE, stdin);
-            send(remote, send_buffer, MAX_MSG_SIZE, NO_FLAGS);
-
-            // Check to see if the user is requesting to quit
-            if (strcmp((char*) send_buffer, "~quit\n") == 0) {
-                pthread_kill(handler, SIGUSR1);
-                break;
-            }
+    if (state < 0) {
+        return;
+    }
 
-            printf("<%s>: ", username);
-            fflush(stdout);  
-            was_last_sender = true;
-            
-            // Clear the message buffer to prevent parts of old messages
-            // from appearing with new ones
-            memset(send_buffer, 0, MAX_MSG_SIZE);
-        }
-    }
-
-    free(send_buffer);
-    pthread_exit(NULL);
-}
-
-/* Handles the receiving of messages from the remote client */
-void *receive_messages(void* empty) {
-    struct pollfd pfd;
-    pfd.fd = remote;
-    pfd.events = POLLIN;
-
-    char* exit_cmd = "~quit\n";
-    receive_buffer = malloc(MAX_MSG_SIZE);
-    
-    while(connection_established) {
-        if (poll(&pfd, 1, 0) > 0) {
-            int msg_len = 0;
-            msg_len = recv(
-                remote,
-                receive_buffer,
-                MAX_MSG_SIZE,
-                NO_FLAGS
-            );
-
-            if (msg_len < 0) {
-                perror("In receive_messages: ");
-            } else {
-                was_last_sender = false;
+    if (chat->node != NULL) {
+        relay_set_presence(chat->node, state);
+    }
 
-                if (strcmp((char*) receive_buffer, exit_cmd) == 0) {
-                    pthread_kill(handler, SIGUSR2);
-                    break;
-                }
+    for (size_t i = 0; i < chat->nhosts; i++) {
+        if (chat->hosts[i].session != NULL) {
+            session_set_presence(chat->hosts[i].session, state);
+        }
+    }
+}
 
-                printf("\n<%s>: %s", r_username, (char*)receive_buffer); 
-                printf("<%s>: ", username);
-                fflush(stdout); // Write standard out despite no newline
+// Streams a file to the host, or from the host to each of its clients. The
+// transfer carries on in the background while chatting continues
+void send_file(chat *chat, const char *line) {
+    char path[MAX_MSG_SIZE];
+    FILE *out = open_output(chat);
+
+    strncpy(path, line, MAX_MSG_SIZE - 1);
+    path[MAX_MSG_SIZE - 1] = '\0';
+    path[strcspn(path, "\n")] = '\0';
+
+    if (path[0] == '\0') {
+        fputs("Usage: ~send <path>\n", out);
+    } else if (chat->node != NULL) {
+        int recipients = relay_send_file(chat->node, path);
+
+        if (recipients < 0) {
+            fprintf(out, "Cannot send %s\n", path);
+        } else if (recipients == 0) {
+            fputs("There is no one to send files to\n", out);
+        }
+    } else if (active_host(chat)->session == NULL || session_send_file(active_host(chat)->session, path) < 0) {
+        fprintf(out, "Cannot send %s\n", path);
+    }
 
-                memset(receive_buffer, 0, MAX_MSG_SIZE);
-            }
+    close_output(chat, out);
+}
+
+// Prints the most recent messages in the history that contain every term in
+// terms, newest first
+void search_history(chat *chat, const char *terms) {
+    FILE *out = open_output(chat);
+
+    if (chat->history == NULL) {
+        fputs("Search is only available on the host\n", out);
+        close_output(chat, out);
+        return;
+    }
+
+    // Whatever has been relayed up to now is searched too
+    index_messages(chat);
+
+    uint64_t results[MAX_SEARCH_RESULTS];
+    int64_t nmatches = search_index_query(chat->history, terms, results, MAX_SEARCH_RESULTS);
+
+    if (nmatches < 0) {
+        fputs("Usage: ~search <terms>\n", out);
+        close_output(chat, out);
+        return;
+    }
+
+    fprintf(
+        out,
+        "%ld of %lu messages matched",
+        nmatches,
+        search_index_count(chat->history)
+    );
+    if (nmatches > MAX_SEARCH_RESULTS) {
+        fprintf(out, " (showing the %d most recent)", MAX_SEARCH_RESULTS);
+    }
+    fputc('\n', out);
+
+    char match_username[MAX_UNAME_SIZE];
+    char match_msg[MAX_MSG_SIZE];
+    for (int64_t i = 0; i < nmatches && i < MAX_SEARCH_RESULTS; i++) {
+        if (search_index_get(chat->history, results[i], match_username, match_msg) == 0) {
+            fprintf(out, "  #%lu <%s>: %s\n", results[i], match_username, match_msg);
         }
     }
 
-    free(receive_buffer);
-    pthread_exit(NULL);
-}
\ No newline at end of file
+    close_output(chat, out);
+}
@@ -0,0 +1,232 @@
+// tabs.c - A tabbed terminal interface
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <chat.h>
+#include <term_windows.h>
+#include <tabs.h>
+
+#define KEY_TAB 9
+
+typedef struct tab {
+    msg_window *messages; // NULL if the tab is not open
+    char label[TABS_MAX_LABEL];
+    bool unread; // Printed to since it was last shown
+} tab;
+
+struct tabs {
+    ext_window *bar;
+    edit_window *edit;
+    tab tabs[TABS_MAX];
+    int active; // -1 if no tabs are open
+
+    char line[MAX_MSG_SIZE]; // What is being typed
+    size_t length;
+    size_t max_length; // The most that fits on the edit line
+};
+
+// Redraws the tab bar: every open tab, in order, with the active one
+// highlighted and those with unread output starred
+static void draw_bar(tabs *tabs) {
+    char label[TABS_MAX_LABEL + 3];
+    uint16_t col = 0;
+
+    ext_window_clear(tabs->bar);
+
+    for (int i = 0; i < TABS_MAX; i++) {
+        if (tabs->tabs[i].messages == NULL) {
+            continue;
+        }
+
+        snprintf(label, sizeof(label), " %s%s ", tabs->tabs[i].unread ? "*" : "", tabs->tabs[i].label);
+        if (ext_window_puts(tabs->bar, col, label, i == tabs->active) < 0) {
+            break;
+        }
+        col += strlen(label) + 1;
+    }
+}
+
+tabs *tabs_create() {
+    tabs *tabs = calloc(1, sizeof(struct tabs));
+
+    if (tabs == NULL) {
+        return NULL;
+    }
+
+    if (term_windows_init_term(NULL, stdout, stdin) < 0) {
+        free(tabs);
+        return NULL;
+    }
+    term_windows_set_deferred(true);
+
+    // Cursors only count up to 255 columns
+    uint16_t ncols = COLS < UINT8_MAX ? COLS : UINT8_MAX;
+
+    tabs->active = -1;
+    tabs->bar = ext_window_create(1, COLS, 0, 0);
+    tabs->edit = edit_window_create(1, ncols, LINES - 1, 0);
+    tabs->max_length = ncols - 1 < MAX_MSG_SIZE - 2 ? ncols - 1 : MAX_MSG_SIZE - 2;
+    term_windows_set_focus(tabs->edit);
+
+    draw_bar(tabs);
+    tabs_flush(tabs);
+
+    return tabs;
+}
+
+void tabs_destroy(tabs *tabs) {
+    for (int i = 0; i < TABS_MAX; i++) {
+        if (tabs->tabs[i].messages != NULL) {
+            msg_window_destroy(tabs->tabs[i].messages);
+        }
+    }
+
+    ext_window_destroy(tabs->bar);
+    edit_window_destroy(tabs->edit);
+    term_windows_set_focus(NULL);
+    term_windows_set_deferred(false);
+    term_windows_end();
+    free(tabs);
+}
+
+// Makes tab the one that is shown
+static void select_tab(tabs *tabs, int tab) {
+    if (tabs->active >= 0) {
+        msg_window_set_hidden(tabs->tabs[tabs->active].messages, true);
+    }
+
+    tabs->active = tab;
+    tabs->tabs[tab].unread = false;
+    msg_window_set_hidden(tabs->tabs[tab].messages, false);
+    draw_bar(tabs);
+}
+
+// Returns the open tab step places after tab, going round past either end
+static int next_tab(tabs *tabs, int tab, int step) {
+    for (int i = 1; i <= TABS_MAX; i++) {
+        int next = ((tab + i * step) % TABS_MAX + TABS_MAX) % TABS_MAX;
+
+        if (tabs->tabs[next].messages != NULL) {
+            return next;
+        }
+    }
+
+    return -1;
+}
+
+int tabs_open(tabs *tabs, const char *label) {
+    for (int i = 0; i < TABS_MAX; i++) {
+        tab *tab = &tabs->tabs[i];
+
+        if (tab->messages != NULL) {
+            continue;
+        }
+
+        tab->messages = msg_window_create(LINES - 2, COLS, 1, 0);
+        tab->messages->hidden = true;
+        strncpy(tab->label, label, TABS_MAX_LABEL - 1);
+        tab->label[TABS_MAX_LABEL - 1] = '\0';
+        tab->unread = false;
+
+        if (tabs->active < 0) {
+            select_tab(tabs, i);
+        } else {
+            draw_bar(tabs);
+        }
+
+        return i;
+    }
+
+    return -1;
+}
+
+void tabs_set_label(tabs *tabs, int tab, const char *label) {
+    strncpy(tabs->tabs[tab].label, label, TABS_MAX_LABEL - 1);
+    tabs->tabs[tab].label[TABS_MAX_LABEL - 1] = '\0';
+    draw_bar(tabs);
+}
+
+void tabs_close(tabs *tabs, int tab) {
+    msg_window_destroy(tabs->tabs[tab].messages);
+    tabs->tabs[tab].messages = NULL;
+
+    if (tabs->active == tab) {
+        tabs->active = -1;
+
+        int next = next_tab(tabs, tab, 1);
+        if (next >= 0) {
+            select_tab(tabs, next);
+            return;
+        }
+    }
+
+    draw_bar(tabs);
+}
+
+int tabs_active(tabs *tabs) {
+    return tabs->active;
+}
+
+void tabs_print(tabs *tabs, int tab, const char *text) {
+    if (tab < 0 || tabs->tabs[tab].messages == NULL) {
+        return;
+    }
+
+    msg_window_add_line(tabs->tabs[tab].messages, text);
+
+    if (tab != tabs->active && !tabs->tabs[tab].unread) {
+        tabs->tabs[tab].unread = true;
+        draw_bar(tabs);
+    }
+}
+
+int8_t tabs_read_line(tabs *tabs, char *line, size_t size) {
+    int key;
+
+    while ((key = edit_window_read_key(tabs->edit)) != ERR) {
+        if (key == KEY_TAB || key == KEY_BTAB) {
+            int next = next_tab(tabs, tabs->active, key == KEY_TAB ? 1 : -1);
+
+            if (next >= 0 && next != tabs->active) {
+                select_tab(tabs, next);
+            }
+        } else if (key == KEY_BACKSPACE || key == KEY_ALT_BACKSPACE || key == '\b') {
+            if (tabs->length > 0) {
+                tabs->length--;
+                edit_window_backspace(tabs->edit);
+            }
+        } else if (key == KEY_ENTER || key == KEY_ALT_ENTER_1 || key == KEY_ALT_ENTER_2) {
+            snprintf(line, size, "%.*s\n", (int) tabs->length, tabs->line);
+            tabs->length = 0;
+            edit_window_set_col(tabs->edit, 0);
+            edit_window_clrln(tabs->edit);
+
+            return 1;
+        } else if (key >= ' ' && key <= '~' && tabs->length < tabs->max_length) {
+            tabs->line[tabs->length++] = key;
+            edit_window_putc(tabs->edit, key);
+        }
+    }
+
+    return 0;
+}
+
+void tabs_flush() {
+    term_windows_flush();
+}
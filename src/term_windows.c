@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <term_windows.h>
 #include <string.h>
+#include <stdio.h>
 
 // TODO Create window registration
 // TODO Verify license stuff
@@ -31,13 +32,34 @@
 // message to a window and displaying all the messages in a window should be
 // decoupled and handled seperately
 
-void term_windows_init() {
-    // Set our locale to be portable, since our ncurses instance will inherit
-    // this
-    setlocale(LC_ALL, "");
+static uint64_t refresh_count; // Number of window refreshes performed
+static void (*edit_hook)(void *ctx); // Called when the contents of an edit_window change
+static void *edit_hook_ctx; // Passed to edit_hook
+static bool deferred; // Refreshes wait for term_windows_flush
+static bool flush_pending; // Windows have changed since the last flush
+static edit_window *focus; // Where the cursor is left by a flush
+
+// Every refresh goes through here so that it can be counted
+static void refresh_window(WINDOW *window) {
+    if (deferred) {
+        wnoutrefresh(window);
+        flush_pending = true;
+        return;
+    }
 
-    // Initialqize curses in standard mode
-    initscr(); // Intialize our screen; we need to do this before anything else
+    wrefresh(window);
+    refresh_count++;
+}
+
+// Hidden msg_windows are kept up to date but not drawn
+static void refresh_msg_window(msg_window *win) {
+    if (!win->hidden) {
+        refresh_window(win->window);
+    }
+}
+
+// Applies the input and output options every screen is used with
+static void configure_screen() {
     cbreak(); // Disable line-buffering (and buffering in general)
     noecho(); // Disable echoing of characters read into stdin
     nonl(); // Do not automatically read a return key press as a newline0
@@ -49,6 +71,57 @@ void term_windows_init() {
     keypad(stdscr, TRUE);
 }
 
+void term_windows_init() {
+    // Set our locale to be portable, since our ncurses instance will inherit
+    // this
+    setlocale(LC_ALL, "");
+
+    // Initialqize curses in standard mode
+    initscr(); // Intialize our screen; we need to do this before anything else
+    configure_screen();
+}
+
+int8_t term_windows_init_term(const char *type, FILE *out, FILE *in) {
+    setlocale(LC_ALL, "");
+
+    if (newterm(type, out, in) == NULL) {
+        return -1;
+    }
+    configure_screen();
+
+    return 0;
+}
+
+void term_windows_set_edit_hook(void (*hook)(void *ctx), void *ctx) {
+    edit_hook = hook;
+    edit_hook_ctx = ctx;
+}
+
+void term_windows_set_deferred(bool defer) {
+    deferred = defer;
+}
+
+void term_windows_set_focus(edit_window *win) {
+    focus = win;
+}
+
+void term_windows_flush() {
+    if (flush_pending) {
+        // The cursor ends up wherever it was in the window refreshed last
+        if (focus != NULL) {
+            wmove(focus->window, focus->print_curs->cur_line, focus->print_curs->cur_col);
+            wnoutrefresh(focus->window);
+        }
+        doupdate();
+        refresh_count++;
+        flush_pending = false;
+    }
+}
+
+uint64_t term_windows_refresh_count() {
+    return refresh_count;
+}
+
 void term_windows_end() {
     // Reset all terminal input and output options
     nocbreak();
@@ -80,6 +153,35 @@ ext_window *ext_window_create_from_existing(WINDOW *win) {
     return new_ext_window;
 }
 
+int8_t ext_window_clear(ext_window *win) {
+    werase(win->window);
+    refresh_window(win->window);
+
+    return 0;
+}
+
+int8_t ext_window_puts(ext_window *win, uint16_t col, const char *str, bool highlight) {
+    if (col >= win->ncols) {
+        return -1;
+    }
+
+    if (highlight) {
+        wattron(win->window, A_REVERSE);
+    }
+    mvwaddnstr(win->window, 0, col, str, win->ncols - col);
+    if (highlight) {
+        wattroff(win->window, A_REVERSE);
+    }
+    refresh_window(win->window);
+
+    return 0;
+}
+
+void ext_window_destroy(ext_window *win) {
+    delwin(win->window);
+    free(win);
+}
+
 edit_window *edit_window_create(uint16_t nlines, uint16_t ncols, uint16_t start_row, uint16_t start_col) {
     edit_window *new_edit_window = malloc(sizeof(edit_window));
 
@@ -94,6 +196,12 @@ edit_window *edit_window_create(uint16_t nlines, uint16_t ncols, uint16_t start_
     return new_edit_window;
 }
 
+void edit_window_destroy(edit_window *win) {
+    delwin(win->window);
+    free(win->print_curs);
+    free(win);
+}
+
 // TODO Handle case where we try to move up too many lines
 int64_t edit_window_move_v(edit_window *win, int64_t nlines) {
     uint64_t displacement = nlines;
@@ -109,7 +217,7 @@ int64_t edit_window_move_v(edit_window *win, int64_t nlines) {
     win->print_curs->cur_line += displacement;
 
     wmove(win->window, win->print_curs->cur_line, win->print_curs->cur_col);
-    wrefresh(win->window);
+    refresh_window(win->window);
 
     return displacement;
 }
@@ -129,16 +237,16 @@ int32_t edit_window_move_h(edit_window *win, int32_t ncols) {
     }
 
     wmove(win->window, win->print_curs->cur_line, win->print_curs->cur_col + displacement);
-    wrefresh(win->window);
+    refresh_window(win->window);
 
     return displacement;
 }
 
 int8_t edit_window_set_row(edit_window *win, uint16_t line_num) {
-    if (line_num >= 0 && line_num <= win->nlines) {
+    if (line_num <= win->nlines) {
         win->print_curs->cur_line = line_num;
         wmove(win->window, line_num, win->print_curs->cur_col);
-        wrefresh(win->window);
+        refresh_window(win->window);
 
         return 0;
     }
@@ -147,10 +255,10 @@ int8_t edit_window_set_row(edit_window *win, uint16_t line_num) {
 }
 
 int8_t edit_window_set_col(edit_window *win, uint16_t col_num) {
-    if (col_num >= 0 && col_num <= win->ncols) {
+    if (col_num <= win->ncols) {
         win->print_curs->cur_col = col_num;
-        wmove(win->window, col_num, win->print_curs->cur_col);
-        wrefresh(win->window);
+        wmove(win->window, win->print_curs->cur_line, col_num);
+        refresh_window(win->window);
 
         return 0;
     }
@@ -160,17 +268,21 @@ int8_t edit_window_set_col(edit_window *win, uint16_t col_num) {
 
 int8_t edit_window_clrln(edit_window *win) {
     wclrtoeol(win->window);
-    wrefresh(win->window);
+    refresh_window(win->window);
 
     return 0;
 }
 
 int8_t edit_window_putc(edit_window *win, char c) {
     waddch(win->window, c);
-    wrefresh(win->window);
+    refresh_window(win->window);
 
     win->print_curs->cur_col++;
 
+    if (edit_hook != NULL) {
+        edit_hook(edit_hook_ctx);
+    }
+
     return 0;
 }
 
@@ -181,7 +293,11 @@ int8_t edit_window_backspace(edit_window *win) {
         // Delete the character present)
         wdelch(win->window);
 
-        wrefresh(win->window);
+        refresh_window(win->window);
+
+        if (edit_hook != NULL) {
+            edit_hook(edit_hook_ctx);
+        }
 
         return 0;
     }
@@ -189,6 +305,15 @@ int8_t edit_window_backspace(edit_window *win) {
     return -1;
 }
 
+int edit_window_read_key(edit_window *win) {
+    // Keys are read without waiting, from the window so that the cursor is
+    // left where the user is typing
+    nodelay(win->window, TRUE);
+    keypad(win->window, TRUE);
+
+    return wgetch(win->window);
+}
+
 msg_window *msg_window_create(uint16_t nlines, uint16_t ncols, uint16_t start_row, uint16_t start_col) {
     msg_window *new_msg_window = malloc(sizeof(msg_window));
 
@@ -205,9 +330,18 @@ msg_window *msg_window_create(uint16_t nlines, uint16_t ncols, uint16_t start_ro
     new_msg_window->print_curs->cur_line = 0;
     new_msg_window->print_curs->cur_col = 0;
 
+    new_msg_window->hidden = false;
+
     return new_msg_window;
 }
 
+void msg_window_destroy(msg_window *win) {
+    delwin(win->window);
+    free(win->read_curs);
+    free(win->print_curs);
+    free(win);
+}
+
 // TODO Handle case where we try to move up too many lines
 int64_t msg_window_move_v(msg_window *win, int64_t nlines) {
     uint64_t displacement = nlines;
@@ -223,7 +357,7 @@ int64_t msg_window_move_v(msg_window *win, int64_t nlines) {
     win->print_curs->cur_line += displacement;
 
     wmove(win->window, win->print_curs->cur_line, win->print_curs->cur_col);
-    wrefresh(win->window);
+    refresh_msg_window(win);
 
     return displacement;
 }
@@ -245,16 +379,16 @@ int32_t msg_window_move_h(msg_window *win, int32_t ncols) {
     win->print_curs->cur_col += displacement;
 
     wmove(win->window, win->print_curs->cur_line, win->print_curs->cur_col);
-    wrefresh(win->window);
+    refresh_msg_window(win);
 
     return displacement;
 }
 
 int8_t msg_window_set_row(msg_window *win, uint16_t line_num) {
-    if (line_num >= 0 && line_num <= win->nlines) {
+    if (line_num <= win->nlines) {
         win->print_curs->cur_line = line_num;
         wmove(win->window, line_num, win->print_curs->cur_col);
-        wrefresh(win->window);
+        refresh_msg_window(win);
 
         return 0;
     }
@@ -263,10 +397,10 @@ int8_t msg_window_set_row(msg_window *win, uint16_t line_num) {
 }
 
 int8_t msg_window_set_col(msg_window *win, uint16_t col_num) {
-    if (col_num >= 0 && col_num <= win->ncols) {
+    if (col_num <= win->ncols) {
         win->print_curs->cur_col = col_num;
         wmove(win->window, win->print_curs->cur_line, col_num);
-        wrefresh(win->window);
+        refresh_msg_window(win);
 
         return 0;
     }
@@ -284,9 +418,40 @@ int8_t msg_window_scroll(msg_window* win, uint64_t nlines) {
 
 int8_t msg_window_puts(msg_window *win, char* str) {
     waddstr(win->window, str);
-    wrefresh(win->window);
+    refresh_msg_window(win);
 
     win->print_curs->cur_col += strlen(str);
 
     return 0;
-}
\ No newline at end of file
+}
+int8_t msg_window_add_line(msg_window *win, const char *str) {
+    int line, col;
+
+    wmove(win->window, win->print_curs->cur_line, win->print_curs->cur_col);
+    waddstr(win->window, str);
+
+    // ncurses wraps and scrolls as it goes; all that is left is to finish
+    // the line if str did not
+    getyx(win->window, line, col);
+    if (col != 0) {
+        waddch(win->window, '\n');
+        getyx(win->window, line, col);
+    }
+
+    win->print_curs->cur_line = line;
+    win->print_curs->cur_col = col;
+    refresh_msg_window(win);
+
+    return 0;
+}
+
+void msg_window_set_hidden(msg_window *win, bool hidden) {
+    win->hidden = hidden;
+
+    // Everything written while hidden has to be drawn, not just what changed
+    // since the last refresh
+    if (!hidden) {
+        touchwin(win->window);
+        refresh_window(win->window);
+    }
+}
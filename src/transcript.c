@@ -0,0 +1,357 @@
+// transcript.c - An asynchronous, group-committing transcript logger
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <transcript.h>
+
+#define WRITE_BUFFER_SIZE 65536 // Records are batched into writes this large
+
+// A slot in the ring. sequence tells producers and the writer whose turn it
+// is to use the slot (see transcript_logger_log)
+typedef struct transcript_slot {
+    _Atomic uint64_t sequence;
+    uint16_t length;
+    uint8_t record[TRANSCRIPT_MAX_RECORD_SIZE];
+} transcript_slot;
+
+struct transcript_logger {
+    int fd;
+    uint32_t sync_ms;
+    uint64_t sync_bytes;
+    uint8_t *buffer; // Where the writer batches records, WRITE_BUFFER_SIZE bytes
+
+    pthread_t writer;
+    atomic_bool running;
+    atomic_uint_fast64_t dropped;
+
+    // The writer sleeps on wakeup once the ring is empty, setting sleeping
+    // first so that producers know to write to it
+    int wakeup;
+    atomic_bool sleeping;
+
+    // Producers claim slots by advancing enqueue_pos; only the writer thread
+    // touches dequeue_pos. They sit on separate cache lines so producers and
+    // the writer do not fight over them
+    _Alignas(64) _Atomic uint64_t enqueue_pos;
+    _Alignas(64) uint64_t dequeue_pos;
+    transcript_slot slots[TRANSCRIPT_QUEUE_SIZE];
+};
+
+static void put_u16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Writes all of buf to fd, retrying on short writes
+static bool write_all(int fd, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+
+        if (written < 0) {
+            return false;
+        }
+
+        buf += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+// Fills in record as msg being sent or received by username now, or as the
+// note of dropped records. Returns its length
+static uint16_t encode_record(uint8_t *record, uint8_t direction, const char *username, const char *msg) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    size_t u_len = strnlen(username, MAX_UNAME_SIZE);
+    size_t m_len = strnlen(msg, MAX_MSG_SIZE);
+    uint16_t length = TRANSCRIPT_RECORD_HEADER_SIZE + u_len + m_len;
+
+    put_u16(record, length);
+    record[2] = direction;
+    record[3] = u_len;
+    put_u64(record + 4, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+    memcpy(record + TRANSCRIPT_RECORD_HEADER_SIZE, username, u_len);
+    memcpy(record + TRANSCRIPT_RECORD_HEADER_SIZE + u_len, msg, m_len);
+
+    return length;
+}
+
+// Returns true if the writer has nothing to dequeue
+static bool ring_empty(transcript_logger *logger) {
+    transcript_slot *slot = &logger->slots[logger->dequeue_pos & (TRANSCRIPT_QUEUE_SIZE - 1)];
+
+    return atomic_load_explicit(&slot->sequence, memory_order_acquire) != logger->dequeue_pos + 1;
+}
+
+// Moves the next record out of the ring into out. Returns its length, or 0 if
+// the ring is empty
+static uint16_t dequeue(transcript_logger *logger, uint8_t *out) {
+    transcript_slot *slot = &logger->slots[logger->dequeue_pos & (TRANSCRIPT_QUEUE_SIZE - 1)];
+    uint64_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+    if (seq != logger->dequeue_pos + 1) {
+        return 0;
+    }
+
+    uint16_t length = slot->length;
+    memcpy(out, slot->record, length);
+
+    // Hand the slot back to producers for their next lap around the ring
+    atomic_store_explicit(&slot->sequence, logger->dequeue_pos + TRANSCRIPT_QUEUE_SIZE, memory_order_release);
+    logger->dequeue_pos++;
+
+    return length;
+}
+
+static void *write_transcript(void *arg) {
+    transcript_logger *logger = arg;
+    uint8_t *buffer = logger->buffer;
+    size_t buffered = 0;
+    uint64_t unsynced = 0;
+    uint64_t last_sync = monotonic_ms();
+    uint64_t reported = 0; // Dropped records already noted in the transcript
+
+    for (;;) {
+        // Read the flag before draining so nothing queued ahead of shutdown
+        // can be missed
+        bool running = atomic_load(&logger->running);
+        uint64_t dropped = atomic_load_explicit(&logger->dropped, memory_order_relaxed);
+        uint16_t length;
+
+        // Records dropped since the last drain are noted ahead of those that
+        // made it into the ring after them
+        if (dropped > reported) {
+            char count[24];
+
+            snprintf(count, sizeof(count), "%lu", dropped - reported);
+            buffered += encode_record(buffer + buffered, TRANSCRIPT_DROPPED, "", count);
+            reported = dropped;
+        }
+
+        while (buffered + TRANSCRIPT_MAX_RECORD_SIZE <= WRITE_BUFFER_SIZE
+            && (length = dequeue(logger, buffer + buffered)) > 0) {
+            buffered += length;
+        }
+
+        if (buffered > 0) {
+            if (!write_all(logger->fd, buffer, buffered)) {
+                perror("In write_transcript - failed to write transcript");
+            }
+
+            unsynced += buffered;
+
+            // The buffer filled up before the ring emptied; keep draining
+            // before deciding whether to sync
+            bool more = buffered + TRANSCRIPT_MAX_RECORD_SIZE > WRITE_BUFFER_SIZE;
+            buffered = 0;
+            if (more) {
+                continue;
+            }
+        }
+
+        uint64_t now = monotonic_ms();
+        if (unsynced > 0 && (unsynced >= logger->sync_bytes
+            || now - last_sync >= logger->sync_ms || !running)) {
+            fdatasync(logger->fd);
+            unsynced = 0;
+            last_sync = now;
+        }
+
+        if (!running) {
+            break;
+        }
+
+        // Sleep until a record is queued, the logger is destroyed or the
+        // next sync is due. Checking the ring again after setting sleeping
+        // means a record queued in between is never slept through: either
+        // we see it, or its producer sees sleeping and wakes us
+        int timeout = -1;
+        if (unsynced > 0) {
+            uint64_t since = now - last_sync;
+            timeout = since >= logger->sync_ms ? 0 : logger->sync_ms - since;
+        }
+
+        atomic_store_explicit(&logger->sleeping, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (ring_empty(logger)) {
+            struct pollfd pfd = { logger->wakeup, POLLIN, 0 };
+            uint64_t count;
+
+            poll(&pfd, 1, timeout);
+            read(logger->wakeup, &count, sizeof(count));
+        }
+
+        atomic_store_explicit(&logger->sleeping, false, memory_order_relaxed);
+    }
+
+    pthread_exit(NULL);
+}
+
+transcript_logger *transcript_logger_create(const char *path, uint32_t sync_ms, uint64_t sync_bytes) {
+    transcript_logger *logger = aligned_alloc(64, sizeof(transcript_logger));
+
+    if (logger == NULL) {
+        return NULL;
+    }
+
+    logger->buffer = malloc(WRITE_BUFFER_SIZE);
+    logger->wakeup = eventfd(0, EFD_NONBLOCK);
+
+    if (logger->buffer == NULL || logger->wakeup < 0) {
+        if (logger->wakeup >= 0) {
+            close(logger->wakeup);
+        }
+        free(logger->buffer);
+        free(logger);
+        return NULL;
+    }
+
+    logger->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+    if (logger->fd < 0) {
+        perror("In transcript_logger_create - failed to open transcript");
+        close(logger->wakeup);
+        free(logger->buffer);
+        free(logger);
+        return NULL;
+    }
+
+    // New transcripts start with the file header
+    if (lseek(logger->fd, 0, SEEK_END) == 0) {
+        uint8_t header[TRANSCRIPT_FILE_HEADER_SIZE];
+
+        memcpy(header, TRANSCRIPT_MAGIC, 4);
+        put_u16(header + 4, TRANSCRIPT_VERSION);
+        put_u16(header + 6, 0);
+        write_all(logger->fd, header, TRANSCRIPT_FILE_HEADER_SIZE);
+    }
+
+    logger->sync_ms = sync_ms;
+    logger->sync_bytes = sync_bytes;
+    atomic_init(&logger->running, true);
+    atomic_init(&logger->dropped, 0);
+    atomic_init(&logger->sleeping, false);
+    atomic_init(&logger->enqueue_pos, 0);
+    logger->dequeue_pos = 0;
+
+    // Slot i is first free for the producer that claims position i
+    for (uint64_t i = 0; i < TRANSCRIPT_QUEUE_SIZE; i++) {
+        atomic_init(&logger->slots[i].sequence, i);
+    }
+
+    // The writer inherits our signal mask. Block everything while spawning it
+    // so that signals meant for the handler thread are never delivered there
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+    int result = pthread_create(&logger->writer, NULL, write_transcript, logger);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (result != 0) {
+        close(logger->fd);
+        close(logger->wakeup);
+        free(logger->buffer);
+        free(logger);
+        return NULL;
+    }
+
+    return logger;
+}
+
+int8_t transcript_logger_log(transcript_logger *logger, uint8_t direction, const char *username, const char *msg) {
+    uint64_t pos = atomic_load_explicit(&logger->enqueue_pos, memory_order_relaxed);
+    transcript_slot *slot;
+
+    // A slot whose sequence equals our position is free for us to claim. A
+    // smaller sequence means the writer has not emptied it yet: the ring is
+    // full. A larger one means another producer beat us to it
+    for (;;) {
+        slot = &logger->slots[pos & (TRANSCRIPT_QUEUE_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t diff = (int64_t) (seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&logger->enqueue_pos, &pos, pos + 1,
+                memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&logger->dropped, 1, memory_order_relaxed);
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&logger->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->length = encode_record(slot->record, direction, username, msg);
+
+    // Publish the record to the writer, and wake it if it has gone to sleep
+    // (see write_transcript)
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&logger->sleeping, memory_order_relaxed)
+        && atomic_exchange_explicit(&logger->sleeping, false, memory_order_relaxed)) {
+        uint64_t one = 1;
+        write(logger->wakeup, &one, sizeof(one));
+    }
+
+    return 0;
+}
+
+uint64_t transcript_logger_destroy(transcript_logger *logger) {
+    uint64_t one = 1;
+
+    atomic_store(&logger->running, false);
+    write(logger->wakeup, &one, sizeof(one));
+    pthread_join(logger->writer, NULL);
+
+    close(logger->fd);
+    close(logger->wakeup);
+
+    uint64_t dropped = atomic_load(&logger->dropped);
+    free(logger->buffer);
+    free(logger);
+
+    return dropped;
+}
@@ -0,0 +1,113 @@
+// transcript_dump - Prints a sockets_chat transcript in readable form
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <transcript.h>
+
+static uint16_t get_u16(const uint8_t *in) {
+    return in[0] | (uint16_t) in[1] << 8;
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+    uint64_t value = 0;
+
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+
+    return value;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s TRANSCRIPT\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror("In main - failed to open transcript");
+        return 2;
+    }
+
+    uint8_t header[TRANSCRIPT_FILE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)
+        || memcmp(header, TRANSCRIPT_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s is not a transcript\n", argv[1]);
+        return 3;
+    }
+
+    if (get_u16(header + 4) != TRANSCRIPT_VERSION) {
+        fprintf(stderr, "Unsupported transcript version %d\n", get_u16(header + 4));
+        return 4;
+    }
+
+    uint8_t record[TRANSCRIPT_MAX_RECORD_SIZE];
+    uint64_t nrecords = 0;
+
+    while (fread(record, 1, TRANSCRIPT_RECORD_HEADER_SIZE, file) == TRANSCRIPT_RECORD_HEADER_SIZE) {
+        uint16_t length = get_u16(record);
+        uint8_t u_len = record[3];
+
+        if (length < TRANSCRIPT_RECORD_HEADER_SIZE + u_len || length > TRANSCRIPT_MAX_RECORD_SIZE) {
+            fprintf(stderr, "Corrupt record after %lu records\n", nrecords);
+            return 5;
+        }
+
+        size_t body = length - TRANSCRIPT_RECORD_HEADER_SIZE;
+        if (fread(record + TRANSCRIPT_RECORD_HEADER_SIZE, 1, body, file) != body) {
+            fprintf(stderr, "Truncated record after %lu records\n", nrecords);
+            return 5;
+        }
+
+        uint64_t timestamp = get_u64(record + 4);
+        time_t seconds = timestamp / 1000000000;
+        char time_str[32];
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+
+        const char *username = (char*) record + TRANSCRIPT_RECORD_HEADER_SIZE;
+        const char *msg = username + u_len;
+        int m_len = body - u_len;
+
+        // Messages usually carry the newline they were typed with
+        if (m_len > 0 && msg[m_len - 1] == '\n') {
+            m_len--;
+        }
+
+        if (record[2] == TRANSCRIPT_DROPPED) {
+            printf("%s.%09lu !! %.*s records dropped\n", time_str, timestamp % 1000000000, m_len, msg);
+            nrecords++;
+            continue;
+        }
+
+        printf(
+            "%s.%09lu %s <%.*s>: %.*s\n",
+            time_str,
+            timestamp % 1000000000,
+            record[2] == TRANSCRIPT_SENT ? "->" : "<-",
+            u_len, username,
+            m_len, msg
+        );
+        nrecords++;
+    }
+
+    fclose(file);
+
+    return 0;
+}
@@ -0,0 +1,313 @@
+// frame_test - Tests the frame codec and frame_reader
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <frame.h>
+#include "test.h"
+
+#define MAX_FRAME_SIZE (FRAME_HEADER_SIZE + 8 * FRAME_MAX_HOPS + FRAME_MAX_PAYLOAD)
+#define CHUNK_SIZE 5000 // Larger than any other payload
+
+// Opens a connected pair of sockets; frames are written to fds[0] and read
+// from fds[1]
+static void open_pair(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("In open_pair - failed to open a socket pair");
+        fds[0] = fds[1] = -1;
+    }
+}
+
+static void close_pair(int fds[2]) {
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Encodes the frame described by header and payload into out, as frame_send
+// puts it on the wire. Returns its size
+static size_t encode_frame(uint8_t *out, const frame_header *header, const void *payload) {
+    int fds[2];
+    ssize_t size = -1;
+
+    open_pair(fds);
+    if (frame_send(fds[0], header, payload) == 0) {
+        size = recv(fds[1], out, MAX_FRAME_SIZE, MSG_DONTWAIT);
+    }
+    close_pair(fds);
+
+    return size > 0 ? (size_t) size : 0;
+}
+
+// A message with hops comes out as it went in
+static void test_round_trip() {
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + MAX_MSG_SIZE];
+    frame_reader in;
+    char username[MAX_UNAME_SIZE], msg[MAX_MSG_SIZE];
+    int fds[2];
+
+    open_pair(fds);
+    memset(&in, 0, sizeof(in));
+
+    frame_init_message(&header, payload, "alice", "hello there");
+    header.origin = 7;
+    header.id = 42;
+    frame_stamp_hop(&header);
+    frame_stamp_hop(&header);
+
+    CHECK(frame_send(fds[0], &header, payload) == 0);
+    CHECK(frame_reader_recv(&in, fds[1]) == 1);
+    CHECK(in.header.type == FRAME_MESSAGE);
+    CHECK(in.header.origin == 7);
+    CHECK(in.header.id == 42);
+    CHECK(in.header.sent_at == header.sent_at);
+    CHECK(in.header.nhops == 2);
+    CHECK(in.header.hops[0] == header.hops[0] && in.header.hops[1] == header.hops[1]);
+
+    frame_split_message(&in.header, in.payload, username, msg);
+    CHECK(strcmp(username, "alice") == 0);
+    CHECK(strcmp(msg, "hello there") == 0);
+
+    close_pair(fds);
+}
+
+// A frame trickling in a byte at a time is pending until its last byte
+static void test_byte_at_a_time() {
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + MAX_MSG_SIZE];
+    uint8_t encoded[MAX_FRAME_SIZE];
+    frame_reader in;
+    int fds[2];
+
+    open_pair(fds);
+    memset(&in, 0, sizeof(in));
+
+    frame_init_message(&header, payload, "bob", "one byte at a time");
+    frame_stamp_hop(&header);
+    size_t size = encode_frame(encoded, &header, payload);
+
+    CHECK(!frame_reader_busy(&in));
+    CHECK(frame_reader_recv(&in, fds[1]) == FRAME_PENDING);
+
+    for (size_t i = 0; i < size - 1; i++) {
+        CHECK(write(fds[0], encoded + i, 1) == 1);
+        CHECK(frame_reader_recv(&in, fds[1]) == FRAME_PENDING);
+        CHECK(frame_reader_busy(&in));
+    }
+
+    CHECK(write(fds[0], encoded + size - 1, 1) == 1);
+    CHECK(frame_reader_recv(&in, fds[1]) == 1);
+    CHECK(in.header.length == header.length);
+    CHECK(memcmp(in.payload, payload, header.length) == 0);
+
+    // A complete frame is returned again until the reader moves on
+    CHECK(frame_reader_recv(&in, fds[1]) == 1);
+    frame_reader_next(&in);
+    CHECK(!frame_reader_busy(&in));
+    CHECK(frame_reader_recv(&in, fds[1]) == FRAME_PENDING);
+
+    close_pair(fds);
+}
+
+// Frames that arrive together are read one at a time
+static void test_back_to_back() {
+    frame_header first, second;
+    uint8_t payload[MAX_UNAME_SIZE + MAX_MSG_SIZE];
+    uint8_t encoded[2 * MAX_FRAME_SIZE];
+    frame_reader in;
+    int fds[2];
+
+    open_pair(fds);
+    memset(&in, 0, sizeof(in));
+
+    frame_init_message(&first, payload, "carol", "first");
+    size_t size = encode_frame(encoded, &first, payload);
+
+    memset(&second, 0, sizeof(second));
+    second.type = FRAME_SYNC;
+    second.id = 1234;
+    size += encode_frame(encoded + size, &second, NULL);
+
+    CHECK(write(fds[0], encoded, size) == (ssize_t) size);
+
+    CHECK(frame_reader_recv(&in, fds[1]) == 1);
+    CHECK(in.header.type == FRAME_MESSAGE);
+    frame_reader_next(&in);
+
+    CHECK(frame_reader_recv(&in, fds[1]) == 1);
+    CHECK(in.header.type == FRAME_SYNC && in.header.id == 1234 && in.header.length == 0);
+    frame_reader_next(&in);
+
+    CHECK(frame_reader_recv(&in, fds[1]) == FRAME_PENDING);
+
+    close_pair(fds);
+}
+
+// Headers that cannot be valid are errors, and a closed connection is told
+// apart from one that has nothing more yet
+static void test_bad_frames() {
+    static uint8_t payload[FRAME_MAX_CHUNK + 1];
+    frame_header header;
+    frame_reader in;
+    int fds[2];
+
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_MESSAGE;
+    header.length = FRAME_MAX_PAYLOAD + 1;
+
+    open_pair(fds);
+    memset(&in, 0, sizeof(in));
+    CHECK(frame_send(fds[0], &header, payload) == 0);
+    CHECK(frame_reader_recv(&in, fds[1]) == -1);
+    close_pair(fds);
+
+    // The username cannot be longer than the payload it is part of
+    header.length = 4;
+    header.uname_len = 5;
+
+    open_pair(fds);
+    frame_reader_next(&in);
+    CHECK(frame_send(fds[0], &header, payload) == 0);
+    CHECK(frame_reader_recv(&in, fds[1]) == -1);
+    close_pair(fds);
+
+    // Chunks may be larger than other payloads, up to a point
+    header.type = FRAME_FILE_CHUNK;
+    header.uname_len = 0;
+    header.length = FRAME_MAX_CHUNK + 1;
+
+    open_pair(fds);
+    frame_reader_next(&in);
+    CHECK(frame_send(fds[0], &header, payload) == 0);
+    CHECK(frame_reader_recv(&in, fds[1]) == -1);
+    close_pair(fds);
+
+    open_pair(fds);
+    frame_reader_next(&in);
+    close(fds[0]);
+    CHECK(frame_reader_recv(&in, fds[1]) == 0);
+    close(fds[1]);
+}
+
+// A chunk is complete once its header is in; the data is left for the caller
+static void test_file_chunk() {
+    frame_header header;
+    uint8_t data[CHUNK_SIZE];
+    uint8_t read_back[CHUNK_SIZE];
+    frame_reader in;
+    int fds[2];
+
+    open_pair(fds);
+    memset(&in, 0, sizeof(in));
+    memset(data, 'x', sizeof(data));
+
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_FILE_CHUNK;
+    header.id = 3;
+    header.length = sizeof(data);
+
+    CHECK(frame_send(fds[0], &header, data) == 0);
+    CHECK(frame_reader_recv(&in, fds[1]) == 1);
+    CHECK(in.header.type == FRAME_FILE_CHUNK && in.header.length == sizeof(data));
+    CHECK(recv(fds[1], read_back, sizeof(read_back), MSG_WAITALL) == sizeof(read_back));
+    CHECK(memcmp(read_back, data, sizeof(data)) == 0);
+
+    close_pair(fds);
+}
+
+// Part of a frame saved from one reader is finished in another
+static void test_save_restore() {
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + MAX_MSG_SIZE];
+    uint8_t encoded[MAX_FRAME_SIZE];
+    uint8_t saved[sizeof(frame_reader)];
+    frame_reader in, restored;
+    int fds[2];
+
+    open_pair(fds);
+    memset(&in, 0, sizeof(in));
+    memset(&restored, 0, sizeof(restored));
+
+    frame_init_message(&header, payload, "dave", "saved partway through the payload");
+    frame_stamp_hop(&header);
+    size_t size = encode_frame(encoded, &header, payload);
+    size_t split = size - 10;
+
+    CHECK(write(fds[0], encoded, split) == (ssize_t) split);
+    CHECK(frame_reader_recv(&in, fds[1]) == FRAME_PENDING);
+
+    size_t length = frame_reader_save(&in, 0, saved);
+
+    CHECK(length == split);
+    CHECK(frame_reader_restore(&restored, saved, length) == 0);
+    CHECK(frame_reader_busy(&restored));
+
+    CHECK(write(fds[0], encoded + split, size - split) == (ssize_t) (size - split));
+    CHECK(frame_reader_recv(&restored, fds[1]) == 1);
+    CHECK(restored.header.nhops == 1 && restored.header.hops[0] == header.hops[0]);
+    CHECK(memcmp(restored.payload, payload, header.length) == 0);
+
+    // A chunk is saved as just what is left of it
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_FILE_CHUNK;
+    header.length = 1000;
+
+    frame_reader_next(&in);
+    size = frame_encode_header(encoded, &header);
+    CHECK(write(fds[0], encoded, size) == (ssize_t) size);
+    CHECK(frame_reader_recv(&in, fds[1]) == 1);
+    length = frame_reader_save(&in, 400, saved);
+    CHECK(frame_reader_restore(&restored, saved, length) == 0);
+    CHECK(restored.header.type == FRAME_FILE_CHUNK && restored.header.length == 400);
+
+    // Garbage is not a frame
+    memset(saved, 0xff, FRAME_HEADER_SIZE);
+    CHECK(frame_reader_restore(&restored, saved, FRAME_HEADER_SIZE) == -1);
+
+    close_pair(fds);
+}
+
+// A HELLO carries a session to resume only when given one
+static void test_hello() {
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + FRAME_RESUME_SIZE];
+    char username[MAX_UNAME_SIZE];
+    uint64_t token, seq;
+
+    frame_init_hello(&header, payload, FRAME_HELLO_CLIENT, "erin", 0, 0);
+    CHECK(!frame_split_resume(&header, payload, &token, &seq));
+    CHECK(token == 0 && seq == 0);
+
+    frame_init_hello(&header, payload, FRAME_HELLO_CLIENT, "erin", 0x0123456789abcdefULL, 99);
+    CHECK(frame_split_resume(&header, payload, &token, &seq));
+    CHECK(token == 0x0123456789abcdefULL && seq == 99);
+
+    frame_split_message(&header, payload, username, NULL);
+    CHECK(strcmp(username, "erin") == 0);
+}
+
+int main() {
+    test_round_trip();
+    test_byte_at_a_time();
+    test_back_to_back();
+    test_bad_frames();
+    test_file_chunk();
+    test_save_restore();
+    test_hello();
+
+    return test_result("frame_test");
+}
@@ -0,0 +1,289 @@
+// outbox_test - Tests the outbox's lanes, budget and saving
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <outbox.h>
+#include "test.h"
+
+#define MAX_FRAMES 256 // The most frames a test reads back
+#define MESSAGES 100 // Messages queued in each lane
+#define MESSAGE_SIZE (FRAME_HEADER_SIZE + MAX_UNAME_SIZE + MAX_MSG_SIZE) // The most a message takes
+#define FILE_SIZE 3000 // Bytes of the file sent from disk
+
+// A frame as it came out of an outbox
+typedef struct sent_frame {
+    uint8_t type;
+    uint8_t lane;
+    uint64_t id;
+} sent_frame;
+
+// Queues a message numbered id, replayed (and so bulk) if replayed is set
+static int8_t push_message(outbox *box, uint64_t id, bool replayed) {
+    static char filler[MAX_MSG_SIZE];
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + MAX_MSG_SIZE];
+
+    memset(filler, 'm', MAX_MSG_SIZE - 1);
+    frame_init_message(&header, payload, "alice", filler);
+    header.id = id;
+    header.flags = replayed ? FRAME_MESSAGE_REPLAYED : 0;
+
+    return outbox_push(box, &header, payload);
+}
+
+// Queues a frame of type with no payload, numbered id
+static int8_t push_empty(outbox *box, uint8_t type, uint64_t id) {
+    frame_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.id = id;
+
+    return outbox_push(box, &header, NULL);
+}
+
+// Flushes box into a socket pair and reads back up to max frames into frames.
+// Returns how many were read
+static size_t flush_and_read(outbox *box, sent_frame *frames, size_t max) {
+    frame_reader *in = calloc(1, sizeof(frame_reader));
+    size_t count = 0;
+    int fds[2];
+
+    if (in == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        free(in);
+        return 0;
+    }
+
+    CHECK(outbox_drain(box, fds[0], 1000) == 1);
+    close(fds[0]);
+
+    while (count < max && frame_reader_recv(in, fds[1]) == 1) {
+        frames[count].type = in->header.type;
+        frames[count].lane = outbox_lane(&in->header);
+        frames[count].id = in->header.id;
+        count++;
+
+        // The data of a chunk follows its header
+        if (in->header.type == FRAME_FILE_CHUNK) {
+            uint8_t data[FILE_SIZE];
+
+            CHECK(in->header.length <= FILE_SIZE);
+            CHECK(recv(fds[1], data, in->header.length, MSG_WAITALL) == (ssize_t) in->header.length);
+        }
+        frame_reader_next(in);
+    }
+
+    close(fds[1]);
+    free(in);
+
+    return count;
+}
+
+// Frames go in the lanes outbox.h says they do
+static void test_lanes() {
+    frame_header header;
+
+    memset(&header, 0, sizeof(header));
+
+    uint8_t control[] = { FRAME_HELLO, FRAME_PING, FRAME_PONG, FRAME_SYNC, FRAME_FILE_ACK, FRAME_PRESENCE };
+    for (size_t i = 0; i < sizeof(control); i++) {
+        header.type = control[i];
+        CHECK(outbox_lane(&header) == OUTBOX_CONTROL);
+    }
+
+    header.type = FRAME_MESSAGE;
+    CHECK(outbox_lane(&header) == OUTBOX_INTERACTIVE);
+    header.type = FRAME_QUIT;
+    CHECK(outbox_lane(&header) == OUTBOX_INTERACTIVE);
+
+    uint8_t bulk[] = { FRAME_FILE_START, FRAME_FILE_CHUNK, FRAME_FILE_END };
+    for (size_t i = 0; i < sizeof(bulk); i++) {
+        header.type = bulk[i];
+        CHECK(outbox_lane(&header) == OUTBOX_BULK);
+    }
+
+    header.type = FRAME_MESSAGE;
+    header.flags = FRAME_MESSAGE_REPLAYED;
+    CHECK(outbox_lane(&header) == OUTBOX_BULK);
+    header.type = FRAME_PRESENCE;
+    header.flags = FRAME_PRESENCE_SNAPSHOT;
+    CHECK(outbox_lane(&header) == OUTBOX_BULK);
+}
+
+// Control goes first, the interactive lane gets several times the bulk lane's
+// share, and every lane keeps its order
+static void test_round_robin() {
+    outbox *box = outbox_create(OUTBOX_MAX_BYTES);
+    sent_frame frames[MAX_FRAMES];
+    uint64_t last[OUTBOX_LANES] = { 0 };
+    size_t interactive = 0, bulk = 0;
+
+    for (uint64_t id = 1; id <= MESSAGES; id++) {
+        CHECK(push_message(box, id, true) == 0);
+    }
+    for (uint64_t id = 1; id <= MESSAGES; id++) {
+        CHECK(push_message(box, id, false) == 0);
+    }
+    CHECK(push_empty(box, FRAME_PING, 1) == 0);
+    CHECK(outbox_pending(box));
+    CHECK(outbox_memory(box) > 2 * MESSAGES * MAX_MSG_SIZE);
+
+    size_t count = flush_and_read(box, frames, MAX_FRAMES);
+
+    CHECK(count == 2 * MESSAGES + 1);
+    CHECK(frames[0].type == FRAME_PING);
+
+    for (size_t i = 0; i < count; i++) {
+        CHECK(frames[i].id > last[frames[i].lane]);
+        last[frames[i].lane] = frames[i].id;
+
+        if (i <= MESSAGES / 2) {
+            interactive += frames[i].lane == OUTBOX_INTERACTIVE;
+            bulk += frames[i].lane == OUTBOX_BULK;
+        }
+    }
+
+    // About four interactive frames go out for every bulk one while both
+    // lanes have some, but the bulk lane is not starved
+    CHECK(interactive >= 3 * bulk);
+    CHECK(bulk > 0);
+    CHECK(!outbox_pending(box));
+
+    outbox_destroy(box);
+}
+
+// A QUIT throws away the bulk frames still waiting, but not the chat before it
+static void test_quit_discards_bulk() {
+    outbox *box = outbox_create(OUTBOX_MAX_BYTES);
+    sent_frame frames[MAX_FRAMES];
+
+    for (uint64_t id = 1; id <= 5; id++) {
+        push_message(box, id, true);
+        push_message(box, id, false);
+    }
+    push_empty(box, FRAME_QUIT, 0);
+
+    size_t count = flush_and_read(box, frames, MAX_FRAMES);
+
+    CHECK(count == 6);
+    for (size_t i = 0; i < count; i++) {
+        CHECK(frames[i].lane == OUTBOX_INTERACTIVE);
+    }
+    CHECK(frames[count - 1].type == FRAME_QUIT);
+
+    outbox_destroy(box);
+}
+
+// Frames past the budget are refused, and clearing frees the room up again
+static void test_budget() {
+    outbox *box = outbox_create(10 * MESSAGE_SIZE);
+    int accepted = 0;
+
+    while (push_message(box, accepted + 1, false) == 0) {
+        accepted++;
+    }
+
+    CHECK(accepted >= 5 && accepted <= 10);
+
+    outbox_clear(box);
+    CHECK(!outbox_pending(box));
+    CHECK(push_message(box, 1, false) == 0);
+
+    outbox_destroy(box);
+}
+
+// File data is sent from the file, after its header
+static void test_file() {
+    outbox *box = outbox_create(OUTBOX_MAX_BYTES);
+    sent_frame frames[MAX_FRAMES];
+    char path[] = "/tmp/outbox_testXXXXXX";
+    uint8_t data[FILE_SIZE];
+    frame_header chunk;
+    int file = mkstemp(path);
+
+    CHECK(file >= 0);
+    unlink(path);
+    memset(data, 'f', sizeof(data));
+    CHECK(write(file, data, sizeof(data)) == sizeof(data));
+
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.type = FRAME_FILE_CHUNK;
+    chunk.id = 9;
+    chunk.length = FILE_SIZE - 1000;
+
+    CHECK(outbox_push_file(box, &chunk, file, 1000) == 0);
+    close(file);
+
+    // Only the header is held in memory
+    CHECK(outbox_memory(box) < FILE_SIZE);
+
+    size_t count = flush_and_read(box, frames, MAX_FRAMES);
+
+    CHECK(count == 1);
+    CHECK(frames[0].type == FRAME_FILE_CHUNK && frames[0].id == 9);
+
+    outbox_destroy(box);
+}
+
+// What is saved from one outbox is sent, byte for byte, by another
+static void test_save_restore() {
+    outbox *box = outbox_create(OUTBOX_MAX_BYTES);
+    outbox *restored = outbox_create(OUTBOX_MAX_BYTES);
+    uint8_t expected[32 * MESSAGE_SIZE], received[32 * MESSAGE_SIZE];
+    size_t length;
+    int fds[2];
+
+    for (uint64_t id = 1; id <= 5; id++) {
+        push_message(box, id, id % 2 == 0);
+        push_empty(box, FRAME_PING, id);
+    }
+
+    uint8_t *saved = outbox_save(box, &length);
+
+    CHECK(saved != NULL);
+    CHECK(length < sizeof(expected));
+    CHECK(outbox_restore(restored, saved, length) == 0);
+
+    // The original sends the same bytes it saved
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CHECK(outbox_drain(box, fds[0], 1000) == 1);
+    CHECK(recv(fds[1], expected, length, MSG_WAITALL) == (ssize_t) length);
+    CHECK(memcmp(expected, saved, length) == 0);
+
+    CHECK(outbox_drain(restored, fds[0], 1000) == 1);
+    CHECK(recv(fds[1], received, length, MSG_WAITALL) == (ssize_t) length);
+    CHECK(memcmp(received, saved, length) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    free(saved);
+    outbox_destroy(box);
+    outbox_destroy(restored);
+}
+
+int main() {
+    test_lanes();
+    test_round_robin();
+    test_quit_discards_bulk();
+    test_budget();
+    test_file();
+    test_save_restore();
+
+    return test_result("outbox_test");
+}
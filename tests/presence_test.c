@@ -0,0 +1,287 @@
+// presence_test - Tests presence tables and trackers
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <string.h>
+#include <presence.h>
+#include "test.h"
+
+#define MAX_USERS 4096 // The most users the tables here keep track of
+#define MANY_USERS 3000 // Users whose changes take several batches to send
+
+// Returns the state the table has for username, or -1 if it lists none
+static int state_of(presence_table *table, const char *username) {
+    static presence_user users[MAX_USERS];
+    size_t count = presence_table_list(table, users, MAX_USERS);
+
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(users[i].username, username) == 0) {
+            return users[i].state;
+        }
+    }
+
+    return -1;
+}
+
+// Returns the number of entries in a PRESENCE payload
+static size_t count_entries(const uint8_t *payload, size_t length) {
+    size_t count = 0;
+
+    for (size_t offset = 0; offset + PRESENCE_ENTRY_SIZE <= length; count++) {
+        offset += PRESENCE_ENTRY_SIZE + payload[offset + 1];
+    }
+
+    return count;
+}
+
+// The latest version wins, whatever order changes arrive in
+static void test_versions() {
+    presence_table *table = presence_table_create(MAX_USERS);
+
+    CHECK(presence_table_update(table, "bob", PRESENCE_ONLINE, 100));
+    CHECK(presence_table_update(table, "bob", PRESENCE_TYPING, 300));
+    CHECK(!presence_table_update(table, "bob", PRESENCE_AWAY, 200));
+    CHECK(!presence_table_update(table, "bob", PRESENCE_AWAY, 300));
+    CHECK(state_of(table, "bob") == PRESENCE_TYPING);
+
+    // Changes stamped now are later than any before them
+    CHECK(presence_table_update(table, "bob", PRESENCE_AWAY, 0));
+    CHECK(state_of(table, "bob") == PRESENCE_AWAY);
+
+    // Tables merged through the payloads they send agree in either order
+    presence_table *first = presence_table_create(MAX_USERS);
+    presence_table *second = presence_table_create(MAX_USERS);
+    uint8_t older[PRESENCE_ENTRY_SIZE + MAX_UNAME_SIZE];
+    uint8_t newer[PRESENCE_ENTRY_SIZE + MAX_UNAME_SIZE];
+    size_t older_length = presence_encode(older, "carol", PRESENCE_ONLINE, 1000);
+    size_t newer_length = presence_encode(newer, "carol", PRESENCE_OFFLINE, 2000);
+
+    presence_table_apply(first, older, older_length, NULL);
+    presence_table_apply(first, newer, newer_length, NULL);
+    presence_table_apply(second, newer, newer_length, NULL);
+    presence_table_apply(second, older, older_length, NULL);
+    CHECK(state_of(first, "carol") == -1);
+    CHECK(state_of(second, "carol") == -1);
+
+    presence_table_destroy(table);
+    presence_table_destroy(first);
+    presence_table_destroy(second);
+}
+
+// Only the last of a user's changes between collections is sent, and nothing
+// at all if they end up where they were
+static void test_coalescing() {
+    presence_table *table = presence_table_create(MAX_USERS);
+    uint8_t payload[PRESENCE_MAX_BATCH];
+
+    for (int i = 0; i < 1000; i++) {
+        presence_table_update(table, "dave", i % 2 == 0 ? PRESENCE_ONLINE : PRESENCE_TYPING, 0);
+    }
+
+    size_t length = presence_table_collect(table, payload, sizeof(payload));
+
+    CHECK(count_entries(payload, length) == 1);
+    CHECK(payload[0] == PRESENCE_TYPING);
+    CHECK(presence_table_collect(table, payload, sizeof(payload)) == 0);
+
+    presence_table_update(table, "dave", PRESENCE_ONLINE, 0);
+    presence_table_update(table, "dave", PRESENCE_TYPING, 0);
+    CHECK(presence_table_collect(table, payload, sizeof(payload)) == 0);
+
+    presence_table_destroy(table);
+}
+
+// Changes go out at most PRESENCE_MAX_BATCH bytes at a time, and all of them
+// get there in the end
+static void test_batches() {
+    presence_table *table = presence_table_create(MAX_USERS);
+    presence_table *copy = presence_table_create(MAX_USERS);
+    uint8_t payload[PRESENCE_MAX_BATCH];
+    char username[MAX_UNAME_SIZE];
+    size_t length, batches = 0;
+
+    for (int i = 0; i < MANY_USERS; i++) {
+        snprintf(username, sizeof(username), "user%d", i);
+        CHECK(presence_table_update(table, username, PRESENCE_ONLINE, 0));
+    }
+
+    while ((length = presence_table_collect(table, payload, sizeof(payload))) > 0) {
+        CHECK(length <= PRESENCE_MAX_BATCH);
+        presence_table_apply(copy, payload, length, NULL);
+        batches++;
+    }
+
+    CHECK(batches > 1);
+    CHECK(presence_table_list(copy, NULL, 0) == MANY_USERS);
+
+    // A snapshot covers everyone online, however many payloads it takes
+    presence_table *snapshot = presence_table_create(MAX_USERS);
+    size_t cursor = 0;
+
+    presence_table_update(table, "user0", PRESENCE_OFFLINE, 0);
+    while (cursor != PRESENCE_SNAPSHOT_DONE) {
+        length = presence_table_snapshot(table, payload, sizeof(payload), &cursor);
+        presence_table_apply(snapshot, payload, length, NULL);
+    }
+    CHECK(presence_table_list(snapshot, NULL, 0) == MANY_USERS - 1);
+    CHECK(state_of(snapshot, "user0") == -1);
+
+    presence_table_destroy(table);
+    presence_table_destroy(copy);
+    presence_table_destroy(snapshot);
+}
+
+// Writes the name of user i of MANY_USERS into username
+static void name_user(char *username, int i) {
+    snprintf(username, MAX_UNAME_SIZE, "user%d", i % MANY_USERS);
+}
+
+// A snapshot taken a piece at a time while the table changes and grows still
+// covers everyone, given the changes sent alongside it
+static void test_snapshot_while_updating() {
+    presence_table *table = presence_table_create(MAX_USERS);
+    presence_table *copy = presence_table_create(MAX_USERS);
+    uint8_t payload[PRESENCE_MAX_BATCH];
+    char username[MAX_UNAME_SIZE];
+    size_t length, cursor = 0;
+    int next = 0;
+
+    for (; next < PRESENCE_MIN_USERS / 2; next++) {
+        name_user(username, next);
+        presence_table_update(table, username, PRESENCE_ONLINE, 0);
+    }
+    while (presence_table_collect(table, payload, sizeof(payload)) > 0);
+
+    // Each round, some users leave and more arrive than the table has room
+    // for, so it grows underneath the snapshot, which falls behind
+    while (cursor != PRESENCE_SNAPSHOT_DONE) {
+        for (int i = 0; i < 8; i++) {
+            name_user(username, next - 1 - 3 * i);
+            presence_table_update(table, username, PRESENCE_OFFLINE, 0);
+        }
+        for (int i = 0; i < 64 && next < MANY_USERS; i++, next++) {
+            name_user(username, next);
+            presence_table_update(table, username, i % 2 ? PRESENCE_AWAY : PRESENCE_ONLINE, 0);
+        }
+
+        length = presence_table_collect(table, payload, PRESENCE_MAX_BATCH / 2);
+        presence_table_apply(copy, payload, length, NULL);
+        length = presence_table_snapshot(table, payload, PRESENCE_MAX_BATCH / 8, &cursor);
+        presence_table_apply(copy, payload, length, NULL);
+    }
+    while ((length = presence_table_collect(table, payload, sizeof(payload))) > 0) {
+        presence_table_apply(copy, payload, length, NULL);
+    }
+    CHECK(next == MANY_USERS);
+
+    // A change that went out in a snapshot before it was collected is still
+    // sent when it is undone
+    presence_table_update(table, "late", PRESENCE_ONLINE, 0);
+    for (cursor = 0; cursor != PRESENCE_SNAPSHOT_DONE;) {
+        length = presence_table_snapshot(table, payload, sizeof(payload), &cursor);
+        presence_table_apply(copy, payload, length, NULL);
+    }
+    CHECK(state_of(copy, "late") == PRESENCE_ONLINE);
+
+    presence_table_update(table, "late", PRESENCE_OFFLINE, 0);
+    while ((length = presence_table_collect(table, payload, sizeof(payload))) > 0) {
+        presence_table_apply(copy, payload, length, NULL);
+    }
+    CHECK(state_of(copy, "late") == -1);
+
+    CHECK(presence_table_list(copy, NULL, 0) == presence_table_list(table, NULL, 0));
+    for (int i = 0; i < MANY_USERS; i++) {
+        name_user(username, i);
+        CHECK(state_of(copy, username) == state_of(table, username));
+    }
+
+    presence_table_destroy(table);
+    presence_table_destroy(copy);
+}
+
+// Clients may only speak for themselves, and never set the version
+static void test_only() {
+    presence_table *table = presence_table_create(MAX_USERS);
+    uint8_t payload[2 * (PRESENCE_ENTRY_SIZE + MAX_UNAME_SIZE)];
+    size_t length = presence_encode(payload, "erin", PRESENCE_TYPING, UINT64_MAX);
+
+    length += presence_encode(payload + length, "mallory", PRESENCE_AWAY, 5);
+    presence_table_apply(table, payload, length, "erin");
+
+    CHECK(state_of(table, "erin") == PRESENCE_TYPING);
+    CHECK(state_of(table, "mallory") == -1);
+
+    // The version claimed was not taken, so later changes still win
+    CHECK(presence_table_update(table, "erin", PRESENCE_ONLINE, 0));
+
+    presence_table_destroy(table);
+}
+
+// The table stops taking new users once it is full, but still takes changes
+// from those it has and reuses the slots of those who left
+static void test_full() {
+    presence_table *table = presence_table_create(MAX_USERS);
+    uint8_t payload[PRESENCE_MAX_BATCH];
+    char username[MAX_UNAME_SIZE];
+    int added = 0;
+
+    for (int i = 0; i < 2 * MAX_USERS; i++) {
+        snprintf(username, sizeof(username), "u%d", i);
+        if (!presence_table_update(table, username, PRESENCE_ONLINE, 0)) {
+            break;
+        }
+        added++;
+    }
+
+    CHECK(added == MAX_USERS);
+    CHECK(presence_table_update(table, "u0", PRESENCE_AWAY, 0));
+
+    presence_table_update(table, "u1", PRESENCE_OFFLINE, 0);
+    while (presence_table_collect(table, payload, sizeof(payload)) > 0);
+    CHECK(presence_table_update(table, "newcomer", PRESENCE_ONLINE, 0));
+
+    presence_table_destroy(table);
+}
+
+// A user's own client reports each state once, and typing ends on input
+static void test_tracker() {
+    presence_tracker tracker;
+
+    presence_tracker_init(&tracker);
+    CHECK(presence_tracker_poll(&tracker) == -1);
+
+    presence_tracker_keystroke(&tracker);
+    presence_tracker_keystroke(&tracker);
+    CHECK(presence_tracker_poll(&tracker) == PRESENCE_TYPING);
+    CHECK(presence_tracker_poll(&tracker) == -1);
+    CHECK(presence_tracker_timeout(&tracker) > 0 && presence_tracker_timeout(&tracker) <= PRESENCE_TYPING_MS);
+
+    presence_tracker_input(&tracker);
+    CHECK(presence_tracker_poll(&tracker) == PRESENCE_ONLINE);
+    CHECK(presence_tracker_timeout(&tracker) > PRESENCE_TYPING_MS);
+}
+
+int main() {
+    test_versions();
+    test_coalescing();
+    test_batches();
+    test_snapshot_while_updating();
+    test_only();
+    test_full();
+    test_tracker();
+
+    return test_result("presence_test");
+}
@@ -0,0 +1,844 @@
+// relay_test - Tests relays linked together over loopback
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Every relay here runs in this process and listens on a loopback port. Each
+// has a client watching it: a plain socket speaking frames, as sockets_chat
+// would, whose messages are recorded so that the tests can check that every
+// message arrives everywhere exactly once, across a chain of links, around a
+// loop of them and after a link is cut and comes back (SYNC), that no
+// connection can stall or flood the others, that files arrive whole and
+// that a new relay can take over from a running one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <chat.h>
+#include <frame.h>
+#include <relay.h>
+#include "test.h"
+
+#define BASE_PORT 47600 // Relays and proxies listen on ports from here up
+#define WAIT_MS 5000 // The longest anything is waited for
+#define SETTLE_MS 500 // Time given for duplicates to show up, if any would
+#define MAX_DELIVERED 256
+
+static char download_dir[] = "/tmp/relay_testXXXXXX"; // Where relays save files
+
+// A client of a relay, speaking frames over a socket
+typedef struct client {
+    int fd;
+    frame_reader in;
+    uint64_t token; // The session to resume, if any
+    uint64_t received; // The last sequence number received
+    uint64_t acked; // The last of our messages the relay acknowledged
+    uint64_t file_acks; // FILE_ACKs received
+} client;
+
+// A relay and the messages its watching client has been sent
+typedef struct node {
+    relay *relay;
+    int port;
+    client watcher;
+    size_t ndelivered;
+    char delivered[MAX_DELIVERED][MAX_MSG_SIZE];
+} node;
+
+// Forwards one connection at a time from its port to a relay's, and can be
+// cut to make a link drop and stay down
+typedef struct proxy {
+    pthread_t thread;
+    int listener;
+    int target_port;
+    atomic_bool cut; // Connections are closed, and new ones refused, while set
+    atomic_bool running;
+} proxy;
+
+static void ignore_delivery(void *ctx, const char *username, const char *msg) {
+    (void) ctx;
+    (void) username;
+    (void) msg;
+}
+
+static void ignore_notice(void *ctx, const char *notice) {
+    (void) ctx;
+    (void) notice;
+}
+
+// Returns a socket listening on port on loopback, or -1 on error
+static int listen_on(int port) {
+    struct sockaddr_in address;
+    int reuse = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0
+        || bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(fd, 8) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+// Returns a socket connected to port on loopback, or -1 on error
+static int connect_to(int port) {
+    struct sockaddr_in address;
+    int fd = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+// Copies whatever is ready from one socket to the other. Returns false once
+// either end has closed
+static bool forward(int from, int to) {
+    uint8_t buffer[16384];
+    ssize_t received = recv(from, buffer, sizeof(buffer), 0);
+
+    return received > 0 && send(to, buffer, received, MSG_NOSIGNAL) == received;
+}
+
+static void *run_proxy(void *arg) {
+    proxy *proxy = arg;
+    struct pollfd pfds[3] = {
+        { .fd = proxy->listener, .events = POLLIN },
+        { .fd = -1, .events = POLLIN },
+        { .fd = -1, .events = POLLIN }
+    };
+
+    while (atomic_load(&proxy->running)) {
+        bool open = pfds[1].fd >= 0;
+
+        if (poll(pfds, 3, 10) < 0) {
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept(proxy->listener, NULL, NULL);
+
+            if (fd >= 0 && !open && !atomic_load(&proxy->cut)) {
+                pfds[1].fd = fd;
+                pfds[2].fd = connect_to(proxy->target_port);
+                open = true;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        bool failed = pfds[2].fd < 0 || atomic_load(&proxy->cut)
+            || ((pfds[1].revents & (POLLIN | POLLHUP)) && !forward(pfds[1].fd, pfds[2].fd))
+            || ((pfds[2].revents & (POLLIN | POLLHUP)) && !forward(pfds[2].fd, pfds[1].fd));
+
+        if (open && failed) {
+            close(pfds[1].fd);
+            if (pfds[2].fd >= 0) {
+                close(pfds[2].fd);
+            }
+            pfds[1].fd = pfds[2].fd = -1;
+        }
+
+        pfds[1].revents = pfds[2].revents = 0;
+    }
+
+    close(pfds[1].fd);
+    close(pfds[2].fd);
+
+    return NULL;
+}
+
+// Starts a proxy from port to target_port. Returns 0 on success or -1 on error
+static int8_t start_proxy(proxy *proxy, int port, int target_port) {
+    proxy->listener = listen_on(port);
+    proxy->target_port = target_port;
+    atomic_store(&proxy->cut, false);
+    atomic_store(&proxy->running, true);
+
+    if (proxy->listener < 0 || pthread_create(&proxy->thread, NULL, run_proxy, proxy) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void stop_proxy(proxy *proxy) {
+    atomic_store(&proxy->running, false);
+    pthread_join(proxy->thread, NULL);
+    close(proxy->listener);
+}
+
+// Connects client to the relay on port as username, resuming its session if
+// it has one. Returns 1 if the session was resumed, 0 if it is new or -1 on
+// error
+static int client_connect(client *client, int port, const char *username) {
+    frame_header hello;
+    uint8_t payload[MAX_UNAME_SIZE + FRAME_RESUME_SIZE];
+    struct pollfd pfd;
+    uint64_t seq;
+
+    client->fd = connect_to(port);
+    memset(&client->in, 0, sizeof(client->in));
+
+    frame_init_hello(&hello, payload, FRAME_HELLO_CLIENT, username, client->token, client->received);
+    if (client->fd < 0 || frame_send(client->fd, &hello, payload) < 0) {
+        return -1;
+    }
+
+    pfd.fd = client->fd;
+    pfd.events = POLLIN;
+
+    int8_t result = FRAME_PENDING;
+    for (int waited = 0; result == FRAME_PENDING && waited < WAIT_MS; waited += 10) {
+        poll(&pfd, 1, 10);
+        result = frame_reader_recv(&client->in, client->fd);
+    }
+
+    if (result != 1 || client->in.header.type != FRAME_HELLO) {
+        return -1;
+    }
+
+    bool resumed = client->in.header.flags & FRAME_HELLO_RESUMED;
+
+    frame_split_resume(&client->in.header, client->in.payload, &client->token, &seq);
+    frame_reader_next(&client->in);
+
+    return resumed ? 1 : 0;
+}
+
+// Reads frames from the relay for up to ms milliseconds, keeping track of the
+// sequence numbers received and acknowledged, until a message with text msg
+// arrives (if msg is not NULL). Returns the number of such messages read, or
+// -1 if the relay closed the connection
+static int client_read(client *client, const char *msg, int ms) {
+    struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+    uint64_t end = frame_monotonic_now() + ms * 1000000ULL;
+    char username[MAX_UNAME_SIZE], text[MAX_MSG_SIZE];
+    int found = 0;
+
+    while (frame_monotonic_now() < end && (msg == NULL || found == 0)) {
+        int8_t result;
+
+        poll(&pfd, 1, 10);
+        while ((result = frame_reader_recv(&client->in, client->fd)) == 1) {
+            frame_header *header = &client->in.header;
+
+            if (header->type == FRAME_MESSAGE && !(header->flags & FRAME_MESSAGE_NOTICE)) {
+                frame_split_message(header, client->in.payload, username, text);
+                found += msg != NULL && strcmp(text, msg) == 0;
+                if (header->id > client->received) {
+                    client->received = header->id;
+                }
+            } else if (header->type == FRAME_ACK && header->id > client->acked) {
+                client->acked = header->id;
+            } else if (header->type == FRAME_FILE_ACK) {
+                client->file_acks++;
+            }
+
+            frame_reader_next(&client->in);
+        }
+
+        if (result != FRAME_PENDING) {
+            return -1;
+        }
+    }
+
+    return found;
+}
+
+// Sends the relay msg from username as the client's message number id (0 for
+// none)
+static void client_send(client *client, const char *username, const char *msg, uint64_t id) {
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + MAX_MSG_SIZE];
+
+    frame_init_message(&header, payload, username, msg);
+    header.id = id;
+    frame_send(client->fd, &header, payload);
+}
+
+// Announces file transfer id, of a file named name that is size bytes long,
+// from username
+static void client_start_file(client *client, const char *username, uint64_t id, uint64_t size, const char *name) {
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + 8 + FILE_MAX_NAME];
+    size_t u_len = strlen(username);
+    uint32_t high = htonl((uint32_t) (size >> 32)), low = htonl((uint32_t) size);
+
+    memcpy(payload, username, u_len);
+    memcpy(payload + u_len, &high, 4);
+    memcpy(payload + u_len + 4, &low, 4);
+    memcpy(payload + u_len + 8, name, strlen(name));
+
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_FILE_START;
+    header.id = id;
+    header.uname_len = u_len;
+    header.length = u_len + 8 + strlen(name);
+    frame_send(client->fd, &header, payload);
+}
+
+// Records every message that has reached node's watching client
+static void collect(node *node) {
+    char username[MAX_UNAME_SIZE];
+
+    while (frame_reader_recv(&node->watcher.in, node->watcher.fd) == 1) {
+        frame_header *header = &node->watcher.in.header;
+
+        if (header->type == FRAME_MESSAGE && node->ndelivered < MAX_DELIVERED) {
+            frame_split_message(header, node->watcher.in.payload, username, node->delivered[node->ndelivered]);
+            node->ndelivered++;
+        }
+
+        frame_reader_next(&node->watcher.in);
+    }
+}
+
+// Returns how many times node has sent msg to its watching client
+static int delivered(node *node, const char *msg) {
+    int count = 0;
+
+    collect(node);
+    for (size_t i = 0; i < node->ndelivered; i++) {
+        count += strcmp(node->delivered[i], msg) == 0;
+    }
+
+    return count;
+}
+
+// Waits up to WAIT_MS for node to send msg to its watching client. Returns
+// true if it did
+static bool wait_delivered(node *node, const char *msg) {
+    for (int waited = 0; waited < WAIT_MS; waited += 10) {
+        if (delivered(node, msg) > 0) {
+            return true;
+        }
+        usleep(10000);
+    }
+
+    return false;
+}
+
+// Starts a relay for username on port, linked to each of the nlinks ports in
+// links, and connects its watching client. Returns 0 on success or -1 on
+// error
+static int8_t start_node(node *node, const char *username, int port, const int *links, int nlinks) {
+    char service[8];
+
+    memset(node, 0, sizeof(*node));
+    node->port = port;
+    node->watcher.fd = -1;
+    node->relay = relay_create(port, username, ignore_delivery, ignore_notice, NULL, NULL);
+
+    if (node->relay == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < nlinks; i++) {
+        snprintf(service, sizeof(service), "%d", links[i]);
+        relay_add_link(node->relay, "127.0.0.1", service);
+    }
+    relay_set_download_dir(node->relay, download_dir);
+
+    if (relay_start(node->relay) < 0) {
+        return -1;
+    }
+
+    return client_connect(&node->watcher, port, "watcher");
+}
+
+static void stop_node(node *node) {
+    relay_stop(node->relay);
+    close(node->watcher.fd);
+}
+
+// Messages travel down a chain of links, and around a loop of them, reaching
+// every relay exactly once
+static void test_federation() {
+    node a, b, c;
+    int b_links[] = { BASE_PORT };
+    int c_links[] = { BASE_PORT, BASE_PORT + 1 };
+
+    // c links to both a and b, so that there is a loop
+    if (!CHECK(start_node(&a, "anna", BASE_PORT, NULL, 0) == 0)
+        || !CHECK(start_node(&b, "bert", BASE_PORT + 1, b_links, 1) == 0)
+        || !CHECK(start_node(&c, "cleo", BASE_PORT + 2, c_links, 2) == 0)) {
+        return;
+    }
+
+    relay_broadcast(a.relay, "from anna");
+    relay_broadcast(c.relay, "from cleo");
+    relay_broadcast(b.relay, "from bert");
+
+    CHECK(wait_delivered(&b, "from anna") && wait_delivered(&c, "from anna"));
+    CHECK(wait_delivered(&a, "from cleo") && wait_delivered(&b, "from cleo"));
+    CHECK(wait_delivered(&a, "from bert") && wait_delivered(&c, "from bert"));
+
+    // A client's message reaches everyone but the client itself
+    client_send(&b.watcher, "watcher", "from a client", 0);
+    CHECK(wait_delivered(&a, "from a client") && wait_delivered(&c, "from a client"));
+
+    // Once the links are up, messages go straight through
+    for (int i = 0; i < 20; i++) {
+        char msg[MAX_MSG_SIZE];
+
+        snprintf(msg, sizeof(msg), "anna says %d", i);
+        relay_broadcast(a.relay, msg);
+    }
+    CHECK(wait_delivered(&c, "anna says 19"));
+
+    usleep(SETTLE_MS * 1000);
+
+    CHECK(delivered(&b, "from anna") == 1 && delivered(&c, "from anna") == 1);
+    CHECK(delivered(&a, "from cleo") == 1 && delivered(&b, "from cleo") == 1);
+    CHECK(delivered(&a, "from bert") == 1 && delivered(&c, "from bert") == 1);
+    CHECK(delivered(&a, "from a client") == 1 && delivered(&c, "from a client") == 1);
+    CHECK(delivered(&a, "from anna") == 1);
+    CHECK(delivered(&b, "from a client") == 0);
+    for (int i = 0; i < 20; i++) {
+        char msg[MAX_MSG_SIZE];
+
+        snprintf(msg, sizeof(msg), "anna says %d", i);
+        CHECK(delivered(&b, msg) == 1 && delivered(&c, msg) == 1);
+    }
+
+    stop_node(&c);
+    stop_node(&b);
+    stop_node(&a);
+}
+
+// Messages sent on either side while a link is down cross over once it is
+// back, and nothing that crossed before is sent again
+static void test_resync() {
+    node d, e;
+    proxy link;
+    int e_links[] = { BASE_PORT + 12 };
+
+    if (!CHECK(start_node(&d, "dora", BASE_PORT + 10, NULL, 0) == 0)
+        || !CHECK(start_proxy(&link, BASE_PORT + 12, BASE_PORT + 10) == 0)
+        || !CHECK(start_node(&e, "emil", BASE_PORT + 11, e_links, 1) == 0)) {
+        return;
+    }
+
+    relay_broadcast(d.relay, "before the cut");
+    CHECK(wait_delivered(&e, "before the cut"));
+
+    atomic_store(&link.cut, true);
+    usleep(SETTLE_MS * 1000);
+
+    relay_broadcast(d.relay, "dora during the cut");
+    relay_broadcast(e.relay, "emil during the cut");
+    usleep(SETTLE_MS * 1000);
+    CHECK(delivered(&e, "dora during the cut") == 0);
+    CHECK(delivered(&d, "emil during the cut") == 0);
+
+    atomic_store(&link.cut, false);
+    CHECK(wait_delivered(&e, "dora during the cut"));
+    CHECK(wait_delivered(&d, "emil during the cut"));
+
+    usleep(SETTLE_MS * 1000);
+    CHECK(delivered(&e, "before the cut") == 1);
+    CHECK(delivered(&e, "dora during the cut") == 1);
+    CHECK(delivered(&d, "emil during the cut") == 1);
+
+    stop_node(&e);
+    stop_proxy(&link);
+    stop_node(&d);
+}
+
+// A connection that never says HELLO, or stops partway through a frame or a
+// file chunk, holds up no one else
+static void test_stalled() {
+    node h;
+    client stalled, chunked, other;
+    uint8_t partial[] = { FRAME_MESSAGE, 0, 5, 0, 0 };
+
+    memset(&stalled, 0, sizeof(stalled));
+    memset(&other, 0, sizeof(other));
+
+    if (!CHECK(start_node(&h, "hugo", BASE_PORT + 30, NULL, 0) == 0)) {
+        return;
+    }
+
+    int silent = connect_to(BASE_PORT + 30);
+
+    CHECK(client_connect(&stalled, BASE_PORT + 30, "stalled") == 0);
+    CHECK(send(stalled.fd, partial, sizeof(partial), 0) == sizeof(partial));
+
+    // Another stops partway through a chunk of a file
+    frame_header chunk;
+    uint8_t encoded[FRAME_HEADER_SIZE + 10];
+
+    memset(&chunked, 0, sizeof(chunked));
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.type = FRAME_FILE_CHUNK;
+    chunk.id = 1;
+    chunk.length = 1000;
+
+    size_t size = frame_encode_header(encoded, &chunk);
+
+    memset(encoded + size, 'x', 10);
+    CHECK(client_connect(&chunked, BASE_PORT + 30, "chunked") == 0);
+    client_start_file(&chunked, "chunked", 1, 1000, "stalled.bin");
+    CHECK(send(chunked.fd, encoded, size + 10, 0) == (ssize_t) (size + 10));
+    usleep(SETTLE_MS * 1000);
+
+    uint64_t start = frame_monotonic_now();
+
+    CHECK(client_connect(&other, BASE_PORT + 30, "other") == 0);
+    client_send(&other, "other", "past the stall", 0);
+    CHECK(wait_delivered(&h, "past the stall"));
+    CHECK(frame_monotonic_now() - start < RELAY_HANDSHAKE_MS / 4 * 1000000ULL);
+
+    close(silent);
+    close(stalled.fd);
+    close(chunked.fd);
+    close(other.fd);
+    stop_node(&h);
+
+    char path[sizeof(download_dir) + 16];
+
+    snprintf(path, sizeof(path), "%s/stalled.bin", download_dir);
+    unlink(path);
+}
+
+// A client flooding the relay with messages is held to its rate, and holds up
+// no one else's
+static void test_flood() {
+    node j;
+    client flooder, other;
+    char msg[MAX_MSG_SIZE];
+
+    memset(&flooder, 0, sizeof(flooder));
+    memset(&other, 0, sizeof(other));
+
+    if (!CHECK(start_node(&j, "jane", BASE_PORT + 50, NULL, 0) == 0)
+        || !CHECK(client_connect(&flooder, BASE_PORT + 50, "flooder") == 0)
+        || !CHECK(client_connect(&other, BASE_PORT + 50, "other") == 0)) {
+        return;
+    }
+
+    uint64_t start = frame_monotonic_now();
+
+    for (int i = 0; i < 50 * RELAY_MESSAGE_BURST; i++) {
+        snprintf(msg, sizeof(msg), "flood %d", i);
+        client_send(&flooder, "flooder", msg, 0);
+    }
+
+    uint64_t sent = frame_monotonic_now();
+
+    client_send(&other, "other", "through the flood", 0);
+    CHECK(wait_delivered(&j, "through the flood"));
+    CHECK(frame_monotonic_now() - sent < SETTLE_MS * 1000000ULL);
+
+    // The burst gets through at once, and the rest only at the rate
+    usleep(SETTLE_MS * 1000);
+    collect(&j);
+
+    uint64_t elapsed_ms = (frame_monotonic_now() - start) / 1000000;
+    size_t flooded = 0;
+
+    for (size_t i = 0; i < j.ndelivered; i++) {
+        flooded += strncmp(j.delivered[i], "flood ", 6) == 0;
+    }
+    CHECK(flooded >= RELAY_MESSAGE_BURST);
+    CHECK(flooded <= RELAY_MESSAGE_BURST + RELAY_MESSAGE_RATE * elapsed_ms / 1000 + 1);
+
+    close(flooder.fd);
+    close(other.fd);
+    stop_node(&j);
+}
+
+// A file larger than the window arrives whole on the relay's disk, with chat
+// getting through in the middle of it, and only the client a file is going to
+// can acknowledge its chunks
+static void test_file() {
+    node k;
+    client lena, mona, nina;
+    static uint8_t data[16 * FILE_CHUNK_SIZE + 123], saved[sizeof(data) + 1];
+    char path[sizeof(download_dir) + 16];
+    frame_header header;
+    uint64_t nchunks = 0;
+
+    memset(&lena, 0, sizeof(lena));
+    memset(&mona, 0, sizeof(mona));
+    memset(&nina, 0, sizeof(nina));
+    snprintf(path, sizeof(path), "%s/big.bin", download_dir);
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) (i * 31 + i / 7);
+    }
+
+    if (!CHECK(start_node(&k, "kurt", BASE_PORT + 60, NULL, 0) == 0)
+        || !CHECK(client_connect(&lena, BASE_PORT + 60, "lena") == 0)) {
+        return;
+    }
+
+    client_start_file(&lena, "lena", 1, sizeof(data), "big.bin");
+
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_FILE_CHUNK;
+    header.id = 1;
+
+    for (size_t offset = 0; offset < sizeof(data); offset += header.length, nchunks++) {
+        for (int waited = 0; nchunks - lena.file_acks >= FILE_WINDOW && waited < WAIT_MS; waited += 10) {
+            client_read(&lena, NULL, 10);
+        }
+        if (!CHECK(nchunks - lena.file_acks < FILE_WINDOW)) {
+            break;
+        }
+
+        header.length = sizeof(data) - offset < FILE_CHUNK_SIZE ? sizeof(data) - offset : FILE_CHUNK_SIZE;
+        frame_send(lena.fd, &header, data + offset);
+
+        if (nchunks == FILE_WINDOW * 2) {
+            client_send(&lena, "lena", "in the middle of a file", 0);
+            CHECK(wait_delivered(&k, "in the middle of a file"));
+        }
+    }
+
+    header.type = FRAME_FILE_END;
+    header.length = 0;
+    frame_send(lena.fd, &header, NULL);
+
+    // Chunks are acknowledged once they are on disk
+    for (int waited = 0; lena.file_acks < nchunks && waited < WAIT_MS; waited += 10) {
+        client_read(&lena, NULL, 10);
+    }
+    CHECK(lena.file_acks == nchunks);
+
+    FILE *file = fopen(path, "rb");
+
+    if (CHECK(file != NULL)) {
+        CHECK(fread(saved, 1, sizeof(saved), file) == sizeof(data));
+        CHECK(memcmp(saved, data, sizeof(data)) == 0);
+        fclose(file);
+    }
+
+    // The relay sends the file back out to every client. mona acknowledges
+    // every transfer but her own, which must make none of them go on
+    CHECK(client_connect(&mona, BASE_PORT + 60, "mona") == 0);
+    CHECK(client_connect(&nina, BASE_PORT + 60, "nina") == 0);
+    CHECK(relay_send_file(k.relay, path) == 4);
+
+    uint64_t own = 0;
+
+    for (int waited = 0; own == 0 && waited < WAIT_MS; waited += 10) {
+        usleep(10000);
+        while (own == 0 && frame_reader_recv(&mona.in, mona.fd) == 1) {
+            if (mona.in.header.type == FRAME_FILE_START) {
+                own = mona.in.header.id;
+            }
+            frame_reader_next(&mona.in);
+        }
+    }
+    CHECK(own != 0);
+
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_FILE_ACK;
+    for (uint64_t id = own > 8 ? own - 8 : 1; id <= own + 8; id++) {
+        for (int i = 0; i < FILE_WINDOW * 8 && id != own; i++) {
+            header.id = id;
+            frame_send(mona.fd, &header, NULL);
+        }
+    }
+    usleep(SETTLE_MS * 1000);
+
+    // nina never reads, so what the relay sent her is still in her socket
+    int pending = 0;
+
+    ioctl(nina.fd, FIONREAD, &pending);
+    CHECK(pending >= FILE_WINDOW * FILE_CHUNK_SIZE);
+    CHECK(pending < (FILE_WINDOW + 1) * FILE_CHUNK_SIZE);
+
+    close(k.watcher.fd);
+    close(lena.fd);
+    close(mona.fd);
+    close(nina.fd);
+    relay_stop(k.relay);
+    unlink(path);
+}
+
+// A client whose connection drops resumes its session: it is sent what it
+// missed and nothing more, and what it resends is not delivered twice
+static void test_resume() {
+    node f, g;
+    client xavier;
+    int g_links[] = { BASE_PORT + 20 };
+
+    memset(&xavier, 0, sizeof(xavier));
+
+    if (!CHECK(start_node(&f, "finn", BASE_PORT + 20, NULL, 0) == 0)
+        || !CHECK(start_node(&g, "gina", BASE_PORT + 21, g_links, 1) == 0)
+        || !CHECK(client_connect(&xavier, BASE_PORT + 21, "xavier") == 0)) {
+        return;
+    }
+
+    // A message from a client on one relay reaches the clients of both
+    client_send(&xavier, "xavier", "first from xavier", 1);
+    CHECK(wait_delivered(&g, "first from xavier"));
+    CHECK(wait_delivered(&f, "first from xavier"));
+
+    relay_broadcast(f.relay, "before the drop");
+    CHECK(client_read(&xavier, "before the drop", WAIT_MS) == 1);
+
+    // The relay acknowledges what it has accepted
+    for (int waited = 0; xavier.acked < 1 && waited < WAIT_MS; waited += 10) {
+        client_read(&xavier, NULL, 10);
+    }
+    CHECK(xavier.acked == 1);
+
+    close(xavier.fd);
+    usleep(SETTLE_MS * 1000);
+    relay_broadcast(f.relay, "while xavier was away");
+    usleep(SETTLE_MS * 1000);
+
+    CHECK(client_connect(&xavier, BASE_PORT + 21, "xavier") == 1);
+    CHECK(client_read(&xavier, "while xavier was away", WAIT_MS) == 1);
+    CHECK(client_read(&xavier, "before the drop", SETTLE_MS) == 0);
+
+    // Resending a message already accepted does not deliver it again
+    client_send(&xavier, "xavier", "first from xavier", 1);
+    client_send(&xavier, "xavier", "second from xavier", 2);
+    CHECK(wait_delivered(&f, "second from xavier"));
+
+    usleep(SETTLE_MS * 1000);
+    CHECK(delivered(&f, "first from xavier") == 1);
+    CHECK(delivered(&g, "first from xavier") == 1);
+    CHECK(delivered(&g, "second from xavier") == 1);
+
+    close(xavier.fd);
+    stop_node(&g);
+    stop_node(&f);
+}
+
+static void note_handed_over(void *ctx) {
+    atomic_store((atomic_bool *) ctx, true);
+}
+
+// A new relay takes over from a running one without its clients noticing,
+// even one that was partway through sending a message
+static void test_upgrade() {
+    node old_node, new_node;
+    client yara;
+    atomic_bool handed_over = false;
+    char path[sizeof(download_dir) + 16];
+    frame_header header;
+    uint8_t payload[MAX_UNAME_SIZE + MAX_MSG_SIZE];
+    uint8_t encoded[FRAME_HEADER_SIZE + sizeof(payload)];
+
+    memset(&old_node, 0, sizeof(old_node));
+    memset(&new_node, 0, sizeof(new_node));
+    memset(&yara, 0, sizeof(yara));
+    snprintf(path, sizeof(path), "%s/upgrade", download_dir);
+
+    old_node.relay = relay_create(BASE_PORT + 40, "ivan", ignore_delivery, ignore_notice, NULL, &handed_over);
+    if (!CHECK(old_node.relay != NULL)
+        || !CHECK(relay_enable_upgrades(old_node.relay, path, note_handed_over) == 0)
+        || !CHECK(relay_start(old_node.relay) == 0)
+        || !CHECK(client_connect(&old_node.watcher, BASE_PORT + 40, "watcher") == 0)
+        || !CHECK(client_connect(&yara, BASE_PORT + 40, "yara") == 0)) {
+        return;
+    }
+
+    client_send(&yara, "yara", "before the upgrade", 1);
+    CHECK(wait_delivered(&old_node, "before the upgrade"));
+
+    // Half of a message is in when the new relay takes over
+    frame_init_message(&header, payload, "yara", "across the upgrade");
+    header.id = 2;
+
+    size_t size = frame_encode_header(encoded, &header);
+
+    memcpy(encoded + size, payload, header.length);
+    size += header.length;
+    CHECK(send(yara.fd, encoded, size / 2, 0) == (ssize_t) (size / 2));
+    usleep(SETTLE_MS * 1000);
+
+    new_node.relay = relay_create(BASE_PORT + 40, "ivan", ignore_delivery, ignore_notice, NULL, NULL);
+    if (!CHECK(new_node.relay != NULL)
+        || !CHECK(relay_enable_upgrades(new_node.relay, path, note_handed_over) == 0)
+        || !CHECK(relay_start(new_node.relay) == 0)) {
+        return;
+    }
+    for (int waited = 0; !atomic_load(&handed_over) && waited < WAIT_MS; waited += 10) {
+        usleep(10000);
+    }
+    CHECK(atomic_load(&handed_over));
+
+    // The watcher's connection went across with the rest, along with what it
+    // had been sent
+    new_node.watcher = old_node.watcher;
+    memcpy(new_node.delivered, old_node.delivered, sizeof(old_node.delivered));
+    new_node.ndelivered = old_node.ndelivered;
+
+    CHECK(send(yara.fd, encoded + size / 2, size - size / 2, 0) == (ssize_t) (size - size / 2));
+    CHECK(wait_delivered(&new_node, "across the upgrade"));
+
+    client_send(&yara, "yara", "after the upgrade", 3);
+    CHECK(wait_delivered(&new_node, "after the upgrade"));
+    relay_broadcast(new_node.relay, "from the new relay");
+    CHECK(client_read(&yara, "from the new relay", WAIT_MS) == 1);
+
+    usleep(SETTLE_MS * 1000);
+    CHECK(delivered(&new_node, "before the upgrade") == 1);
+    CHECK(delivered(&new_node, "across the upgrade") == 1);
+
+    close(yara.fd);
+    relay_stop(old_node.relay);
+    stop_node(&new_node);
+}
+
+int main() {
+    if (mkdtemp(download_dir) == NULL) {
+        perror("In main - failed to make a download directory");
+        return 1;
+    }
+
+    test_federation();
+    test_resync();
+    test_stalled();
+    test_resume();
+    test_flood();
+    test_file();
+    test_upgrade();
+
+    rmdir(download_dir);
+
+    return test_result("relay_test");
+}
@@ -0,0 +1,177 @@
+// search_index_test - Tests the search index against a brute force search
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <string.h>
+#include <search_index.h>
+#include <chat.h>
+#include "test.h"
+
+// Enough messages that common terms' posting lists have many skip entries,
+// and ids large enough to take several bytes as varints
+#define MESSAGES (100 * SEARCH_SKIP_INTERVAL)
+#define RESULTS 10
+#define RETAINED 1000 // How many messages the index that ages them out holds
+
+static const char *words[] = { "alpha", "beta", "gamma", "delta", "deploy", "error", "relay", "ping" };
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+// Writes the text of message seq into msg. Words are picked so that terms
+// range from common to rare, and rare ones come in clumps
+static void message_text(uint64_t seq, char *msg) {
+    snprintf(
+        msg, MAX_MSG_SIZE, "%s, %s %s. Tag%lu!",
+        words[seq % NWORDS], words[(seq / NWORDS) % NWORDS], words[(seq * 7 / 3) % NWORDS],
+        (unsigned long) ((seq / 50) % 300)
+    );
+}
+
+// Returns true if the text of message seq holds every word of query (which
+// must be lowercase words separated by single spaces)
+static bool matches(uint64_t seq, const char *query) {
+    char msg[MAX_MSG_SIZE], lowered[MAX_MSG_SIZE + 2], word[MAX_MSG_SIZE + 2];
+    const char *start = query;
+
+    message_text(seq, msg);
+
+    // Words are found with a space on either side
+    lowered[0] = ' ';
+    size_t i;
+    for (i = 0; msg[i] != '\0'; i++) {
+        lowered[i + 1] = msg[i] >= 'A' && msg[i] <= 'Z' ? msg[i] - 'A' + 'a'
+            : (msg[i] == ',' || msg[i] == '.' || msg[i] == '!') ? ' ' : msg[i];
+    }
+    lowered[i + 1] = ' ';
+    lowered[i + 2] = '\0';
+
+    while (*start != '\0') {
+        size_t length = strcspn(start, " ");
+
+        snprintf(word, sizeof(word), " %.*s ", (int) length, start);
+        if (strstr(lowered, word) == NULL) {
+            return false;
+        }
+
+        start += length + (start[length] == ' ');
+    }
+
+    return true;
+}
+
+// Every query finds what a brute force search over messages first to last
+// finds, newest first
+static void test_queries(search_index *index, uint64_t first, uint64_t last) {
+    const char *queries[] = {
+        "alpha", "alpha beta", "deploy error", "tag7", "tag200 gamma", "relay ping delta", "tag0 tag1", "absent"
+    };
+    const char *typed[] = {
+        "ALPHA", "Alpha, BETA", "deploy... error!", "Tag7", "tag200 GAMMA", "relay ping delta", "tag0 tag1", "absent"
+    };
+
+    for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        uint64_t results[RESULTS], expected[RESULTS];
+        int64_t count = 0;
+
+        for (uint64_t seq = last; seq >= first; seq--) {
+            if (matches(seq, queries[q])) {
+                if (count < RESULTS) {
+                    expected[count] = seq;
+                }
+                count++;
+            }
+        }
+
+        int64_t found = search_index_query(index, typed[q], results, RESULTS);
+
+        if (!CHECK(found == count)) {
+            fprintf(stderr, "  \"%s\" found %ld messages rather than %ld\n", typed[q], (long) found, (long) count);
+            continue;
+        }
+
+        for (int64_t i = 0; i < count && i < RESULTS; i++) {
+            CHECK(results[i] == expected[i]);
+        }
+    }
+
+    CHECK(search_index_query(index, " ,.! ", NULL, 0) == -1);
+}
+
+// Messages come back as they were added
+static void test_get(search_index *index) {
+    char username[MAX_UNAME_SIZE], msg[MAX_MSG_SIZE], expected[MAX_MSG_SIZE];
+
+    CHECK(search_index_count(index) == MESSAGES);
+
+    for (uint64_t seq = 1; seq <= MESSAGES; seq += MESSAGES / 7) {
+        message_text(seq, expected);
+        CHECK(search_index_get(index, seq, username, msg) == 0);
+        CHECK(strcmp(username, seq % 2 == 0 ? "alice" : "bob") == 0);
+        CHECK(strcmp(msg, expected) == 0);
+    }
+
+    CHECK(search_index_get(index, 0, username, msg) == -1);
+    CHECK(search_index_get(index, MESSAGES + 1, username, msg) == -1);
+}
+
+// Once the index is full, the oldest half of its messages age out and are
+// neither found nor returned
+static void test_aging() {
+    search_index *index = search_index_create(RETAINED);
+    char username[MAX_UNAME_SIZE], msg[MAX_MSG_SIZE];
+
+    if (!CHECK(index != NULL)) {
+        return;
+    }
+
+    for (uint64_t seq = 1; seq <= MESSAGES; seq++) {
+        message_text(seq, msg);
+        CHECK(search_index_add(index, seq % 2 == 0 ? "alice" : "bob", msg) == seq);
+    }
+
+    // Generations hold RETAINED / 2 messages, and the newest is partly full
+    uint64_t first = (MESSAGES - 1) / (RETAINED / 2) * (RETAINED / 2) - RETAINED / 2 + 1;
+
+    CHECK(search_index_count(index) == MESSAGES - first + 1);
+    CHECK(search_index_get(index, first - 1, username, msg) == -1);
+    CHECK(search_index_get(index, first, username, msg) == 0);
+    test_queries(index, first, MESSAGES);
+
+    search_index_destroy(index);
+}
+
+int main() {
+    search_index *index = search_index_create(SEARCH_MAX_MESSAGES);
+    char msg[MAX_MSG_SIZE];
+
+    if (index == NULL) {
+        fputs("Error: Failed to create the index\n", stderr);
+        return 1;
+    }
+
+    for (uint64_t seq = 1; seq <= MESSAGES; seq++) {
+        message_text(seq, msg);
+        CHECK(search_index_add(index, seq % 2 == 0 ? "alice" : "bob", msg) == seq);
+    }
+
+    test_queries(index, 1, MESSAGES);
+    test_get(index);
+
+    search_index_destroy(index);
+
+    test_aging();
+
+    return test_result("search_index_test");
+}
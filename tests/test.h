@@ -0,0 +1,53 @@
+// test - Checks shared by the unit and loopback tests
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Every test program is a handful of test functions run one after another
+// from main. A failed CHECK is reported with where it is and carries on, so
+// one run shows everything that is wrong; test_result then sums up and gives
+// the program's exit status, which make test stops on.
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#define CHECK(condition) test_check((condition), #condition, __FILE__, __LINE__)
+
+static int test_failures;
+
+// Reports condition, as written at file:line, if it did not hold
+static inline bool test_check(bool held, const char *condition, const char *file, int line) {
+    if (!held) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+        test_failures++;
+    }
+
+    return held;
+}
+
+// Reports how the program named name did. Returns its exit status
+static inline int test_result(const char *name) {
+    if (test_failures > 0) {
+        printf("%s: %d checks failed\n", name, test_failures);
+        return 1;
+    }
+
+    printf("%s: passed\n", name);
+    return 0;
+}
+
+#endif
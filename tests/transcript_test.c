@@ -0,0 +1,235 @@
+// transcript_test - Tests the transcript logger and transcript_dump
+// Copyright (C) 2020  Nicklas Carpenter
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Transcripts are written to a temporary directory. The records that go
+// through the ring are read back from the file as written, and again through
+// bin/transcript_dump, which make builds before running the tests. To fill
+// the ring, the logger writes into a FIFO that is not read until afterwards.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <transcript.h>
+#include "test.h"
+
+#define RECORDS 1000 // Records logged to a file, well within the ring
+#define FLOOD (TRANSCRIPT_QUEUE_SIZE * 4) // Records logged while the FIFO is full
+
+static char directory[] = "/tmp/transcript_testXXXXXX";
+
+// A record read back from a transcript
+typedef struct record {
+    uint8_t direction;
+    char username[MAX_UNAME_SIZE + 1];
+    char msg[MAX_MSG_SIZE + 1];
+} record;
+
+static uint16_t get_u16(const uint8_t *in) {
+    return in[0] | (uint16_t) in[1] << 8;
+}
+
+// Picks apart the record at data, which holds length bytes. Returns the
+// record's length, or 0 if no whole record is there
+static size_t parse_record(const uint8_t *data, size_t length, record *out) {
+    if (length < TRANSCRIPT_RECORD_HEADER_SIZE || length < get_u16(data)) {
+        return 0;
+    }
+
+    size_t size = get_u16(data);
+    size_t u_len = data[3];
+    size_t m_len = size - TRANSCRIPT_RECORD_HEADER_SIZE - u_len;
+
+    out->direction = data[2];
+    memcpy(out->username, data + TRANSCRIPT_RECORD_HEADER_SIZE, u_len);
+    out->username[u_len] = '\0';
+    memcpy(out->msg, data + TRANSCRIPT_RECORD_HEADER_SIZE + u_len, m_len);
+    out->msg[m_len] = '\0';
+
+    return size;
+}
+
+// Writes the text of record i into msg
+static void record_text(int i, char *msg) {
+    snprintf(msg, MAX_MSG_SIZE, "message %d\n", i);
+}
+
+// Every record logged is in the file, in order, after the file header, and
+// transcript_dump shows each of them
+static void test_round_trip() {
+    static uint8_t data[RECORDS * TRANSCRIPT_MAX_RECORD_SIZE];
+    char path[sizeof(directory) + 16], command[sizeof(path) + 32];
+    char msg[MAX_MSG_SIZE], line[256], expected[256];
+    record read_back;
+
+    snprintf(path, sizeof(path), "%s/chat.sctr", directory);
+
+    transcript_logger *logger = transcript_logger_create(path, TRANSCRIPT_DEFAULT_SYNC_MS, TRANSCRIPT_DEFAULT_SYNC_BYTES);
+
+    if (!CHECK(logger != NULL)) {
+        return;
+    }
+
+    for (int i = 0; i < RECORDS; i++) {
+        record_text(i, msg);
+        CHECK(transcript_logger_log(logger, i % 2 ? TRANSCRIPT_RECEIVED : TRANSCRIPT_SENT, i % 2 ? "bob" : "alice", msg) == 0);
+    }
+    CHECK(transcript_logger_destroy(logger) == 0);
+
+    FILE *file = fopen(path, "rb");
+
+    if (!CHECK(file != NULL)) {
+        return;
+    }
+
+    size_t length = fread(data, 1, sizeof(data), file);
+    size_t offset = TRANSCRIPT_FILE_HEADER_SIZE;
+
+    fclose(file);
+    CHECK(length > TRANSCRIPT_FILE_HEADER_SIZE && memcmp(data, TRANSCRIPT_MAGIC, 4) == 0);
+    CHECK(get_u16(data + 4) == TRANSCRIPT_VERSION);
+
+    for (int i = 0; i < RECORDS; i++) {
+        size_t size = parse_record(data + offset, length - offset, &read_back);
+
+        if (!CHECK(size > 0)) {
+            break;
+        }
+        offset += size;
+
+        record_text(i, msg);
+        CHECK(read_back.direction == (i % 2 ? TRANSCRIPT_RECEIVED : TRANSCRIPT_SENT));
+        CHECK(strcmp(read_back.username, i % 2 ? "bob" : "alice") == 0);
+        CHECK(strcmp(read_back.msg, msg) == 0);
+    }
+    CHECK(offset == length);
+
+    // Lines look like "2020-01-01 00:00:00.000000000 -> <alice>: message 0"
+    snprintf(command, sizeof(command), "bin/transcript_dump %s", path);
+
+    FILE *dump = popen(command, "r");
+    int nlines = 0;
+
+    if (!CHECK(dump != NULL)) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), dump) != NULL) {
+        snprintf(
+            expected, sizeof(expected), "%s <%s>: message %d\n",
+            nlines % 2 ? "<-" : "->", nlines % 2 ? "bob" : "alice", nlines
+        );
+        CHECK(strlen(line) > 30 && strcmp(line + 30, expected) == 0);
+        nlines++;
+    }
+    CHECK(pclose(dump) == 0);
+    CHECK(nlines == RECORDS);
+
+    unlink(path);
+}
+
+static void *destroy_logger(void *logger) {
+    uint64_t *dropped = malloc(sizeof(uint64_t));
+
+    *dropped = transcript_logger_destroy(logger);
+
+    return dropped;
+}
+
+// Records that find the ring full are dropped without blocking, and the
+// transcript notes how many were
+static void test_dropped() {
+    static uint8_t data[(FLOOD + 16) * TRANSCRIPT_MAX_RECORD_SIZE];
+    char path[sizeof(directory) + 16], msg[MAX_MSG_SIZE];
+    uint64_t refused = 0;
+    record read_back;
+
+    snprintf(path, sizeof(path), "%s/fifo", directory);
+
+    // The read end is opened first, or the logger would wait for it
+    int reader = mkfifo(path, 0600) == 0 ? open(path, O_RDONLY | O_NONBLOCK) : -1;
+
+    if (!CHECK(reader >= 0)) {
+        return;
+    }
+
+    transcript_logger *logger = transcript_logger_create(path, TRANSCRIPT_DEFAULT_SYNC_MS, TRANSCRIPT_DEFAULT_SYNC_BYTES);
+
+    if (!CHECK(logger != NULL)) {
+        close(reader);
+        return;
+    }
+
+    // Long messages fill the FIFO quickly, after which the writer can take
+    // nothing more out of the ring
+    memset(msg, 'x', MAX_MSG_SIZE - 1);
+    msg[MAX_MSG_SIZE - 1] = '\0';
+    for (int i = 0; i < FLOOD; i++) {
+        refused += transcript_logger_log(logger, TRANSCRIPT_RECEIVED, "flood", msg) < 0;
+    }
+    CHECK(refused > 0);
+
+    // The writer only finishes once everything it has is read
+    pthread_t destroyer;
+    void *dropped = NULL;
+    size_t length = 0;
+    ssize_t got;
+
+    pthread_create(&destroyer, NULL, destroy_logger, logger);
+    fcntl(reader, F_SETFL, 0);
+    while (length < sizeof(data) && (got = read(reader, data + length, sizeof(data) - length)) > 0) {
+        length += got;
+    }
+    pthread_join(destroyer, &dropped);
+    close(reader);
+
+    CHECK(dropped != NULL && *(uint64_t*) dropped == refused);
+    free(dropped);
+
+    // A FIFO cannot be seeked, so has no file header
+    uint64_t written = 0, noted = 0;
+
+    for (size_t offset = 0, size; (size = parse_record(data + offset, length - offset, &read_back)) > 0; offset += size) {
+        if (read_back.direction == TRANSCRIPT_DROPPED) {
+            noted += strtoull(read_back.msg, NULL, 10);
+        } else {
+            CHECK(strcmp(read_back.msg, msg) == 0);
+            written++;
+        }
+    }
+    CHECK(noted == refused);
+    CHECK(written + refused == FLOOD);
+
+    unlink(path);
+}
+
+int main() {
+    if (mkdtemp(directory) == NULL) {
+        perror("In main - failed to make a directory for transcripts");
+        return 1;
+    }
+
+    test_round_trip();
+    test_dropped();
+
+    rmdir(directory);
+
+    return test_result("transcript_test");
+}